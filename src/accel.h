@@ -0,0 +1,29 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+/* Internal interface between crc.c and the optional CPU-specific kernels
+under src/accel. Not part of the public API.
+
+meson.build compiles at most one src/accel/$CPU_FAMILY.c and defines
+MODEM_ACCEL when it does. Each accel_*_kernel() function probes the CPU it
+is running on (CPUID, HWCAP, etc.) and returns NULL if the instructions its
+kernel needs are missing, in which case crc.c keeps the portable engine. The
+probes are only called once per kernel, on first use. */
+
+#include <stddef.h> /* For size_t. */
+
+typedef unsigned int (* crc_kernel_t)(unsigned int crc, const unsigned char * data, size_t size);
+typedef unsigned int (* chksum_kernel_t)(unsigned int sum, const unsigned char * data, size_t size);
+
+/* Portable engines (the CRC-16 one is selected by the crc_engine option).
+Kernels use these for inputs too short to be worth vectorizing and for the
+final bytes that do not fill a vector register. */
+unsigned int crc_update_portable(unsigned int crc, const unsigned char * data, size_t size);
+unsigned int chksum_update_portable(unsigned int sum, const unsigned char * data, size_t size);
+
+#ifdef MODEM_ACCEL
+crc_kernel_t accel_crc_kernel(void);
+chksum_kernel_t accel_chksum_kernel(void);
+#endif
+
+#endif        /*  #ifndef ACCEL_H  */
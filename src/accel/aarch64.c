@@ -0,0 +1,166 @@
+#include "accel.h"
+
+#include <stddef.h> /* For size_t, NULL. */
+
+/* CRC-16/XMODEM using the ARMv8 PMULL (64x64 polynomial multiply)
+instruction. This is the same folding scheme as src/accel/x86_64.c; see there
+for the derivation.
+
+The 8-bit XMODEM checksum uses NEON pairwise widening adds (UADALP). */
+
+#if defined(__GNUC__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+	#define ACCEL_TARGET
+#elif defined(__clang__)
+	#define ACCEL_TARGET __attribute__((target("aes")))
+#else
+	#define ACCEL_TARGET __attribute__((target("+crypto")))
+#endif
+
+/* x^n mod P(x), P(x) = x^16 + x^12 + x^5 + 1. */
+#define K_128 0xAEFC
+#define K_192 0x650B
+#define K_512 0x13FC
+#define K_576 0x8832
+
+static unsigned int crc_update_pmull(unsigned int crc, const unsigned char * data, size_t size);
+static unsigned int chksum_update_neon(unsigned int sum, const unsigned char * data, size_t size);
+
+crc_kernel_t accel_crc_kernel(void)
+{
+#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) ? crc_update_pmull : NULL;
+#else
+	/* Every Apple aarch64 core implements the crypto extensions. */
+	return crc_update_pmull;
+#endif
+}
+
+chksum_kernel_t accel_chksum_kernel(void)
+{
+#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_ASIMD) ? chksum_update_neon : NULL;
+#else
+	return chksum_update_neon;
+#endif
+}
+
+
+/* Private functions begin here. */
+/* Loads are byte-reversed so that bit n of the register is the coefficient
+of x^n. */
+ACCEL_TARGET static uint64x2_t load_be(const unsigned char * data)
+{
+	uint8x16_t bytes = vrev64q_u8(vld1q_u8(data));
+	return vreinterpretq_u64_u8(vextq_u8(bytes, bytes, 8));
+}
+
+ACCEL_TARGET static void store_be(unsigned char * data, uint64x2_t val)
+{
+	uint8x16_t bytes = vrev64q_u8(vreinterpretq_u8_u64(val));
+	vst1q_u8(data, vextq_u8(bytes, bytes, 8));
+}
+
+/* Multiply the high half of val by k_hi and the low half by k_lo. */
+ACCEL_TARGET static uint64x2_t fold(uint64x2_t val, poly64_t k_hi, poly64_t k_lo)
+{
+	poly128_t hi = vmull_p64((poly64_t) vgetq_lane_u64(val, 1), k_hi);
+	poly128_t lo = vmull_p64((poly64_t) vgetq_lane_u64(val, 0), k_lo);
+	return veorq_u64(vreinterpretq_u64_p128(hi), vreinterpretq_u64_p128(lo));
+}
+
+ACCEL_TARGET static unsigned int crc_update_pmull(unsigned int crc, const unsigned char * data, size_t size)
+{
+	unsigned char residue[16];
+	uint64x2_t lane0, lane1, lane2, lane3;
+
+	if(size < 32)
+	{
+		return crc_update_portable(crc, data, size);
+	}
+
+	/* The running CRC is XORed into the first 16 bits of the message. */
+	lane0 = veorq_u64(load_be(data), \
+		vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t) (crc & 0xFFFF) << 48)));
+
+	if(size >= 64)
+	{
+		lane1 = load_be(data + 16);
+		lane2 = load_be(data + 32);
+		lane3 = load_be(data + 48);
+		data += 64;
+		size -= 64;
+
+		while(size >= 64)
+		{
+			lane0 = veorq_u64(fold(lane0, K_576, K_512), load_be(data));
+			lane1 = veorq_u64(fold(lane1, K_576, K_512), load_be(data + 16));
+			lane2 = veorq_u64(fold(lane2, K_576, K_512), load_be(data + 32));
+			lane3 = veorq_u64(fold(lane3, K_576, K_512), load_be(data + 48));
+			data += 64;
+			size -= 64;
+		}
+
+		lane0 = veorq_u64(fold(lane0, K_192, K_128), lane1);
+		lane0 = veorq_u64(fold(lane0, K_192, K_128), lane2);
+		lane0 = veorq_u64(fold(lane0, K_192, K_128), lane3);
+	}
+	else
+	{
+		data += 16;
+		size -= 16;
+	}
+
+	while(size >= 16)
+	{
+		lane0 = veorq_u64(fold(lane0, K_192, K_128), load_be(data));
+		data += 16;
+		size -= 16;
+	}
+
+	store_be(residue, lane0);
+	crc = crc_update_portable(0x0000, residue, 16);
+	return crc_update_portable(crc, data, size);
+}
+
+/* Only the low 8 bits of the sum matter, so the 16-bit lanes wrapping
+around does not change the result. */
+static unsigned int chksum_update_neon(unsigned int sum, const unsigned char * data, size_t size)
+{
+	uint16x8_t acc0 = vdupq_n_u16(0);
+	uint16x8_t acc1 = vdupq_n_u16(0);
+
+	while(size >= 32)
+	{
+		acc0 = vpadalq_u8(acc0, vld1q_u8(data));
+		acc1 = vpadalq_u8(acc1, vld1q_u8(data + 16));
+		data += 32;
+		size -= 32;
+	}
+
+	sum += vaddvq_u16(vaddq_u16(acc0, acc1));
+	return chksum_update_portable(sum, data, size);
+}
+
+#else
+
+/* The kernels rely on GCC/Clang function attributes and intrinsics, and on
+an OS-specific way to query CPU features. */
+crc_kernel_t accel_crc_kernel(void)
+{
+	return NULL;
+}
+
+chksum_kernel_t accel_chksum_kernel(void)
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "accel.h"
+
+#include <stddef.h> /* For size_t, NULL. */
+
+/* CRC-16/XMODEM using carry-less multiplication (PCLMULQDQ), based on the
+folding method from Intel's "Fast CRC Computation for Generic Polynomials
+Using PCLMULQDQ Instruction".
+
+The message is treated as one large polynomial M(x), most significant bit
+first. The CRC XMODEM wants is M(x) * x^16 mod P(x). Rather than reducing
+M(x) bit by bit, each 128-bit block S is "folded" onto the block after it
+using:
+
+S * x^128 = S_hi * x^192 + S_lo * x^128
+          = S_hi * (x^192 mod P) + S_lo * (x^128 mod P)   (mod P)
+
+The constants are 16-bit, so each product fits in 80 bits and the folded
+value stays within one 128-bit register. Whatever is left after folding
+is congruent to M(x) mod P, and its CRC is computed with the portable
+engine, which then continues over the bytes that did not fill a block.
+
+Four independent lanes are folded by 512 bits at a time to hide the latency
+of PCLMULQDQ, then combined into one lane.
+
+The 8-bit XMODEM checksum uses PSADBW, which sums 8 bytes into each 64-bit
+half of a register in one instruction. */
+
+#if defined(__GNUC__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define ACCEL_TARGET __attribute__((target("pclmul,ssse3")))
+
+/* x^n mod P(x), P(x) = x^16 + x^12 + x^5 + 1. */
+#define K_128 0xAEFC
+#define K_192 0x650B
+#define K_512 0x13FC
+#define K_576 0x8832
+
+static unsigned int crc_update_clmul(unsigned int crc, const unsigned char * data, size_t size);
+static unsigned int chksum_update_sse2(unsigned int sum, const unsigned char * data, size_t size);
+
+crc_kernel_t accel_crc_kernel(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	{
+		return NULL;
+	}
+
+	return ((ecx & bit_PCLMUL) && (ecx & bit_SSSE3)) ? crc_update_clmul : NULL;
+}
+
+chksum_kernel_t accel_chksum_kernel(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	{
+		return NULL;
+	}
+
+	return (edx & bit_SSE2) ? chksum_update_sse2 : NULL;
+}
+
+
+/* Private functions begin here. */
+/* Loads are byte-reversed so that bit n of the register is the coefficient
+of x^n, which is what PCLMULQDQ expects. */
+ACCEL_TARGET static __m128i load_be(const unsigned char * data)
+{
+	const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, \
+		8, 9, 10, 11, 12, 13, 14, 15);
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), reverse);
+}
+
+ACCEL_TARGET static void store_be(unsigned char * data, __m128i val)
+{
+	const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, \
+		8, 9, 10, 11, 12, 13, 14, 15);
+	_mm_storeu_si128((__m128i *) data, _mm_shuffle_epi8(val, reverse));
+}
+
+/* Multiply the high half of val by the high constant and the low half by the
+low constant. */
+ACCEL_TARGET static __m128i fold(__m128i val, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(val, k, 0x11), \
+		_mm_clmulepi64_si128(val, k, 0x00));
+}
+
+ACCEL_TARGET static unsigned int crc_update_clmul(unsigned int crc, const unsigned char * data, size_t size)
+{
+	const __m128i k_128 = _mm_set_epi64x(K_192, K_128);
+	const __m128i k_512 = _mm_set_epi64x(K_576, K_512);
+	unsigned char residue[16];
+	__m128i lane0, lane1, lane2, lane3;
+
+	if(size < 32)
+	{
+		return crc_update_portable(crc, data, size);
+	}
+
+	/* The running CRC is XORed into the first 16 bits of the message. */
+	lane0 = _mm_xor_si128(load_be(data), \
+		_mm_set_epi64x((long long) ((unsigned long long) (crc & 0xFFFF) << 48), 0));
+
+	if(size >= 64)
+	{
+		lane1 = load_be(data + 16);
+		lane2 = load_be(data + 32);
+		lane3 = load_be(data + 48);
+		data += 64;
+		size -= 64;
+
+		while(size >= 64)
+		{
+			lane0 = _mm_xor_si128(fold(lane0, k_512), load_be(data));
+			lane1 = _mm_xor_si128(fold(lane1, k_512), load_be(data + 16));
+			lane2 = _mm_xor_si128(fold(lane2, k_512), load_be(data + 32));
+			lane3 = _mm_xor_si128(fold(lane3, k_512), load_be(data + 48));
+			data += 64;
+			size -= 64;
+		}
+
+		lane0 = _mm_xor_si128(fold(lane0, k_128), lane1);
+		lane0 = _mm_xor_si128(fold(lane0, k_128), lane2);
+		lane0 = _mm_xor_si128(fold(lane0, k_128), lane3);
+	}
+	else
+	{
+		data += 16;
+		size -= 16;
+	}
+
+	while(size >= 16)
+	{
+		lane0 = _mm_xor_si128(fold(lane0, k_128), load_be(data));
+		data += 16;
+		size -= 16;
+	}
+
+	store_be(residue, lane0);
+	crc = crc_update_portable(0x0000, residue, 16);
+	return crc_update_portable(crc, data, size);
+}
+
+/* Only the low 8 bits of the sum matter, so the 64-bit accumulators can
+never overflow in a way that changes the result. */
+__attribute__((target("sse2"))) static unsigned int chksum_update_sse2(unsigned int sum, const unsigned char * data, size_t size)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+
+	while(size >= 32)
+	{
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) data), zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (data + 16)), zero));
+		data += 32;
+		size -= 32;
+	}
+
+	acc0 = _mm_add_epi64(acc0, acc1);
+	acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+	sum += (unsigned int) _mm_cvtsi128_si32(acc0);
+	return chksum_update_portable(sum, data, size);
+}
+
+#else
+
+/* The kernels rely on GCC/Clang function attributes and intrinsics. */
+crc_kernel_t accel_crc_kernel(void)
+{
+	return NULL;
+}
+
+chksum_kernel_t accel_chksum_kernel(void)
+{
+	return NULL;
+}
+
+#endif
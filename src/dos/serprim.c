@@ -11,6 +11,7 @@ directory. */
 #include <comlib.h>
 #include <limits.h>
 #include <stddef.h>
+#include <time.h>
 
 /* Todo- Add logic to check that the serial port in fact exists. Eventually,
 remove dependencies off PICTOR lib. */
@@ -129,25 +130,31 @@ int write_data(serial_handle_t port, char * data, unsigned int num_bytes)
 	}	
 }
 
-int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int timeout)
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms)
 {
 	/* Guard against signed overflow in either direction when converting
 	to ticks. Additionally, the DOS library may not handle negative 
 	timeouts well. A timeout < 0 will be set to 0. */
-	unsigned int timeout_ticks;
+	unsigned long timeout_ticks;
 	int prev_timeout;
 	
 	(void) port;
 	
-	if(timeout < 0)
+	if(timeout_ms < 0)
 	{
-		timeout = 0;
+		timeout_ms = 0;
 	}
 	
-	timeout_ticks = timeout * 18;
-	
 	/* Guard against out of bounds unsigned to signed conversion. */
-	if(num_bytes > INT_MAX || timeout_ticks > INT_MAX)
+	if(num_bytes > INT_MAX || timeout_ms > (LONG_MAX / 91))
+	{
+		return -2;
+	}
+	
+	/* 18.2 ticks per second is 91 ticks per 5000 ms. Round up, so short
+	timeouts do not become 0. */
+	timeout_ticks = ((unsigned long) timeout_ms * 91 + 4999) / 5000;
+	if(timeout_ticks > INT_MAX)
 	{
 		return -2;
 	}
@@ -176,6 +183,21 @@ int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int tim
 	
 }
 
+/* DOS is single-tasking, so clock() effectively counts wall time. It only
+ticks 18.2 times per second, which is as good as comread() timeouts get. */
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
+{
+	int rc;
+	clock_t start, end;
+	
+	start = clock();
+	rc = read_data(port, data, num_bytes, timeout_ms);
+	end = clock();
+	
+	*elapsed_ms = (long) ((end - start) * 1000L / CLOCKS_PER_SEC);
+	return rc;
+}
+
 int close_handle(serial_handle_t port)
 {
 	(void) port;
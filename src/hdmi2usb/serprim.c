@@ -7,6 +7,16 @@
 #include <generated/csr.h>
 #include <hw/common.h>
 
+/* Timer ticks per millisecond. Tick counts are kept in unsigned long: ten
+seconds of ticks no longer fit an int above about 214 MHz. */
+#define TICKS_PER_MS ((unsigned long) SYSTEM_CLOCK_FREQUENCY / 1000UL)
+/* Longest wait measured in one go; timer0 wraps after 11 seconds. */
+#define SLICE_MS 10000L
+
+static int read_timed(char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms);
+static unsigned long timer_ticks(void);
+static unsigned long ticks_since(unsigned long start);
+
 
 serial_handle_t open_handle(unsigned short port_no)
 {
@@ -22,12 +32,12 @@ int init_port(serial_handle_t port, unsigned long baud_rate)
 {
     /* BIOS will initialize uart and timer, but we need to measure
     intervals greater than 2 seconds (up to 10). */
-    int t;
+    unsigned long t;
     (void) port;
     (void) baud_rate;
 
     timer0_en_write(0);
-    t = 11*SYSTEM_CLOCK_FREQUENCY;
+    t = 11UL * SYSTEM_CLOCK_FREQUENCY;
     timer0_reload_write(t);
     timer0_load_write(t);
     timer0_en_write(1);
@@ -48,46 +58,18 @@ int write_data(serial_handle_t port, char * data, unsigned int num_bytes)
     return 0;
 }
 
-int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int timeout)
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms)
 {
-    unsigned int count = 0;
-    int start_time = 0;
+    long elapsed_ms;
 
     (void) port;
-
-    elapsed(&start_time, -1); /* Initialize elapsed function. */
-    while(!elapsed(&start_time, timeout * SYSTEM_CLOCK_FREQUENCY))
-    {
-        if(uart_read_nonblock())
-        {
-            data[count++] = uart_read();
-            if(count >= num_bytes)
-            {
-                return 0;
-            }
-        }
-    }
-
-    return -1;
+    return read_timed(data, num_bytes, timeout_ms, &elapsed_ms);
 }
 
-int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, int timeout, int * elapsed)
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
 {
-    int start_time, end_time;
-    int rv;
-
-    start_time = timer0_value_read();
-    rv = read_data(port, data, num_bytes, timeout);
-    end_time = timer0_value_read();
-
-    if(start_time < end_time)
-    {
-        /* Down counter. Timer rolled over if start < end. */
-        end_time += timer0_reload_read();
-    }
-
-    *elapsed = (end_time - start_time) / SYSTEM_CLOCK_FREQUENCY;
-    return rv;
+    (void) port;
+    return read_timed(data, num_bytes, timeout_ms, elapsed_ms);
 }
 
 int close_handle(serial_handle_t port)
@@ -107,3 +89,63 @@ int flush_device(serial_handle_t port)
 
     return 0;
 }
+
+
+/* Private functions begin here. */
+static int read_timed(char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
+{
+    unsigned int count = 0;
+    unsigned long start, slice_ticks;
+    long slice_ms;
+
+    (* elapsed_ms) = 0;
+    if(timeout_ms < 0)
+    {
+        timeout_ms = 0;
+    }
+
+    /* timer0 is set up to measure at most 11 seconds (see init_port()), so
+    longer timeouts are waited out in slices, and the time spent is summed
+    slice by slice. */
+    do{
+        slice_ms = (timeout_ms > SLICE_MS) ? SLICE_MS : timeout_ms;
+        timeout_ms -= slice_ms;
+        slice_ticks = (unsigned long) slice_ms * TICKS_PER_MS;
+
+        start = timer_ticks();
+        do{
+            if(uart_read_nonblock())
+            {
+                data[count++] = uart_read();
+                if(count >= num_bytes)
+                {
+                    (* elapsed_ms) += (long) (ticks_since(start) / TICKS_PER_MS);
+                    return 0;
+                }
+            }
+        }while(ticks_since(start) < slice_ticks);
+
+        (* elapsed_ms) += slice_ms;
+    }while(timeout_ms > 0);
+
+    return -1;
+}
+
+static unsigned long timer_ticks(void)
+{
+    timer0_update_value_write(1);
+    return timer0_value_read();
+}
+
+/* Ticks since start. timer0 counts down, and is reloaded at 0. */
+static unsigned long ticks_since(unsigned long start)
+{
+    unsigned long now = timer_ticks();
+
+    if(now <= start)
+    {
+        return start - now;
+    }
+
+    return start + (timer0_reload_read() - now);
+}
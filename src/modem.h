@@ -9,7 +9,6 @@ function expects at least a valid handle opened by open_handle(), and a
 function pointer that indicates how to transfer the data before/after serial
 transmit/receive.
 
-\todo Add `sfl_boot_cmd_t` callback function type for SFL boot.
 \todo Add \p size_hint parameter to all functions to handle use-cases where
 entire packet cannot be stored at once.
 */
@@ -33,6 +32,8 @@ entire packet cannot be stored at once.
 #define CAN 0x18
 #define SUB 0x1A
 #define ASCII_C 0x43
+#define ASCII_W 0x57
+#define ASCII_G 0x47
 
 /* EOF = SUB in XModem at least. This was for CP/M and DOS
 compatibility. The platform specific EOF should be checked for,
@@ -73,8 +74,9 @@ are possible.
 typedef enum modem_errors{
 	MODEM_NO_ERRORS = 0, /**< Transfer completed successfully. */
 	BAD_CRC_CHKSUM, /**< Used to indicate a bad XMODEM CRC or checksum for the
-	current received packet. This value is never returned, and gets mapped
-	to ::MODEM_TIMEOUT if enough errors occur. */
+	current received packet. Only returned by an ::XMODEM_G receiver, which
+	cannot ask for the packet again; otherwise it gets mapped to
+	::MODEM_TIMEOUT if enough errors occur. */
 	SENT_CAN, /**< XMODEM receiver cancelled the transfer. */
 	PACKET_MISMATCH, /**< XMODEM packet equals number different from expected. */
 	CHANNEL_ERROR, /**< ::input_channel_t or ::output_channel_t callback function
@@ -85,9 +87,41 @@ typedef enum modem_errors{
 	Corresponds to ::SERIAL_HW_ERROR in ::serial_status_t. */
 	MODEM_TIMEOUT,	/**< No data was read in expected time frame. Corresponds to
 	::SERIAL_TIMEOUT in ::serial_status_t. */
-	NOT_IMPLEMENTED
+	NOT_IMPLEMENTED,
+	MODEM_IN_PROGRESS /**< Transfer has not finished yet. Only returned by
+	xmodem_session_status(). */
 }modem_errors_t;
 
+/** \brief Largest window accepted by xmodem_tx_windowed().
+
+Block numbers are 8 bits, so the window must be well short of 256 blocks for
+acknowledgements to be unambiguous.
+*/
+#define XMODEM_MAX_WINDOW 128
+
+/** \brief Longest file name sent or received by YMODEM, excluding the
+terminating `NUL`. */
+#define YMODEM_MAX_NAME 255
+
+/** \brief Largest ZMODEM data subpacket sent or accepted. */
+#define ZMODEM_BLOCK_SIZE 1024
+
+/** \brief Size of the buffer zmodem_tx() and zmodem_rx() need: one raw
+subpacket, and room for it once escaped. */
+#define ZMODEM_BUF_SIZE (3 * ZMODEM_BLOCK_SIZE + 16)
+
+/** \brief Size of the buffer sfl_rx() needs: the largest SFL frame, a 4 byte
+header followed by up to 255 bytes of payload. */
+#define SFL_FRAME_SIZE 259
+
+/** \brief Size of the buffer sfl_tx() needs: room to encode the next frame
+while the one before it is acknowledged. */
+#define SFL_TX_BUF_SIZE (2 * SFL_FRAME_SIZE)
+
+/** \brief \p erased_value for sfl_tx() when the target's memory holds
+nothing known, so every byte of the image is sent. */
+#define SFL_NOT_ERASED -1
+
 /** \brief XMODEM transfer mode selection.
 
 This enum is an input parameter into the xmodem_tx() and xmodem_rx() functions
@@ -97,9 +131,33 @@ typedef enum xfer_modes
 {
 	XMODEM = 0, /**< Use XMODEM w/ 128 byte packets and 8-bit checksum. */
 	XMODEM_CRC, /**< Use XMODEM w/ 128 byte packets and 16-bit CRC. */
-	XMODEM_1K /**< Use XMODEM w/ 1024 byte packets and 16-bit CRC. */
+	XMODEM_1K, /**< Use XMODEM w/ 1024 byte packets and 16-bit CRC. */
+	XMODEM_G /**< Use XMODEM-G: ::XMODEM_1K packets, streamed without
+	per-packet acknowledgements. The receiver starts with 'G', and cancels
+	the transfer on any error. Only for error-free links. Either side falls
+	back to ::XMODEM_1K if the other does not support it. */
 }xmodem_xfer_mode_t;
 
+/** \brief Running checksum/CRC state.
+
+A ::crc_state_t accumulates the XMODEM checksum or CRC over data that arrives
+in several pieces. Feeding a buffer to crc_update() in any number of chunks
+gives the same result as one call to generate_chksum() or generate_crc() over
+the whole buffer. This lets a receiver check a packet while it is still
+arriving, and lets code which already copies the payload compute the CRC
+during the copy instead of in a second pass (see crc_copy() and
+::checked_channel_t).
+
+The members are exposed so the state can live on the stack or in a channel's
+\p chan_state; treat them as read-only.
+*/
+typedef struct crc_state
+{
+	unsigned int value; /**< Running checksum or CRC. */
+	int use_crc; /**< Nonzero if \p value is a 16-bit CRC, zero for an 8-bit
+	checksum. */
+}crc_state_t;
+
 /**
 \typedef output_channel_t
 \brief Transmit function pointer for data transfer routines.
@@ -164,6 +222,87 @@ functions.
 */
 typedef int (* output_channel_t)(char * buf, const int request_size, const int last_sent_size, void * const chan_state);
 
+/**
+\typedef borrow_channel_t
+\brief Zero-copy transmit function pointer for data transfer routines.
+
+A function of type ::borrow_channel_t is an alternative to ::output_channel_t
+for data which already sits in memory, such as an `mmap`'d file or a region
+of flash. Instead of copying the next payload into a buffer supplied by the
+protocol, the callback lends the protocol a pointer into its own storage.
+The protocol computes the checksum/CRC and transmits straight from there.
+
+\param[out] buf Set by the callback to the start of the next payload. It
+must remain valid, and its contents unchanged, until the callback is called
+again or the transfer routine returns. May be left unset if 0 is returned.
+\param[in] request_size Size of the payload the data transmitter requested.
+\param[in] last_sent_size Identical to the parameter of ::output_channel_t.
+On a retransmit, this is 0 and the callback should lend the same data again.
+\param[in,out] chan_state An opaque pointer to the state required to send data
+properly.
+\returns Number of bytes available at \p buf, at most \p request_size.
+A value less than \p request_size signals the end of the data, exactly as for
+::output_channel_t.
+\returns A negative value on unrecoverable errors.
+
+The borrowing equivalent of the example given for ::output_channel_t is:
+
+\code{.c}
+int borrow_from_buf(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state) {
+	buf_reader_t * reader = chan_state;
+	size_t space_left;
+
+	reader->bufpos += last_sent_size;
+	space_left = reader->buflen - reader->bufpos;
+
+	*buf = (const char *) reader->buf + reader->bufpos;
+	return space_left < (size_t) request_size ? (int) space_left : request_size;
+}
+\endcode
+
+\sa xmodem_tx_borrow()
+*/
+typedef int (* borrow_channel_t)(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state);
+
+/**
+\typedef checked_channel_t
+\brief Transmit function pointer which also computes the checksum/CRC.
+
+A function of type ::checked_channel_t is an alternative to ::output_channel_t
+for callbacks which copy their data into \p buf anyway. Copying with
+crc_copy() into \p check folds the data into the packet's checksum/CRC while
+it is still in cache, and the protocol skips its own pass over the payload.
+
+\param[out] buf Identical to the parameter of ::output_channel_t.
+\param[in] request_size Identical to the parameter of ::output_channel_t.
+\param[in] last_sent_size Identical to the parameter of ::output_channel_t.
+\param[in,out] check Checksum/CRC of the packet, already initialized with
+crc_init(). Exactly the bytes written to \p buf, in order, must be passed to
+crc_copy() or crc_update() on \p check.
+\param[in,out] chan_state An opaque pointer to the state required to send data
+properly.
+\returns As for ::output_channel_t.
+
+The checked equivalent of the example given for ::output_channel_t is:
+
+\code{.c}
+int copy_from_buf(char * buf, const int request_size, const int last_sent_size, crc_state_t * check, void * const chan_state) {
+	buf_reader_t * reader = chan_state;
+	size_t space_left, size_read;
+
+	reader->bufpos += last_sent_size;
+	space_left = reader->buflen - reader->bufpos;
+
+	size_read = space_left < (size_t) request_size ? space_left : (size_t) request_size;
+	crc_copy(check, (unsigned char *) buf, (const unsigned char *) reader->buf + reader->bufpos, size_read);
+	return (int) size_read;
+}
+\endcode
+
+\sa xmodem_tx_checked()
+*/
+typedef int (* checked_channel_t)(char * buf, const int request_size, const int last_sent_size, crc_state_t * check, void * const chan_state);
+
 /**
 \typedef input_channel_t
 \brief Receive function pointer for data transfer routines.
@@ -210,11 +349,245 @@ int write_to_buf(const char * buf, const int buf_size, const int eof, void * con
 }
 \endcode
 
-\todo Add \p address input argument to handle protocols such as SFL where
-this information is provided.
+Protocols which carry a destination address with the data, such as SFL, use
+::input_addr_channel_t instead.
 */
 typedef int (* input_channel_t)(const char * buf, const int buf_size, const int eof, void * const chan_state);
 
+/**
+\typedef input_window_t
+\brief Zero-copy receive function pointer for data transfer routines.
+
+A function of type ::input_window_t is an alternative to ::input_channel_t
+for sinks which can expose their final destination as memory, such as a
+window of an `mmap`'d output file or a RAM load address on target. Before
+each block is received, the protocol asks the callback where to put it, and
+the serial port reads the payload straight there.
+
+\param[in] request_size Size of the next payload. The returned buffer must
+have room for this many bytes.
+\param[in] last_recv_size Size of the payload received into the buffer
+returned by the previous call, or 0 if that payload was rejected (bad CRC,
+timeout) and will be received again. A nonzero value commits the previous
+payload; the callback should advance past it.
+\param[in] eof End of transfer was detected by the protocol. \p request_size
+is 0 and no data will be written; this call only commits the last payload.
+\param[in,out] chan_state An opaque pointer to the state required to receive
+data properly.
+\returns Destination for the next payload, or `NULL` if the sink has no room
+or failed, which aborts the transfer. When \p eof is set, any non-`NULL`
+value indicates success.
+
+The buffer returned is written before the block's checksum/CRC has been
+checked, so it must not be something the caller acts on until committed.
+Like with ::input_channel_t, the last block includes any ::CPMEOF padding
+sent by the transmitter.
+
+An example for a preallocated buffer:
+
+\code{.c}
+char * window_in_buf(const int request_size, const int last_recv_size, const int eof, void * const chan_state) {
+	buf_writer_t * writer = chan_state;
+
+	writer->bufpos += last_recv_size;
+	if(eof) {
+		return (char *) writer->buf;
+	}
+
+	if(writer->buflen - writer->bufpos < (size_t) request_size) {
+		return NULL;
+	}
+
+	return (char *) writer->buf + writer->bufpos;
+}
+\endcode
+
+\sa xmodem_rx_window()
+*/
+typedef char * (* input_window_t)(const int request_size, const int last_recv_size, const int eof, void * const chan_state);
+
+/** \brief File information carried by a YMODEM header (block 0).
+
+\todo YMODEM can also carry a file mode and serial number, which are ignored.
+*/
+typedef struct ymodem_file_info
+{
+	char name[YMODEM_MAX_NAME + 1]; /**< `NUL`-terminated file name. A
+	receiver gets the name exactly as sent, which may include directories,
+	so it must be checked before being used as a path. */
+	unsigned long size; /**< Exact length of the file in bytes, if
+	\p has_size is set. */
+	int has_size; /**< Nonzero if \p size is known. Without it, a receiver
+	gets whole blocks, including the padding, as with XMODEM. */
+	unsigned long mtime; /**< Modification time in seconds since
+	1970-01-01 UTC, or 0 if unknown. */
+}ymodem_file_info_t;
+
+/**
+\typedef ymodem_next_file_t
+\brief YMODEM transmitter callback to start the next file of a batch.
+
+\param[out] info Set by the callback to describe the next file. ymodem_tx()
+clears it beforehand.
+\param[in,out] chan_state The same opaque pointer passed to the
+::output_channel_t, which reads the file once this callback returns.
+\returns 1 if \p info describes another file to send, 0 if the batch is
+complete, and a negative value on errors.
+*/
+typedef int (* ymodem_next_file_t)(ymodem_file_info_t * info, void * const chan_state);
+
+/**
+\typedef ymodem_open_file_t
+\brief YMODEM receiver callback for the start of each file of a batch.
+
+Called once each file's header has been received, before any of its data.
+Since the exact size is known up front, a sink may preallocate space for
+it. Each file's data is then passed to the ::input_channel_t without any
+padding, followed by a call with \p eof set.
+
+\param[in] info Description of the file about to be received.
+\param[in,out] chan_state The same opaque pointer passed to the
+::input_channel_t.
+\returns 0 to receive the file, or a negative value to cancel the transfer.
+*/
+typedef int (* ymodem_open_file_t)(const ymodem_file_info_t * info, void * const chan_state);
+
+/**
+\typedef seek_channel_t
+\brief Reposition the data source of a transmitter.
+
+ZMODEM receivers ask for data by offset: to resume a file, or to resend
+everything after an error. After this callback returns, the
+::output_channel_t is called with \p last_sent_size 0 and must continue
+reading from \p offset.
+
+\param[in] offset Offset within the current file.
+\param[in,out] chan_state The same opaque pointer passed to the
+::output_channel_t.
+\returns 0 on success, or a negative value if \p offset can't be reached,
+which cancels the transfer.
+*/
+typedef int (* seek_channel_t)(unsigned long offset, void * const chan_state);
+
+/**
+\typedef zmodem_open_file_t
+\brief ZMODEM receiver callback for the start of each file.
+
+Like ::ymodem_open_file_t, but the receiver can also skip the file, or
+resume it after an interrupted transfer.
+
+\param[in] info Description of the file offered.
+\param[in,out] offset 0 on entry. To resume, set it to the number of bytes
+of the file already held; the ::input_channel_t then only gets the rest.
+\param[in,out] chan_state The same opaque pointer passed to the
+::input_channel_t.
+\returns 0 to receive the file, 1 to skip it, or a negative value to cancel
+the transfer.
+*/
+typedef int (* zmodem_open_file_t)(const ymodem_file_info_t * info, unsigned long * offset, void * const chan_state);
+
+/**
+\typedef input_addr_channel_t
+\brief Receive function pointer for protocols which address their data.
+
+Identical to ::input_channel_t, except that each payload comes with the
+address the transmitter wants it written to. Payloads are passed in the
+order they arrive, which need not be ascending, and a payload may be passed
+again if the transmitter resends it.
+
+\param[in] address Destination of the first byte of \p buf. When \p eof is
+set, the address execution should continue from, if the protocol gives one.
+\param[in] buf Buffer of received serial port data.
+\param[in] buf_size Size of the buffer with received data. 0 when \p eof is
+set.
+\param[in] eof End of transfer was detected by the protocol.
+\param[in,out] chan_state An opaque pointer to the state required to receive
+data properly.
+\returns Value of \p buf_size on success, as for ::input_channel_t.
+
+\sa sfl_rx()
+*/
+typedef int (* input_addr_channel_t)(unsigned long address, const char * buf, const int buf_size, const int eof, void * const chan_state);
+
+/**
+\typedef sfl_boot_cmd_t
+\brief Start a program received by sfl_rx().
+
+Called by sfl_rx() once the host asks the target to jump to the image it
+loaded, after the request has been acknowledged. On a bootloader this
+normally transfers control and never returns.
+
+\param[in] address Entry point given by the host.
+\param[in,out] chan_state The same opaque pointer passed to the
+::input_addr_channel_t.
+\returns 0 on success, nonzero if the program can't be started.
+*/
+typedef int (* sfl_boot_cmd_t)(unsigned long address, void * const chan_state);
+
+/**
+\typedef sfl_next_region_t
+\brief Describe the next region of an image for sfl_tx().
+
+An image is any number of regions, each a block of memory bound for an
+address on the target, such as the sections of an ELF file. Regions are
+sent in the order given; ones which adjoin are packed into frames together.
+
+\param[out] address Target address of the region.
+\param[out] data Contents of the region. Must stay valid until the next
+call.
+\param[out] size Size of the region in bytes. May be 0.
+\param[in,out] chan_state An opaque pointer to the state required to find
+the regions.
+\returns 1 if a region was described, 0 once there are none left, or a
+negative value on error, which aborts the upload.
+*/
+typedef int (* sfl_next_region_t)(unsigned long * address, const unsigned char ** data, size_t * size, void * const chan_state);
+
+/** \brief Statistics of one XMODEM or YMODEM transfer.
+
+Filled in by the blocking XMODEM and YMODEM functions when given a non-`NULL`
+\p stats parameter, so a slow or failing transfer can be diagnosed
+afterwards. Counts cover the whole call, including YMODEM headers, and are
+valid whatever the transfer returns. Members not relevant to one direction
+remain 0. With `NULL`, no time is spent counting, and no timings are taken.
+*/
+typedef struct modem_stats
+{
+	unsigned long packets_sent; /**< Packets sent, including retransmissions. */
+	unsigned long packets_received; /**< Packets whose start character arrived,
+	good or bad. */
+	unsigned long retransmits; /**< Packets sent again, after a NAK or, in a
+	window, to go back. */
+	unsigned long naks_received; /**< NAKs received by the transmitter. */
+	unsigned long naks_bad_check; /**< NAKs sent for a bad checksum/CRC, or in
+	a window, a garbled header. */
+	unsigned long naks_timeout; /**< NAKs sent because a packet stalled
+	partway through, or none arrived in time. */
+	unsigned long out_of_sequence; /**< Packets dropped by a windowed receiver
+	because one before them was rejected. */
+	unsigned long timeouts; /**< Waits for the other side which timed out. The
+	transmitter gives up on the first. */
+	unsigned long tail_switches; /**< Switches from 1024 to 128 byte blocks in
+	an ::XMODEM_1K transfer, made to send (or seen when receiving) the short
+	tail of the data. This is the normal end of most transfers, not a sign of
+	errors; line errors never cause a switch. */
+	unsigned long downgrades_crc; /**< Falls back from CRC to checksum by the
+	receiver. */
+	unsigned long payload_bytes; /**< File data carried by the packets, without
+	the padding known to be padding. */
+	unsigned long padding_bytes; /**< ::CPMEOF padding added by the transmitter,
+	or removed by ymodem_rx() using the file size. */
+	unsigned long wire_bytes; /**< Bytes of packets sent or received in full,
+	including retransmissions, headers and checksums/CRCs. */
+	unsigned long ack_rtt_count; /**< ACKs timed for the members below. Not
+	measured in a window, where ACKs overlap sending. */
+	unsigned long ack_rtt_total_ms; /**< Total time from sending a packet to
+	its ACK. The average is this over \p ack_rtt_count. */
+	long ack_rtt_min_ms; /**< Shortest time from sending a packet to its
+	ACK. */
+	long ack_rtt_max_ms; /**< Longest time from sending a packet to its ACK. */
+}modem_stats_t;
+
 /* Wrapper function for all possible xfer modes (wrapper.c).
 (Possibly open serial port as well?) */
 /* uint16_t modem_tx(modem_file_t ** f_ptr, serial_handle_t device, uint8_t flags);
@@ -236,17 +609,62 @@ pointer offset into the buffer where the data payload starts is passed into
 is appropriately sized:
 - 132 bytes if ::XMODEM is used.
 - 133 bytes if ::XMODEM_CRC is used.
-- 1029 bytes if ::XMODEM_1K is used.
+- 1029 bytes if ::XMODEM_1K or ::XMODEM_G is used.
 \param[in,out] chan_state State for callback \p data_out, passed into the \p
 chan_state parameter of \p data_out. xmodem_tx() itself does not modify
 \p chan_state.
 \param[in] device Handle to a serial port.
 \param[in] flags XMODEM protocol variant to use. ::XMODEM_1K will be converted
 to ::XMODEM_CRC when less than 1024 bytes are left to send.
+\param[out] stats Statistics of the transfer, or `NULL`.
 
 \sa output_channel_t xmodem_xfer_mode_t
 */
-modem_errors_t xmodem_tx(output_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags);
+modem_errors_t xmodem_tx(output_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief XMODEM transmitter implementation, sending from borrowed memory.
+
+xmodem_tx_borrow() is identical to xmodem_tx(), except that payloads are lent
+by \p data_out rather than copied into \p buf. \p buf still holds each
+packet's header and checksum/CRC. The payload is only copied into \p buf for
+the final, short block, which must be padded with ::CPMEOF.
+
+On platforms implementing write_datav(), each packet is sent with a single
+gather write, so a payload is never copied in the common case, even if it is
+retransmitted.
+
+\param[in,out] data_out Callback that xmodem_tx_borrow() uses to borrow more
+data.
+\param[in] buf Intermediate buffer, sized exactly as for xmodem_tx().
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa borrow_channel_t xmodem_tx()
+*/
+modem_errors_t xmodem_tx_borrow(borrow_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief XMODEM transmitter implementation, with the checksum/CRC computed
+by the callback.
+
+xmodem_tx_checked() is identical to xmodem_tx(), except that \p data_out
+folds each payload into the packet's checksum/CRC as it copies it, so the
+payload is only read once. If an ::XMODEM_1K transfer switches to 128 byte
+blocks after \p data_out has supplied more than 128 bytes, that one packet's
+checksum/CRC is computed again by xmodem_tx_checked().
+
+\param[in,out] data_out Callback that xmodem_tx_checked() uses to obtain more
+data.
+\param[in] buf Intermediate buffer, sized exactly as for xmodem_tx().
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa checked_channel_t crc_copy() xmodem_tx()
+*/
+modem_errors_t xmodem_tx_checked(checked_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
 
 /** \brief XMODEM receiver implementation.
 
@@ -263,7 +681,7 @@ pointer offset into the buffer where the data payload starts is passed into
 is appropriately sized:
 - 132 bytes if ::XMODEM is used.
 - 133 bytes if ::XMODEM_CRC is used.
-- 1029 bytes if ::XMODEM_1K is used.
+- 1029 bytes if ::XMODEM_1K or ::XMODEM_G is used.
 \param[in,out] chan_state State for callback \p data_in, passed into the \p
 chan_state parameter of \p data_in. xmodem_rx() itself does not modify
 \p chan_state.
@@ -272,36 +690,532 @@ chan_state parameter of \p data_in. xmodem_rx() itself does not modify
 combination of ::XMODEM_1K and ::XMODEM_CRC packets during receipt.
 Additionally, during initial negotiation, ::XMODEM_1K and ::XMODEM_CRC will be
 downgraded to ::XMODEM if the xmodem_rx() does not receive an appropriate
-response within 3 attempts.
+response within 3 attempts. ::XMODEM_G asks for a streamed transfer once, then
+continues as ::XMODEM_1K; a streamed transfer is cancelled on the first bad
+packet or timeout, returning ::BAD_CRC_CHKSUM or ::MODEM_TIMEOUT.
+\param[out] stats Statistics of the transfer, or `NULL`.
 
 \sa input_channel_t xmodem_xfer_mode_t
 */
-modem_errors_t xmodem_rx(input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags);
+modem_errors_t xmodem_rx(input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief XMODEM receiver implementation, receiving in place.
+
+xmodem_rx_window() is identical to xmodem_rx(), except that each payload is
+read from the serial port directly into memory supplied by \p data_in, so it
+is never copied. \p buf only stages each packet's header and checksum/CRC.
+If a block fails its check, the retransmission is written over it in place.
+
+\param[in,out] data_in Callback that supplies the destination of each
+payload.
+\param[in] buf Intermediate buffer for the packet header and trailer. It must
+be at least 5 bytes.
+\param[in,out] chan_state State for callback \p data_in.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_rx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa input_window_t xmodem_rx()
+*/
+modem_errors_t xmodem_rx_window(input_window_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief Windowed XMODEM transmitter implementation.
+
+xmodem_tx_windowed() is identical to xmodem_tx(), except that against a
+receiver which asks for it, up to \p window packets are sent before waiting
+for the first to be acknowledged. This hides the acknowledgement round trip
+on links with high latency, such as USB-serial adapters and networked console
+servers.
+
+A windowed receiver (xmodem_rx_windowed()) starts the transfer with a `W`
+instead of a `C`. From then on, packets are unchanged, but each ACK or NAK is
+followed by the number of the block it refers to. An ACK acknowledges that
+block and every block before it; a NAK asks for that block and every block
+after it to be sent again (go-back-N). Against a receiver which starts with
+`C`, xmodem_tx_windowed() behaves exactly like xmodem_tx(). Windowing
+requires CRCs, so ::XMODEM transfers are never windowed.
+
+\param[in,out] data_out Callback that xmodem_tx_windowed() uses to obtain more
+data. Unacknowledged packets are kept in \p buf, so \p data_out is never
+asked for the same data twice.
+\param[in] buf Buffer holding the packets in flight. It must be
+\p window times the size required by xmodem_tx(): 133 bytes per packet for
+::XMODEM_CRC and 1029 bytes per packet for ::XMODEM_1K.
+\param[in] window Maximum number of unacknowledged packets, from 1 to
+::XMODEM_MAX_WINDOW. Larger values are reduced to ::XMODEM_MAX_WINDOW.
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa xmodem_rx_windowed() xmodem_tx()
+*/
+modem_errors_t xmodem_tx_windowed(output_channel_t data_out, unsigned char * buf, unsigned int window, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief XMODEM transmitter implementation, reading ahead.
+
+xmodem_tx_prefetch() is identical to xmodem_tx(), except that each block is
+read from \p data_out, padded and given its checksum/CRC while the block
+before it waits to be acknowledged. Slow sources, such as decompressors,
+network file systems or flash on a target, then no longer add their latency
+to every packet. The receiver sees no difference.
+
+A NAK resends the packet in flight without asking \p data_out for it again.
+As a result, \p last_sent_size reports a block once it has been sent, not
+once it has been acknowledged, and \p data_out may be asked for one block
+past the point where a failed transfer stopped. ::XMODEM_G transfers which
+stream gain nothing from reading ahead, and are sent as by xmodem_tx().
+
+\param[in,out] data_out Callback that xmodem_tx_prefetch() uses to obtain
+more data.
+\param[in] buf Buffer holding the packet in flight and the next one. It must
+be twice the size required by xmodem_tx(): 266 bytes for ::XMODEM or
+::XMODEM_CRC, and 2058 bytes for ::XMODEM_1K or ::XMODEM_G.
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa xmodem_tx()
+*/
+modem_errors_t xmodem_tx_prefetch(output_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief Windowed XMODEM receiver implementation.
+
+xmodem_rx_windowed() is identical to xmodem_rx(), except that it offers the
+transmitter a window by starting with `W` (see xmodem_tx_windowed()). Blocks
+still arrive and are passed to \p data_in in order, so the receiver needs no
+more memory than xmodem_rx(). After a bad block, blocks the transmitter had
+already sent are discarded until it goes back to the bad one.
+
+If no packet arrives within the first handshake timeout, the transmitter is
+assumed not to support windows, and xmodem_rx_windowed() continues exactly
+like xmodem_rx().
+
+\param[in,out] data_in Callback that xmodem_rx_windowed() uses to send data.
+\param[in] buf Intermediate buffer, sized as for xmodem_rx().
+\param[in,out] chan_state State for callback \p data_in.
+\param[in] device Handle to a serial port.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_rx(). ::XMODEM
+does not offer a window.
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa xmodem_tx_windowed() xmodem_rx()
+*/
+modem_errors_t xmodem_rx_windowed(input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief State of a non-blocking XMODEM transfer.
+
+A session carries out the same protocol as xmodem_tx() or xmodem_rx(), with
+the same retries and timeouts, but performs no I/O and never waits. Instead,
+the caller moves bytes between the session and the serial port:
+
+- Bytes received are handed to xmodem_session_feed().
+- Bytes to transmit are fetched with xmodem_session_output(), and reported
+with xmodem_session_sent() once written.
+- When nothing arrives, xmodem_session_tick() must be called by the time
+returned by xmodem_session_deadline().
+
+Times are in milliseconds from any fixed point, such as a monotonic clock;
+only differences between them are used. This lets a transfer be driven from
+`poll()` or `epoll`, a cooperative scheduler, or a UART interrupt, and lets
+one thread run many transfers at once. A minimal driver looks like:
+
+\code{.c}
+xmodem_session_rx(&session, write_to_buf, buf, &writer, XMODEM_1K, now());
+while(1) {
+	if((size = xmodem_session_output(&session, &out)) > 0) {
+		xmodem_session_sent(&session, write(fd, out, size), now());
+	} else if(xmodem_session_deadline(&session, &deadline)) {
+		if(wait_readable(fd, deadline - now())) {
+			xmodem_session_feed(&session, in, read(fd, in, sizeof(in)), now());
+		}
+		xmodem_session_tick(&session, now());
+	} else {
+		break;
+	}
+}
+status = xmodem_session_status(&session);
+\endcode
+
+Members are private; start a session with xmodem_session_tx(),
+xmodem_session_tx_image() or xmodem_session_rx(). Windowed and YMODEM transfers are only available through
+the blocking functions.
+*/
+typedef struct xmodem_session
+{
+	output_channel_t data_out;
+	input_channel_t data_in;
+	const struct xmodem_image * image; /* Packets to send, if not NULL. */
+	size_t packet_no; /* Index into image of the packet being sent. */
+	unsigned char * buf;
+	void * chan_state;
+	int state;
+	modem_errors_t status;
+	xmodem_xfer_mode_t flags; /* Current mode; falls back during a transfer. */
+	const unsigned char * out; /* Output not yet sent. */
+	size_t out_size;
+	unsigned char codes[4]; /* Control characters queued for output. */
+	long wait_ms; /* Timeout which starts once the output is sent. */
+	long deadline;
+	int has_deadline;
+	long start_timeout; /* Receiver's timeout for the next packet. */
+	int error_count;
+	int offer_tries; /* Handshake attempts spent on 'G'. */
+	int streaming;
+	int eof;
+	int last_sent_size;
+	char tx_code;
+	unsigned char expected_block_no;
+	size_t block_size;
+	size_t packet_size;
+	size_t received; /* Bytes of the current packet in buf. */
+}xmodem_session_t;
+
+/** \brief Start a non-blocking XMODEM transmitter.
+
+The session waits for the receiver to start the transfer, exactly as
+xmodem_tx() does.
+
+\param[out] session Session to initialize.
+\param[in,out] data_out Callback that the session uses to obtain more data.
+\param[in] buf Buffer holding the packet being sent, sized as for xmodem_tx().
+It must not be modified until the session ends.
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\param[in] now_ms Current time.
+
+\sa xmodem_session_t
+*/
+void xmodem_session_tx(xmodem_session_t * session, output_channel_t data_out, unsigned char * buf, void * chan_state, const xmodem_xfer_mode_t flags, long now_ms);
+
+/** \brief Start a non-blocking XMODEM receiver.
+
+The session queues the first NAK or `C` to start the transfer, exactly as
+xmodem_rx() does.
+
+\param[out] session Session to initialize.
+\param[in,out] data_in Callback that the session uses to send data.
+\param[in] buf Buffer holding the packet being received, sized as for
+xmodem_rx().
+\param[in,out] chan_state State for callback \p data_in.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_rx().
+\param[in] now_ms Current time.
+
+\sa xmodem_session_t
+*/
+void xmodem_session_rx(xmodem_session_t * session, input_channel_t data_in, unsigned char * buf, void * chan_state, const xmodem_xfer_mode_t flags, long now_ms);
+
+/** \brief Pass bytes received from the serial port to a session.
+
+Callbacks run from within this function. A transmitter discards anything
+received while a packet is still waiting to be sent, as xmodem_tx() does by
+flushing the serial port before each packet.
+
+\param[in,out] session Session in progress.
+\param[in] data Bytes received.
+\param[in] size Number of bytes at \p data.
+\param[in] now_ms Current time.
+\returns Number of bytes used. This is less than \p size only if the session
+ended partway through \p data; the rest belongs to whatever follows the
+transfer.
+*/
+size_t xmodem_session_feed(xmodem_session_t * session, const char * data, size_t size, long now_ms);
+
+/** \brief Get bytes a session needs sent.
+
+Output may remain after the session has ended, such as the final ACK of a
+receiver or the CAN sent when it gives up; it should still be sent.
+
+\param[in] session Session to query.
+\param[out] data Set to the bytes to send, if any. They remain valid until
+the next call to any other session function.
+\returns Number of bytes at \p data, or 0 if there is nothing to send.
+*/
+size_t xmodem_session_output(const xmodem_session_t * session, const char ** data);
+
+/** \brief Report bytes sent from xmodem_session_output().
+
+Timeouts waiting for the other side start when the last byte of the output
+has been sent.
+
+\param[in,out] session Session whose output was sent.
+\param[in] size Number of bytes sent from the start of the output. May be
+less than was returned by xmodem_session_output().
+\param[in] now_ms Current time.
+*/
+void xmodem_session_sent(xmodem_session_t * session, size_t size, long now_ms);
+
+/** \brief Get the time by which a session must be ticked.
+
+\param[in] session Session to query.
+\param[out] deadline_ms Set to the time at which the session times out
+waiting for input, if there is one.
+\returns Nonzero if \p deadline_ms was set. There is no deadline while output
+is pending or after the session has ended.
+*/
+int xmodem_session_deadline(const xmodem_session_t * session, long * deadline_ms);
+
+/** \brief Let a session act on the passing of time.
+
+Handles a timeout if the deadline has passed; otherwise does nothing, so it
+is safe to call at any time. A timeout usually queues output, such as a NAK
+asking for a packet again.
+
+\param[in,out] session Session to update.
+\param[in] now_ms Current time.
+*/
+void xmodem_session_tick(xmodem_session_t * session, long now_ms);
+
+/** \brief Get the outcome of a session.
+
+\param[in] session Session to query.
+\returns ::MODEM_IN_PROGRESS until the session ends, after which the value
+xmodem_tx() or xmodem_rx() would have returned.
+*/
+modem_errors_t xmodem_session_status(const xmodem_session_t * session);
+
+/** \brief An image framed once for any number of XMODEM transmitters.
+
+An image holds every packet of a transfer, with block numbers, padding and
+checksum/CRC already in place, back to back in one read-only buffer. When
+the same data goes to many devices, each transmitter then only has to write
+packets out, instead of copying, padding and checking every block again for
+every device. Nothing in an image changes while it is sent, so any number of
+transfers, in any number of threads, may share it.
+
+Members are private; initialize with xmodem_image_init().
+*/
+typedef struct xmodem_image
+{
+	const unsigned char * packets;
+	size_t num_packets;
+	size_t num_1k; /* Leading 1024 byte packets; the rest are 128 bytes. */
+	xmodem_xfer_mode_t flags;
+}xmodem_image_t;
+
+/** \brief Get the size of buffer needed to frame an image.
+
+\param[in] data_size Size of the data the image will hold.
+\param[in] flags XMODEM protocol variant the image will be sent with.
+\returns Size of buffer required by xmodem_image_init().
+*/
+size_t xmodem_image_size(size_t data_size, const xmodem_xfer_mode_t flags);
+
+/** \brief Frame data as an image.
+
+The packets are exactly those xmodem_tx() would send for \p data with
+\p flags: with ::XMODEM_1K or ::XMODEM_G, the data after the last whole
+1024 byte block goes in 128 byte blocks, and the last block is padded with
+::CPMEOF. An image is always sent in the mode it was framed for; to serve
+receivers which want checksums as well as ones which want CRCs, frame one
+image of each.
+
+\param[out] image Image to initialize.
+\param[out] buf Buffer to hold the packets, of at least
+xmodem_image_size() bytes. It must remain valid, and unchanged, for as long
+as \p image is used.
+\param[in] buf_size Size of \p buf.
+\param[in] data Data to frame. It is no longer needed once this returns.
+\param[in] data_size Size of \p data.
+\param[in] flags XMODEM protocol variant to frame for.
+\returns 0 on success, -1 if \p buf is too small.
+
+\sa xmodem_tx_image() xmodem_session_tx_image()
+*/
+int xmodem_image_init(xmodem_image_t * image, unsigned char * buf, size_t buf_size, const unsigned char * data, size_t data_size, const xmodem_xfer_mode_t flags);
+
+/** \brief XMODEM transmitter implementation, sending a framed image.
+
+xmodem_tx_image() is identical to xmodem_tx() with the mode \p image was
+framed for, except that packets are sent straight from \p image.
+
+\param[in] image Image to send.
+\param[in] device Handle to a serial port.
+\param[out] stats Statistics of the transfer, or `NULL`. The image's payload
+and padding are not counted.
+
+\sa xmodem_image_init()
+*/
+modem_errors_t xmodem_tx_image(const xmodem_image_t * image, serial_handle_t device, modem_stats_t * stats);
+
+/** \brief Start a non-blocking XMODEM transmitter sending a framed image.
+
+Like xmodem_session_tx(), but packets are sent straight from \p image.
+
+\param[out] session Session to initialize.
+\param[in] image Image to send.
+\param[in] now_ms Current time.
+
+\sa xmodem_image_init() xmodem_session_t
+*/
+void xmodem_session_tx_image(xmodem_session_t * session, const xmodem_image_t * image, long now_ms);
+
+/** \brief YMODEM batch transmitter implementation.
+
+ymodem_tx() sends any number of files in one session. For each file,
+\p next_file describes it, a header block (block 0) carrying its name,
+exact size and modification time is sent, and then its data is sent exactly
+as by xmodem_tx(). Once \p next_file reports the end of the batch, an
+empty header ends the session.
+
+\param[in,out] next_file Callback that starts each file in turn.
+\param[in,out] data_out Callback that ymodem_tx() uses to read the current
+file. Its \p last_sent_size starts from 0 for each file.
+\param[in] buf Intermediate buffer, sized as for xmodem_tx().
+\param[in,out] chan_state State for \p next_file and \p data_out.
+\param[in] device Handle to a serial port.
+\param[in] flags ::XMODEM_1K or ::XMODEM_CRC. YMODEM requires CRCs, so
+::XMODEM is treated as ::XMODEM_CRC. With ::XMODEM_CRC, names must be short
+enough for the header to fit in 128 bytes. ::XMODEM_G selects YMODEM-G: file
+data is streamed if the receiver asks with 'G', but headers are still
+acknowledged.
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\returns ::CHANNEL_ERROR if \p next_file or \p data_out fails, or a header
+does not fit in a block. Otherwise, as for xmodem_tx().
+
+\sa ymodem_rx() ymodem_next_file_t
+*/
+modem_errors_t ymodem_tx(ymodem_next_file_t next_file, output_channel_t data_out, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief YMODEM batch receiver implementation.
+
+ymodem_rx() receives files until the transmitter ends the session. Each
+file's header is passed to \p open_file. Its data is then passed to
+\p data_in trimmed to the size given in the header, so the ::CPMEOF padding
+never reaches the sink. Once the file is complete, \p data_in is called with
+\p buf_size 0 and \p eof set.
+
+\param[in,out] open_file Callback called at the start of each file.
+\param[in,out] data_in Callback that ymodem_rx() uses to send data.
+\param[in] buf Intermediate buffer, sized as for xmodem_rx().
+\param[in,out] chan_state State for \p open_file and \p data_in.
+\param[in] device Handle to a serial port.
+\param[in] flags ::XMODEM_1K to accept both 128 and 1024 byte blocks, or
+::XMODEM_CRC for 128 byte blocks only. ::XMODEM is treated as ::XMODEM_CRC.
+::XMODEM_G selects YMODEM-G, as for xmodem_rx().
+\param[out] stats Statistics of the transfer, or `NULL`.
+
+\sa ymodem_tx() ymodem_open_file_t
+*/
+modem_errors_t ymodem_rx(ymodem_open_file_t open_file, input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device, const xmodem_xfer_mode_t flags, modem_stats_t * stats);
+
+/** \brief ZMODEM batch transmitter implementation.
+
+zmodem_tx() sends any number of files, described by \p next_file as for
+ymodem_tx(). Each file is streamed in subpackets of ::ZMODEM_BLOCK_SIZE
+bytes without waiting for acknowledgements; 32-bit CRCs are used if the
+receiver supports them, and every control character is escaped if the
+receiver asks for that (`ESCCTL`). If the receiver reports an error, or resumes a file,
+it names the offset to continue from, and \p seek repositions the file
+there.
+
+\param[in,out] next_file Callback that starts each file in turn.
+\param[in,out] data_out Callback that zmodem_tx() uses to read the current
+file.
+\param[in,out] seek Callback that repositions the current file. It is
+always called once before the first read of each file.
+\param[in] buf Intermediate buffer of ::ZMODEM_BUF_SIZE bytes.
+\param[in,out] chan_state State for \p next_file, \p data_out and \p seek.
+\param[in] device Handle to a serial port.
+
+\returns ::SENT_CAN if the receiver cancelled, ::CHANNEL_ERROR if a callback
+failed, ::MODEM_TIMEOUT if the receiver stopped responding or kept reporting
+errors.
+
+\sa zmodem_rx() seek_channel_t
+*/
+modem_errors_t zmodem_tx(ymodem_next_file_t next_file, output_channel_t data_out, seek_channel_t seek, unsigned char * buf, void * chan_state, serial_handle_t device);
+
+/** \brief ZMODEM batch receiver implementation.
+
+zmodem_rx() receives files until the transmitter ends the session. Each
+file's name, size and modification time are passed to \p open_file, which
+may skip the file or resume it from an offset. Data is passed to \p data_in
+as it arrives, with no padding, followed by a call with \p buf_size 0 and
+\p eof set once the file is complete. Any damaged data is requested again
+from the last good offset, so \p data_in never sees it.
+
+The receiver offers full streaming and 32-bit CRCs, and accepts subpackets
+of up to ::ZMODEM_BLOCK_SIZE bytes, which is what lrzsz sends unless told
+otherwise. A longer subpacket, such as `sz -8` sends, cannot be received at
+all; the transfer is cancelled and ::NOT_IMPLEMENTED returned.
+
+\param[in,out] open_file Callback called at the start of each file.
+\param[in,out] data_in Callback that zmodem_rx() uses to send data.
+\param[in] buf Intermediate buffer of ::ZMODEM_BUF_SIZE bytes.
+\param[in,out] chan_state State for \p open_file and \p data_in.
+\param[in] device Handle to a serial port.
+
+\returns As for zmodem_tx(), or ::NOT_IMPLEMENTED if the transmitter sent a
+subpacket longer than ::ZMODEM_BLOCK_SIZE.
+
+\sa zmodem_tx() zmodem_open_file_t
+*/
+modem_errors_t zmodem_rx(zmodem_open_file_t open_file, input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device);
 
 /** \brief SFL receiver implementation.
 
-sfl_rx() will initiate a data receive session over the opened serial device
-\p device. The function will call callback \p data_in as a data sink for
-received packets. sfl_rx() will pass a pointer within \p buf, along with a
-valid buffer size for \p data_in to send to a destination. Data transfer has
-ended when \p eof indicates an end-of-data condition (`1`).
+sfl_rx() loads a program over the opened serial device \p device using SFL,
+the serial boot protocol of MiSoC and LiteX. It asks for an image with the
+SFL magic string, which `flterm` or `litex_term` answers. Each frame is
+checked against its CRC-16 and answered, in the order frames arrive, as the
+LiteX BIOS does; damaged frames are asked for again. Each LOAD frame's data is passed to \p data_in with its address, in
+the order the frames arrive.
 
-\param[in,out] data_in Callback that sfl_rx() uses to send data.
-\param[in] buf Intermediate buffer, used to hold a full SFL packet. A
-pointer offset into the buffer where the data payload starts is passed into
-\p data_in's \p buf parameter. It is up to the caller to ensure the buffer
-at least 256 bytes.
-\param[in,out] chan_state State for callback \p data_in, passed into the \p
-chan_state parameter of \p data_in. sfl_rx() itself does not modify
-\p chan_state.
+When the host sends JUMP, \p data_in is called with \p eof set and the entry
+point as \p address, the command is acknowledged, and \p boot is called.
+
+\param[in,out] data_in Callback that sfl_rx() uses to store data.
+\param[in,out] boot Callback that starts the loaded program.
+\param[in] buf Intermediate buffer of ::SFL_FRAME_SIZE bytes, used to hold a
+full SFL frame. \p data_in's \p buf points into it.
+\param[in,out] chan_state State for callbacks \p data_in and \p boot.
+sfl_rx() itself does not modify \p chan_state.
+\param[in] device Handle to a serial port.
+
+\returns ::MODEM_NO_ERRORS if \p boot returned 0, ::SENT_CAN if the host
+aborted, ::CHANNEL_ERROR if a callback failed, ::MODEM_TIMEOUT if the host
+did not answer or too many consecutive frames were damaged.
+*/
+modem_errors_t sfl_rx(input_addr_channel_t data_in, sfl_boot_cmd_t boot, unsigned char * buf, void * chan_state, serial_handle_t device);
+
+/** \brief SFL transmitter implementation.
+
+sfl_tx() uploads an image to a MiSoC or LiteX target, as `flterm` does. It
+waits for the target to ask for an image, sends LOAD frames of up to 251
+bytes, then a JUMP to \p entry. Adjoining regions are packed into full
+frames. Frames are pipelined: the next frame is already sent by the time the
+current one is acknowledged. The target answers every frame in order, so
+each reply is matched to the oldest unanswered frame, and only frames it
+reports as damaged are sent again. The JUMP is sent once every LOAD frame
+is acknowledged.
+
+If the target's memory is known to be filled with \p erased_value (such as
+erased flash, or zeroed RAM), runs of that byte in the image are not sent.
+
+\param[in,out] next_region Callback that describes each region in turn.
+\param[in] entry Address the target jumps to once the image is loaded.
+\param[in] erased_value Value of each byte of the target's memory before
+loading, or ::SFL_NOT_ERASED to send the whole image.
+\param[in] buf Intermediate buffer of ::SFL_TX_BUF_SIZE bytes.
+\param[in,out] chan_state State for \p next_region.
 \param[in] device Handle to a serial port.
+
+\returns ::MODEM_NO_ERRORS once the target has acknowledged the JUMP,
+::SENT_CAN if the target rejected a frame, ::CHANNEL_ERROR if \p next_region
+failed, ::MODEM_TIMEOUT if the target did not ask for an image or stopped
+responding.
+
+\sa sfl_rx() sfl_next_region_t
 */
-modem_errors_t sfl_rx(input_channel_t data_in, unsigned char * buf, void * chan_state, serial_handle_t device);
+modem_errors_t sfl_tx(sfl_next_region_t next_region, unsigned long entry, int erased_value, unsigned char * buf, void * chan_state, serial_handle_t device);
 
 /* Change data sizes all to uint32_t? */
 /** \brief Generate 8-bit checksum.
 
-Exported by xmodem.c. Calculate an 8-bit checksum.
+Exported by crc.c. Calculate an 8-bit checksum.
 
 \param[in] data Buffer to calculate the checksum.
 \param[in] size Size of the input buffer.
@@ -313,7 +1227,9 @@ unsigned char generate_chksum(unsigned char * data, size_t size);
 
 /** \brief Generate XMODEM CRC16.
 
-Exported by xmodem.c. Calculate the 16-bit CRC required by XMODEM.
+Exported by crc.c. Calculate the 16-bit CRC required by XMODEM. The
+implementation is selected at build time by the `crc_engine` option; all
+engines return identical results.
 
 \param[in] data Buffer to calculate the CRC.
 \param[in] size Size of the input buffer.
@@ -323,4 +1239,59 @@ Exported by xmodem.c. Calculate the 16-bit CRC required by XMODEM.
 */
 unsigned short generate_crc(unsigned char * data, size_t size);
 
+/** \brief Generate ZMODEM CRC-32.
+
+Exported by crc.c. Calculate the 32-bit CRC used by ZMODEM binary frames,
+which is the same CRC-32 as Ethernet and zlib. Results can be chained: pass 0
+to start, and a previous result to continue over more data.
+
+\param[in] crc 0, or the CRC of the data preceding \p data.
+\param[in] data Buffer to calculate the CRC.
+\param[in] size Size of the input buffer.
+
+\returns 32-bit CRC of everything passed so far.
+*/
+unsigned long generate_crc32(unsigned long crc, const unsigned char * data, size_t size);
+
+/** \brief Start a checksum/CRC computation.
+
+\param[out] state State to initialize.
+\param[in] flags ::XMODEM selects the 8-bit checksum; every other mode
+selects the 16-bit CRC.
+*/
+void crc_init(crc_state_t * state, const xmodem_xfer_mode_t flags);
+
+/** \brief Add data to a checksum/CRC computation.
+
+\param[in,out] state State previously initialized by crc_init().
+\param[in] data Next chunk of data.
+\param[in] size Size of \p data. May be 0.
+*/
+void crc_update(crc_state_t * state, const unsigned char * data, size_t size);
+
+/** \brief Copy data and add it to a checksum/CRC computation.
+
+Equivalent to copying \p size bytes from \p src to \p dest followed by
+crc_update() on \p dest, but reads the data back while it is still in cache.
+Intended for code that fills a packet from a buffer.
+\p src and \p dest must not overlap.
+
+\param[in,out] state State previously initialized by crc_init().
+\param[out] dest Destination buffer.
+\param[in] src Source buffer.
+\param[in] size Number of bytes to copy.
+*/
+void crc_copy(crc_state_t * state, unsigned char * dest, const unsigned char * src, size_t size);
+
+/** \brief Finish a checksum/CRC computation.
+
+crc_final() does not modify \p state, so a running value can be inspected
+and then updated further.
+
+\param[in] state State previously initialized by crc_init().
+\returns The 8-bit checksum or 16-bit CRC of all data passed to crc_update()
+and crc_copy() since crc_init().
+*/
+unsigned short crc_final(const crc_state_t * state);
+
 #endif
@@ -0,0 +1,68 @@
+#include "custombaud.h"
+
+#if defined(__linux__)
+
+/* termios2 with BOTHER lets the kernel pick the divisor for any rate. These
+headers define their own struct termios, so <termios.h> must not be
+included here. */
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+int set_custom_baud(int fd, unsigned long baud_rate)
+{
+	struct termios2 tio;
+
+	if(ioctl(fd, TCGETS2, &tio))
+	{
+		return -1;
+	}
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baud_rate;
+	tio.c_ospeed = baud_rate;
+
+	return ioctl(fd, TCSETS2, &tio) ? -1 : 0;
+}
+
+#elif defined(__APPLE__)
+
+#include <sys/ioctl.h>
+#include <IOKit/serial/ioss.h>
+
+int set_custom_baud(int fd, unsigned long baud_rate)
+{
+	speed_t speed = (speed_t) baud_rate;
+
+	return ioctl(fd, IOSSIOSPEED, &speed) ? -1 : 0;
+}
+
+#elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+
+/* On the BSDs, speed_t is the baud rate itself, so cfsetspeed() already
+accepts any value the driver can generate. */
+#include <termios.h>
+
+int set_custom_baud(int fd, unsigned long baud_rate)
+{
+	struct termios tio;
+
+	if(tcgetattr(fd, &tio) || cfsetspeed(&tio, (speed_t) baud_rate))
+	{
+		return -1;
+	}
+
+	return tcsetattr(fd, TCSANOW, &tio) ? -1 : 0;
+}
+
+#else
+
+int set_custom_baud(int fd, unsigned long baud_rate)
+{
+	(void) fd;
+	(void) baud_rate;
+
+	return -1;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef CUSTOMBAUD_H
+#define CUSTOMBAUD_H
+
+/* Internal to the posix platform. Setting a baud rate without a B* constant
+needs OS-specific headers which conflict with <termios.h>, so it lives in its
+own translation unit. */
+
+/* Set both input and output speed of tty fd to baud_rate, after all other
+termios settings have been applied. Returns 0 on success, -1 if the OS has no
+way to set arbitrary rates or the driver rejected the rate. */
+int set_custom_baud(int fd, unsigned long baud_rate);
+
+#endif        /*  #ifndef CUSTOMBAUD_H  */
@@ -0,0 +1,476 @@
+#include "engine.h"
+#include "serposix.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stddef.h> /* For NULL. */
+
+/* Largest read from a port at a time; enough for a whole XMODEM_1K packet.
+Each wakeup reads once, so a busy port can't starve the others. */
+#define ENGINE_READ_SIZE 2048
+
+/* Events taken from each epoll_wait() call. */
+#define ENGINE_MAX_EVENTS 64
+
+static int add_port(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, \
+	void * chan_state);
+static void handle_event(modem_engine_t * engine, engine_port_t * port, unsigned int events, \
+	long now_ms);
+static void service_port(modem_engine_t * engine, engine_port_t * port, long now_ms);
+static int read_port(engine_port_t * port, long now_ms);
+static void feed_buffered(engine_port_t * port, long now_ms);
+static int write_port(engine_port_t * port, long now_ms);
+static void finish_port(modem_engine_t * engine, engine_port_t * port, modem_errors_t status);
+static void timer_set(modem_engine_t * engine, engine_port_t * port);
+static void timer_remove(modem_engine_t * engine, engine_port_t * port);
+static void timer_expire(modem_engine_t * engine, long now_ms);
+static void expire_slot(modem_engine_t * engine, int slot, long now_ms);
+static long timer_next(const modem_engine_t * engine, long now_ms);
+static int slot_of(long time_ms);
+static long tick_start(long time_ms);
+
+
+int engine_init(modem_engine_t * engine, engine_done_t done_fcn)
+{
+	long now = posix_monotonic_ms();
+	int count;
+
+	if((engine->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		return -1;
+	}
+
+	engine->done_fcn = done_fcn;
+	engine->active = 0;
+	engine->wheel_time = tick_start(now);
+	for(count = 0; count < ENGINE_WHEEL_SLOTS; count++)
+	{
+		engine->wheel[count] = NULL;
+	}
+
+	return 0;
+}
+
+int engine_add_tx(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, \
+	output_channel_t data_out, unsigned char * buf, void * chan_state, xmodem_xfer_mode_t flags)
+{
+	long now;
+
+	/* As xmodem_tx() does, so a stale NAK or 'C' doesn't start the
+	transfer. */
+	serial_flush(device);
+	if(add_port(engine, port, device, chan_state))
+	{
+		return -1;
+	}
+
+	now = posix_monotonic_ms();
+	xmodem_session_tx(&port->session, data_out, buf, chan_state, flags, now);
+	service_port(engine, port, now);
+	return 0;
+}
+
+int engine_add_tx_image(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, \
+	const xmodem_image_t * image, void * chan_state)
+{
+	long now;
+
+	serial_flush(device);
+	if(add_port(engine, port, device, chan_state))
+	{
+		return -1;
+	}
+
+	now = posix_monotonic_ms();
+	xmodem_session_tx_image(&port->session, image, now);
+	service_port(engine, port, now);
+	return 0;
+}
+
+int engine_add_rx(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, \
+	input_channel_t data_in, unsigned char * buf, void * chan_state, xmodem_xfer_mode_t flags)
+{
+	long now;
+
+	if(add_port(engine, port, device, chan_state))
+	{
+		return -1;
+	}
+
+	now = posix_monotonic_ms();
+	xmodem_session_rx(&port->session, data_in, buf, chan_state, flags, now);
+	feed_buffered(port, now);
+	service_port(engine, port, now);
+	return 0;
+}
+
+int engine_run(modem_engine_t * engine, long timeout_ms)
+{
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	long now = posix_monotonic_ms();
+	long stop = now + timeout_ms;
+
+	while(engine->active > 0)
+	{
+		long wait_ms = timer_next(engine, now);
+		int count, ready;
+
+		if(timeout_ms >= 0)
+		{
+			if(stop - now <= 0)
+			{
+				break;
+			}
+			if(wait_ms < 0 || wait_ms > stop - now)
+			{
+				wait_ms = stop - now;
+			}
+		}
+
+		ready = epoll_wait(engine->epfd, events, ENGINE_MAX_EVENTS, (int) wait_ms);
+		if(ready < 0 && errno != EINTR)
+		{
+			return -1;
+		}
+
+		now = posix_monotonic_ms();
+		for(count = 0; count < ready; count++)
+		{
+			handle_event(engine, events[count].data.ptr, events[count].events, now);
+		}
+		timer_expire(engine, now);
+	}
+
+	return (int) engine->active;
+}
+
+modem_errors_t engine_port_status(const engine_port_t * port)
+{
+	return port->status;
+}
+
+void engine_close(modem_engine_t * engine)
+{
+	if(engine->epfd >= 0)
+	{
+		close(engine->epfd);
+		engine->epfd = -1;
+	}
+	engine->active = 0;
+}
+
+
+/* Private functions begin here. */
+static int add_port(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, \
+	void * chan_state)
+{
+	struct epoll_event ev;
+
+	port->device = device;
+	port->chan_state = chan_state;
+	port->status = MODEM_IN_PROGRESS;
+	port->slot = -1;
+	port->next = port->prev = NULL;
+	if((port->fd = posix_get_fd(device)) < 0)
+	{
+		return -1;
+	}
+
+	ev.events = port->events = EPOLLIN;
+	ev.data.ptr = port;
+	if(epoll_ctl(engine->epfd, EPOLL_CTL_ADD, port->fd, &ev))
+	{
+		return -1;
+	}
+
+	engine->active++;
+	return 0;
+}
+
+static void handle_event(modem_engine_t * engine, engine_port_t * port, unsigned int events, \
+	long now_ms)
+{
+	if(xmodem_session_status(&port->session) == MODEM_IN_PROGRESS)
+	{
+		/* Any input is read before acting on a hangup, as it may be the
+		rest of the transfer. */
+		if(((events & EPOLLIN) && read_port(port, now_ms)) \
+			|| (!(events & EPOLLIN) && (events & (EPOLLERR | EPOLLHUP))))
+		{
+			finish_port(engine, port, MODEM_HW_ERROR);
+			return;
+		}
+	}
+
+	service_port(engine, port, now_ms);
+}
+
+/* Send what the session has queued, then wait for whatever it needs next:
+room to send the rest, input, or its deadline. */
+static void service_port(modem_engine_t * engine, engine_port_t * port, long now_ms)
+{
+	modem_errors_t status;
+	unsigned int events;
+	const char * out;
+
+	status = xmodem_session_status(&port->session);
+	if(write_port(port, now_ms))
+	{
+		/* A receiver ignores failure to send its final ACK, as
+		xmodem_rx() does. */
+		finish_port(engine, port, (status == MODEM_IN_PROGRESS) ? MODEM_HW_ERROR : status);
+		return;
+	}
+
+	status = xmodem_session_status(&port->session);
+	if(xmodem_session_output(&port->session, &out) == 0)
+	{
+		if(status != MODEM_IN_PROGRESS)
+		{
+			finish_port(engine, port, status);
+			return;
+		}
+		events = EPOLLIN;
+	}
+	else
+	{
+		/* Once the session has ended, input is left unread. */
+		events = (status == MODEM_IN_PROGRESS) ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+	}
+
+	if(events != port->events)
+	{
+		struct epoll_event ev;
+
+		ev.events = port->events = events;
+		ev.data.ptr = port;
+		(void) epoll_ctl(engine->epfd, EPOLL_CTL_MOD, port->fd, &ev);
+	}
+
+	timer_set(engine, port);
+}
+
+static int read_port(engine_port_t * port, long now_ms)
+{
+	char buf[ENGINE_READ_SIZE];
+	ssize_t got;
+
+	do{
+		got = read(port->fd, buf, sizeof(buf));
+	}while(got < 0 && errno == EINTR);
+
+	if(got > 0)
+	{
+		/* Input after the end of the transfer is dropped. */
+		(void) xmodem_session_feed(&port->session, buf, (size_t) got, now_ms);
+		return 0;
+	}
+
+	/* A read of 0 means the other end has gone. */
+	return (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+}
+
+/* Pass the session any input the handle already holds, from serial_rcv_some(),
+serial_peek() or serial_rcv() before the port was added. It has been taken
+off the file descriptor, so epoll will never report it. */
+static void feed_buffered(engine_port_t * port, long now_ms)
+{
+	char buf[ENGINE_READ_SIZE];
+	unsigned int got;
+
+	while(xmodem_session_status(&port->session) == MODEM_IN_PROGRESS \
+		&& serial_rcv_some(buf, sizeof(buf), 0, &got, port->device) == SERIAL_NO_ERRORS \
+		&& got > 0)
+	{
+		(void) xmodem_session_feed(&port->session, buf, got, now_ms);
+	}
+}
+
+/* Write until the session has nothing more to send, or the port is full.
+Streaming, the session queues the next packet as each one goes. */
+static int write_port(engine_port_t * port, long now_ms)
+{
+	const char * out;
+	size_t size;
+
+	while((size = xmodem_session_output(&port->session, &out)) > 0)
+	{
+		ssize_t written = write(port->fd, out, size);
+
+		if(written > 0)
+		{
+			xmodem_session_sent(&port->session, (size_t) written, now_ms);
+		}
+		else if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		else if(!(written < 0 && errno == EINTR))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void finish_port(modem_engine_t * engine, engine_port_t * port, modem_errors_t status)
+{
+	struct epoll_event ev; /* Ignored, but kernels before 2.6.9 need it. */
+
+	timer_remove(engine, port);
+	(void) epoll_ctl(engine->epfd, EPOLL_CTL_DEL, port->fd, &ev);
+	port->status = status;
+	engine->active--;
+
+	if(engine->done_fcn != NULL)
+	{
+		engine->done_fcn(port, status, port->chan_state);
+	}
+}
+
+/* File port under its session's deadline, if it has one. */
+static void timer_set(modem_engine_t * engine, engine_port_t * port)
+{
+	long deadline;
+	int slot;
+
+	timer_remove(engine, port);
+	if(!xmodem_session_deadline(&port->session, &deadline))
+	{
+		return;
+	}
+
+	/* A deadline already past is handled with the earliest slot. */
+	port->deadline = deadline;
+	slot = slot_of((deadline - engine->wheel_time < 0) ? engine->wheel_time : deadline);
+
+	port->slot = slot;
+	port->prev = NULL;
+	port->next = engine->wheel[slot];
+	if(port->next != NULL)
+	{
+		port->next->prev = port;
+	}
+	engine->wheel[slot] = port;
+}
+
+static void timer_remove(modem_engine_t * engine, engine_port_t * port)
+{
+	if(port->slot < 0)
+	{
+		return;
+	}
+
+	if(port->prev != NULL)
+	{
+		port->prev->next = port->next;
+	}
+	else
+	{
+		engine->wheel[port->slot] = port->next;
+	}
+	if(port->next != NULL)
+	{
+		port->next->prev = port->prev;
+	}
+
+	port->slot = -1;
+	port->next = port->prev = NULL;
+}
+
+/* Tick every session whose deadline has passed. Slots are visited in order
+up to the one holding now_ms. That one is only passed once it has fully
+elapsed, as it may still hold deadlines later in the tick. */
+static void timer_expire(modem_engine_t * engine, long now_ms)
+{
+	int count;
+
+	if(now_ms - engine->wheel_time >= (long) ENGINE_TICK_MS * ENGINE_WHEEL_SLOTS)
+	{
+		for(count = 0; count < ENGINE_WHEEL_SLOTS; count++)
+		{
+			expire_slot(engine, count, now_ms);
+		}
+		engine->wheel_time = tick_start(now_ms);
+		return;
+	}
+
+	while(1)
+	{
+		expire_slot(engine, slot_of(engine->wheel_time), now_ms);
+		if(now_ms - engine->wheel_time < ENGINE_TICK_MS)
+		{
+			break;
+		}
+		engine->wheel_time += ENGINE_TICK_MS;
+	}
+}
+
+static void expire_slot(modem_engine_t * engine, int slot, long now_ms)
+{
+	engine_port_t * port = engine->wheel[slot];
+
+	while(port != NULL)
+	{
+		/* Servicing the port may file it again, possibly in this slot. */
+		engine_port_t * next = port->next;
+
+		if(port->deadline - now_ms <= 0)
+		{
+			timer_remove(engine, port);
+			xmodem_session_tick(&port->session, now_ms);
+			service_port(engine, port, now_ms);
+		}
+		port = next;
+	}
+}
+
+/* Time until the earliest deadline, or -1 if there are none. Only the
+first occupied slot normally needs looking at; its entries may belong to a
+later turn of the wheel though, in which case the search goes on. */
+static long timer_next(const modem_engine_t * engine, long now_ms)
+{
+	long earliest = 0;
+	int found = 0, count;
+
+	for(count = 0; count < ENGINE_WHEEL_SLOTS; count++)
+	{
+		long slot_end = engine->wheel_time + (long) (count + 1) * ENGINE_TICK_MS;
+		const engine_port_t * port = engine->wheel[slot_of(slot_end - ENGINE_TICK_MS)];
+
+		for(; port != NULL; port = port->next)
+		{
+			if(!found || port->deadline - earliest < 0)
+			{
+				earliest = port->deadline;
+				found = 1;
+			}
+		}
+
+		if(found && earliest - slot_end < 0)
+		{
+			break;
+		}
+	}
+
+	if(!found)
+	{
+		return -1;
+	}
+
+	return (earliest - now_ms < 0) ? 0 : earliest - now_ms;
+}
+
+static int slot_of(long time_ms)
+{
+	return (int) ((unsigned long) time_ms / ENGINE_TICK_MS % ENGINE_WHEEL_SLOTS);
+}
+
+/* Start of the tick holding time_ms. Computed unsigned, like slot_of(), so
+it agrees with the slots after the clock wraps to negative values. */
+static long tick_start(long time_ms)
+{
+	return (long) ((unsigned long) time_ms - (unsigned long) time_ms % ENGINE_TICK_MS);
+}
@@ -0,0 +1,175 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+/** \file engine.h
+\brief Multi-Port Transfer Engine
+
+engine.h runs XMODEM transfers on many serial ports at once from a single
+thread, such as a production station flashing dozens of boards. Each port is
+driven by an ::xmodem_session_t. The engine waits on every port with `epoll`
+and keeps each session's protocol deadline in a timer wheel, so the cost of
+a wakeup depends on the number of ports with something to do, not on the
+number of ports open. Several engines may run in separate threads to spread
+ports over cores; an engine itself is not thread-safe.
+
+The engine is only available on Linux, which provides `epoll`.
+
+Like the rest of libmodem, the engine never allocates: the caller supplies an
+::engine_port_t for each transfer. The engine reads and writes each port's
+file descriptor (see posix_get_fd()) directly, but never closes it.
+*/
+
+#include "modem.h"
+#include "serial.h"
+
+/** \brief Resolution of the timer wheel in milliseconds. */
+#define ENGINE_TICK_MS 10
+
+/** \brief Number of slots in the timer wheel. Deadlines more than
+::ENGINE_TICK_MS * ::ENGINE_WHEEL_SLOTS ms ahead share slots with nearer ones,
+and are passed over until their turn comes round. */
+#define ENGINE_WHEEL_SLOTS 256
+
+typedef struct engine_port engine_port_t;
+
+/**
+\typedef engine_done_t
+\brief Completion callback of a ::modem_engine_t.
+
+Called once for each port, as soon as its transfer has ended and any final
+response has been sent. By then the engine no longer uses the port, so the
+callback may close its serial handle, or reuse \p port for another transfer.
+
+\param[in] port Port whose transfer ended.
+\param[in] status Outcome of the transfer: what xmodem_tx() or xmodem_rx()
+would have returned, or ::MODEM_HW_ERROR if the port failed.
+\param[in,out] chan_state The \p chan_state the transfer was started with.
+*/
+typedef void (* engine_done_t)(engine_port_t * port, modem_errors_t status, void * const chan_state);
+
+/** \brief A transfer run by a ::modem_engine_t.
+
+Members are private; start a transfer with engine_add_tx(),
+engine_add_tx_image() or engine_add_rx().
+*/
+struct engine_port
+{
+	xmodem_session_t session;
+	serial_handle_t device;
+	int fd;
+	unsigned int events; /* epoll events asked for. */
+	void * chan_state;
+	modem_errors_t status;
+	long deadline;
+	int slot; /* Timer wheel slot, or -1. */
+	engine_port_t * next; /* Other ports in the same slot. */
+	engine_port_t * prev;
+};
+
+/** \brief State of a multi-port transfer engine.
+
+Members are private; initialize with engine_init().
+*/
+typedef struct modem_engine
+{
+	int epfd;
+	engine_done_t done_fcn;
+	unsigned int active; /* Transfers not yet ended. */
+	long wheel_time; /* Start of the earliest slot not yet expired. */
+	engine_port_t * wheel[ENGINE_WHEEL_SLOTS];
+}modem_engine_t;
+
+/** \brief Create a transfer engine.
+
+\param[out] engine Engine to initialize.
+\param[in] done_fcn Callback for each transfer which ends. May be `NULL`, in
+which case engine_port_status() can be checked instead.
+\returns 0 on success, -1 if `epoll` could not be set up.
+
+\sa engine_close()
+*/
+int engine_init(modem_engine_t * engine, engine_done_t done_fcn);
+
+/** \brief Start an XMODEM transmitter on a port.
+
+Like xmodem_tx(), the port's pending input is flushed first. The transfer
+runs during engine_run().
+
+\param[in,out] engine Engine to run the transfer.
+\param[out] port State of the transfer. It must stay in place, unmodified,
+until the transfer has ended.
+\param[in] device Handle to a serial port, from serial_init() or
+posix_open_fd(). Only one transfer may use it at a time.
+\param[in,out] data_out Callback that the transfer uses to obtain more data.
+\param[in] buf Packet buffer, sized as for xmodem_tx().
+\param[in,out] chan_state State for callback \p data_out.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_tx().
+\returns 0 on success, -1 if \p device can't be waited on.
+*/
+int engine_add_tx(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, output_channel_t data_out, unsigned char * buf, void * chan_state, const xmodem_xfer_mode_t flags);
+
+/** \brief Start an XMODEM transmitter sending a framed image on a port.
+
+Like engine_add_tx(), but packets are written straight from \p image, which
+any number of ports may send at once. This is the cheapest way to send the
+same data to many devices.
+
+\param[in,out] engine Engine to run the transfer.
+\param[out] port State of the transfer, as for engine_add_tx().
+\param[in] device Handle to a serial port, as for engine_add_tx().
+\param[in] image Image to send, from xmodem_image_init().
+\param[in,out] chan_state Passed to the ::engine_done_t callback, to tell
+transfers apart. Not otherwise used.
+\returns 0 on success, -1 if \p device can't be waited on.
+*/
+int engine_add_tx_image(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, const xmodem_image_t * image, void * chan_state);
+
+/** \brief Start an XMODEM receiver on a port.
+
+The first NAK or `C` is sent straight away, as by xmodem_rx(). The transfer
+runs during engine_run(). Unlike engine_add_tx(), the port is not flushed:
+input \p device has already received, such as bytes left over from
+serial_peek() or serial_rcv_some(), is passed to the transfer first.
+
+\param[in,out] engine Engine to run the transfer.
+\param[out] port State of the transfer, as for engine_add_tx().
+\param[in] device Handle to a serial port, as for engine_add_tx().
+\param[in,out] data_in Callback that the transfer uses to send data.
+\param[in] buf Packet buffer, sized as for xmodem_rx().
+\param[in,out] chan_state State for callback \p data_in.
+\param[in] flags XMODEM protocol variant to use, as for xmodem_rx().
+\returns 0 on success, -1 if \p device can't be waited on.
+*/
+int engine_add_rx(modem_engine_t * engine, engine_port_t * port, serial_handle_t device, input_channel_t data_in, unsigned char * buf, void * chan_state, const xmodem_xfer_mode_t flags);
+
+/** \brief Run transfers until they have all ended.
+
+Callbacks of all transfers, including \p done_fcn, are called from within
+engine_run().
+
+\param[in,out] engine Engine to run.
+\param[in] timeout_ms Return after this long even if transfers remain, or
+wait indefinitely if negative. Transfers carry on at the next call.
+\returns Number of transfers still in progress, or -1 if waiting failed.
+*/
+int engine_run(modem_engine_t * engine, long timeout_ms);
+
+/** \brief Get the outcome of a transfer.
+
+\param[in] port Port previously passed to engine_add_tx(),
+engine_add_tx_image() or engine_add_rx().
+\returns ::MODEM_IN_PROGRESS until the transfer ends, then the status also
+passed to the ::engine_done_t callback.
+*/
+modem_errors_t engine_port_status(const engine_port_t * port);
+
+/** \brief Release resources held by an engine.
+
+Transfers still in progress are abandoned, without their callbacks being
+called. Serial handles are not closed.
+
+\param[in,out] engine Engine to release.
+*/
+void engine_close(modem_engine_t * engine);
+
+#endif        /*  #ifndef ENGINE_H  */
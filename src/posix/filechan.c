@@ -0,0 +1,347 @@
+/* posix_fallocate() and posix_madvise() are POSIX.1-2001 ADV options. */
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "filechan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stddef.h> /* For NULL. */
+
+/* Sink writes are multiples of this, so they stay aligned to file system
+blocks. */
+#define FILECHAN_ALIGN 4096
+
+/* Longest run of CPMEOF that can be padding. Senders pad at most one block,
+and no XMODEM block is larger than 1024 bytes. */
+#define FILECHAN_MAX_PAD 1024
+
+static int fill_buffer(file_source_t * src, size_t want);
+static void sink_commit(file_sink_t * sink, size_t size);
+static int sink_make_room(file_sink_t * sink, size_t size);
+static int write_all(int fd, const unsigned char * data, size_t size);
+static int wait_ready(int fd, short events);
+
+
+int file_source_init(file_source_t * src, int fd, unsigned char * buf, size_t buf_size)
+{
+	struct stat st;
+
+	src->fd = fd;
+	src->map = NULL;
+	src->map_size = 0;
+	src->pos = 0;
+	src->end = 0;
+	src->buf = buf;
+	src->buf_size = buf_size;
+	src->at_eof = 0;
+
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode) && (off_t) (size_t) st.st_size == st.st_size)
+	{
+		if(st.st_size == 0)
+		{
+			/* Nothing to map; the transfer is a single padding block. */
+			src->at_eof = 1;
+			return 0;
+		}
+
+		src->map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(src->map == MAP_FAILED)
+		{
+			src->map = NULL;
+		}
+		else
+		{
+			src->map_size = (size_t) st.st_size;
+			/* Advisory only; ignore failure. */
+			(void) posix_madvise((void *) src->map, src->map_size, POSIX_MADV_SEQUENTIAL);
+			return 0;
+		}
+	}
+
+	return (buf != NULL && buf_size >= FILECHAN_MIN_BUF) ? 0 : -1;
+}
+
+int file_source_borrow(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	file_source_t * src = chan_state;
+	size_t left;
+
+	src->pos += last_sent_size;
+	if(src->map != NULL)
+	{
+		left = src->map_size - src->pos;
+		(* buf) = (const char *) src->map + src->pos;
+	}
+	else
+	{
+		if(fill_buffer(src, request_size))
+		{
+			return -1;
+		}
+
+		left = src->end - src->pos;
+		(* buf) = (const char *) src->buf + src->pos;
+	}
+
+	return (left < (size_t) request_size) ? (int) left : request_size;
+}
+
+int file_source_read(char * buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	const char * data;
+	int size;
+
+	if((size = file_source_borrow(&data, request_size, last_sent_size, chan_state)) > 0)
+	{
+		memcpy(buf, data, size);
+	}
+
+	return size;
+}
+
+void file_source_close(file_source_t * src)
+{
+	if(src->map != NULL)
+	{
+		(void) munmap((void *) src->map, src->map_size);
+		src->map = NULL;
+	}
+}
+
+
+int file_sink_init(file_sink_t * sink, int fd, unsigned char * buf, size_t buf_size, off_t size_hint)
+{
+	struct stat st;
+
+	sink->fd = fd;
+	sink->buf = buf;
+	sink->buf_size = buf_size;
+	sink->fill = 0;
+	sink->run = 0;
+	sink->last_block = 0;
+	sink->written = 0;
+	sink->is_regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+
+	if(buf == NULL || buf_size < FILECHAN_MIN_BUF)
+	{
+		return -1;
+	}
+
+	if(sink->is_regular && size_hint > 0)
+	{
+		/* Advisory only; the file grows as written if this fails. */
+		(void) posix_fallocate(fd, 0, size_hint);
+	}
+
+	return 0;
+}
+
+int file_sink_write(const char * buf, const int buf_size, const int eof, void * const chan_state)
+{
+	file_sink_t * sink = chan_state;
+
+	if(eof)
+	{
+		return buf_size;
+	}
+
+	if(buf_size < 0 || sink_make_room(sink, buf_size))
+	{
+		return -1;
+	}
+
+	memcpy(sink->buf + sink->fill, buf, buf_size);
+	sink_commit(sink, buf_size);
+	return buf_size;
+}
+
+char * file_sink_window(const int request_size, const int last_recv_size, const int eof, void * const chan_state)
+{
+	file_sink_t * sink = chan_state;
+
+	/* The previous payload is already in place at buf + fill. */
+	sink_commit(sink, last_recv_size);
+	if(eof)
+	{
+		return (char *) sink->buf;
+	}
+
+	if(request_size < 0 || sink_make_room(sink, request_size))
+	{
+		return NULL;
+	}
+
+	return (char *) sink->buf + sink->fill;
+}
+
+int file_sink_close(file_sink_t * sink)
+{
+	size_t pad = (sink->run < sink->last_block) ? sink->run : sink->last_block;
+	int rc = 0;
+
+	if(write_all(sink->fd, sink->buf, sink->fill - pad))
+	{
+		rc = -1;
+	}
+	else
+	{
+		sink->written += sink->fill - pad;
+	}
+	sink->fill = 0;
+	sink->run = 0;
+
+	/* Give back any space reserved by posix_fallocate() beyond the end. */
+	if(sink->is_regular && ftruncate(sink->fd, sink->written))
+	{
+		rc = -1;
+	}
+
+	return rc;
+}
+
+
+/* Private functions begin here. */
+/* Make at least want bytes available from src->pos, unless the input ends
+first. Reads as much as fits each time, to keep the number of system calls
+down. */
+static int fill_buffer(file_source_t * src, size_t want)
+{
+	if(src->end - src->pos >= want || src->at_eof)
+	{
+		return 0;
+	}
+
+	memmove(src->buf, src->buf + src->pos, src->end - src->pos);
+	src->end -= src->pos;
+	src->pos = 0;
+
+	while(src->end < want && !src->at_eof)
+	{
+		ssize_t got = read(src->fd, src->buf + src->end, src->buf_size - src->end);
+
+		if(got > 0)
+		{
+			src->end += (size_t) got;
+		}
+		else if(got == 0)
+		{
+			src->at_eof = 1;
+		}
+		else if(errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			if(wait_ready(src->fd, POLLIN))
+			{
+				return -1;
+			}
+		}
+		else if(errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Account for size bytes just placed at buf + fill, tracking how long the
+trailing run of CPMEOF is so that it can be dropped at the end. */
+static void sink_commit(file_sink_t * sink, size_t size)
+{
+	const unsigned char * data = sink->buf + sink->fill;
+	size_t tail = size;
+
+	if(size == 0)
+	{
+		return;
+	}
+
+	while(tail > 0 && data[tail - 1] == CPMEOF)
+	{
+		tail--;
+	}
+
+	sink->run = (tail == 0) ? sink->run + size : size - tail;
+	sink->fill += size;
+	sink->last_block = size;
+}
+
+/* Ensure size bytes are free at buf + fill, writing out whole aligned
+batches. A run of CPMEOF which may turn out to be padding stays behind. */
+static int sink_make_room(file_sink_t * sink, size_t size)
+{
+	size_t hold, out;
+
+	if(sink->buf_size - sink->fill >= size)
+	{
+		return 0;
+	}
+
+	hold = (sink->run < FILECHAN_MAX_PAD) ? sink->run : FILECHAN_MAX_PAD;
+	out = sink->fill - hold;
+	out -= out % FILECHAN_ALIGN;
+
+	if(write_all(sink->fd, sink->buf, out))
+	{
+		return -1;
+	}
+
+	memmove(sink->buf, sink->buf + out, sink->fill - out);
+	sink->fill -= out;
+	sink->written += out;
+	if(sink->run > sink->fill)
+	{
+		sink->run = sink->fill;
+	}
+
+	return (sink->buf_size - sink->fill >= size) ? 0 : -1;
+}
+
+static int write_all(int fd, const unsigned char * data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t written = write(fd, data, size);
+
+		if(written > 0)
+		{
+			data += written;
+			size -= (size_t) written;
+		}
+		else if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if(wait_ready(fd, POLLOUT))
+			{
+				return -1;
+			}
+		}
+		else if(!(written < 0 && errno == EINTR))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int wait_ready(int fd, short events)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	do{
+		rc = poll(&pfd, 1, -1);
+	}while(rc < 0 && errno == EINTR);
+
+	return (rc > 0 && (pfd.revents & (events | POLLHUP))) ? 0 : -1;
+}
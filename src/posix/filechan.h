@@ -0,0 +1,152 @@
+#ifndef FILECHAN_H
+#define FILECHAN_H
+
+/** \file filechan.h
+\brief POSIX File Channels
+
+filechan.h provides ready-made data transfer callbacks for reading a file
+descriptor from modem.h transmitters and writing one from modem.h receivers,
+so applications on the `posix` platform need not write their own.
+
+Like the rest of libmodem, the channels never allocate: the caller supplies
+any buffer they need. Neither side closes the file descriptor it is given.
+
+The file source reads regular files through `mmap`, so with
+xmodem_tx_borrow() a payload goes from the page cache to the serial port
+without being copied. Anything which cannot be mapped (pipes, sockets,
+terminals) is read with large `read()` calls into the caller's buffer
+instead.
+
+The file sink collects received payloads into the caller's buffer and writes
+them out in large batches, with xmodem_rx_window() receiving directly into
+that buffer. XMODEM pads the final block with ::CPMEOF; the sink holds back
+any trailing run of ::CPMEOF and discards it when the sink is closed, so the
+output ends where the input did without a second pass over the file. A file
+which really ends in ::CPMEOF loses those bytes, which is inherent to XMODEM.
+*/
+
+#include "modem.h"
+
+#include <sys/types.h> /* For off_t. */
+#include <stddef.h> /* For size_t. */
+
+/** \brief Smallest buffer accepted by file_source_init() and
+file_sink_init(). */
+#define FILECHAN_MIN_BUF 8192
+
+/** \brief State of a file being transmitted.
+
+Members are private; initialize with file_source_init().
+*/
+typedef struct file_source
+{
+	int fd;
+	const unsigned char * map; /* Whole file, or NULL if streaming. */
+	size_t map_size;
+	size_t pos; /* Offset of the current payload within map or buf. */
+	size_t end; /* Bytes of buf holding file data. */
+	unsigned char * buf;
+	size_t buf_size;
+	int at_eof; /* read() returned 0. */
+}file_source_t;
+
+/** \brief State of a file being received.
+
+Members are private; initialize with file_sink_init().
+*/
+typedef struct file_sink
+{
+	int fd;
+	unsigned char * buf;
+	size_t buf_size;
+	size_t fill; /* Committed bytes in buf not yet written. */
+	size_t run; /* Length of the run of CPMEOF at the end of buf. */
+	size_t last_block; /* Size of the most recently committed payload. */
+	off_t written; /* Bytes written to fd. */
+	int is_regular; /* fd refers to a regular file. */
+}file_sink_t;
+
+/** \brief Prepare a file descriptor for transmission.
+
+Regular files are mapped and advised for sequential access. Otherwise
+\p fd is read in large blocks into \p buf, which must then hold at least
+::FILECHAN_MIN_BUF bytes.
+
+\param[out] src Source state to initialize.
+\param[in] fd File descriptor open for reading, positioned at offset 0 if it
+is a regular file.
+\param[in] buf Buffer for streaming reads. May be `NULL` if \p fd is known to
+be a regular file.
+\param[in] buf_size Size of \p buf.
+\returns 0 on success, -1 if \p fd cannot be mapped and \p buf is unusable.
+
+\sa file_source_borrow() file_source_read() file_source_close()
+*/
+int file_source_init(file_source_t * src, int fd, unsigned char * buf, size_t buf_size);
+
+/** \brief ::borrow_channel_t for a ::file_source_t.
+
+Pass with a ::file_source_t as \p chan_state to xmodem_tx_borrow().
+*/
+int file_source_borrow(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state);
+
+/** \brief ::output_channel_t for a ::file_source_t.
+
+Pass with a ::file_source_t as \p chan_state to xmodem_tx(). Prefer
+file_source_borrow(), which avoids copying each payload.
+*/
+int file_source_read(char * buf, const int request_size, const int last_sent_size, void * const chan_state);
+
+/** \brief Release resources held by a ::file_source_t.
+
+Unmaps the file, if it was mapped. \p fd is not closed.
+
+\param[in,out] src Source to release.
+*/
+void file_source_close(file_source_t * src);
+
+/** \brief Prepare a file descriptor to receive a file.
+
+If \p fd is a regular file and \p size_hint is nonzero, space for
+\p size_hint bytes is reserved up front with `posix_fallocate()`, so the file
+system can lay the file out contiguously. file_sink_close() trims the file to
+the bytes actually received.
+
+\param[out] sink Sink state to initialize.
+\param[in] fd File descriptor open for writing, positioned at offset 0 if it
+is a regular file.
+\param[in] buf Batching buffer, at least ::FILECHAN_MIN_BUF bytes. Larger
+buffers mean fewer, larger writes.
+\param[in] buf_size Size of \p buf.
+\param[in] size_hint Expected size of the file, or 0 if unknown (XMODEM
+does not send it).
+\returns 0 on success, -1 if \p buf is too small.
+
+\sa file_sink_write() file_sink_window() file_sink_close()
+*/
+int file_sink_init(file_sink_t * sink, int fd, unsigned char * buf, size_t buf_size, off_t size_hint);
+
+/** \brief ::input_channel_t for a ::file_sink_t.
+
+Pass with a ::file_sink_t as \p chan_state to xmodem_rx().
+*/
+int file_sink_write(const char * buf, const int buf_size, const int eof, void * const chan_state);
+
+/** \brief ::input_window_t for a ::file_sink_t.
+
+Pass with a ::file_sink_t as \p chan_state to xmodem_rx_window(), which
+receives each payload straight into the batching buffer.
+*/
+char * file_sink_window(const int request_size, const int last_recv_size, const int eof, void * const chan_state);
+
+/** \brief Finish writing a received file.
+
+Writes out everything received except the trailing ::CPMEOF padding, and
+trims a regular file to that length. \p fd is not closed.
+
+\param[in,out] sink Sink to finish.
+\returns 0 on success, -1 if a write or truncate failed.
+*/
+int file_sink_close(file_sink_t * sink);
+
+#endif        /*  #ifndef FILECHAN_H  */
@@ -0,0 +1,214 @@
+#include "runner.h"
+#include "serposix.h"
+
+#include <pthread.h>
+#include <stddef.h> /* For NULL. */
+
+/* Shared by every thread of one runner_run() call. */
+typedef struct runner_pool
+{
+	pthread_mutex_t lock;
+	runner_job_t * jobs;
+	size_t num_jobs;
+	size_t next_job; /* Next job not yet taken by a thread. */
+	int locked; /* lock is in use; not needed by a single thread. */
+}runner_pool_t;
+
+static void * worker(void * arg);
+static void run_job(runner_job_t * job);
+static int count_out(char * buf, const int request_size, const int last_sent_size, void * const chan_state);
+static int count_in(const char * buf, const int buf_size, const int eof, void * const chan_state);
+
+
+int runner_run(runner_job_t * jobs, size_t num_jobs, unsigned int workers, runner_stats_t * stats)
+{
+	pthread_t threads[RUNNER_MAX_WORKERS - 1];
+	runner_pool_t pool;
+	unsigned int started, count;
+	long start = posix_monotonic_ms();
+	int failed = 0;
+	size_t job;
+
+	if(workers == 0)
+	{
+		return -1;
+	}
+
+	if(workers > RUNNER_MAX_WORKERS)
+	{
+		workers = RUNNER_MAX_WORKERS;
+	}
+
+	if(workers > num_jobs)
+	{
+		workers = num_jobs;
+	}
+
+	pool.locked = 0;
+	if(workers > 1)
+	{
+		if(pthread_mutex_init(&pool.lock, NULL) == 0)
+		{
+			pool.locked = 1;
+		}
+		else
+		{
+			/* Without the lock, only one thread can take jobs. */
+			workers = 1;
+		}
+	}
+
+	pool.jobs = jobs;
+	pool.num_jobs = num_jobs;
+	pool.next_job = 0;
+
+	/* The calling thread is a worker too, so a run always makes
+	progress even if no threads could be started. */
+	for(started = 0; started + 1 < workers; started++)
+	{
+		if(pthread_create(&threads[started], NULL, worker, &pool))
+		{
+			break;
+		}
+	}
+
+	worker(&pool);
+	for(count = 0; count < started; count++)
+	{
+		pthread_join(threads[count], NULL);
+	}
+
+	if(pool.locked)
+	{
+		pthread_mutex_destroy(&pool.lock);
+	}
+
+	if(stats != NULL)
+	{
+		stats->failed = 0;
+		stats->bytes = 0;
+	}
+
+	for(job = 0; job < num_jobs; job++)
+	{
+		if(jobs[job].status != MODEM_NO_ERRORS)
+		{
+			failed++;
+		}
+
+		if(stats != NULL)
+		{
+			stats->bytes += jobs[job].bytes;
+		}
+	}
+
+	if(stats != NULL)
+	{
+		stats->failed = (unsigned int) failed;
+		stats->elapsed_ms = posix_monotonic_ms() - start;
+		stats->bytes_per_sec = (stats->elapsed_ms > 0) ? \
+			(unsigned long) ((double) stats->bytes * 1000.0 / stats->elapsed_ms) : 0;
+	}
+
+	return failed;
+}
+
+
+/* Private functions begin here. */
+static void * worker(void * arg)
+{
+	runner_pool_t * pool = arg;
+	size_t job;
+
+	for(;;)
+	{
+		if(pool->locked)
+		{
+			pthread_mutex_lock(&pool->lock);
+		}
+
+		job = pool->next_job;
+		if(job < pool->num_jobs)
+		{
+			pool->next_job++;
+		}
+
+		if(pool->locked)
+		{
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		if(job >= pool->num_jobs)
+		{
+			break;
+		}
+
+		run_job(&pool->jobs[job]);
+	}
+
+	return NULL;
+}
+
+static void run_job(runner_job_t * job)
+{
+	serial_handle_t device = job->device;
+	long start = posix_monotonic_ms();
+
+	job->bytes = 0;
+	job->last_size = 0;
+
+	if(device == NULL && serial_init(job->port_no, job->baud_rate, &device) != SERIAL_NO_ERRORS)
+	{
+		job->status = MODEM_HW_ERROR;
+		job->duration_ms = posix_monotonic_ms() - start;
+		return;
+	}
+
+	if(job->direction == RUNNER_TX)
+	{
+		job->status = xmodem_tx(count_out, job->buf, job, device, job->mode, NULL);
+
+		/* The final payload is never reported through last_sent_size;
+		it was accepted if the transfer succeeded. */
+		if(job->status == MODEM_NO_ERRORS)
+		{
+			job->bytes += job->last_size;
+		}
+	}
+	else
+	{
+		job->status = xmodem_rx(count_in, job->buf, job, device, job->mode, NULL);
+	}
+
+	if(job->device == NULL)
+	{
+		serial_close(&device);
+	}
+
+	job->duration_ms = posix_monotonic_ms() - start;
+}
+
+static int count_out(char * buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	runner_job_t * job = chan_state;
+	int size;
+
+	job->bytes += last_sent_size;
+	size = job->data_out(buf, request_size, last_sent_size, job->chan_state);
+	job->last_size = (size > 0) ? size : 0;
+	return size;
+}
+
+static int count_in(const char * buf, const int buf_size, const int eof, void * const chan_state)
+{
+	runner_job_t * job = chan_state;
+	int size;
+
+	size = job->data_in(buf, buf_size, eof, job->chan_state);
+	if(size > 0)
+	{
+		job->bytes += size;
+	}
+
+	return size;
+}
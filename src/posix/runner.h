@@ -0,0 +1,94 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+/** \file runner.h
+\brief Parallel Transfer Runner
+
+runner.h runs a list of XMODEM transfers on a bounded pool of threads, one
+transfer per thread at a time, for applications which flash many boards from
+one process but cannot be built around the event-driven ::xmodem_session_t
+(see engine.h). Each job is an ordinary serial_init() followed by xmodem_tx()
+or xmodem_rx(), so the channel callbacks are the same ones a single blocking
+transfer would use.
+
+The protocol code runs in many threads at once. xmodem.c, serial.c and crc.c
+keep no state between calls apart from the CRC kernel chosen on first use,
+which is read and written atomically. Paths set by posix_set_port_path()
+must be set up before runner_run() is called.
+
+Like the rest of libmodem, the runner never allocates: the caller supplies
+each job's packet buffer, and the runner's threads keep their state on their
+own stacks.
+*/
+
+#include "modem.h"
+#include "serial.h"
+
+/** \brief Most threads runner_run() will use at once. */
+#define RUNNER_MAX_WORKERS 256
+
+/** \brief Direction of a ::runner_job_t. */
+typedef enum runner_direction
+{
+	RUNNER_TX = 0, /**< Send with xmodem_tx(). */
+	RUNNER_RX /**< Receive with xmodem_rx(). */
+}runner_direction_t;
+
+/** \brief One transfer run by runner_run().
+
+The caller fills in the members up to and including \p buf; runner_run()
+fills in the results. Remaining members are private.
+*/
+typedef struct runner_job
+{
+	unsigned short port_no; /**< Port to open with serial_init(). */
+	unsigned long baud_rate; /**< Baud rate passed to serial_init(). */
+	serial_handle_t device; /**< If not `NULL`, an already open port to use
+	instead of \p port_no, which the runner will not close. */
+	runner_direction_t direction; /**< Send or receive. */
+	xmodem_xfer_mode_t mode; /**< XMODEM protocol variant to use. */
+	output_channel_t data_out; /**< Data source, for ::RUNNER_TX. */
+	input_channel_t data_in; /**< Data sink, for ::RUNNER_RX. */
+	void * chan_state; /**< State for \p data_out or \p data_in. */
+	unsigned char * buf; /**< Packet buffer, sized as for xmodem_tx() or
+	xmodem_rx(). Each job needs its own. */
+
+	modem_errors_t status; /**< Outcome of the transfer, or
+	::MODEM_HW_ERROR if the port could not be opened. */
+	long duration_ms; /**< Time from opening the port to the end of the
+	transfer. */
+	unsigned long bytes; /**< Payload bytes the other side accepted (when
+	sending) or that were passed to \p data_in (when receiving). */
+
+	int last_size; /* Size of the payload data_out last returned. */
+}runner_job_t;
+
+/** \brief Totals for one call to runner_run(). */
+typedef struct runner_stats
+{
+	unsigned int failed; /**< Jobs which did not end in ::MODEM_NO_ERRORS. */
+	unsigned long bytes; /**< Sum of \p bytes over all jobs. */
+	long elapsed_ms; /**< Wall-clock time for the whole run. */
+	unsigned long bytes_per_sec; /**< \p bytes over \p elapsed_ms. */
+}runner_stats_t;
+
+/** \brief Run transfers on a pool of threads, and wait for them to end.
+
+Jobs are started in order, each as soon as a thread is free. Both ends of a
+link may be in the same call, provided the receiver directly follows its
+transmitter (or vice versa) and \p workers is even: an unmatched end then
+waits at most until one other transfer ends, well within the XMODEM start
+timeouts.
+
+\param[in,out] jobs Transfers to run; results are stored in each.
+\param[in] num_jobs Number of entries in \p jobs.
+\param[in] workers Most transfers to run at once, up to
+::RUNNER_MAX_WORKERS. The calling thread is one of them. If fewer threads can
+be started, the jobs are shared among those that were.
+\param[out] stats Totals over all jobs. May be `NULL`.
+\returns Number of jobs which did not end in ::MODEM_NO_ERRORS, or -1 if
+\p workers is zero.
+*/
+int runner_run(runner_job_t * jobs, size_t num_jobs, unsigned int workers, runner_stats_t * stats);
+
+#endif        /*  #ifndef RUNNER_H  */
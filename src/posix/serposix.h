@@ -0,0 +1,78 @@
+#ifndef SERPOSIX_H
+#define SERPOSIX_H
+
+/** \file serposix.h
+\brief POSIX Serial Port Extensions
+
+serposix.h consists of functions only available on the `posix` platform.
+They exist because an integer \p port_no, as taken by serial_init(), cannot
+name every serial device on a POSIX system, and because hosted applications
+often already have a file descriptor (from openpty(), a socket activation
+manager, etc.) which they want to use with the data transfer API.
+
+By default, serial_init() opens `/dev/ttyS<port_no>`. The format string can be
+changed at build time with the `posix_tty_format` option, or per port at
+runtime with posix_set_port_path().
+*/
+
+#include "serial.h"
+
+/** \brief Number of port numbers whose device path can be overridden. */
+#define POSIX_MAX_PORTS 1024
+
+/** \brief Override the device opened for a port number.
+
+After a successful call, serial_init() with \p port_no will open \p path
+instead of the default device. Passing `NULL` restores the default.
+
+\p path is not copied, and must remain valid until serial_init() has been
+called for \p port_no. Paths should be set up before serial_init() is called
+from other threads.
+
+\param[in] port_no Port number to override. Must be < ::POSIX_MAX_PORTS.
+\param[in] path Path to a tty device, e.g. `/dev/ttyUSB0` or `/dev/pts/3`.
+\returns 0 on success, -1 if \p port_no is out of range.
+*/
+int posix_set_port_path(unsigned short port_no, const char * path);
+
+/** \brief Create a serial handle from an open file descriptor.
+
+posix_open_fd() is the equivalent of serial_init() for a tty which is
+already open. The tty is put into raw mode at \p baud_rate, exactly as
+init_port() would. The handle owns \p fd from then on: serial_close()
+restores the previous tty settings and closes \p fd.
+
+\param[in] fd Open file descriptor of a tty (including either side of a
+pseudo-terminal).
+\param[in] baud_rate Baud rate to set. Ignored by pseudo-terminals.
+\returns A valid handle, or `NULL` if \p fd is not a tty or could not be
+configured. \p fd is not closed on failure.
+*/
+serial_handle_t posix_open_fd(int fd, unsigned long baud_rate);
+
+/** \brief Get the file descriptor behind a serial handle.
+
+Useful for multiplexing several ports with poll()/epoll. Reading from or
+writing to the descriptor directly bypasses libmodem. Each handle takes in
+received data with large reads and keeps what it has not yet returned, so
+call serial_flush() before reading the descriptor directly; otherwise bytes
+the handle already holds are missed.
+
+\param[in] port Valid handle.
+\returns The file descriptor of \p port, or -1 if \p port is invalid.
+*/
+int posix_get_fd(serial_handle_t port);
+
+/** \brief Read a millisecond clock for timeouts and deadlines.
+
+The clock is monotonic and starts near 0 at the first call in the process.
+On targets with a 32-bit `long`, it wraps after about 24.8 days, so compare
+two readings by their difference (`deadline - now < 0`), never directly.
+The serial primitives, the transfer engine and the job runner all use this
+clock.
+
+\returns Milliseconds since the first call, modulo the range of `long`.
+*/
+long posix_monotonic_ms(void);
+
+#endif        /*  #ifndef SERPOSIX_H  */
@@ -0,0 +1,589 @@
+/* clock_gettime() and friends are POSIX.1-2008. */
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "serial.h"
+#include "serprim.h"
+#include "serposix.h"
+#include "custombaud.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h> /* For snprintf. */
+#include <stdlib.h>
+#include <string.h> /* For memcpy. */
+#include <sys/uio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <stddef.h> /* For NULL. */
+
+#ifndef POSIX_TTY_FORMAT
+	#define POSIX_TTY_FORMAT "/dev/ttyS%u"
+#endif
+
+/* Size of each handle's receive buffer. Whenever it is empty, it is refilled
+with a single read() of up to this many bytes, so reads of a few bytes at a
+time (start characters, ACKs, block numbers) are served from memory; one
+read() usually takes in a whole XMODEM_1K packet. */
+#ifndef POSIX_RX_BUF_SIZE
+	#define POSIX_RX_BUF_SIZE 2048
+#endif
+
+/* State behind a posix serial_handle_t. */
+typedef struct posix_port
+{
+	int fd;
+	int saved_valid; /* saved holds the settings to restore on close. */
+	struct termios saved;
+	unsigned long baud_rate; /* As set by init_port(), or 0. */
+	size_t rx_start; /* rx_buf[rx_start..rx_end) is not yet received. */
+	size_t rx_end;
+	unsigned char rx_buf[POSIX_RX_BUF_SIZE];
+}posix_port_t;
+
+#define VOID_TO_POSIX(x) ((posix_port_t *) (x))
+
+/* Spans passed to each writev() call; always <= IOV_MAX (at least 16). */
+#define WRITEV_BATCH 16
+
+static const char * port_paths[POSIX_MAX_PORTS];
+
+/* posix_monotonic_ms() counts from the first call, so it stays well away
+from wrapping for as long as most processes run. */
+static pthread_once_t clock_once = PTHREAD_ONCE_INIT;
+static struct timespec clock_base;
+
+static posix_port_t * alloc_port(int fd);
+static void clock_init(void);
+static int wait_fd(int fd, short events, long timeout_ms);
+static int take_rx(posix_port_t * port, char * data, unsigned int max_bytes, long deadline, \
+	int peek);
+static int read_fd(int fd, char * data, size_t size, long deadline);
+static int baud_to_speed(unsigned long baud_rate, speed_t * speed);
+
+
+serial_handle_t open_handle(unsigned short port_no)
+{
+	char default_path[32];
+	const char * path;
+	posix_port_t * port;
+	int fd;
+
+	if(port_no < POSIX_MAX_PORTS && port_paths[port_no] != NULL)
+	{
+		path = port_paths[port_no];
+	}
+	else
+	{
+		snprintf(default_path, sizeof(default_path), POSIX_TTY_FORMAT, port_no);
+		path = default_path;
+	}
+
+	/* O_NOCTTY: a serial port must never become our controlling terminal.
+	O_NONBLOCK: all waiting is done in poll() so timeouts can be honoured;
+	it also avoids blocking on modem control lines while opening. */
+	if((fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+	{
+		return NULL;
+	}
+
+	if((port = alloc_port(fd)) == NULL)
+	{
+		close(fd);
+	}
+
+	return port;
+}
+
+int handle_valid(serial_handle_t port)
+{
+	return (port != NULL) && (VOID_TO_POSIX(port)->fd >= 0);
+}
+
+int init_port(serial_handle_t port, unsigned long baud_rate)
+{
+	posix_port_t * pport = VOID_TO_POSIX(port);
+	struct termios tio;
+	speed_t speed;
+	int std_speed;
+
+	if(tcgetattr(pport->fd, &tio))
+	{
+		return -1;
+	}
+
+	if(!pport->saved_valid)
+	{
+		pport->saved = tio;
+		pport->saved_valid = 1;
+	}
+
+	/* Raw mode, 8N1, no flow control. Equivalent to cfmakeraw(), which
+	is not in POSIX. */
+	tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | \
+		ICRNL | IXON | IXOFF | IXANY | INPCK);
+	tio.c_oflag &= ~OPOST;
+	tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+	tio.c_cflag |= CS8 | CREAD | CLOCAL;
+#ifdef CRTSCTS
+	tio.c_cflag &= ~CRTSCTS;
+#endif
+	/* read() returns whatever is available immediately; poll() does the
+	waiting. */
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	std_speed = !baud_to_speed(baud_rate, &speed);
+	if(std_speed && (cfsetispeed(&tio, speed) || cfsetospeed(&tio, speed)))
+	{
+		return -1;
+	}
+
+	if(tcsetattr(pport->fd, TCSANOW, &tio))
+	{
+		return -1;
+	}
+
+	if(!std_speed && set_custom_baud(pport->fd, baud_rate))
+	{
+		return -1;
+	}
+
+	pport->baud_rate = baud_rate;
+	return 0;
+}
+
+int write_data(serial_handle_t port, char * data, unsigned int num_bytes)
+{
+	int fd = VOID_TO_POSIX(port)->fd;
+
+	while(num_bytes > 0)
+	{
+		ssize_t written = write(fd, data, num_bytes);
+
+		if(written > 0)
+		{
+			data += written;
+			num_bytes -= (unsigned int) written;
+		}
+		else if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			/* Output buffer is full; wait for the UART to drain it. */
+			if(wait_fd(fd, POLLOUT, -1) < 0)
+			{
+				return -1;
+			}
+		}
+		else if(!(written < 0 && errno == EINTR))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int write_datav(serial_handle_t port, const serial_iovec_t * iov, unsigned int iovcnt)
+{
+	int fd = VOID_TO_POSIX(port)->fd;
+	struct iovec batch[WRITEV_BATCH];
+	unsigned int next = 0; /* First span of iov not yet copied to batch. */
+	size_t skip = 0; /* Bytes of iov[next] already written. */
+
+	while(next < iovcnt)
+	{
+		int used = 0;
+		unsigned int i;
+		ssize_t written;
+
+		for(i = next; i < iovcnt && used < WRITEV_BATCH; i++)
+		{
+			size_t offset = (i == next) ? skip : 0;
+
+			if(iov[i].num_bytes > offset)
+			{
+				batch[used].iov_base = iov[i].data + offset;
+				batch[used].iov_len = iov[i].num_bytes - offset;
+				used++;
+			}
+		}
+
+		if(used == 0)
+		{
+			break;
+		}
+
+		written = writev(fd, batch, used);
+		if(written < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				if(wait_fd(fd, POLLOUT, -1) < 0)
+				{
+					return -1;
+				}
+			}
+			else if(errno != EINTR)
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		/* Advance past whatever the kernel took, which may end partway
+		through a span. */
+		while(next < iovcnt && (size_t) written >= iov[next].num_bytes - skip)
+		{
+			written -= iov[next].num_bytes - skip;
+			skip = 0;
+			next++;
+		}
+		skip += written;
+	}
+
+	return 0;
+}
+
+/* The timeout covers the whole request rather than each read() call, so a
+trickle of bytes cannot stretch it. */
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms)
+{
+	long deadline;
+
+	if(timeout_ms < 0)
+	{
+		timeout_ms = 0;
+	}
+	deadline = posix_monotonic_ms() + timeout_ms;
+
+	while(num_bytes > 0)
+	{
+		int got = take_rx(VOID_TO_POSIX(port), data, num_bytes, deadline, 0);
+
+		if(got < 0)
+		{
+			return got;
+		}
+
+		data += got;
+		num_bytes -= (unsigned int) got;
+	}
+
+	return 0;
+}
+
+int read_data_some(serial_handle_t port, char * data, unsigned int max_bytes, long timeout_ms, int peek)
+{
+	if(timeout_ms < 0)
+	{
+		timeout_ms = 0;
+	}
+
+	return take_rx(VOID_TO_POSIX(port), data, max_bytes, posix_monotonic_ms() + timeout_ms, peek);
+}
+
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
+{
+	int rc;
+	long start;
+
+	start = posix_monotonic_ms();
+	rc = read_data(port, data, num_bytes, timeout_ms);
+	*elapsed_ms = posix_monotonic_ms() - start;
+
+	return rc;
+}
+
+unsigned long get_baud_rate(serial_handle_t port)
+{
+	return VOID_TO_POSIX(port)->baud_rate;
+}
+
+int close_handle(serial_handle_t port)
+{
+	posix_port_t * pport = VOID_TO_POSIX(port);
+	int rc = 0;
+
+	if(pport->saved_valid)
+	{
+		/* Best effort; the device may already be gone. */
+		(void) tcsetattr(pport->fd, TCSANOW, &pport->saved);
+	}
+
+	if(close(pport->fd))
+	{
+		rc = -1;
+	}
+
+	pport->fd = -1;
+	free(pport);
+	return rc;
+}
+
+int flush_device(serial_handle_t port)
+{
+	posix_port_t * pport = VOID_TO_POSIX(port);
+
+	pport->rx_start = pport->rx_end = 0;
+	return tcflush(pport->fd, TCIFLUSH) ? -1 : 0;
+}
+
+
+/* Functions from serposix.h. */
+int posix_set_port_path(unsigned short port_no, const char * path)
+{
+	if(port_no >= POSIX_MAX_PORTS)
+	{
+		return -1;
+	}
+
+	port_paths[port_no] = path;
+	return 0;
+}
+
+serial_handle_t posix_open_fd(int fd, unsigned long baud_rate)
+{
+	posix_port_t * port;
+	int flags;
+
+	if(fd < 0 || !isatty(fd))
+	{
+		return NULL;
+	}
+
+	if((port = alloc_port(fd)) == NULL)
+	{
+		return NULL;
+	}
+
+	if((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) \
+		|| init_port(port, baud_rate))
+	{
+		/* Leave fd open, but undo any changes. */
+		if(port->saved_valid)
+		{
+			(void) tcsetattr(fd, TCSANOW, &port->saved);
+		}
+		free(port);
+		return NULL;
+	}
+
+	return port;
+}
+
+int posix_get_fd(serial_handle_t port)
+{
+	return handle_valid(port) ? VOID_TO_POSIX(port)->fd : -1;
+}
+
+long posix_monotonic_ms(void)
+{
+	struct timespec now;
+	unsigned long elapsed;
+
+	pthread_once(&clock_once, clock_init);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Unsigned, so that an overflow wraps instead of being undefined. */
+	elapsed = (unsigned long) (now.tv_sec - clock_base.tv_sec) * 1000UL;
+	elapsed += (unsigned long) (now.tv_nsec / 1000000L);
+	elapsed -= (unsigned long) (clock_base.tv_nsec / 1000000L);
+	return (long) elapsed;
+}
+
+
+/* Private functions begin here. */
+static posix_port_t * alloc_port(int fd)
+{
+	posix_port_t * port = malloc(sizeof(posix_port_t));
+
+	if(port != NULL)
+	{
+		port->fd = fd;
+		port->saved_valid = 0;
+		port->baud_rate = 0;
+		port->rx_start = port->rx_end = 0;
+	}
+
+	return port;
+}
+
+static void clock_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock_base);
+}
+
+/* Receive up to max_bytes from the receive buffer, first refilling it with
+one read() if it is empty. A request too big for the buffer is read straight
+into data instead. Returns the number of bytes received, -1 if none arrived
+by deadline, or -2 on errors. */
+static int take_rx(posix_port_t * port, char * data, unsigned int max_bytes, long deadline, \
+	int peek)
+{
+	size_t avail = port->rx_end - port->rx_start;
+
+	if(avail == 0)
+	{
+		int got;
+
+		if(!peek && max_bytes >= POSIX_RX_BUF_SIZE)
+		{
+			return read_fd(port->fd, data, max_bytes, deadline);
+		}
+
+		if((got = read_fd(port->fd, (char *) port->rx_buf, POSIX_RX_BUF_SIZE, deadline)) < 0)
+		{
+			return got;
+		}
+
+		port->rx_start = 0;
+		port->rx_end = avail = (size_t) got;
+	}
+
+	if(avail > max_bytes)
+	{
+		avail = max_bytes;
+	}
+
+	memcpy(data, &port->rx_buf[port->rx_start], avail);
+	if(!peek)
+	{
+		port->rx_start += avail;
+	}
+
+	return (int) avail;
+}
+
+/* A single read() of up to size bytes, first waiting until deadline for
+data if none is available. Returns as take_rx(). */
+static int read_fd(int fd, char * data, size_t size, long deadline)
+{
+	for(;;)
+	{
+		ssize_t got = read(fd, data, size);
+
+		if(got > 0)
+		{
+			return (int) got;
+		}
+		else if(got == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			long remaining = deadline - posix_monotonic_ms();
+			int rc;
+
+			/* With VMIN = VTIME = 0 a tty read() returns 0 when no data is
+			available, so both cases mean "wait for more". A hangup is
+			reported by poll() instead. */
+			if(remaining <= 0)
+			{
+				return -1;
+			}
+
+			if((rc = wait_fd(fd, POLLIN, remaining)) < 0)
+			{
+				return -2;
+			}
+			else if(rc == 0)
+			{
+				return -1;
+			}
+		}
+		else if(errno != EINTR)
+		{
+			return -2;
+		}
+	}
+}
+
+/* Returns 1 if fd is ready, 0 on timeout, -1 on error or hangup. A negative
+timeout waits forever. */
+static int wait_fd(int fd, short events, long timeout_ms)
+{
+	struct pollfd pfd;
+	long deadline = posix_monotonic_ms() + timeout_ms;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	while(1)
+	{
+		int rc = poll(&pfd, 1, (int) timeout_ms);
+
+		if(rc > 0)
+		{
+			return (pfd.revents & events) ? 1 : -1;
+		}
+		else if(rc == 0)
+		{
+			return 0;
+		}
+		else if(errno != EINTR)
+		{
+			return -1;
+		}
+
+		if(timeout_ms >= 0)
+		{
+			timeout_ms = deadline - posix_monotonic_ms();
+			if(timeout_ms < 0)
+			{
+				timeout_ms = 0;
+			}
+		}
+	}
+}
+
+/* Returns 0 and sets speed if baud_rate has a B* constant, -1 otherwise. */
+static int baud_to_speed(unsigned long baud_rate, speed_t * speed)
+{
+	static const struct { unsigned long rate; speed_t speed; } speeds[] = {
+		{ 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 },
+		{ 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+		{ 38400, B38400 },
+#ifdef B57600
+		{ 57600, B57600 },
+#endif
+#ifdef B115200
+		{ 115200, B115200 },
+#endif
+#ifdef B230400
+		{ 230400, B230400 },
+#endif
+#ifdef B460800
+		{ 460800, B460800 },
+#endif
+#ifdef B921600
+		{ 921600, B921600 },
+#endif
+#ifdef B1000000
+		{ 1000000, B1000000 },
+#endif
+#ifdef B2000000
+		{ 2000000, B2000000 },
+#endif
+#ifdef B3000000
+		{ 3000000, B3000000 },
+#endif
+#ifdef B4000000
+		{ 4000000, B4000000 },
+#endif
+	};
+	size_t i;
+
+	for(i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+	{
+		if(speeds[i].rate == baud_rate)
+		{
+			*speed = speeds[i].speed;
+			return 0;
+		}
+	}
+
+	return -1;
+}
@@ -3,6 +3,19 @@
 
 #include <stddef.h> /* For NULL. */
 
+/* The idle gap which ends serial_drain(), in characters at the port's baud
+rate, and never less than SERIAL_DRAIN_MIN_MS. USB-serial adapters hold data
+for up to 16 ms (the default FTDI latency timer) before passing it on, so a
+sender can appear to pause for that long in mid-packet. */
+#ifndef SERIAL_DRAIN_IDLE_CHARS
+	#define SERIAL_DRAIN_IDLE_CHARS 32L
+#endif
+#ifndef SERIAL_DRAIN_MIN_MS
+	#define SERIAL_DRAIN_MIN_MS 20L
+#endif
+/* Bytes discarded per read while draining. */
+#define SERIAL_DRAIN_CHUNK 256
+
 /* TODO: Serial close within routines? */
 
 /* At some point, baud_rate will likely become a struct of serial parameters. */
@@ -31,10 +44,43 @@ serial_status_t serial_snd(char * data, unsigned int num_bytes, serial_handle_t
 	return ser_stat;
 }
 
+serial_status_t serial_sndv(const serial_iovec_t * iov, unsigned int iovcnt, serial_handle_t port)
+{
+	serial_status_t ser_stat = SERIAL_NO_ERRORS;
+
+	if(!handle_valid(port))
+	{
+		ser_stat = SERIAL_HW_ERROR;
+	}
+	else
+	{
+#ifdef HAVE_WRITE_DATAV
+		if(write_datav(port, iov, iovcnt))
+		{
+			ser_stat = SERIAL_HW_ERROR;
+		}
+#else
+		unsigned int count;
+
+		for(count = 0; count < iovcnt; count++)
+		{
+			if(iov[count].num_bytes > 0 && \
+				write_data(port, iov[count].data, iov[count].num_bytes))
+			{
+				ser_stat = SERIAL_HW_ERROR;
+				break;
+			}
+		}
+#endif
+	}
+
+	return ser_stat;
+}
+
 serial_status_t serial_rcv(char * data, unsigned int num_bytes, int timeout, int * time_spent, serial_handle_t port)
 {
 	serial_status_t ser_stat;
-	int read_stat;
+	long time_spent_ms;
 
 	/* Guard against negative values being converted to ridiculous timeouts.
 	A timeout < 0 will be set to 0. */
@@ -43,15 +89,36 @@ serial_status_t serial_rcv(char * data, unsigned int num_bytes, int timeout, int
 		timeout = 0;
 	}
 
+	ser_stat = serial_rcv_ms(data, num_bytes, 1000L * timeout, \
+		(time_spent == NULL) ? NULL : &time_spent_ms, port);
+	if(time_spent != NULL)
+	{
+		(* time_spent) = (int) (time_spent_ms / 1000);
+	}
+
+	return ser_stat;
+}
+
+serial_status_t serial_rcv_ms(char * data, unsigned int num_bytes, long timeout_ms, long * time_spent_ms, serial_handle_t port)
+{
+	serial_status_t ser_stat;
+	int read_stat;
+
+	if(timeout_ms < 0)
+	{
+		timeout_ms = 0;
+	}
+
 	if(handle_valid(port))
 	{
-		if(time_spent == NULL)
+		if(time_spent_ms == NULL)
 		{
-			read_stat = read_data(port, data, num_bytes, timeout);
+			read_stat = read_data(port, data, num_bytes, timeout_ms);
 		}
 		else
 		{
-			read_stat = read_data_get_elapsed_time(port, data, num_bytes, timeout, time_spent);
+			(* time_spent_ms) = 0;
+			read_stat = read_data_get_elapsed_time(port, data, num_bytes, timeout_ms, time_spent_ms);
 		}
 	}
 	else
@@ -78,6 +145,116 @@ serial_status_t serial_rcv(char * data, unsigned int num_bytes, int timeout, int
 	return ser_stat;
 }
 
+serial_status_t serial_rcv_some(char * data, unsigned int max_bytes, long timeout_ms, unsigned int * num_read, serial_handle_t port)
+{
+	int read_stat;
+
+	if(timeout_ms < 0)
+	{
+		timeout_ms = 0;
+	}
+
+	(* num_read) = 0;
+	if(!handle_valid(port))
+	{
+		return SERIAL_HW_ERROR;
+	}
+	else if(max_bytes == 0)
+	{
+		return SERIAL_NO_ERRORS;
+	}
+
+#ifdef HAVE_READ_DATA_SOME
+	read_stat = read_data_some(port, data, max_bytes, timeout_ms, 0);
+#else
+	read_stat = read_data(port, data, 1, timeout_ms);
+	if(read_stat == 0)
+	{
+		read_stat = 1;
+	}
+#endif
+
+	if(read_stat > 0)
+	{
+		(* num_read) = (unsigned int) read_stat;
+		return SERIAL_NO_ERRORS;
+	}
+
+	return (read_stat == -1) ? SERIAL_TIMEOUT : SERIAL_HW_ERROR;
+}
+
+serial_status_t serial_peek(char * data, long timeout_ms, serial_handle_t port)
+{
+#ifdef HAVE_READ_DATA_SOME
+	int read_stat;
+
+	if(timeout_ms < 0)
+	{
+		timeout_ms = 0;
+	}
+
+	if(!handle_valid(port))
+	{
+		return SERIAL_HW_ERROR;
+	}
+
+	read_stat = read_data_some(port, data, 1, timeout_ms, 1);
+	if(read_stat > 0)
+	{
+		return SERIAL_NO_ERRORS;
+	}
+
+	return (read_stat == -1) ? SERIAL_TIMEOUT : SERIAL_HW_ERROR;
+#else
+	(void) data;
+	(void) timeout_ms;
+	(void) port;
+	return SERIAL_HW_ERROR;
+#endif
+}
+
+serial_status_t serial_drain(serial_handle_t port, long idle_ms)
+{
+	char discard[SERIAL_DRAIN_CHUNK];
+	serial_status_t ser_stat;
+	unsigned int num_read;
+#ifdef HAVE_GET_BAUD_RATE
+	unsigned long baud_rate;
+#endif
+
+	if(!handle_valid(port))
+	{
+		return SERIAL_HW_ERROR;
+	}
+
+#ifdef HAVE_GET_BAUD_RATE
+	/* 10 bits per character: start, 8 data, stop. */
+	if((baud_rate = get_baud_rate(port)) > 0)
+	{
+		long gap = (long) ((SERIAL_DRAIN_IDLE_CHARS * 10000UL + baud_rate - 1) / baud_rate);
+
+		if(gap < SERIAL_DRAIN_MIN_MS)
+		{
+			gap = SERIAL_DRAIN_MIN_MS;
+		}
+
+		if(gap < idle_ms)
+		{
+			idle_ms = gap;
+		}
+	}
+#endif
+
+	/* Whatever the flush misses, or if it fails, is read and discarded
+	below. */
+	(void) flush_device(port);
+	do{
+		ser_stat = serial_rcv_some(discard, sizeof(discard), idle_ms, &num_read, port);
+	}while(ser_stat == SERIAL_NO_ERRORS);
+
+	return (ser_stat == SERIAL_TIMEOUT) ? SERIAL_NO_ERRORS : SERIAL_HW_ERROR;
+}
+
 serial_status_t serial_close(serial_handle_t * port_addr)
 {
 	serial_status_t ser_stat = SERIAL_NO_ERRORS;
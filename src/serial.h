@@ -49,6 +49,16 @@ typedef enum serial_status
 	SERIAL_HW_ERROR /**< Catch-all for all other errors. */
 }serial_status_t;
 
+/** \brief One span of data for serial_sndv().
+
+Mirrors POSIX `struct iovec`, but with the types used elsewhere in this API.
+*/
+typedef struct serial_iovec
+{
+	char * data; /**< Start of the span. */
+	unsigned int num_bytes; /**< Length of the span. May be 0. */
+}serial_iovec_t;
+
 /** \brief Initialize underlying serial port.
 
 serial_init() should perform any initialization required to operate on the
@@ -100,6 +110,28 @@ write_data() reported an error.
 */
 serial_status_t serial_snd(char * data, unsigned int num_bytes, serial_handle_t port);
 
+/** \brief Send several buffers over serial port as one write.
+
+serial_sndv() sends each span in \p iov in order, as if the spans had been
+concatenated and passed to serial_snd(). This lets a protocol send a packet
+whose header, payload and trailer live in different buffers without first
+copying them together.
+
+If the platform implements write_datav(), all spans are handed to the
+operating system or UART driver at once (a single `writev()` on `posix`).
+Otherwise serial_sndv() falls back to calling write_data() once per nonempty
+span.
+
+\param[in] iov Array of spans to send.
+\param[in] iovcnt Number of elements in \p iov.
+\param[in] port Handle to a serial port.
+\returns Same as serial_snd(). If ::SERIAL_HW_ERROR is returned, any prefix
+of the data may have been sent.
+
+\sa serial_snd() write_datav() write_data()
+*/
+serial_status_t serial_sndv(const serial_iovec_t * iov, unsigned int iovcnt, serial_handle_t port);
+
 /** \brief Receive data over serial port.
 
 serial_receive() should receive data from the serial port into the buffer
@@ -112,15 +144,19 @@ operation. However, in cases where this is not possible, \p timeout may be
 measured one character at a time for a buffer, timing out if any read takes
 longer than 1 second.
 
+serial_rcv() is a wrapper around serial_rcv_ms() for callers which only need
+whole-second timeouts.
+
 \param[in] data Buffer of data to receive.
 \param[in] num_bytes Number of bytes to receive.
 \param[in] timeout Timeout in seconds to wait for data. A timeout of 0 returns
 immediately. A timeout < 0 will be converted to 0 by the underlying primitive.
 \param[in,out] time_spent If non-NULL, serial_rcv will return the time elapsed
-waiting for data in this parameter. If ::SERIAL_TIMEOUT was returned, the
-value need not match \p timeout; rely on ::SERIAL_TIMEOUT and \p timeout in
-this case. If this param is NULL, then primitive read_data() is called;
-otherwise read_data_get_elapsed_time() is called.
+waiting for data in this parameter, rounded down to whole seconds. If
+::SERIAL_TIMEOUT was returned, the value need not match \p timeout; rely on
+::SERIAL_TIMEOUT and \p timeout in this case. If this param is NULL, then
+primitive read_data() is called; otherwise read_data_get_elapsed_time() is
+called.
 \param[in] port Handle to a serial port.
 \retval ::SERIAL_NO_ERRORS An entire buffer of data was received successfully.
 \retval ::SERIAL_TIMEOUT The underlying primitive timed out waiting for the
@@ -135,6 +171,94 @@ to work. It should be removed.
 */
 serial_status_t serial_rcv(char * data, unsigned int num_bytes, int timeout, int * time_spent, serial_handle_t port);
 
+/** \brief Receive data over serial port, with millisecond timeouts.
+
+serial_rcv_ms() behaves exactly like serial_rcv(), except that \p timeout_ms
+and \p time_spent_ms are in milliseconds. Protocols should prefer it, so that
+waits can be sized to what the link needs rather than rounded up to the next
+second.
+
+\param[in] data Buffer of data to receive.
+\param[in] num_bytes Number of bytes to receive.
+\param[in] timeout_ms Timeout in milliseconds to wait for the entire buffer.
+A timeout < 0 will be converted to 0.
+\param[in,out] time_spent_ms If non-NULL, the time elapsed waiting for data in
+milliseconds. Only valid if ::SERIAL_NO_ERRORS was returned.
+\param[in] port Handle to a serial port.
+\returns Same as serial_rcv().
+
+\sa serial_rcv() read_data() read_data_get_elapsed_time()
+*/
+serial_status_t serial_rcv_ms(char * data, unsigned int num_bytes, long timeout_ms, long * time_spent_ms, serial_handle_t port);
+
+/** \brief Receive whatever data is available over serial port.
+
+serial_rcv_some() waits up to \p timeout_ms for data to arrive, then returns
+as much as is available, up to \p max_bytes, instead of waiting for a fixed
+amount. Protocols use it to drain or scan the line in bulk.
+
+If the platform implements read_data_some(), bytes already held in its
+receive buffer are returned without a system call. Otherwise one byte is
+received per call.
+
+\param[out] data Buffer of data to receive.
+\param[in] max_bytes Most bytes to receive.
+\param[in] timeout_ms Timeout in milliseconds to wait for the first byte. A
+timeout < 0 will be converted to 0.
+\param[out] num_read Number of bytes received. Only valid if
+::SERIAL_NO_ERRORS was returned.
+\param[in] port Handle to a serial port.
+\returns ::SERIAL_NO_ERRORS if at least one byte (or \p max_bytes == 0)
+was received, ::SERIAL_TIMEOUT if none arrived in time, ::SERIAL_HW_ERROR
+otherwise.
+
+\sa serial_rcv_ms() read_data_some()
+*/
+serial_status_t serial_rcv_some(char * data, unsigned int max_bytes, long timeout_ms, unsigned int * num_read, serial_handle_t port);
+
+/** \brief Look at the next received character without removing it.
+
+serial_peek() waits up to \p timeout_ms for a character, and copies it into
+\p data. The character is still received by the next call to serial_rcv(),
+serial_rcv_ms() or serial_rcv_some().
+
+Only platforms which implement read_data_some() (`posix` and `windows`) support
+serial_peek().
+
+\param[out] data The next character.
+\param[in] timeout_ms Timeout in milliseconds to wait for a character. A
+timeout < 0 will be converted to 0.
+\param[in] port Handle to a serial port.
+\returns ::SERIAL_NO_ERRORS if a character is available, ::SERIAL_TIMEOUT if
+none arrived in time, ::SERIAL_HW_ERROR on errors or if the platform does not
+support peeking.
+
+\sa serial_rcv_some() read_data_some()
+*/
+serial_status_t serial_peek(char * data, long timeout_ms, serial_handle_t port);
+
+/** \brief Discard incoming data until the line goes idle.
+
+serial_drain() resynchronizes with a sender after an error, for instance
+after a damaged packet whose remainder is still arriving. Everything already
+received is discarded at once with serial_flush(), and anything arriving
+later is read and discarded in bulk, until nothing has arrived for an idle
+gap.
+
+If the platform implements get_baud_rate(), the gap is the time taken to
+send a few dozen characters at the port's baud rate, but no less than a few
+milliseconds, to allow for USB-serial adapters which deliver data in bursts.
+\p idle_ms bounds it from above, and is the gap on other platforms.
+
+\param[in] port Handle to a serial port.
+\param[in] idle_ms Longest idle gap to wait for, in milliseconds.
+\returns ::SERIAL_NO_ERRORS once the line has been idle for the gap,
+::SERIAL_HW_ERROR if reading failed.
+
+\sa serial_flush() serial_rcv_some() get_baud_rate()
+*/
+serial_status_t serial_drain(serial_handle_t port, long idle_ms);
+
 /** \brief Close serial port.
 
 serial_close() shall deallocate any resources that were previously required for
@@ -85,6 +85,25 @@ to the UART transmit register successfully, nonzero (`-1`) otherwise.
 */
 int write_data(serial_handle_t port, char * data, unsigned int num_bytes);
 
+/** \brief Do serial port gather write.
+
+This primitive is _optional_. A platform which implements it must also add
+`HAVE_WRITE_DATAV` to the defines used to compile `src/serial.c` (see
+`meson.build`); otherwise serial_sndv() falls back to write_data().
+
+write_datav() shall behave as if each of the \p iovcnt spans in \p iov were
+passed to write_data() in order, but should hand them to the underlying
+driver in as few operations as possible.
+
+\param[in] port Handle to a serial port.
+\param[in] iov Array of spans to send.
+\param[in] iovcnt Number of elements in \p iov.
+\returns Same as write_data().
+
+\sa serial_sndv()
+*/
+int write_datav(serial_handle_t port, const serial_iovec_t * iov, unsigned int iovcnt);
+
 /** \brief Do serial port read.
 
 This function does the actual read from a asynchronously-filled receive buffer
@@ -95,7 +114,9 @@ undefined if this function fails.
 \param[in] port Handle to a serial port.
 \param[out] data Buffer of data to receive.
 \param[in] num_bytes Number of bytes to receive.
-\param[in] timeout Timeout in seconds to wait for data.
+\param[in] timeout_ms Timeout in milliseconds to wait for data, measured
+over the whole read. An implementation may round up to the resolution of
+its timer, but must not round a nonzero timeout down to 0.
 \retval 0 The read completed successfully.
 \retval -1 The read timed out before \p num_bytes were read.
 \retval -2 All other possible errors reading (hardware failure, etc). All other
@@ -103,7 +124,7 @@ nonzero values are acceptable.
 
 \sa serial_rcv()
 */
-int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int timeout);
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms);
 
 /** \brief Do serial port read, and report elapsed time.
 
@@ -122,36 +143,77 @@ like this:
 \code{.c}
 #include <time.h>
 
-int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, int timeout, int * elapsed)
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
 {
 	int rc;
-	time_t start, end;
+	clock_t start, end;
 
-	time(&start)
-	rc = read_data(port, data, num_bytes, timeout);
-	time(&end);
+	start = clock();
+	rc = read_data(port, data, num_bytes, timeout_ms);
+	end = clock();
 
-	*elapsed = (int) difftime(end, start);
+	*elapsed_ms = (long) ((end - start) * 1000.0 / CLOCKS_PER_SEC);
 	return rc;
 }
 \endcode
 
+Note that clock() measures processor time, so this only works if read_data()
+busy-waits. Implementations which sleep should use a wall clock instead.
+
 \param[in] port Handle to a serial port.
 \param[out] data Buffer of data to receive.
 \param[in] num_bytes Number of bytes to receive.
-\param[in] timeout Timeout in seconds to wait for data.
-\param[out] elapsed Time spent in this function (and children), from invocation
-to return, in seconds.
+\param[in] timeout_ms Timeout in milliseconds to wait for data.
+\param[out] elapsed_ms Time spent in this function (and children), from
+invocation to return, in milliseconds. Data transfer functions add this to a
+running total each invocation, so it should be as accurate as the platform
+timer allows rather than rounded down to a coarse unit.
 \returns Return value semantics are identical to read_data().
 
-\bug \p elapsed should have greater granularity to prevent \p elapsed from
-returning 0 if data is received close to but not greater than one
-second apart. Data transfer functions rely on adding elapsed to a global
-`time_spent` counter each invocation.
-
 \sa read_data() serial_rcv()
 */
-int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, int timeout, int * elapsed);
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms);
+
+/** \brief Do partial serial port read.
+
+This primitive is _optional_. A platform which implements it must also add
+`HAVE_READ_DATA_SOME` to the defines used to compile `src/serial.c` (see
+`meson.build`); otherwise serial_rcv_some() falls back to reading one byte
+with read_data(), and serial_peek() is unavailable.
+
+read_data_some() waits until at least one byte is available, then transfers
+as many as are available, up to \p max_bytes, without waiting further. It is
+meant for platforms which keep a receive buffer per handle, filled with
+large reads, so that small requests are served from memory.
+
+\param[in] port Handle to a serial port.
+\param[out] data Buffer of data to receive.
+\param[in] max_bytes Most bytes to receive. Nonzero.
+\param[in] timeout_ms Timeout in milliseconds to wait for the first byte, as
+for read_data().
+\param[in] peek If nonzero, the bytes are left in place, to be received
+again by the next read.
+\returns The number of bytes transferred, from 1 to \p max_bytes.
+\retval -1 No data arrived within \p timeout_ms.
+\retval -2 All other possible errors reading, as for read_data().
+
+\sa serial_rcv_some() serial_peek()
+*/
+int read_data_some(serial_handle_t port, char * data, unsigned int max_bytes, long timeout_ms, int peek);
+
+/** \brief Report the baud rate of a serial port.
+
+This primitive is _optional_. A platform which implements it must also add
+`HAVE_GET_BAUD_RATE` to the defines used to compile `src/serial.c` (see
+`meson.build`). serial_drain() uses it to size the idle gap which ends a
+drain to the speed of the line; without it, the caller's gap is used as is.
+
+\param[in] port Handle to a serial port.
+\returns The baud rate passed to init_port(), or 0 if it is not known.
+
+\sa serial_drain()
+*/
+unsigned long get_baud_rate(serial_handle_t port);
 
 /** \brief Deallocate resources for a serial port.
 
@@ -0,0 +1,557 @@
+#include "serial.h"
+#include "modem.h"
+
+#include <stddef.h> /* For NULL. */
+
+/* Handshake strings. The target asks for a boot image with SFL_MAGIC_REQ,
+and the host answers with SFL_MAGIC_ACK before sending frames. */
+#define SFL_MAGIC_LEN 14
+#define SFL_MAGIC_REQ "sL5DdSMmkekro\n"
+#define SFL_MAGIC_ACK "z6IHG7cYDID6o\n"
+
+/* Frame layout: payload length, CRC-16 (MSB first) over the command and
+payload, then the command and payload themselves. */
+#define SFL_LEN 0
+#define SFL_CRC 1
+#define SFL_CMD 3
+#define SFL_PAYLOAD 4
+
+/* Commands. LOAD and JUMP payloads start with a big-endian address. */
+#define SFL_CMD_ABORT 0x00
+#define SFL_CMD_LOAD 0x01
+#define SFL_CMD_JUMP 0x02
+#define SFL_ADDR_LEN 4
+
+/* Replies to each frame. */
+#define SFL_ACK_SUCCESS 'K'
+#define SFL_ACK_CRCERROR 'C'
+#define SFL_ACK_UNKNOWN 'U'
+#define SFL_ACK_ERROR 'E'
+
+/* Protocol timeouts in milliseconds. The handshake timeout follows the
+LiteX BIOS, which asks once and gives up after a quarter of a second. */
+#ifndef SFL_MAGIC_TIMEOUT_MS
+	#define SFL_MAGIC_TIMEOUT_MS 250L /* Host answering the request. */
+#endif
+#ifndef SFL_MAGIC_RETRIES
+	#define SFL_MAGIC_RETRIES 4
+#endif
+#ifndef SFL_TIMEOUT_MS
+	#define SFL_TIMEOUT_MS 10000L /* Waiting for the next frame. */
+#endif
+#ifndef SFL_FRAME_TIMEOUT_MS
+	#define SFL_FRAME_TIMEOUT_MS 1000L /* Rest of a frame, once started. */
+#endif
+#ifndef SFL_ACK_TIMEOUT_MS
+	/* Long enough for the target to time out a short frame. */
+	#define SFL_ACK_TIMEOUT_MS (SFL_FRAME_TIMEOUT_MS + 500L)
+#endif
+/* Consecutive damaged frames before giving up, as in the LiteX BIOS. */
+#ifndef SFL_MAX_FAILURES
+	#define SFL_MAX_FAILURES 256
+#endif
+/* Consecutive unacknowledged rounds before sfl_tx() gives up. */
+#ifndef SFL_TX_RETRIES
+	#define SFL_TX_RETRIES 10
+#endif
+
+/* Data bytes in a full LOAD frame. */
+#define SFL_LOAD_SIZE (SFL_FRAME_SIZE - SFL_PAYLOAD - SFL_ADDR_LEN)
+
+/* Frames sfl_tx() keeps in flight: one being acknowledged, and the next
+already sent behind it. Each has its own slot of the caller's buffer. */
+#define SFL_TX_WINDOW (SFL_TX_BUF_SIZE / SFL_FRAME_SIZE)
+
+/* Shortest run of the erased value worth skipping. Splitting a frame around
+a run costs another header and address, so shorter runs are sent. */
+#define SFL_MIN_SKIP 32
+
+/* Where sfl_tx() is in the regions given by the caller. */
+typedef struct sfl_cursor
+{
+	unsigned long addr;
+	const unsigned char * data;
+	size_t left;
+	int done; /* The region callback has returned 0. */
+}sfl_cursor_t;
+
+static modem_errors_t wait_for_magic(serial_handle_t serial_device, const char * magic, \
+	long timeout_ms);
+static int fill_load_frame(unsigned char * frame, sfl_cursor_t * cur, \
+	sfl_next_region_t next_region_fcn, void * chan_state, int erased_value);
+static size_t find_run(const unsigned char * data, size_t size, unsigned char value);
+static void start_frame(unsigned char * frame, unsigned char cmd, unsigned long addr, \
+	crc_state_t * crc);
+static void finish_frame(unsigned char * frame, size_t len, const crc_state_t * crc);
+static void send_abort(serial_handle_t serial_device);
+static void send_ack(serial_handle_t serial_device, char ack);
+static unsigned long get_addr(const unsigned char * data);
+static modem_errors_t serial_to_modem_error(serial_status_t status);
+
+
+modem_errors_t sfl_rx(input_addr_channel_t data_in_fcn, sfl_boot_cmd_t boot_fcn, \
+	unsigned char * buf, void * chan_state, serial_handle_t serial_device)
+{
+	char request[SFL_MAGIC_LEN] = SFL_MAGIC_REQ;
+	serial_status_t ser_status;
+	modem_errors_t modem_status = MODEM_TIMEOUT;
+	unsigned int tries, failures = 0;
+	unsigned short crc;
+	unsigned long addr;
+	int len;
+
+	for(tries = 0; tries < SFL_MAGIC_RETRIES; tries++)
+	{
+		serial_snd(request, SFL_MAGIC_LEN, serial_device);
+		if((modem_status = wait_for_magic(serial_device, SFL_MAGIC_ACK, \
+			SFL_MAGIC_TIMEOUT_MS)) != MODEM_TIMEOUT)
+		{
+			break;
+		}
+	}
+
+	if(modem_status != MODEM_NO_ERRORS)
+	{
+		return modem_status;
+	}
+
+	while(1)
+	{
+		if(failures >= SFL_MAX_FAILURES)
+		{
+			return MODEM_TIMEOUT;
+		}
+
+		/* The length byte says how much more to read, so a whole frame
+		takes two reads. */
+		if((ser_status = serial_rcv_ms((char *) buf, 1, SFL_TIMEOUT_MS, NULL, \
+			serial_device)) != SERIAL_NO_ERRORS)
+		{
+			return serial_to_modem_error(ser_status);
+		}
+
+		len = buf[SFL_LEN];
+		ser_status = serial_rcv_ms((char *) buf + SFL_CRC, SFL_PAYLOAD - SFL_CRC + len, \
+			SFL_FRAME_TIMEOUT_MS, NULL, serial_device);
+		if(ser_status == SERIAL_HW_ERROR)
+		{
+			return MODEM_HW_ERROR;
+		}
+
+		crc = (unsigned short) ((buf[SFL_CRC] << 8) | buf[SFL_CRC + 1]);
+		if(ser_status == SERIAL_TIMEOUT || crc != generate_crc(buf + SFL_CMD, len + 1))
+		{
+			/* As the LiteX BIOS does, answer every frame in turn, so a
+			frame the host pipelined behind this one is still answered.
+			Hosts match replies to frames by their order. */
+			send_ack(serial_device, SFL_ACK_CRCERROR);
+			failures++;
+			continue;
+		}
+
+		failures = 0;
+		switch(buf[SFL_CMD])
+		{
+			case SFL_CMD_LOAD:
+				if(len < SFL_ADDR_LEN)
+				{
+					send_ack(serial_device, SFL_ACK_ERROR);
+					break;
+				}
+
+				addr = get_addr(buf + SFL_PAYLOAD);
+				if(data_in_fcn(addr, (char *) buf + SFL_PAYLOAD + SFL_ADDR_LEN, \
+					len - SFL_ADDR_LEN, 0, chan_state) != len - SFL_ADDR_LEN)
+				{
+					send_ack(serial_device, SFL_ACK_ERROR);
+					return CHANNEL_ERROR;
+				}
+				send_ack(serial_device, SFL_ACK_SUCCESS);
+				break;
+
+			case SFL_CMD_JUMP:
+				if(len < SFL_ADDR_LEN)
+				{
+					send_ack(serial_device, SFL_ACK_ERROR);
+					break;
+				}
+
+				addr = get_addr(buf + SFL_PAYLOAD);
+				if(data_in_fcn(addr, (char *) buf, 0, 1, chan_state) != 0)
+				{
+					send_ack(serial_device, SFL_ACK_ERROR);
+					return CHANNEL_ERROR;
+				}
+
+				/* The host needs its acknowledgement before the target
+				stops listening. */
+				send_ack(serial_device, SFL_ACK_SUCCESS);
+				return boot_fcn(addr, chan_state) ? CHANNEL_ERROR : MODEM_NO_ERRORS;
+
+			case SFL_CMD_ABORT:
+				send_ack(serial_device, SFL_ACK_SUCCESS);
+				return SENT_CAN;
+
+			default:
+				send_ack(serial_device, SFL_ACK_UNKNOWN);
+				break;
+		}
+	}
+}
+
+modem_errors_t sfl_tx(sfl_next_region_t next_region_fcn, unsigned long entry, int erased_value, \
+	unsigned char * buf, void * chan_state, serial_handle_t serial_device)
+{
+	char answer[SFL_MAGIC_LEN] = SFL_MAGIC_ACK;
+	serial_status_t ser_status;
+	modem_errors_t modem_status;
+	sfl_cursor_t cur;
+	crc_state_t crc;
+	/* Slots of frames waiting for a reply, oldest first. Replies carry no
+	frame number, so each one answers the oldest frame. */
+	unsigned int pending[SFL_TX_WINDOW], num_pending = 0, slot, i;
+	unsigned int errors = 0;
+	int more = 1, len;
+	char ack;
+
+	cur.left = 0;
+	cur.done = 0;
+
+	if((modem_status = wait_for_magic(serial_device, SFL_MAGIC_REQ, \
+		SFL_TIMEOUT_MS)) != MODEM_NO_ERRORS)
+	{
+		return modem_status;
+	}
+	serial_snd(answer, SFL_MAGIC_LEN, serial_device);
+
+	while(1)
+	{
+		/* Keep the window full, so the target never waits on the host: the
+		next frame is encoded and sent while the current one is being
+		acknowledged. */
+		while(more && num_pending < SFL_TX_WINDOW)
+		{
+			unsigned char * frame;
+
+			/* Take the slot no pending frame is using. */
+			for(slot = 0; slot < SFL_TX_WINDOW; slot++)
+			{
+				for(i = 0; i < num_pending && pending[i] != slot; i++);
+				if(i == num_pending)
+				{
+					break;
+				}
+			}
+			frame = buf + slot * SFL_FRAME_SIZE;
+
+			if((len = fill_load_frame(frame, &cur, next_region_fcn, chan_state, \
+				erased_value)) < 0)
+			{
+				send_abort(serial_device);
+				return CHANNEL_ERROR;
+			}
+			else if(len == 0)
+			{
+				/* The target starts the program as soon as it sees JUMP,
+				so it goes only once every LOAD is acknowledged. */
+				if(num_pending > 0)
+				{
+					break;
+				}
+				start_frame(frame, SFL_CMD_JUMP, entry, &crc);
+				finish_frame(frame, 0, &crc);
+				more = 0;
+			}
+
+			serial_snd((char *) frame, SFL_PAYLOAD + frame[SFL_LEN], serial_device);
+			pending[num_pending++] = slot;
+		}
+
+		if(num_pending == 0)
+		{
+			return MODEM_NO_ERRORS;
+		}
+
+		ser_status = serial_rcv_ms(&ack, 1, SFL_ACK_TIMEOUT_MS, NULL, serial_device);
+		if(ser_status == SERIAL_HW_ERROR)
+		{
+			return MODEM_HW_ERROR;
+		}
+		else if(ser_status == SERIAL_NO_ERRORS)
+		{
+			if(ack == SFL_ACK_ERROR || ack == SFL_ACK_UNKNOWN)
+			{
+				/* The target can't store the frame; resending won't help. */
+				send_abort(serial_device);
+				return SENT_CAN;
+			}
+			else if(ack != SFL_ACK_SUCCESS && ack != SFL_ACK_CRCERROR)
+			{
+				/* Stray output from the target, which answers nothing. */
+				continue;
+			}
+
+			/* The reply answers the oldest pending frame. */
+			slot = pending[0];
+			for(i = 1; i < num_pending; i++)
+			{
+				pending[i - 1] = pending[i];
+			}
+			num_pending--;
+
+			if(ack == SFL_ACK_SUCCESS)
+			{
+				errors = 0;
+				continue;
+			}
+		}
+
+		if(++errors > SFL_TX_RETRIES)
+		{
+			send_abort(serial_device);
+			return MODEM_TIMEOUT;
+		}
+
+		if(ser_status == SERIAL_NO_ERRORS)
+		{
+			/* A damaged frame. Frames behind it are answered on their own,
+			so only this one is sent again, behind them. */
+			unsigned char * frame = buf + slot * SFL_FRAME_SIZE;
+
+			serial_snd((char *) frame, SFL_PAYLOAD + frame[SFL_LEN], serial_device);
+			pending[num_pending++] = slot;
+		}
+		else
+		{
+			/* Silence: a frame or its reply went missing. Send every pending
+			frame again, in order; loading the same data twice is harmless. */
+			for(i = 0; i < num_pending; i++)
+			{
+				unsigned char * frame = buf + pending[i] * SFL_FRAME_SIZE;
+
+				serial_snd((char *) frame, SFL_PAYLOAD + frame[SFL_LEN], serial_device);
+			}
+		}
+	}
+}
+
+
+/* Private functions begin here. */
+/* Look for magic in whatever arrives within timeout_ms, skipping anything
+else, such as console output. */
+static modem_errors_t wait_for_magic(serial_handle_t serial_device, const char * magic, \
+	long timeout_ms)
+{
+	serial_status_t ser_status;
+	long remaining = timeout_ms, spent;
+	int matched = 0;
+	char c;
+
+	while(remaining > 0)
+	{
+		ser_status = serial_rcv_ms(&c, 1, remaining, &spent, serial_device);
+		if(ser_status != SERIAL_NO_ERRORS)
+		{
+			return serial_to_modem_error(ser_status);
+		}
+		remaining -= spent;
+
+		if(c == magic[matched])
+		{
+			if(++matched == SFL_MAGIC_LEN)
+			{
+				return MODEM_NO_ERRORS;
+			}
+		}
+		else
+		{
+			/* No proper prefix of either magic string is also a
+			suffix of it, so a mismatch can only restart the match. */
+			matched = (c == magic[0]) ? 1 : 0;
+		}
+	}
+
+	return MODEM_TIMEOUT;
+}
+
+/* Fill frame with the next LOAD: as many contiguous bytes as fit, taken
+across regions if they adjoin, and stopping short of any long run of
+erased_value. Returns the number of data bytes, 0 once the regions are
+exhausted, or -1 if the region callback failed. */
+static int fill_load_frame(unsigned char * frame, sfl_cursor_t * cur, \
+	sfl_next_region_t next_region_fcn, void * chan_state, int erased_value)
+{
+	unsigned char * dest = frame + SFL_PAYLOAD + SFL_ADDR_LEN;
+	unsigned long addr = 0;
+	crc_state_t crc;
+	size_t len = 0;
+	int rc;
+
+	while(len < SFL_LOAD_SIZE)
+	{
+		size_t take, run_at;
+
+		if(cur->left == 0)
+		{
+			if(cur->done)
+			{
+				break;
+			}
+
+			if((rc = next_region_fcn(&cur->addr, &cur->data, &cur->left, chan_state)) < 0)
+			{
+				return -1;
+			}
+			else if(rc == 0)
+			{
+				cur->done = 1;
+				cur->left = 0;
+			}
+			continue;
+		}
+
+		if(len == 0)
+		{
+			addr = cur->addr;
+			start_frame(frame, SFL_CMD_LOAD, addr, &crc);
+		}
+		else if(cur->addr != addr + len)
+		{
+			break;
+		}
+
+		take = (cur->left < SFL_LOAD_SIZE - len) ? cur->left : SFL_LOAD_SIZE - len;
+		if(erased_value != SFL_NOT_ERASED)
+		{
+			/* Look far enough past the end of the frame to see a run which
+			starts inside it. */
+			size_t scan = take + SFL_MIN_SKIP - 1;
+
+			run_at = find_run(cur->data, (cur->left < scan) ? cur->left : scan, \
+				(unsigned char) erased_value);
+			if(run_at == 0)
+			{
+				/* The target already holds the run; step over all of it. The
+				frame, if started, ends here. */
+				while(run_at < cur->left && cur->data[run_at] == (unsigned char) erased_value)
+				{
+					run_at++;
+				}
+				cur->addr += run_at;
+				cur->data += run_at;
+				cur->left -= run_at;
+				continue;
+			}
+			else if(run_at < take)
+			{
+				take = run_at;
+			}
+		}
+
+		crc_copy(&crc, dest + len, cur->data, take);
+		len += take;
+		cur->addr += take;
+		cur->data += take;
+		cur->left -= take;
+	}
+
+	if(len == 0)
+	{
+		return 0;
+	}
+
+	finish_frame(frame, len, &crc);
+	return (int) len;
+}
+
+/* Offset of the first run of at least SFL_MIN_SKIP bytes of value in data,
+or size if there is none. */
+static size_t find_run(const unsigned char * data, size_t size, unsigned char value)
+{
+	size_t i, run = 0;
+
+	for(i = 0; i < size; i++)
+	{
+		if(data[i] != value)
+		{
+			run = 0;
+		}
+		else if(++run == SFL_MIN_SKIP)
+		{
+			return i + 1 - SFL_MIN_SKIP;
+		}
+	}
+
+	return size;
+}
+
+/* Put cmd and addr in place at the start of a LOAD or JUMP frame, and start
+its CRC with them. */
+static void start_frame(unsigned char * frame, unsigned char cmd, unsigned long addr, \
+	crc_state_t * crc)
+{
+	frame[SFL_CMD] = cmd;
+	frame[SFL_PAYLOAD] = (unsigned char) (addr >> 24);
+	frame[SFL_PAYLOAD + 1] = (unsigned char) (addr >> 16);
+	frame[SFL_PAYLOAD + 2] = (unsigned char) (addr >> 8);
+	frame[SFL_PAYLOAD + 3] = (unsigned char) addr;
+	crc_init(crc, XMODEM_CRC);
+	crc_update(crc, frame + SFL_CMD, 1 + SFL_ADDR_LEN);
+}
+
+/* Fill in the length and CRC of a frame begun by start_frame(), once its
+len data bytes have been added to the CRC. */
+static void finish_frame(unsigned char * frame, size_t len, const crc_state_t * crc)
+{
+	unsigned short value = crc_final(crc);
+
+	frame[SFL_LEN] = (unsigned char) (SFL_ADDR_LEN + len);
+	frame[SFL_CRC] = (unsigned char) (value >> 8);
+	frame[SFL_CRC + 1] = (unsigned char) value;
+}
+
+static void send_abort(serial_handle_t serial_device)
+{
+	unsigned char frame[SFL_PAYLOAD];
+	unsigned short value;
+
+	frame[SFL_LEN] = 0;
+	frame[SFL_CMD] = SFL_CMD_ABORT;
+	value = generate_crc(frame + SFL_CMD, 1);
+	frame[SFL_CRC] = (unsigned char) (value >> 8);
+	frame[SFL_CRC + 1] = (unsigned char) value;
+	serial_snd((char *) frame, SFL_PAYLOAD, serial_device);
+}
+
+static void send_ack(serial_handle_t serial_device, char ack)
+{
+	serial_snd(&ack, 1, serial_device);
+}
+
+static unsigned long get_addr(const unsigned char * data)
+{
+	return ((unsigned long) data[0] << 24) | ((unsigned long) data[1] << 16) \
+		| ((unsigned long) data[2] << 8) | (unsigned long) data[3];
+}
+
+static modem_errors_t serial_to_modem_error(serial_status_t status)
+{
+	modem_errors_t equiv_status;
+	switch(status)
+	{
+		case SERIAL_NO_ERRORS:
+			equiv_status = MODEM_NO_ERRORS;
+			break;
+		case SERIAL_TIMEOUT:
+			equiv_status = MODEM_TIMEOUT;
+			break;
+		case SERIAL_HW_ERROR:
+			equiv_status = MODEM_HW_ERROR;
+			break;
+		default:
+			equiv_status = UNDEFINED_ERROR;
+			break;
+	}
+
+	return equiv_status;
+}
@@ -7,33 +7,74 @@ without whose permission this was made possible :)...
 Seriously, thanks! */
 #include <windows.h>
 #include <stdio.h> /* For sprintf. Since we're on windows, we should use it. */
+#include <stdlib.h>
+#include <string.h> /* For memcpy. */
 #include <stddef.h> /* For NULL. */
 
+/* Size of each handle's receive buffer. Whenever it is empty, it is refilled
+with a single ReadFile() of up to this many bytes, so reads of a few bytes at
+a time (start characters, ACKs, block numbers) are served from memory. */
+#ifndef WIN_RX_BUF_SIZE
+	#define WIN_RX_BUF_SIZE 2048
+#endif
+
+/* State behind a windows serial_handle_t. */
+typedef struct win_port
+{
+	HANDLE handle;
+	DWORD rx_wait; /* Read timeout last set on handle, or 0 if none yet. */
+	DWORD rx_start; /* rx_buf[rx_start..rx_end) is not yet received. */
+	DWORD rx_end;
+	unsigned char rx_buf[WIN_RX_BUF_SIZE];
+}win_port_t;
+
+#define VOID_TO_WIN(x) ((win_port_t *) (x))
+
+static int take_rx(win_port_t * port, char * data, DWORD max_bytes, DWORD wait_ms, \
+	int peek);
+static int read_some(win_port_t * port, char * data, DWORD size, DWORD wait_ms);
+static DWORD clamp_wait(long timeout_ms);
+
 
 serial_handle_t open_handle(unsigned short port_no)
 {
 	char com_string[14] = "\\\\.\\COM\0\0\0\0\0\0";
 	HANDLE port_addr;
+	win_port_t * port;
 
 	sprintf(&com_string[7], "%d", port_no);
 	port_addr = CreateFile(com_string, GENERIC_READ | GENERIC_WRITE, 0, NULL, \
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-	return port_addr;
+	if(port_addr == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	if((port = malloc(sizeof(win_port_t))) == NULL)
+	{
+		CloseHandle(port_addr);
+		return NULL;
+	}
+
+	port->handle = port_addr;
+	port->rx_wait = 0;
+	port->rx_start = port->rx_end = 0;
+	return port;
 }
 
 int handle_valid(serial_handle_t port)
 {
-	return (port != INVALID_HANDLE_VALUE);
+	return (port != NULL) && (VOID_TO_WIN(port)->handle != INVALID_HANDLE_VALUE);
 }
 
 int init_port(serial_handle_t port, unsigned long baud_rate)
 {
+	HANDLE handle = VOID_TO_WIN(port)->handle;
 	DCB dcbSerialParams;
 	COMMTIMEOUTS timeouts;
 
-	if(!GetCommState(port, &dcbSerialParams))
+	if(!GetCommState(handle, &dcbSerialParams))
 	{
-		serial_close(port); /* Sets port to null. Necessary? */
 		return -1;
 	}
 
@@ -56,24 +97,25 @@ int init_port(serial_handle_t port, unsigned long baud_rate)
 	dcbSerialParams.fAbortOnError = TRUE;
 
 	/* Note to self: Forgot the indirection operator here- W. Jones... */
-	if(!SetCommState(port, &dcbSerialParams))
+	if(!SetCommState(handle, &dcbSerialParams))
 	{
 		return -2;
 	}
 
 	/* Add if-else here? */
-	GetCommTimeouts(port, &timeouts);
+	GetCommTimeouts(handle, &timeouts);
 	timeouts.ReadIntervalTimeout = MAXDWORD;
 	timeouts.ReadTotalTimeoutMultiplier = 0;
 	timeouts.ReadTotalTimeoutConstant = 0;
 	timeouts.WriteTotalTimeoutMultiplier = 0;
 	timeouts.WriteTotalTimeoutConstant = 0;
 
-	if(!SetCommTimeouts(port, &timeouts))
+	if(!SetCommTimeouts(handle, &timeouts))
 	{
 		return -3;
 	}
 
+	VOID_TO_WIN(port)->rx_wait = 0;
 	return 0;
 }
 
@@ -82,87 +124,183 @@ int write_data(serial_handle_t port, char * data, unsigned int num_bytes)
 	DWORD dwBytesWritten = 0;
 
 	/* No INT_MAX check necessary- num_bytes will fit into DWORD always. */
-	return WriteFile(port, data, (DWORD) num_bytes, &dwBytesWritten, NULL) ? 0 : -1;
+	return WriteFile(VOID_TO_WIN(port)->handle, data, (DWORD) num_bytes, \
+		&dwBytesWritten, NULL) ? 0 : -1;
 }
 
-int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int timeout)
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms)
 {
-	DWORD timeout_ticks;
-	DWORD dwBytesRead = 0;
-	COMMTIMEOUTS prev_timeouts;
-	COMMTIMEOUTS curr_timeouts;
-
-	/* printf("Time left in timeout: %d\n", timeout); */
+	win_port_t * wport = VOID_TO_WIN(port);
+	DWORD wait_ms, start, spent;
+	int got;
 
 	/* Guard against negative values being converted to ridiculous timeouts.
 	A timeout < 0 will be set to 0. */
-	/* All values of num_bytes and 1000*timeout can be represented in a DWORD
-	which windows expects, so no INT_MAX check is necessary. */
-	if(timeout < 0)
+	if(timeout_ms < 0)
 	{
-		timeout = 0;
+		timeout_ms = 0;
 	}
 
-	/* Protect against signed overflow by casting timeout to DWORD. */
-	timeout_ticks = 1000uL * timeout;
-
-	/* Timeout measured in milliseconds */
-	if(!GetCommTimeouts(port, &prev_timeouts))
+	/* The timeout covers the whole read, however many ReadFile() calls it
+	takes. Unsigned subtraction handles the 49.7 day wraparound. */
+	wait_ms = clamp_wait(timeout_ms);
+	start = GetTickCount();
+	while(num_bytes > 0)
 	{
-		/* windows_error("serial_rcv_1()"); */
-		return -2;
+		spent = GetTickCount() - start;
+		if((got = take_rx(wport, data, (DWORD) num_bytes, \
+			(spent < wait_ms) ? wait_ms - spent : 1, 0)) < 0)
+		{
+			return got;
+		}
+
+		data += got;
+		num_bytes -= (unsigned int) got;
 	}
 
-	curr_timeouts = prev_timeouts;
-	curr_timeouts.ReadIntervalTimeout = timeout_ticks;
-	curr_timeouts.ReadTotalTimeoutMultiplier = 0;
-	curr_timeouts.ReadTotalTimeoutConstant = timeout_ticks;
-	curr_timeouts.WriteTotalTimeoutMultiplier = 10;
-	curr_timeouts.WriteTotalTimeoutConstant = 50;
+	return 0;
+}
 
-	if(!SetCommTimeouts(port, &curr_timeouts))
+int read_data_some(serial_handle_t port, char * data, unsigned int max_bytes, long timeout_ms, int peek)
+{
+	if(timeout_ms < 0)
 	{
-		return -2;
+		timeout_ms = 0;
 	}
 
-	if(ReadFile((HANDLE) port, data, (DWORD) num_bytes, &dwBytesRead, NULL))
-	{
-		/* If no error occurred, check to see that all bytes requested
-		 * were received... if not, this is considered a timeout. */
-		SetCommTimeouts(port, &prev_timeouts);
-		return (dwBytesRead == (DWORD) num_bytes) ? 0 : -1;
-	}
-	/* Otherwise a more serious error occurred. */
-	else
-	{
-		SetCommTimeouts(port, &prev_timeouts);
-		return -2;
-	}
+	return take_rx(VOID_TO_WIN(port), data, (DWORD) max_bytes, clamp_wait(timeout_ms), peek);
 }
 
 /* Timeout only needs to be valid if read_data didn't time out. So wrapping
 around read_data() and getting elapsed time, even if it doesn't match
 timeout input arg exactly on timeout, should be fine. */
-int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, int timeout, int * elapsed)
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
 {
 	int rc;
-	ULONGLONG start, end;
+	DWORD start, end;
 
+	/* Unsigned subtraction handles the 49.7 day wraparound. */
 	start = GetTickCount();
-	rc = read_data(port, data, num_bytes, timeout);
+	rc = read_data(port, data, num_bytes, timeout_ms);
 	end = GetTickCount();
 
-	*elapsed = (int) (end - start);
+	*elapsed_ms = (long) (end - start);
 	return rc;
 }
 
 
 int close_handle(serial_handle_t port)
 {
-	return CloseHandle(port) ? 0 : -1;
+	win_port_t * wport = VOID_TO_WIN(port);
+	int rc;
+
+	rc = CloseHandle(wport->handle) ? 0 : -1;
+	wport->handle = INVALID_HANDLE_VALUE;
+	free(wport);
+	return rc;
 }
 
 int flush_device(serial_handle_t port)
 {
-	return FlushFileBuffers(port) ? 0 : -1;
+	win_port_t * wport = VOID_TO_WIN(port);
+
+	wport->rx_start = wport->rx_end = 0;
+	return FlushFileBuffers(wport->handle) ? 0 : -1;
+}
+
+
+/* Private functions begin here. */
+/* Receive up to max_bytes from the receive buffer, first refilling it with
+one ReadFile() if it is empty. A request too big for the buffer is read
+straight into data instead. Returns the number of bytes received, -1 if none
+arrived within wait_ms, or -2 on errors. */
+static int take_rx(win_port_t * port, char * data, DWORD max_bytes, DWORD wait_ms, \
+	int peek)
+{
+	DWORD avail = port->rx_end - port->rx_start;
+
+	if(avail == 0)
+	{
+		int got;
+
+		if(!peek && max_bytes >= WIN_RX_BUF_SIZE)
+		{
+			return read_some(port, data, max_bytes, wait_ms);
+		}
+
+		if((got = read_some(port, (char *) port->rx_buf, WIN_RX_BUF_SIZE, wait_ms)) < 0)
+		{
+			return got;
+		}
+
+		port->rx_start = 0;
+		port->rx_end = avail = (DWORD) got;
+	}
+
+	if(avail > max_bytes)
+	{
+		avail = max_bytes;
+	}
+
+	memcpy(data, &port->rx_buf[port->rx_start], avail);
+	if(!peek)
+	{
+		port->rx_start += avail;
+	}
+
+	return (int) avail;
+}
+
+/* A single ReadFile() of up to size bytes, which returns as soon as any are
+available, waiting up to wait_ms for the first. Returns as take_rx(). */
+static int read_some(win_port_t * port, char * data, DWORD size, DWORD wait_ms)
+{
+	DWORD dwBytesRead = 0;
+
+	/* Changing the timeouts costs two more calls into the driver, so they
+	are only set when the wait differs from the last read's. */
+	if(port->rx_wait != wait_ms)
+	{
+		COMMTIMEOUTS timeouts;
+
+		/* MAXDWORD in both the interval and the multiplier means: return at
+		once with whatever is buffered, otherwise with the first byte to
+		arrive, or time out after the constant. */
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+		timeouts.ReadTotalTimeoutConstant = wait_ms;
+		timeouts.WriteTotalTimeoutMultiplier = 0;
+		timeouts.WriteTotalTimeoutConstant = 0;
+
+		if(!SetCommTimeouts(port->handle, &timeouts))
+		{
+			port->rx_wait = 0;
+			return -2;
+		}
+		port->rx_wait = wait_ms;
+	}
+
+	/* No INT_MAX check necessary- size is at most a read_data() request. */
+	if(!ReadFile(port->handle, data, size, &dwBytesRead, NULL))
+	{
+		return -2;
+	}
+
+	return (dwBytesRead > 0) ? (int) dwBytesRead : -1;
+}
+
+/* A timeout of 0 has a special meaning to ReadFile(), and so does MAXDWORD
+in the constant alongside the MAXDWORD multiplier. */
+static DWORD clamp_wait(long timeout_ms)
+{
+	if(timeout_ms <= 0)
+	{
+		return 1;
+	}
+	else if((unsigned long) timeout_ms >= MAXDWORD)
+	{
+		return MAXDWORD - 1;
+	}
+
+	return (DWORD) timeout_ms;
 }
@@ -3,13 +3,134 @@
 
 #include <stddef.h> /* For size_t, NULL */
 
+/* Number of payload bytes xmodem_rx() reads at a time. The CRC of each chunk
+is computed while the next one is still on the wire. */
+#define RX_CHUNK_SIZE 64
+
+/* Options for tx_packets(). */
+#define TX_HEADER 1 /* Send a single YMODEM block 0, without EOT. */
+#define TX_CONTINUE 2 /* Don't flush before the handshake; the receiver may
+already have answered. */
+#define TX_PREFETCH 4 /* tx_buffer holds two packets; hand over to
+tx_prefetch() unless streaming. */
+
+/* Options for rx_packets(). */
+#define RX_OFFER_WINDOW 1 /* Start with 'W'. */
+#define RX_HEADER 2 /* Receive a single YMODEM block 0. */
+#define RX_CRC_ONLY 4 /* Never fall back to checksums. */
+
+/* States of an xmodem_session_t. */
+#define SESSION_TX_START 0 /* Waiting for the receiver to start. */
+#define SESSION_TX_PACKET 1 /* Sending a packet, then waiting for the response. */
+#define SESSION_TX_EOT 2 /* Sending EOT, then waiting for the ACK. */
+#define SESSION_RX_START 3 /* Waiting for a packet or EOT. */
+#define SESSION_RX_BODY 4 /* Receiving the rest of a packet. */
+#define SESSION_RX_PURGE 5 /* Waiting for the line to go idle after a
+timeout within a packet. */
+#define SESSION_DONE 6
+
+/* State of trim_in(), which passes a YMODEM file's data on to the caller's
+channel without the padding. */
+typedef struct trim_chan
+{
+	input_channel_t data_in_fcn;
+	void * chan_state;
+	unsigned long left; /* Bytes of the file not yet received. */
+	int has_size; /* Only trim if the size is known. */
+	modem_stats_t * stats; /* Counts the padding trimmed, if not NULL. */
+}trim_chan_t;
+
+/* Protocol timeouts in milliseconds. The defaults follow the XMODEM/YMODEM
+reference; ports on fast or reliable links can shorten them by defining these
+at build time. */
+#ifndef XMODEM_START_TIMEOUT_MS
+	#define XMODEM_START_TIMEOUT_MS 60000L /* Sender waiting for NAK/'C'. */
+#endif
+#ifndef XMODEM_RESPONSE_TIMEOUT_MS
+	#define XMODEM_RESPONSE_TIMEOUT_MS 60000L /* Sender waiting for ACK/NAK. */
+#endif
+#ifndef XMODEM_HANDSHAKE_TIMEOUT_MS
+	#define XMODEM_HANDSHAKE_TIMEOUT_MS 3000L /* Receiver resending NAK/'C'
+	until the first packet starts. */
+#endif
+#ifndef XMODEM_PACKET_TIMEOUT_MS
+	#define XMODEM_PACKET_TIMEOUT_MS 10000L /* Receiver waiting for the next
+	packet. */
+#endif
+#ifndef XMODEM_CHAR_TIMEOUT_MS
+	#define XMODEM_CHAR_TIMEOUT_MS 1000L /* Receiver waiting within a packet. */
+#endif
+#ifndef XMODEM_PURGE_IDLE_MS
+	/* Line idle time that ends a purge. serial_drain() shortens it to
+	suit the baud rate where it can. */
+	#define XMODEM_PURGE_IDLE_MS 250L
+#endif
+
+static modem_errors_t tx_packets(output_channel_t data_out_fcn, borrow_channel_t borrow_fcn, \
+	checked_channel_t checked_fcn, unsigned char * tx_buffer, unsigned int window, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, int options, \
+	modem_stats_t * stats);
+static modem_errors_t tx_window(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	unsigned int window, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, modem_stats_t * stats);
+static modem_errors_t tx_prefetch(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	modem_stats_t * stats);
+static int fill_packet(output_channel_t data_out_fcn, unsigned char * packet, \
+	unsigned char block_no, int last_sent_size, void * chan_state, xmodem_xfer_mode_t * flags, \
+	modem_stats_t * stats);
+static modem_errors_t rx_packets(input_channel_t data_in_fcn, input_window_t window_fcn, \
+	unsigned char * rx_buffer, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, int options, modem_stats_t * stats);
+static int header_out(char * buf, const int request_size, const int last_sent_size, \
+	void * const chan_state);
+static int header_in(const char * buf, const int buf_size, const int eof, \
+	void * const chan_state);
+static int trim_in(const char * buf, const int buf_size, const int eof, \
+	void * const chan_state);
+static size_t encode_header(char * buf, const ymodem_file_info_t * info);
+static size_t put_number(char * buf, unsigned long value, unsigned int base);
+static unsigned long get_number(const char ** text, const char * end, unsigned int base, \
+	int * found);
+static void put_check(unsigned char * trailer, const unsigned char * payload, \
+	size_t block_size, xmodem_xfer_mode_t flags);
+static void put_final(unsigned char * trailer, const crc_state_t * check);
+static modem_errors_t send_eot(serial_handle_t serial_device, int windowed, \
+	modem_stats_t * stats);
+static void send_response(serial_handle_t serial_device, char code, unsigned char block_no, \
+	int windowed);
 static void pad_buffer(unsigned char * buf, size_t bufsiz, unsigned char val);
+static void copy_buffer(unsigned char * dest, const unsigned char * src, size_t size);
 /* const doesn't work due to some weird rules in C... */
 /* static void set_packet_offsets(unsigned char ** packet_offsets, unsigned char * packet, unsigned short mode); */
-static void purge(serial_handle_t serial_device);
-static modem_errors_t wait_for_rx_ready(serial_handle_t serial_device, xmodem_xfer_mode_t flags);
-static modem_errors_t wait_for_tx_response(serial_handle_t serial_device, xmodem_xfer_mode_t flags);
+static serial_status_t recv_packet_body(serial_handle_t serial_device, unsigned char * rx_buffer, \
+	unsigned char * payload, size_t data_size, unsigned char * trailer, size_t trailer_size, \
+	crc_state_t * check);
+static modem_errors_t wait_for_rx_ready(serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	int accept_window, char * start_code, modem_stats_t * stats);
 static modem_errors_t serial_to_modem_error(serial_status_t status);
+static modem_errors_t rcv_error(serial_status_t status, modem_stats_t * stats);
+static void stats_init(modem_stats_t * stats);
+static void stats_sent(modem_stats_t * stats, size_t packet_size, int resend);
+static void stats_ack(modem_stats_t * stats, long rtt_ms);
+static modem_errors_t tx_image(const xmodem_image_t * image, serial_handle_t serial_device, \
+	int streaming, modem_stats_t * stats);
+static void count_packets(size_t data_size, xmodem_xfer_mode_t flags, size_t * num_1k, \
+	size_t * num_128);
+static const unsigned char * get_image_packet(const xmodem_image_t * image, size_t packet_no, \
+	size_t * packet_size);
+static void session_init(xmodem_session_t * session, unsigned char * buf, void * chan_state, \
+	xmodem_xfer_mode_t flags);
+static void session_byte(xmodem_session_t * session, unsigned char rx_code, long now_ms);
+static void session_load(xmodem_session_t * session, long now_ms);
+static void session_next(xmodem_session_t * session, long now_ms);
+static void session_eot(xmodem_session_t * session, long now_ms);
+static void session_listen(xmodem_session_t * session, long now_ms);
+static void session_check(xmodem_session_t * session, long now_ms);
+static void session_send(xmodem_session_t * session, const unsigned char * data, size_t size);
+static void session_code(xmodem_session_t * session, char code);
+static void session_wait(xmodem_session_t * session, long wait_ms, long now_ms);
+static void session_end(xmodem_session_t * session, modem_errors_t status, int cancel);
 static offset_names_t get_checksum_offset(unsigned short flags);
 
 
@@ -21,166 +142,442 @@ unsigned constant literal cast (particularly hex values >= 0x80), and
 unsigned overflow semantics (checksum and CRC). Therefore, this function
 expects an unsigned char * buffer as input. */
 modem_errors_t xmodem_tx(output_channel_t data_out_fcn, unsigned char * tx_buffer, void * chan_state, \
-	serial_handle_t serial_device, xmodem_xfer_mode_t flags)
+	serial_handle_t serial_device, xmodem_xfer_mode_t flags, modem_stats_t * stats)
 {
-	char rx_code = NUL;
-	modem_errors_t modem_status = 0;
-	serial_status_t ser_status = 0;
-	offset_names_t chksum_offset;
-	/* Logic variables. */
-	int eof_detected = 0;
-	size_t block_size, packet_size; /* Check to see if EOF was reached using bytes_read */
-	int last_sent_size = 0;
+	stats_init(stats);
+	return tx_packets(data_out_fcn, NULL, NULL, tx_buffer, 0, chan_state, serial_device, flags, 0, \
+		stats);
+}
 
-	/* Flush the device buffer in case some characters were remaining
-	to prevent glitches. */
-	serial_flush(serial_device);
-	if((modem_status = wait_for_rx_ready(serial_device, flags)) != \
-		MODEM_NO_ERRORS)
+modem_errors_t xmodem_tx_borrow(borrow_channel_t borrow_fcn, unsigned char * tx_buffer, void * chan_state, \
+	serial_handle_t serial_device, xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	stats_init(stats);
+	return tx_packets(NULL, borrow_fcn, NULL, tx_buffer, 0, chan_state, serial_device, flags, 0, \
+		stats);
+}
+
+modem_errors_t xmodem_tx_checked(checked_channel_t checked_fcn, unsigned char * tx_buffer, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	modem_stats_t * stats)
+{
+	stats_init(stats);
+	return tx_packets(NULL, NULL, checked_fcn, tx_buffer, 0, chan_state, serial_device, flags, 0, \
+		stats);
+}
+
+modem_errors_t xmodem_tx_windowed(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	unsigned int window, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	if(window == 0)
 	{
-		return modem_status;
+		window = 1;
+	}
+	else if(window > XMODEM_MAX_WINDOW)
+	{
+		window = XMODEM_MAX_WINDOW;
 	}
 
-	tx_buffer[START_CHAR] = (flags == XMODEM_1K) ? STX : SOH;
-	tx_buffer[BLOCK_NO] = 0x01;
-	tx_buffer[COMP_BLOCK_NO] = 0xFE;
-	block_size = (flags == XMODEM_1K) ? 1024 : 128;
-	chksum_offset = (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
-	packet_size = (flags == XMODEM) ? chksum_offset + 1 : chksum_offset + 2;
+	stats_init(stats);
+	return tx_packets(data_out_fcn, NULL, NULL, tx_buffer, window, chan_state, serial_device, \
+		flags, 0, stats);
+}
 
-	do{
-		int bytes_read;
+modem_errors_t xmodem_tx_prefetch(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	modem_stats_t * stats)
+{
+	stats_init(stats);
+	return tx_packets(data_out_fcn, NULL, NULL, tx_buffer, 0, chan_state, serial_device, flags, \
+		TX_PREFETCH, stats);
+}
+
+modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer, void * chan_state, \
+	serial_handle_t serial_device, xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	stats_init(stats);
+	return rx_packets(data_in_fcn, NULL, rx_buffer, chan_state, serial_device, flags, 0, stats);
+}
+
+modem_errors_t xmodem_rx_window(input_window_t window_fcn, unsigned char * rx_buffer, void * chan_state, \
+	serial_handle_t serial_device, xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	stats_init(stats);
+	return rx_packets(NULL, window_fcn, rx_buffer, chan_state, serial_device, flags, 0, stats);
+}
+
+modem_errors_t xmodem_rx_windowed(input_channel_t data_in_fcn, unsigned char * rx_buffer, void * chan_state, \
+	serial_handle_t serial_device, xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	stats_init(stats);
+	return rx_packets(data_in_fcn, NULL, rx_buffer, chan_state, serial_device, flags, \
+		RX_OFFER_WINDOW, stats);
+}
+
+modem_errors_t ymodem_tx(ymodem_next_file_t next_file_fcn, output_channel_t data_out_fcn, \
+	unsigned char * tx_buffer, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	ymodem_file_info_t info;
+	modem_errors_t modem_status;
+	int options = 0;
+	int more;
 
-		/* Read data from IO channel. */
-		if((bytes_read = data_out_fcn((char *) &tx_buffer[DATA], block_size, \
-			last_sent_size, chan_state)) < 0)
+	stats_init(stats);
+	if(flags == XMODEM)
+	{
+		flags = XMODEM_CRC;
+	}
+
+	do{
+		xmodem_xfer_mode_t header_flags;
+
+		/* Clear info, so an empty name ends the batch. */
+		pad_buffer((unsigned char *) info.name, sizeof(info.name), NUL);
+		info.size = 0;
+		info.has_size = 0;
+		info.mtime = 0;
+		if((more = next_file_fcn(&info, chan_state)) < 0)
 		{
 			return CHANNEL_ERROR;
 		}
-
-		/* If less than 1024 bytes left in XMODEM_1K, switch to 128 byte
-		to reduce overhead. */
-		if((flags == XMODEM_1K) && ((size_t) bytes_read < block_size))
+		else if(!more)
 		{
-			tx_buffer[START_CHAR] = SOH;
-			chksum_offset = CHKSUM_CRC;
-			block_size = 128;
-			packet_size = chksum_offset + 2;
-			flags = XMODEM_CRC;
+			info.name[0] = NUL;
 		}
 
-		/* Pad a short packet. This also handles the case where the file
-		ends on a packet-size boundary (write CPMEOF for entire packet). */
-		if((size_t) bytes_read < block_size)
+		/* Headers are sent in 128 byte blocks where they fit, as most
+		receivers expect. */
+		header_flags = (encode_header(NULL, &info) < 128 || flags == XMODEM_CRC) ? \
+			XMODEM_CRC : XMODEM_1K;
+
+		/* The receiver asks for each header and file with a 'C' (or a
+		'G' for a file) as soon as it is ready; only the first one can be
+		preceded by garbage. Headers are always acknowledged. */
+		if((modem_status = tx_packets(header_out, NULL, NULL, tx_buffer, 0, &info, \
+			serial_device, header_flags, TX_HEADER | options, stats)) != MODEM_NO_ERRORS)
 		{
-			eof_detected = 1;
-			pad_buffer(&tx_buffer[DATA + bytes_read], block_size - bytes_read, CPMEOF);
+			return modem_status;
 		}
+		options = TX_CONTINUE;
 
-		/* Generate the checksum/CRC. */
-		if(flags == XMODEM)
+		if(more && (modem_status = tx_packets(data_out_fcn, NULL, NULL, tx_buffer, 0, \
+			chan_state, serial_device, flags, TX_CONTINUE, stats)) != MODEM_NO_ERRORS)
 		{
-			tx_buffer[chksum_offset] = generate_chksum(&tx_buffer[DATA], \
-					block_size);
+			return modem_status;
 		}
-		else /* All other protocols use CRC. */
-		{
-			unsigned int crc16 = generate_crc(&tx_buffer[DATA], block_size);
+	}while(more);
 
-			/* if sizeof(int) == 2, then 0xFF00 is unsigned int.
-			if sizeof(int) > 2, then 0xFF00 is int.
-			However the value ALWAYS remains positive. */
-			tx_buffer[chksum_offset] = ((crc16 & (0xFF00)) >> 8);
-			tx_buffer[chksum_offset + 1] = ((crc16 & (0x00FF)));
-		}
+	return MODEM_NO_ERRORS;
+}
 
-		/* Send the packet. Wait for any character. Protocol is
-		completely receiver-driven (will not retransmit automatically
-		without receiver intervention)- bail on timeout or hardware error. */
-		serial_snd((char *) tx_buffer, packet_size, serial_device);
-		serial_flush(serial_device);
-		if((ser_status = serial_rcv(&rx_code, 1, 60, NULL, serial_device)) != \
-			SERIAL_NO_ERRORS)
+modem_errors_t ymodem_rx(ymodem_open_file_t open_file_fcn, input_channel_t data_in_fcn, \
+	unsigned char * rx_buffer, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, modem_stats_t * stats)
+{
+	ymodem_file_info_t info;
+	trim_chan_t trim;
+	modem_errors_t modem_status;
+
+	stats_init(stats);
+	if(flags == XMODEM)
+	{
+		flags = XMODEM_CRC;
+	}
+
+	while(1)
+	{
+		if((modem_status = rx_packets(header_in, NULL, rx_buffer, &info, serial_device, \
+			(flags == XMODEM_G) ? XMODEM_1K : flags, RX_HEADER | RX_CRC_ONLY, stats)) \
+			!= MODEM_NO_ERRORS)
 		{
-			return serial_to_modem_error(ser_status);
+			return modem_status;
 		}
 
-		/* Interpret the response. */
-		if(rx_code == ACK)
+		/* An empty header ends the batch. */
+		if(info.name[0] == NUL)
 		{
-			/* Increment the block number and negate the
-			complement block number in one line. */
-			tx_buffer[COMP_BLOCK_NO] = ~(++tx_buffer[BLOCK_NO]);
-			last_sent_size = block_size;
+			return MODEM_NO_ERRORS;
 		}
-		else if(rx_code == NAK)
+
+		if(open_file_fcn(&info, chan_state) < 0)
 		{
-			last_sent_size = 0; /* Garbage. Resend. */
-			eof_detected = 0; /* If NAK detected on
-			last packet, it needs to be redone! */
+			char tx_code = CAN;
+
+			serial_snd(&tx_code, 1, serial_device);
+			return CHANNEL_ERROR;
 		}
-		else /* if(rx_code == CAN) */
+
+		trim.data_in_fcn = data_in_fcn;
+		trim.chan_state = chan_state;
+		trim.left = info.size;
+		trim.has_size = info.has_size;
+		trim.stats = stats;
+		if((modem_status = rx_packets(trim_in, NULL, rx_buffer, &trim, serial_device, \
+			flags, RX_CRC_ONLY, stats)) != MODEM_NO_ERRORS)
 		{
-			return SENT_CAN;
+			return modem_status;
 		}
-	}while(!eof_detected);
 
-	/* Wait for ACK or CAN. Is waiting for CAN really necessary? It
-	could probably fit under "timeout", as the receiver has acknowledged
-	all data to be sent at this point. */
-	do{
-		char eot_char = EOT;
-
-		serial_snd(&eot_char, 1, serial_device);
-		if((ser_status = serial_rcv(&rx_code, 1, 60, NULL, serial_device)) != \
-			SERIAL_NO_ERRORS)
+		if(data_in_fcn((const char *) rx_buffer, 0, 1, chan_state) != 0)
 		{
-			return serial_to_modem_error(ser_status);
+			return CHANNEL_ERROR;
 		}
-	}while(!(rx_code == ACK || rx_code == CAN));
+	}
+}
 
-	return (rx_code == ACK) ? MODEM_NO_ERRORS : SENT_CAN;
+
+void xmodem_session_tx(xmodem_session_t * session, output_channel_t data_out_fcn, \
+	unsigned char * tx_buffer, void * chan_state, xmodem_xfer_mode_t flags, long now_ms)
+{
+	session_init(session, tx_buffer, chan_state, flags);
+	session->data_out = data_out_fcn;
+	session->state = SESSION_TX_START;
+
+	/* As in wait_for_rx_ready(), garbage doesn't restart this timeout. */
+	session->deadline = now_ms + XMODEM_START_TIMEOUT_MS;
+	session->has_deadline = 1;
 }
 
-/* Potential reimplementation of xmodem_rx. */
-modem_errors_t xmodem_rx1(input_channel_t data_in_fcn, unsigned char * rx_buffer, void * chan_state, \
-	serial_handle_t serial_device, unsigned short flags)
+void xmodem_session_rx(xmodem_session_t * session, input_channel_t data_in_fcn, \
+	unsigned char * rx_buffer, void * chan_state, xmodem_xfer_mode_t flags, long now_ms)
 {
-	char tx_code;
-	unsigned int error_count = 0;
-	unsigned char expected_start_char, expected_block_no, expected_comp_block_no;
-	int eot_detected = 0;
-	offset_names_t chksum_offset;
-	serial_status_t ser_status;
+	session_init(session, rx_buffer, chan_state, flags);
+	session->data_in = data_in_fcn;
+	session->tx_code = (flags == XMODEM) ? NAK : ASCII_C;
+	if(flags == XMODEM_G)
+	{
+		session->flags = XMODEM_1K;
+		session->tx_code = ASCII_G;
+	}
 
+	session_code(session, session->tx_code);
+	session_listen(session, now_ms);
+}
 
-	tx_code = (flags == XMODEM) ? NAK : ASCII_C;
-	expected_start_char = (flags == XMODEM_1K) ? STX : SOH;
-	expected_block_no = 0x01;
-	expected_comp_block_no = 0xFE;
-	chksum_offset = (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
-	serial_snd(&tx_code, 1, serial_device);
+size_t xmodem_session_feed(xmodem_session_t * session, const char * data, size_t size, long now_ms)
+{
+	size_t used = 0;
 
-	do{
-		modem_errors_t modem_status;
+	while(used < size && session->state != SESSION_DONE)
+	{
+		/* Packet bodies are copied in one go, rather than a byte at a
+		time. */
+		if(session->state == SESSION_RX_BODY)
+		{
+			size_t chunk = session->packet_size - session->received;
+			if(chunk > size - used)
+			{
+				chunk = size - used;
+			}
+
+			copy_buffer(&session->buf[session->received], \
+				(const unsigned char *) &data[used], chunk);
+			session->received += chunk;
+			used += chunk;
 
-		if((modem_status = wait_for_tx_response(serial_device, flags)) != MODEM_NO_ERRORS)
+			if(session->received == session->packet_size)
+			{
+				session_check(session, now_ms);
+			}
+			else
+			{
+				session_wait(session, XMODEM_CHAR_TIMEOUT_MS, now_ms);
+			}
+		}
+		else
 		{
-			return modem_status;
+			session_byte(session, (unsigned char) data[used++], now_ms);
 		}
+	}
 
-	}while(!eot_detected);
+	return used;
+}
 
-	tx_code = ACK;
-	ser_status = serial_snd(&tx_code, 1, serial_device);
-	/* Discard for now, but perhaps add an error code for failure at end? */
+size_t xmodem_session_output(const xmodem_session_t * session, const char ** data)
+{
+	(* data) = (const char *) session->out;
+	return session->out_size;
+}
 
-	return MODEM_NO_ERRORS;
+void xmodem_session_sent(xmodem_session_t * session, size_t size, long now_ms)
+{
+	if(size == 0 || session->out_size == 0)
+	{
+		return;
+	}
+
+	if(size > session->out_size)
+	{
+		size = session->out_size;
+	}
+	session->out += size;
+	session->out_size -= size;
+
+	if(session->out_size > 0 || session->state == SESSION_DONE)
+	{
+		return;
+	}
+
+	/* Streaming, the next packet follows straight away. */
+	if(session->state == SESSION_TX_PACKET && session->streaming)
+	{
+		session_next(session, now_ms);
+	}
+	else
+	{
+		session->deadline = now_ms + session->wait_ms;
+		session->has_deadline = 1;
+	}
+}
+
+int xmodem_session_deadline(const xmodem_session_t * session, long * deadline_ms)
+{
+	if(session->state == SESSION_DONE || session->out_size > 0 || !session->has_deadline)
+	{
+		return 0;
+	}
+
+	(* deadline_ms) = session->deadline;
+	return 1;
 }
 
+void xmodem_session_tick(xmodem_session_t * session, long now_ms)
+{
+	long deadline;
 
-modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer, void * chan_state, \
-	serial_handle_t serial_device, xmodem_xfer_mode_t flags)
+	if(!xmodem_session_deadline(session, &deadline) || now_ms - deadline < 0)
+	{
+		return;
+	}
+
+	switch(session->state)
+	{
+		case SESSION_RX_START:
+			/* A streaming transmitter never waits, so a silent line means it
+			has gone. */
+			if(session->streaming)
+			{
+				session_end(session, MODEM_TIMEOUT, 1);
+			}
+			else
+			{
+				session_code(session, session->tx_code);
+				session_listen(session, now_ms);
+			}
+			break;
+		case SESSION_RX_BODY:
+			/* Let the rest of the packet drain before answering, as
+			serial_drain() does. */
+			session->state = SESSION_RX_PURGE;
+			session_wait(session, XMODEM_PURGE_IDLE_MS, now_ms);
+			break;
+		case SESSION_RX_PURGE:
+			if(session->streaming)
+			{
+				session_end(session, MODEM_TIMEOUT, 1);
+			}
+			else
+			{
+				session_code(session, NAK);
+				session->tx_code = NAK;
+				session_listen(session, now_ms);
+			}
+			break;
+		default: /* The transmitter never retries on its own. */
+			session_end(session, MODEM_TIMEOUT, 0);
+			break;
+	}
+}
+
+modem_errors_t xmodem_session_status(const xmodem_session_t * session)
+{
+	return session->status;
+}
+
+size_t xmodem_image_size(size_t data_size, xmodem_xfer_mode_t flags)
+{
+	size_t num_1k, num_128;
+
+	count_packets(data_size, flags, &num_1k, &num_128);
+	return num_1k * X1K_END + num_128 * ((flags == XMODEM) ? CHKSUM_END : CRC_END);
+}
+
+int xmodem_image_init(xmodem_image_t * image, unsigned char * buf, size_t buf_size, \
+	const unsigned char * data, size_t data_size, xmodem_xfer_mode_t flags)
+{
+	unsigned char * packet = buf;
+	unsigned char block_no = 0x01;
+	size_t num_1k, num_128, count, offset = 0;
+
+	if(buf_size < xmodem_image_size(data_size, flags))
+	{
+		return -1;
+	}
+
+	count_packets(data_size, flags, &num_1k, &num_128);
+	for(count = 0; count < num_1k + num_128; count++)
+	{
+		size_t block_size = (count < num_1k) ? 1024 : 128;
+		size_t chunk = (data_size - offset < block_size) ? data_size - offset : block_size;
+		/* 1024 byte blocks always carry a CRC. */
+		xmodem_xfer_mode_t check_mode = (count < num_1k) ? XMODEM_1K : flags;
+
+		packet[START_CHAR] = (count < num_1k) ? STX : SOH;
+		packet[BLOCK_NO] = block_no;
+		packet[COMP_BLOCK_NO] = ~block_no++;
+		copy_buffer(&packet[DATA], &data[offset], chunk);
+		pad_buffer(&packet[DATA + chunk], block_size - chunk, CPMEOF);
+		put_check(&packet[DATA + block_size], &packet[DATA], block_size, check_mode);
+
+		packet += DATA + block_size + ((check_mode == XMODEM) ? 1 : 2);
+		offset += chunk;
+	}
+
+	image->packets = buf;
+	image->num_packets = num_1k + num_128;
+	image->num_1k = num_1k;
+	image->flags = flags;
+	return 0;
+}
+
+modem_errors_t xmodem_tx_image(const xmodem_image_t * image, serial_handle_t serial_device, \
+	modem_stats_t * stats)
+{
+	modem_errors_t modem_status;
+	char rx_code = NUL;
+
+	stats_init(stats);
+	serial_flush(serial_device);
+	if((modem_status = wait_for_rx_ready(serial_device, image->flags, \
+		0, &rx_code, stats)) != MODEM_NO_ERRORS)
+	{
+		return modem_status;
+	}
+
+	return tx_image(image, serial_device, image->flags == XMODEM_G && rx_code == ASCII_G, \
+		stats);
+}
+
+void xmodem_session_tx_image(xmodem_session_t * session, const xmodem_image_t * image, long now_ms)
+{
+	xmodem_session_tx(session, NULL, NULL, NULL, image->flags, now_ms);
+	session->image = image;
+}
+
+
+/* Private functions begin here. */
+/* Body of xmodem_rx(), xmodem_rx_window() and xmodem_rx_windowed(). Exactly
+one of data_in_fcn and window_fcn is non-NULL. With RX_OFFER_WINDOW, the
+handshake starts with 'W', and if the transmitter answers it, every ACK and
+NAK carries a block number. XMODEM_G starts with 'G' in the same way, and if
+the transmitter answers it, nothing is acknowledged before EOT and any error
+cancels the transfer. With RX_HEADER, a YMODEM block 0 is expected, and
+the function returns as soon as it has been acknowledged. */
+static modem_errors_t rx_packets(input_channel_t data_in_fcn, input_window_t window_fcn, \
+	unsigned char * rx_buffer, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, int options, modem_stats_t * stats)
 {
 	/* Array of pointers to the six packet section offsets within the
 	buffer holding the packet. */
@@ -190,13 +587,25 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 			expected_block_no = 0, expected_comp_block_no = 0;
 	/* Logic variables. */
 	int eot_detected = 0, using_128_blocks_in_1k = 0;
-	size_t bytes_written;
+	int windowed = 0; /* Transmitter answered 'W'. */
+	int streaming = 0; /* Transmitter answered 'G'. */
+	unsigned int offer_tries = 0; /* Handshake attempts spent on 'W' or 'G'. */
+	int offer_streaming = (flags == XMODEM_G);
+	long start_timeout = XMODEM_HANDSHAKE_TIMEOUT_MS;
+	int bytes_written;
+	int last_recv_size = 0; /* Size of the last block accepted into a window. */
 	modem_errors_t modem_status;
 	serial_status_t ser_status;
 	offset_names_t chksum_offset, packet_end;
 	/* int in_bufsiz; */
 
 
+	/* XMODEM_G is XMODEM_1K on the wire. */
+	if(offer_streaming)
+	{
+		flags = XMODEM_1K;
+	}
+
 	/* Depending on mode set, set offsets. */
 	chksum_offset = (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
 	/* clear_buffer(rx_buffer, 1034); */
@@ -226,17 +635,27 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 		chksum_offset = CHKSUM_CRC;
 		packet_end = CHKSUM_END;
 	}
-	expected_block_no = 0x01;
-	expected_comp_block_no = 0xFE;
+	/* Windows need CRCs. */
+	if((options & RX_OFFER_WINDOW) && flags != XMODEM)
+	{
+		tx_code = ASCII_W;
+	}
+	/* Streaming beats a window; there is nothing to retransmit. */
+	if(offer_streaming)
+	{
+		tx_code = ASCII_G;
+	}
+	expected_block_no = (options & RX_HEADER) ? 0x00 : 0x01;
+	expected_comp_block_no = ~expected_block_no;
 	error_count = -1; /* Unsigned warning can be safely ignored. */
 
 	/* Begin by sending starting byte to transmitter. */
 	serial_snd(&tx_code, 1, serial_device);
 
 	do{
-		/* wait_for_tx_response()
-		add difftime to calculate timeout. */
-		size_t expected_size, data_size, data_plus_crc_size;
+		size_t data_size, trailer_size;
+		unsigned char * payload, * trailer;
+		crc_state_t check;
 		rx_buffer[0] = NUL;
 		/* Wait for first character. */
 
@@ -251,36 +670,89 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 				return MODEM_TIMEOUT;
 			}
 
+			/* Stop offering a window or streaming if the first 'W' or 'G'
+			goes unanswered; the transmitter is probably waiting for a 'C'. */
+			if((tx_code == ASCII_W || tx_code == ASCII_G) && error_count > 0)
+			{
+				tx_code = ASCII_C;
+				offer_tries = 1;
+			}
+
 			/* Fallback to XMODEM from XMODEM_CRC if conditions
 			are met. */
-			if(flags == XMODEM_CRC && error_count > 2)
+			if(flags == XMODEM_CRC && !(options & RX_CRC_ONLY) \
+				&& error_count > 2 + offer_tries)
 			{
 				flags = XMODEM;
 				tx_code = NAK;
 				packet_end = CHKSUM_END;
+				if(stats != NULL)
+				{
+					stats->downgrades_crc++;
+				}
 			}
 
-			ser_status = serial_rcv((char *) rx_buffer, 1, 10, NULL, serial_device);
+			ser_status = serial_rcv_ms((char *) rx_buffer, 1, start_timeout, \
+				NULL, serial_device);
 
 			if(rx_buffer[0] == expected_start_char_2 \
 				|| rx_buffer[0] == expected_start_char_1)
 			{
+				/* The sender is up; from now on, allow it the full time
+				between packets. */
+				start_timeout = XMODEM_PACKET_TIMEOUT_MS;
+				if(tx_code == ASCII_W)
+				{
+					windowed = 1;
+				}
+				else if(tx_code == ASCII_G)
+				{
+					streaming = 1;
+				}
 				break;
 			}
+			else if(rx_buffer[0] == EOT && (options & RX_HEADER))
+			{
+				/* The previous file's EOT again; the ACK was lost. */
+				send_response(serial_device, ACK, 0, 0);
+				continue;
+			}
 			else if(rx_buffer[0] == EOT)
 			{
 				eot_detected = 1;
 				break;
 			}
 
-			if(ser_status == SERIAL_TIMEOUT)
+			if(ser_status == SERIAL_TIMEOUT && stats != NULL)
+			{
+				stats->timeouts++;
+				if(tx_code == NAK && !streaming)
+				{
+					stats->naks_timeout++;
+				}
+			}
+
+			/* A streaming transmitter never waits, so a silent line means it
+			has gone. */
+			if(ser_status == SERIAL_TIMEOUT && streaming)
 			{
+				tx_code = CAN;
 				serial_snd(&tx_code, 1, serial_device);
+				return MODEM_TIMEOUT;
+			}
+			else if(ser_status == SERIAL_TIMEOUT)
+			{
+				send_response(serial_device, tx_code, expected_block_no, windowed);
 			}
 		}
 
 		if(!eot_detected)
 		{
+			if(stats != NULL)
+			{
+				stats->packets_received++;
+			}
+
 			/* Check for small XMODEM-1K packet. */
 			if(flags == XMODEM_1K)
 			{
@@ -290,6 +762,10 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 					chksum_offset = CHKSUM_CRC;
 					packet_end = CRC_END;
 					using_128_blocks_in_1k = 1;
+					if(stats != NULL)
+					{
+						stats->tail_switches++;
+					}
 				}
 				else if((rx_buffer[0] == STX) && using_128_blocks_in_1k)
 				{
@@ -301,20 +777,62 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 			}
 
 			/* These are guaranteed to be positive- see enum offset_names_t */
-			expected_size = packet_end - BLOCK_NO;
 			data_size = chksum_offset - DATA;
-			data_plus_crc_size = packet_end - DATA;
+			trailer_size = packet_end - chksum_offset;
 
-			ser_status = serial_rcv((char *) (rx_buffer + 1), \
-				expected_size, 1, NULL, serial_device);
-			modem_status = serial_to_modem_error(ser_status);
-
-			/* Check for common errors. */
-			if(ser_status != SERIAL_NO_ERRORS) /* For now, only TIMEOUT is expected here. */
+			/* With a window, the payload goes straight to its destination and
+			only the header and trailer are staged in rx_buffer. A rejected
+			block is simply overwritten by the retry. */
+			if(window_fcn == NULL)
+			{
+				payload = &rx_buffer[DATA];
+				trailer = &rx_buffer[chksum_offset];
+			}
+			else if((payload = (unsigned char *) window_fcn(data_size, \
+				last_recv_size, 0, chan_state)) == NULL)
+			{
+				tx_code = CAN;
+				serial_snd(&tx_code, 1, serial_device);
+				return CHANNEL_ERROR;
+			}
+			else
+			{
+				trailer = &rx_buffer[DATA];
+				last_recv_size = 0;
+			}
+
+			/* The checksum/CRC is updated as the body arrives, so the result
+			is ready as soon as the last byte is received. */
+			crc_init(&check, flags);
+			ser_status = recv_packet_body(serial_device, rx_buffer, payload, \
+				data_size, trailer, trailer_size, &check);
+			modem_status = serial_to_modem_error(ser_status);
+
+			if(stats != NULL && ser_status == SERIAL_NO_ERRORS)
+			{
+				stats->wire_bytes += DATA + data_size + trailer_size;
+			}
+			else if(stats != NULL && ser_status == SERIAL_TIMEOUT)
+			{
+				stats->timeouts++;
+			}
+
+			/* Check for common errors. */
+			if(ser_status != SERIAL_NO_ERRORS) /* For now, only TIMEOUT is expected here. */
 			{
 				/* If error occurs cause RX timeout before sending status code,
 				since transmitter flushes UART buffer after sending packet. */
-				purge(serial_device);
+				serial_drain(serial_device, XMODEM_PURGE_IDLE_MS);
+			}
+			/* Within a window, blocks the transmitter sent ahead of a rejected
+			one arrive out of sequence. They are dropped until it goes back.
+			A header which doesn't make sense is treated like a bad CRC. */
+			else if(windowed && (rx_buffer[BLOCK_NO] != expected_block_no \
+				|| rx_buffer[COMP_BLOCK_NO] != expected_comp_block_no))
+			{
+				modem_status = (crc_final(&check) == 0 && \
+					(rx_buffer[BLOCK_NO] ^ rx_buffer[COMP_BLOCK_NO]) == 0xFF) ? \
+					PACKET_MISMATCH : BAD_CRC_CHKSUM;
 			}
 			/* If expected block numbers weren't received (either current or
 			previous packet number) synchronicity was lost- unrecoverable. */
@@ -331,19 +849,11 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 				return PACKET_MISMATCH;
 			}
 
-			/* This ridiculous else if statement can be read as:
-			"If using XMODEM and the checksum is bad, set bad
-			checksum error." */
-			else if((flags == XMODEM) && \
-				generate_chksum(&rx_buffer[DATA], data_size) \
-				!= rx_buffer[CHKSUM_CRC])
-			{
-				modem_status = BAD_CRC_CHKSUM;
-			}
-
-			/* Ditto, except for CRC errors. */
-			else if((flags != XMODEM) && \
-				generate_crc(&rx_buffer[DATA], data_plus_crc_size) != 0)
+			/* recv_packet_body() includes the CRC itself in the running CRC,
+			which leaves 0 for a good packet. The checksum is compared
+			directly. */
+			else if(crc_final(&check) != \
+				((flags == XMODEM) ? trailer[0] : 0))
 			{
 				modem_status = BAD_CRC_CHKSUM;
 			}
@@ -352,13 +862,55 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 			{
 				case BAD_CRC_CHKSUM:
 				case MODEM_TIMEOUT:
-					tx_code = NAK;
-					serial_snd(&tx_code, 1, serial_device);
+					/* A streaming transmitter can't go back. */
+					if(streaming)
+					{
+						tx_code = CAN;
+						serial_snd(&tx_code, 1, serial_device);
+						return modem_status;
+					}
+					/* Let any blocks sent after this one drain first, so the
+					NAK is the transmitter's cue to go back. */
+					if(windowed && modem_status == BAD_CRC_CHKSUM)
+					{
+						serial_drain(serial_device, XMODEM_PURGE_IDLE_MS);
+					}
+					send_response(serial_device, NAK, expected_block_no, windowed);
+					if(stats != NULL && modem_status == BAD_CRC_CHKSUM)
+					{
+						stats->naks_bad_check++;
+					}
+					else if(stats != NULL)
+					{
+						stats->naks_timeout++;
+					}
+					break;
+				case PACKET_MISMATCH:
+					/* Only returned within a window. */
+					if(stats != NULL)
+					{
+						stats->out_of_sequence++;
+					}
 					break;
 				case MODEM_NO_ERRORS:
 					expected_comp_block_no = ~(++expected_block_no);
-					bytes_written = data_in_fcn((char *) &rx_buffer[DATA], data_size, eot_detected, chan_state);
-					if(bytes_written < data_size)
+					/* Counted first, so that trim_in() can take the padding
+					back out. */
+					if(stats != NULL && !(options & RX_HEADER))
+					{
+						stats->payload_bytes += data_size;
+					}
+					if(window_fcn == NULL)
+					{
+						bytes_written = data_in_fcn((char *) payload, data_size, eot_detected, chan_state);
+					}
+					else
+					{
+						/* Committed by the next call to window_fcn. */
+						bytes_written = last_recv_size = data_size;
+					}
+
+					if(bytes_written < 0 || (size_t) bytes_written < data_size)
 					{
 						tx_code = CAN;
 						serial_snd(&tx_code, 1, serial_device);
@@ -369,8 +921,14 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 						error_count = -1;
 						/* Reset error count if entire packet successfully
 						sent (all errors retried 10 times). */
-						tx_code = ACK;
-						serial_snd(&tx_code, 1, serial_device);
+						if(!streaming)
+						{
+							send_response(serial_device, ACK, rx_buffer[BLOCK_NO], windowed);
+						}
+						if(options & RX_HEADER)
+						{
+							return MODEM_NO_ERRORS;
+						}
 					}
 					break;
 				default:
@@ -383,6 +941,13 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 		} /* End if(!eot_detected) */
 	}while(!eot_detected);
 
+	if(window_fcn != NULL && window_fcn(0, last_recv_size, 1, chan_state) == NULL)
+	{
+		tx_code = CAN;
+		serial_snd(&tx_code, 1, serial_device);
+		return CHANNEL_ERROR;
+	}
+
 	tx_code = ACK;
 	ser_status = serial_snd(&tx_code, 1, serial_device);
 	/* Discard for now, but perhaps add an error code for failure at end? */
@@ -390,122 +955,1326 @@ modem_errors_t xmodem_rx(input_channel_t data_in_fcn, unsigned char * rx_buffer,
 	return MODEM_NO_ERRORS;
 }
 
-unsigned char generate_chksum(unsigned char * data, size_t size)
+/* Body of xmodem_tx(), xmodem_tx_borrow(), xmodem_tx_checked(),
+xmodem_tx_windowed(), xmodem_tx_prefetch() and ymodem_tx(). Exactly one of
+data_out_fcn, borrow_fcn and checked_fcn is non-NULL; only data_out_fcn is
+used with a window or TX_PREFETCH. A nonzero window accepts a 'W' from the receiver, and
+hands the transfer over to tx_window(). XMODEM_G streams packets if the
+receiver starts with a 'G'.
+With TX_HEADER, a single YMODEM block 0 is sent. */
+static modem_errors_t tx_packets(output_channel_t data_out_fcn, borrow_channel_t borrow_fcn, \
+	checked_channel_t checked_fcn, unsigned char * tx_buffer, unsigned int window, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, int options, \
+	modem_stats_t * stats)
 {
-	unsigned char chksum = 0;
-	register unsigned int count;
-	for(count = 0; count < size; count++)
+	char rx_code = NUL;
+	modem_errors_t modem_status = 0;
+	serial_status_t ser_status = 0;
+	offset_names_t chksum_offset;
+	/* Logic variables. */
+	int eof_detected = 0, streaming = 0;
+	size_t block_size, packet_size; /* Check to see if EOF was reached using bytes_read */
+	int last_sent_size = 0;
+	int resend = 0; /* The packet being sent was NAKed. */
+	long rtt_ms = 0;
+	const unsigned char * payload;
+	serial_iovec_t packet[3]; /* Header, payload, checksum/CRC. */
+
+	/* Flush the device buffer in case some characters were remaining
+	to prevent glitches. */
+	if(!(options & TX_CONTINUE))
 	{
-		chksum += *(data + count);
+		serial_flush(serial_device);
+	}
+	if((modem_status = wait_for_rx_ready(serial_device, flags, \
+		window > 0, &rx_code, stats)) != MODEM_NO_ERRORS)
+	{
+		return modem_status;
 	}
-	return chksum;
-}
 
-/* Use CRC-16-CCITT. XMODEM sends MSB first, so initial
-CRC value should be 0. */
-unsigned short generate_crc(unsigned char * data, size_t size)
-{
-	const unsigned int crc_poly = 0x1021;
-	unsigned int crc = 0x0000;
+	/* XMODEM_G is XMODEM_1K on the wire. Without a 'G', the receiver
+	acknowledges each packet as usual. */
+	if(flags == XMODEM_G)
+	{
+		flags = XMODEM_1K;
+		streaming = (rx_code == ASCII_G);
+	}
+
+	if(rx_code == ASCII_W)
+	{
+		return tx_window(data_out_fcn, tx_buffer, window, chan_state, serial_device, flags, \
+			stats);
+	}
 
-	unsigned int octet_count;
-	unsigned char bit_count;
-	for(octet_count = 0; octet_count < size; octet_count++)
+	if((options & TX_PREFETCH) && !streaming)
 	{
-		crc = (crc ^ (unsigned int) (data[octet_count] & (0xFF)) << 8);
-		for(bit_count = 1; bit_count <= 8; bit_count++)
+		return tx_prefetch(data_out_fcn, tx_buffer, chan_state, serial_device, flags, stats);
+	}
+
+	tx_buffer[START_CHAR] = (flags == XMODEM_1K) ? STX : SOH;
+	tx_buffer[BLOCK_NO] = (options & TX_HEADER) ? 0x00 : 0x01;
+	tx_buffer[COMP_BLOCK_NO] = ~tx_buffer[BLOCK_NO];
+	block_size = (flags == XMODEM_1K) ? 1024 : 128;
+	chksum_offset = (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
+	packet_size = (flags == XMODEM) ? chksum_offset + 1 : chksum_offset + 2;
+
+	do{
+		crc_state_t check;
+		int bytes_read, checked = 0;
+
+		/* Read data from IO channel, or borrow it in place. */
+		if(checked_fcn != NULL)
+		{
+			/* The channel computes the checksum/CRC as it copies. */
+			payload = &tx_buffer[DATA];
+			crc_init(&check, flags);
+			bytes_read = checked_fcn((char *) &tx_buffer[DATA], block_size, \
+				last_sent_size, &check, chan_state);
+			checked = 1;
+		}
+		else if(borrow_fcn == NULL)
+		{
+			payload = &tx_buffer[DATA];
+			bytes_read = data_out_fcn((char *) &tx_buffer[DATA], block_size, \
+				last_sent_size, chan_state);
+		}
+		else
+		{
+			const char * lent = NULL;
+
+			bytes_read = borrow_fcn(&lent, block_size, last_sent_size, chan_state);
+			payload = (const unsigned char *) lent;
+		}
+
+		if(bytes_read < 0 || (size_t) bytes_read > block_size \
+			|| (bytes_read > 0 && payload == NULL))
+		{
+			return CHANNEL_ERROR;
+		}
+
+		/* If less than 1024 bytes left in XMODEM_1K, switch to 128 byte
+		to reduce overhead. */
+		if((flags == XMODEM_1K) && ((size_t) bytes_read < block_size))
 		{
-			/* Taken from ymodem.txt/wikipedia... I don't have the patience
-			 * to develop my own CRC algorithm currently. */
-			if(crc & 0x8000)
+			tx_buffer[START_CHAR] = SOH;
+			chksum_offset = CHKSUM_CRC;
+			block_size = 128;
+			packet_size = chksum_offset + 2;
+			flags = XMODEM_CRC;
+			if(stats != NULL)
 			{
-				crc = (crc << 1) ^ crc_poly;
+				stats->tail_switches++;
 			}
-			else
+			/* The channel's CRC covers more than the smaller block. */
+			checked = checked && (size_t) bytes_read <= block_size;
+		}
+
+		/* Pad a short packet. This also handles the case where the file
+		ends on a packet-size boundary (write CPMEOF for entire packet). */
+		if((size_t) bytes_read < block_size)
+		{
+			eof_detected = 1;
+			/* Borrowed data can't be padded in place; this is the only
+			block that gets copied. */
+			if(payload != &tx_buffer[DATA])
+			{
+				copy_buffer(&tx_buffer[DATA], payload, bytes_read);
+				payload = &tx_buffer[DATA];
+			}
+			pad_buffer(&tx_buffer[DATA + bytes_read], block_size - bytes_read, CPMEOF);
+			if(checked)
+			{
+				crc_update(&check, &tx_buffer[DATA + bytes_read], block_size - bytes_read);
+			}
+			if(stats != NULL && !resend)
 			{
-				crc <<= 1;
+				stats->padding_bytes += block_size - bytes_read;
 			}
 		}
-	}
-	return crc;
-}
 
+		/* Generate the checksum/CRC, unless the channel already has. */
+		if(checked)
+		{
+			put_final(&tx_buffer[chksum_offset], &check);
+		}
+		else
+		{
+			put_check(&tx_buffer[chksum_offset], payload, block_size, flags);
+		}
 
-/* Private functions begin here. */
-/* Do not depend on existence of string.h */
-static void pad_buffer(unsigned char * buf, size_t bufsiz, unsigned char val)
-{
-	size_t count;
-	for(count = 0; count < bufsiz; count++)
-	{
-		buf[count] = val;
-	}
-}
+		packet[0].data = (char *) tx_buffer;
+		packet[0].num_bytes = DATA;
+		packet[1].data = (char *) payload;
+		packet[1].num_bytes = block_size;
+		packet[2].data = (char *) &tx_buffer[chksum_offset];
+		packet[2].num_bytes = packet_size - chksum_offset;
+
+		/* Streaming, packets go out back-to-back; nothing is acknowledged
+		until EOT, and the receiver can only cancel. Poll for that without
+		waiting. */
+		if(streaming)
+		{
+			serial_sndv(packet, 3, serial_device);
+			stats_sent(stats, packet_size, 0);
+			if(serial_rcv_ms(&rx_code, 1, 0, NULL, serial_device) == SERIAL_NO_ERRORS \
+				&& rx_code == CAN)
+			{
+				return SENT_CAN;
+			}
 
-static void purge(serial_handle_t serial_dev)
-{
-	serial_status_t timeout_status = SERIAL_NO_ERRORS;
-	char dummy_byte;
-	do{
-		timeout_status = serial_rcv(&dummy_byte, 1, 1, NULL, serial_dev);
-	}while(timeout_status != SERIAL_TIMEOUT);
+			if(stats != NULL)
+			{
+				stats->payload_bytes += ((size_t) bytes_read < block_size) ? \
+					(size_t) bytes_read : block_size;
+			}
+			tx_buffer[COMP_BLOCK_NO] = ~(++tx_buffer[BLOCK_NO]);
+			last_sent_size = block_size;
+			continue;
+		}
+
+		/* Send the packet. Wait for any character. Protocol is
+		completely receiver-driven (will not retransmit automatically
+		without receiver intervention)- bail on timeout or hardware error. */
+		/* Discard stale input before sending, not after: on a fast link
+		(USB CDC, pseudo-terminals) the response may already have arrived
+		by the time serial_snd() returns. */
+		serial_flush(serial_device);
+		serial_sndv(packet, 3, serial_device);
+		stats_sent(stats, packet_size, resend);
+		/* The response is only timed for stats. */
+		if((ser_status = serial_rcv_ms(&rx_code, 1, XMODEM_RESPONSE_TIMEOUT_MS, \
+			(stats != NULL) ? &rtt_ms : NULL, serial_device)) != SERIAL_NO_ERRORS)
+		{
+			return rcv_error(ser_status, stats);
+		}
+
+		/* Interpret the response. */
+		if(rx_code == ACK)
+		{
+			stats_ack(stats, rtt_ms);
+			/* Going over to 128 byte blocks, data_out_fcn may have read more
+			than the block holds. */
+			if(stats != NULL && !(options & TX_HEADER))
+			{
+				stats->payload_bytes += ((size_t) bytes_read < block_size) ? \
+					(size_t) bytes_read : block_size;
+			}
+
+			/* Increment the block number and negate the
+			complement block number in one line. */
+			tx_buffer[COMP_BLOCK_NO] = ~(++tx_buffer[BLOCK_NO]);
+			last_sent_size = block_size;
+			resend = 0;
+			if(options & TX_HEADER)
+			{
+				return MODEM_NO_ERRORS;
+			}
+		}
+		else if(rx_code == NAK)
+		{
+			last_sent_size = 0; /* Garbage. Resend. */
+			eof_detected = 0; /* If NAK detected on
+			last packet, it needs to be redone! */
+			resend = 1;
+			if(stats != NULL)
+			{
+				stats->naks_received++;
+			}
+		}
+		else /* if(rx_code == CAN) */
+		{
+			return SENT_CAN;
+		}
+	}while(!eof_detected);
+
+	return send_eot(serial_device, 0, stats);
 }
 
-static modem_errors_t wait_for_rx_ready(serial_handle_t serial_device, xmodem_xfer_mode_t flags)
+/* Go-back-N transmitter, used once the receiver has answered 'W'. Up to
+window packets are sent ahead of the receiver. Each stays in its own slot of
+tx_buffer until acknowledged, so it can be sent again without asking
+data_out_fcn for it twice. */
+static modem_errors_t tx_window(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	unsigned int window, void * chan_state, serial_handle_t serial_device, \
+	xmodem_xfer_mode_t flags, modem_stats_t * stats)
 {
-	unsigned int elapsed_time;
-	serial_status_t ser_status = SERIAL_NO_ERRORS;
-	int expected_rx_detected = 0;
-	char rx_code = NUL;
+	/* Blocks are counted from 0; block n goes out with number n + 1. base is
+	the oldest unacknowledged block, next the next one to send, filled the
+	next one to ask data_out_fcn for, and last the final block once known. */
+	unsigned long base = 0, next = 0, filled = 0, last = 0;
+	size_t slot_size = (flags == XMODEM_1K) ? X1K_END : CRC_END;
+	int eof_detected = 0;
+	int last_sent_size = 0;
+	serial_status_t ser_status;
+	char rx_code;
 
-	/* Wait for NAK or 'C', timeout after 1 minute. */
-	elapsed_time = 0;
-	while(!(expected_rx_detected))
+	while(!eof_detected || base <= last)
 	{
-		int time_to_recv;
-		ser_status = serial_rcv(&rx_code, 1, 60 - elapsed_time, &time_to_recv, serial_device);
-		elapsed_time += time_to_recv;
+		int can_send;
 
-		/* What happens if error on setting timeouts? */
-		if(ser_status != SERIAL_NO_ERRORS)
+		/* Send until the window is full. */
+		while(next < base + window && !(eof_detected && next > last))
 		{
-			break;
+			unsigned char * packet = &tx_buffer[(next % window) * slot_size];
+			size_t packet_size;
+			int resend = (next < filled); /* Going back after a NAK. */
+
+			if(next == filled)
+			{
+				size_t block_size = (flags == XMODEM_1K) ? 1024 : 128;
+				int bytes_read = data_out_fcn((char *) &packet[DATA], block_size, \
+					last_sent_size, chan_state);
+
+				if(bytes_read < 0 || (size_t) bytes_read > block_size)
+				{
+					return CHANNEL_ERROR;
+				}
+
+				/* As in tx_packets(), finish an XMODEM_1K transfer with 128
+				byte blocks. */
+				if((flags == XMODEM_1K) && ((size_t) bytes_read < block_size))
+				{
+					flags = XMODEM_CRC;
+					block_size = 128;
+					if(stats != NULL)
+					{
+						stats->tail_switches++;
+					}
+				}
+
+				if((size_t) bytes_read < block_size)
+				{
+					eof_detected = 1;
+					last = next;
+					pad_buffer(&packet[DATA + bytes_read], block_size - bytes_read, CPMEOF);
+					if(stats != NULL)
+					{
+						stats->padding_bytes += block_size - bytes_read;
+					}
+				}
+
+				/* A window can't tell which blocks got through until it
+				ends, so payload is counted as it is read. */
+				if(stats != NULL)
+				{
+					stats->payload_bytes += ((size_t) bytes_read < block_size) ? \
+						(size_t) bytes_read : block_size;
+				}
+
+				packet[START_CHAR] = (block_size == 1024) ? STX : SOH;
+				packet[BLOCK_NO] = (unsigned char) (next + 1);
+				packet[COMP_BLOCK_NO] = (unsigned char) ~packet[BLOCK_NO];
+				put_check(&packet[DATA + block_size], &packet[DATA], block_size, flags);
+				last_sent_size = block_size;
+				filled++;
+			}
+
+			packet_size = (packet[START_CHAR] == STX) ? X1K_END : CRC_END;
+			if((ser_status = serial_snd((char *) packet, packet_size, serial_device)) \
+				!= SERIAL_NO_ERRORS)
+			{
+				return serial_to_modem_error(ser_status);
+			}
+			stats_sent(stats, packet_size, resend);
+			next++;
 		}
-		/* ASCII_C is only correct for XMODEM_1K and XMODEM_CRC. */
-		else if((flags == XMODEM_1K || flags == XMODEM_CRC) && rx_code == ASCII_C)
+
+		/* Only wait for a response once nothing more can be sent; until then,
+		just take whatever has already arrived. */
+		can_send = (next < base + window) && !(eof_detected && next > last);
+		ser_status = serial_rcv_ms(&rx_code, 1, can_send ? 0 : XMODEM_RESPONSE_TIMEOUT_MS, \
+			NULL, serial_device);
+		if(ser_status == SERIAL_TIMEOUT && can_send)
 		{
-			expected_rx_detected = 1;
+			continue;
 		}
-		/* Else, wait for NAK. */
-		else if((flags == XMODEM) && rx_code == NAK)
+		else if(ser_status != SERIAL_NO_ERRORS)
 		{
-			expected_rx_detected = 1;
+			return rcv_error(ser_status, stats);
 		}
-	}
 
-	return serial_to_modem_error(ser_status);
-}
+		if(rx_code == CAN)
+		{
+			return SENT_CAN;
+		}
+		else if(rx_code == ACK || rx_code == NAK)
+		{
+			unsigned char block_no;
+			unsigned long seq, end;
 
-static modem_errors_t wait_for_tx_response(serial_handle_t serial_device, xmodem_xfer_mode_t flags)
-{
-	return MODEM_NO_ERRORS;
-}
+			if((ser_status = serial_rcv_ms((char *) &block_no, 1, XMODEM_CHAR_TIMEOUT_MS, \
+				NULL, serial_device)) != SERIAL_NO_ERRORS)
+			{
+				return rcv_error(ser_status, stats);
+			}
 
-static offset_names_t get_checksum_offset(unsigned short flags)
-{
-	return (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
+			if(stats != NULL && rx_code == NAK)
+			{
+				stats->naks_received++;
+			}
+
+			/* Find the block in flight with that number. A NAK may also name
+			the block about to be sent, if the receiver timed out waiting. */
+			end = (rx_code == NAK) ? next + 1 : next;
+			for(seq = base; seq < end; seq++)
+			{
+				if((unsigned char) (seq + 1) == block_no)
+				{
+					break;
+				}
+			}
+
+			if(seq < end && rx_code == ACK)
+			{
+				base = seq + 1;
+			}
+			else if(seq < end) /* Everything before it arrived; go back. */
+			{
+				base = next = seq;
+			}
+		}
+		/* Anything else, such as a repeated 'W', is ignored. */
+	}
+
+	return send_eot(serial_device, 1, stats);
 }
 
-/* static int wait_for_rx_ack(serial_handle_t serial_device)
+/* Stop-and-wait transmitter which reads each block while the one before it
+awaits its ACK, so a slow data_out_fcn overlaps the time the packet spends
+on the wire. tx_buffer holds two packets: the one in flight, which a NAK
+sends again, and the next, which is ready as soon as the ACK arrives. */
+static modem_errors_t tx_prefetch(output_channel_t data_out_fcn, unsigned char * tx_buffer, \
+	void * chan_state, serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	modem_stats_t * stats)
 {
+	size_t slot_size = (flags == XMODEM_1K) ? X1K_END : CRC_END;
+	unsigned char * packet = tx_buffer;
+	unsigned char * next = &tx_buffer[slot_size];
+	/* eof_detected: the packet in flight is the last. next_eof: likewise
+	for the one in the other slot, once have_next is set. */
+	int eof_detected, next_eof = 0, have_next = 0;
+	int resend = 0;
+	long rtt_ms = 0;
+	serial_status_t ser_status;
 	char rx_code;
 
+	if((eof_detected = fill_packet(data_out_fcn, packet, 1, 0, chan_state, &flags, \
+		stats)) < 0)
+	{
+		return CHANNEL_ERROR;
+	}
 
-} */
+	for(;;)
+	{
+		size_t block_size = (packet[START_CHAR] == STX) ? 1024 : 128;
+		size_t packet_size = DATA + block_size + ((flags == XMODEM) ? 1 : 2);
+		unsigned char * swap;
 
-static modem_errors_t serial_to_modem_error(serial_status_t status)
-{
-	modem_errors_t equiv_status;
+		/* As in tx_packets(), discard stale input before sending. */
+		serial_flush(serial_device);
+		if((ser_status = serial_snd((char *) packet, packet_size, serial_device)) \
+			!= SERIAL_NO_ERRORS)
+		{
+			return serial_to_modem_error(ser_status);
+		}
+		stats_sent(stats, packet_size, resend);
+
+		/* The packet is on its way; read the next block meanwhile. */
+		if(!eof_detected && !have_next)
+		{
+			if((next_eof = fill_packet(data_out_fcn, next, (unsigned char) (packet[BLOCK_NO] + 1), \
+				block_size, chan_state, &flags, stats)) < 0)
+			{
+				return CHANNEL_ERROR;
+			}
+			have_next = 1;
+		}
+
+		/* Only the wait is timed, so time spent reading ahead is left out
+		of the round trip. */
+		if((ser_status = serial_rcv_ms(&rx_code, 1, XMODEM_RESPONSE_TIMEOUT_MS, \
+			(stats != NULL) ? &rtt_ms : NULL, serial_device)) != SERIAL_NO_ERRORS)
+		{
+			return rcv_error(ser_status, stats);
+		}
+
+		resend = (rx_code == NAK);
+		if(rx_code == ACK)
+		{
+			stats_ack(stats, rtt_ms);
+			if(eof_detected)
+			{
+				break;
+			}
+
+			swap = packet;
+			packet = next;
+			next = swap;
+			eof_detected = next_eof;
+			have_next = 0;
+		}
+		else if(rx_code != NAK) /* if(rx_code == CAN) */
+		{
+			return SENT_CAN;
+		}
+		/* On NAK, the same packet goes out again. */
+		else if(stats != NULL)
+		{
+			stats->naks_received++;
+		}
+	}
+
+	return send_eot(serial_device, 0, stats);
+}
+
+/* Read block block_no from data_out_fcn into packet, pad it, and add its
+header and checksum/CRC. As in tx_packets(), an XMODEM_1K transfer finishes
+with 128 byte blocks, so *flags may change to XMODEM_CRC. Returns 1 if this
+is the last block, 0 if not, or -1 on a channel error. */
+static int fill_packet(output_channel_t data_out_fcn, unsigned char * packet, \
+	unsigned char block_no, int last_sent_size, void * chan_state, xmodem_xfer_mode_t * flags, \
+	modem_stats_t * stats)
+{
+	size_t block_size = (*flags == XMODEM_1K) ? 1024 : 128;
+	int bytes_read = data_out_fcn((char *) &packet[DATA], block_size, \
+		last_sent_size, chan_state);
+
+	if(bytes_read < 0 || (size_t) bytes_read > block_size)
+	{
+		return -1;
+	}
+
+	if((*flags == XMODEM_1K) && ((size_t) bytes_read < block_size))
+	{
+		*flags = XMODEM_CRC;
+		block_size = 128;
+		if(stats != NULL)
+		{
+			stats->tail_switches++;
+		}
+	}
+
+	if((size_t) bytes_read < block_size)
+	{
+		pad_buffer(&packet[DATA + bytes_read], block_size - bytes_read, CPMEOF);
+		if(stats != NULL)
+		{
+			stats->padding_bytes += block_size - bytes_read;
+		}
+	}
+
+	/* As in tx_window(), a block read ahead is counted straight away. */
+	if(stats != NULL)
+	{
+		stats->payload_bytes += ((size_t) bytes_read < block_size) ? \
+			(size_t) bytes_read : block_size;
+	}
+
+	packet[START_CHAR] = (block_size == 1024) ? STX : SOH;
+	packet[BLOCK_NO] = block_no;
+	packet[COMP_BLOCK_NO] = (unsigned char) ~block_no;
+	put_check(&packet[DATA + block_size], &packet[DATA], block_size, *flags);
+	return (size_t) bytes_read < block_size;
+}
+
+
+/* Output channel for a YMODEM header. The block is padded with NUL rather
+than CPMEOF, and is always full, so tx_packets() never shrinks it. */
+static int header_out(char * buf, const int request_size, const int last_sent_size, \
+	void * const chan_state)
+{
+	const ymodem_file_info_t * info = chan_state;
+	size_t size = encode_header(NULL, info);
+
+	(void) last_sent_size;
+
+	/* Leave room for the NUL ending the last field. */
+	if(size >= (size_t) request_size)
+	{
+		return -1;
+	}
+
+	encode_header(buf, info);
+	pad_buffer((unsigned char *) &buf[size], request_size - size, NUL);
+	return request_size;
+}
+
+/* Input channel for a YMODEM header. */
+static int header_in(const char * buf, const int buf_size, const int eof, \
+	void * const chan_state)
+{
+	ymodem_file_info_t * info = chan_state;
+	const char * end = buf + buf_size;
+	const char * text;
+	size_t len = 0;
+	int found;
+
+	(void) eof;
+
+	/* The name must be NUL-terminated, and short enough to pass on. */
+	while(len < (size_t) buf_size && buf[len] != NUL)
+	{
+		if(len == YMODEM_MAX_NAME)
+		{
+			return -1;
+		}
+		info->name[len] = buf[len];
+		len++;
+	}
+	if(len == (size_t) buf_size)
+	{
+		return -1;
+	}
+	info->name[len] = NUL;
+
+	/* Every field after the name is optional. */
+	text = &buf[len + 1];
+	info->size = get_number(&text, end, 10, &info->has_size);
+	info->mtime = 0;
+	if(info->has_size && text < end && (* text) == ' ')
+	{
+		text++;
+		info->mtime = get_number(&text, end, 8, &found);
+	}
+
+	return buf_size;
+}
+
+/* Input channel which hands a YMODEM file's data on, up to its size. */
+static int trim_in(const char * buf, const int buf_size, const int eof, \
+	void * const chan_state)
+{
+	trim_chan_t * trim = chan_state;
+	int size = buf_size;
+
+	if(trim->has_size)
+	{
+		if((unsigned long) size > trim->left)
+		{
+			size = (int) trim->left;
+		}
+		trim->left -= size;
+
+		/* rx_packets() has already counted the whole block as payload. */
+		if(trim->stats != NULL)
+		{
+			trim->stats->payload_bytes -= buf_size - size;
+			trim->stats->padding_bytes += buf_size - size;
+		}
+
+		/* A block of nothing but padding. */
+		if(size == 0)
+		{
+			return buf_size;
+		}
+	}
+
+	return (trim->data_in_fcn(buf, size, eof, trim->chan_state) == size) ? buf_size : -1;
+}
+
+/* Write the fields of a YMODEM header to buf, and return their size. If buf
+is NULL, only the size is returned. The end of the batch is an empty header. */
+static size_t encode_header(char * buf, const ymodem_file_info_t * info)
+{
+	size_t len = 0;
+
+	if(info->name[0] == NUL)
+	{
+		return 0;
+	}
+
+	for(len = 0; len < YMODEM_MAX_NAME && info->name[len] != NUL; len++)
+	{
+		if(buf != NULL)
+		{
+			buf[len] = info->name[len];
+		}
+	}
+	if(buf != NULL)
+	{
+		buf[len] = NUL;
+	}
+	len++;
+
+	/* The modification time can only follow a size. */
+	if(info->has_size)
+	{
+		len += put_number((buf != NULL) ? &buf[len] : NULL, info->size, 10);
+		if(info->mtime != 0)
+		{
+			if(buf != NULL)
+			{
+				buf[len] = ' ';
+			}
+			len++;
+			len += put_number((buf != NULL) ? &buf[len] : NULL, info->mtime, 8);
+		}
+	}
+
+	return len;
+}
+
+/* Do not depend on existence of stdio.h either. */
+static size_t put_number(char * buf, unsigned long value, unsigned int base)
+{
+	char digits[3 * sizeof(unsigned long)]; /* Enough for octal. */
+	size_t count = 0, i;
+
+	do{
+		digits[count++] = (char) ('0' + value % base);
+		value /= base;
+	}while(value != 0);
+
+	if(buf != NULL)
+	{
+		for(i = 0; i < count; i++)
+		{
+			buf[i] = digits[count - 1 - i];
+		}
+	}
+
+	return count;
+}
+
+static unsigned long get_number(const char ** text, const char * end, unsigned int base, \
+	int * found)
+{
+	unsigned long value = 0;
+
+	(* found) = 0;
+	while((* text) < end && (** text) >= '0' && (** text) < (char) ('0' + base))
+	{
+		value = value * base + (unsigned long) ((** text) - '0');
+		(* found) = 1;
+		(* text)++;
+	}
+
+	return value;
+}
+
+/* Store the checksum/CRC of a block_size byte payload at trailer. */
+static void put_check(unsigned char * trailer, const unsigned char * payload, \
+	size_t block_size, xmodem_xfer_mode_t flags)
+{
+	crc_state_t check;
+
+	crc_init(&check, flags);
+	crc_update(&check, payload, block_size);
+	put_final(trailer, &check);
+}
+
+/* Store a finished checksum/CRC at trailer. */
+static void put_final(unsigned char * trailer, const crc_state_t * check)
+{
+	if(!check->use_crc)
+	{
+		trailer[0] = (unsigned char) crc_final(check);
+	}
+	else /* All other protocols use CRC. */
+	{
+		unsigned int crc16 = crc_final(check);
+
+		/* if sizeof(int) == 2, then 0xFF00 is unsigned int.
+		if sizeof(int) > 2, then 0xFF00 is int.
+		However the value ALWAYS remains positive. */
+		trailer[0] = ((crc16 & (0xFF00)) >> 8);
+		trailer[1] = ((crc16 & (0x00FF)));
+	}
+}
+
+/* Wait for ACK or CAN. Is waiting for CAN really necessary? It
+could probably fit under "timeout", as the receiver has acknowledged
+all data to be sent at this point. In a window, a NAK left over from a
+receiver timeout still carries a block number, which must not be mistaken
+for the response. */
+static modem_errors_t send_eot(serial_handle_t serial_device, int windowed, \
+	modem_stats_t * stats)
+{
+	serial_status_t ser_status;
+	char rx_code = NUL;
+
+	do{
+		char eot_char = EOT;
+
+		serial_snd(&eot_char, 1, serial_device);
+		if((ser_status = serial_rcv_ms(&rx_code, 1, XMODEM_RESPONSE_TIMEOUT_MS, \
+			NULL, serial_device)) != SERIAL_NO_ERRORS)
+		{
+			return rcv_error(ser_status, stats);
+		}
+
+		if(stats != NULL && rx_code == NAK)
+		{
+			stats->naks_received++;
+		}
+
+		if(windowed && rx_code == NAK)
+		{
+			char block_no;
+
+			(void) serial_rcv_ms(&block_no, 1, XMODEM_CHAR_TIMEOUT_MS, NULL, serial_device);
+		}
+	}while(!(rx_code == ACK || rx_code == CAN));
+
+	return (rx_code == ACK) ? MODEM_NO_ERRORS : SENT_CAN;
+}
+
+/* Send a response to a packet. In a window, ACK and NAK are followed by the
+number of the block they refer to. */
+static void send_response(serial_handle_t serial_device, char code, unsigned char block_no, \
+	int windowed)
+{
+	char response[2];
+
+	response[0] = code;
+	response[1] = (char) block_no;
+	serial_snd(response, (windowed && (code == ACK || code == NAK)) ? 2 : 1, serial_device);
+}
+
+/* Do not depend on existence of string.h */
+static void pad_buffer(unsigned char * buf, size_t bufsiz, unsigned char val)
+{
+	size_t count;
+	for(count = 0; count < bufsiz; count++)
+	{
+		buf[count] = val;
+	}
+}
+
+static void copy_buffer(unsigned char * dest, const unsigned char * src, size_t size)
+{
+	size_t count;
+	for(count = 0; count < size; count++)
+	{
+		dest[count] = src[count];
+	}
+}
+
+/* Receive everything in a packet after the start character: block numbers
+into rx_buffer, data_size bytes of payload into payload and trailer_size bytes
+of checksum/CRC into trailer. The payload is read in chunks and fed to check
+as each one lands. For CRC modes, the CRC itself is fed to check too. */
+static serial_status_t recv_packet_body(serial_handle_t serial_device, unsigned char * rx_buffer, \
+	unsigned char * payload, size_t data_size, unsigned char * trailer, size_t trailer_size, \
+	crc_state_t * check)
+{
+	serial_status_t ser_status;
+	size_t received = 0;
+
+	ser_status = serial_rcv_ms((char *) &rx_buffer[BLOCK_NO], 2, \
+		XMODEM_CHAR_TIMEOUT_MS, NULL, serial_device);
+
+	while(ser_status == SERIAL_NO_ERRORS && received < data_size)
+	{
+		size_t chunk = data_size - received;
+		if(chunk > RX_CHUNK_SIZE)
+		{
+			chunk = RX_CHUNK_SIZE;
+		}
+
+		ser_status = serial_rcv_ms((char *) &payload[received], chunk, \
+			XMODEM_CHAR_TIMEOUT_MS, NULL, serial_device);
+		if(ser_status == SERIAL_NO_ERRORS)
+		{
+			crc_update(check, &payload[received], chunk);
+			received += chunk;
+		}
+	}
+
+	if(ser_status == SERIAL_NO_ERRORS)
+	{
+		ser_status = serial_rcv_ms((char *) trailer, trailer_size, \
+			XMODEM_CHAR_TIMEOUT_MS, NULL, serial_device);
+		if(ser_status == SERIAL_NO_ERRORS && check->use_crc)
+		{
+			crc_update(check, trailer, trailer_size);
+		}
+	}
+
+	return ser_status;
+}
+
+/* If accept_window is nonzero, a 'W' is accepted in place of a 'C'. With
+XMODEM_G, a 'G' is accepted as well. The character that started the transfer
+is returned in start_code. */
+static modem_errors_t wait_for_rx_ready(serial_handle_t serial_device, xmodem_xfer_mode_t flags, \
+	int accept_window, char * start_code, modem_stats_t * stats)
+{
+	long elapsed_time;
+	serial_status_t ser_status = SERIAL_NO_ERRORS;
+	int expected_rx_detected = 0;
+	char rx_code = NUL;
+
+	/* Wait for NAK or 'C', timeout after 1 minute regardless of how much
+	garbage arrives in the meantime. */
+	elapsed_time = 0;
+	while(!(expected_rx_detected))
+	{
+		long time_to_recv;
+		ser_status = serial_rcv_ms(&rx_code, 1, XMODEM_START_TIMEOUT_MS - elapsed_time, \
+			&time_to_recv, serial_device);
+		elapsed_time += time_to_recv;
+
+		/* What happens if error on setting timeouts? */
+		if(ser_status != SERIAL_NO_ERRORS)
+		{
+			break;
+		}
+		/* ASCII_C is only correct for XMODEM_1K, XMODEM_CRC and
+		XMODEM_G. */
+		else if(flags != XMODEM && rx_code == ASCII_C)
+		{
+			expected_rx_detected = 1;
+		}
+		else if(flags != XMODEM && rx_code == ASCII_W && accept_window)
+		{
+			expected_rx_detected = 1;
+		}
+		else if(flags == XMODEM_G && rx_code == ASCII_G)
+		{
+			expected_rx_detected = 1;
+		}
+		/* Else, wait for NAK. */
+		else if((flags == XMODEM) && rx_code == NAK)
+		{
+			expected_rx_detected = 1;
+		}
+	}
+
+	(* start_code) = rx_code;
+	return rcv_error(ser_status, stats);
+}
+
+/* Send the packets of an image, answering responses as tx_packets() does.
+Nothing needs reading or checking here; each packet goes out as framed. */
+static modem_errors_t tx_image(const xmodem_image_t * image, serial_handle_t serial_device, \
+	int streaming, modem_stats_t * stats)
+{
+	serial_status_t ser_status;
+	size_t packet_no = 0;
+	int resend = 0;
+	long rtt_ms = 0;
+	char rx_code = NUL;
+
+	while(packet_no < image->num_packets)
+	{
+		size_t packet_size;
+		const unsigned char * packet = get_image_packet(image, packet_no, &packet_size);
+
+		if(streaming)
+		{
+			serial_snd((char *) packet, packet_size, serial_device);
+			stats_sent(stats, packet_size, 0);
+			if(serial_rcv_ms(&rx_code, 1, 0, NULL, serial_device) == SERIAL_NO_ERRORS \
+				&& rx_code == CAN)
+			{
+				return SENT_CAN;
+			}
+			packet_no++;
+			continue;
+		}
+
+		serial_flush(serial_device);
+		serial_snd((char *) packet, packet_size, serial_device);
+		stats_sent(stats, packet_size, resend);
+		if((ser_status = serial_rcv_ms(&rx_code, 1, XMODEM_RESPONSE_TIMEOUT_MS, \
+			(stats != NULL) ? &rtt_ms : NULL, serial_device)) != SERIAL_NO_ERRORS)
+		{
+			return rcv_error(ser_status, stats);
+		}
+
+		resend = (rx_code == NAK);
+		if(rx_code == ACK)
+		{
+			stats_ack(stats, rtt_ms);
+			packet_no++;
+		}
+		else if(rx_code != NAK)
+		{
+			return SENT_CAN;
+		}
+		else if(stats != NULL)
+		{
+			stats->naks_received++;
+		}
+	}
+
+	return send_eot(serial_device, 0, stats);
+}
+
+/* Count the packets tx_packets() sends for data_size bytes. An XMODEM_1K
+transfer goes over to 128 byte blocks for the last 1023 bytes or fewer, and
+every transfer ends with a short block, which is all padding if the data
+fills the block before it. */
+static void count_packets(size_t data_size, xmodem_xfer_mode_t flags, size_t * num_1k, \
+	size_t * num_128)
+{
+	(* num_1k) = (flags == XMODEM_1K || flags == XMODEM_G) ? data_size / 1024 : 0;
+	(* num_128) = (data_size - (* num_1k) * 1024) / 128 + 1;
+}
+
+static const unsigned char * get_image_packet(const xmodem_image_t * image, size_t packet_no, \
+	size_t * packet_size)
+{
+	if(packet_no < image->num_1k)
+	{
+		(* packet_size) = X1K_END;
+		return &image->packets[packet_no * X1K_END];
+	}
+
+	(* packet_size) = (image->flags == XMODEM) ? CHKSUM_END : CRC_END;
+	return &image->packets[image->num_1k * X1K_END + (packet_no - image->num_1k) * (* packet_size)];
+}
+
+static void session_init(xmodem_session_t * session, unsigned char * buf, void * chan_state, \
+	xmodem_xfer_mode_t flags)
+{
+	session->data_out = NULL;
+	session->data_in = NULL;
+	session->image = NULL;
+	session->packet_no = 0;
+	session->buf = buf;
+	session->chan_state = chan_state;
+	session->status = MODEM_IN_PROGRESS;
+	session->flags = flags;
+	session->out = session->codes;
+	session->out_size = 0;
+	session->wait_ms = 0;
+	session->deadline = 0;
+	session->has_deadline = 0;
+	session->start_timeout = XMODEM_HANDSHAKE_TIMEOUT_MS;
+	session->error_count = -1;
+	session->offer_tries = 0;
+	session->streaming = 0;
+	session->eof = 0;
+	session->last_sent_size = 0;
+	session->tx_code = NUL;
+	session->expected_block_no = 0x01;
+	session->block_size = 0;
+	session->packet_size = 0;
+	session->received = 0;
+}
+
+/* Act on one byte received outside of a packet body. */
+static void session_byte(xmodem_session_t * session, unsigned char rx_code, long now_ms)
+{
+	switch(session->state)
+	{
+		case SESSION_TX_START:
+			if((session->flags != XMODEM && rx_code == ASCII_C) \
+				|| (session->flags == XMODEM_G && rx_code == ASCII_G) \
+				|| (session->flags == XMODEM && rx_code == NAK))
+			{
+				if(session->flags == XMODEM_G)
+				{
+					session->flags = XMODEM_1K;
+					session->streaming = (rx_code == ASCII_G);
+				}
+
+				if(session->image == NULL)
+				{
+					session->buf[START_CHAR] = (session->flags == XMODEM_1K) ? STX : SOH;
+					session->buf[BLOCK_NO] = 0x01;
+					session->buf[COMP_BLOCK_NO] = ~session->buf[BLOCK_NO];
+					session->block_size = (session->flags == XMODEM_1K) ? 1024 : 128;
+				}
+				session_load(session, now_ms);
+			}
+			break;
+		case SESSION_TX_PACKET:
+			/* Streaming, the receiver can only cancel. Otherwise, anything
+			received before the packet has gone is stale, as if flushed. */
+			if(session->streaming || session->out_size > 0)
+			{
+				if(session->streaming && rx_code == CAN)
+				{
+					session_end(session, SENT_CAN, 0);
+				}
+			}
+			else if(rx_code == ACK)
+			{
+				session_next(session, now_ms);
+			}
+			else if(rx_code == NAK)
+			{
+				session->last_sent_size = 0;
+				session->eof = 0;
+				session_load(session, now_ms);
+			}
+			else
+			{
+				session_end(session, SENT_CAN, 0);
+			}
+			break;
+		case SESSION_TX_EOT:
+			if(rx_code == ACK)
+			{
+				session_end(session, MODEM_NO_ERRORS, 0);
+			}
+			else if(rx_code == CAN)
+			{
+				session_end(session, SENT_CAN, 0);
+			}
+			else
+			{
+				session_eot(session, now_ms);
+			}
+			break;
+		case SESSION_RX_START:
+			if(rx_code == SOH || (rx_code == STX && session->flags == XMODEM_1K))
+			{
+				session->start_timeout = XMODEM_PACKET_TIMEOUT_MS;
+				if(session->tx_code == ASCII_G)
+				{
+					session->streaming = 1;
+				}
+
+				session->block_size = (rx_code == STX) ? 1024 : 128;
+				session->packet_size = DATA + session->block_size + \
+					((session->flags == XMODEM) ? 1 : 2);
+				session->buf[START_CHAR] = rx_code;
+				session->received = 1;
+				session->state = SESSION_RX_BODY;
+				session_wait(session, XMODEM_CHAR_TIMEOUT_MS, now_ms);
+			}
+			else if(rx_code == EOT)
+			{
+				session_code(session, ACK);
+				session_end(session, MODEM_NO_ERRORS, 0);
+			}
+			else
+			{
+				session_listen(session, now_ms);
+			}
+			break;
+		case SESSION_RX_PURGE:
+			session_wait(session, XMODEM_PURGE_IDLE_MS, now_ms);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Get the next payload from data_out and queue it as a packet, as
+tx_packets() does. */
+static void session_load(xmodem_session_t * session, long now_ms)
+{
+	unsigned char * payload;
+	int bytes_read;
+
+	if(session->image != NULL)
+	{
+		size_t packet_size;
+		const unsigned char * packet = get_image_packet(session->image, \
+			session->packet_no, &packet_size);
+
+		session->eof = (session->packet_no + 1 == session->image->num_packets);
+		session->state = SESSION_TX_PACKET;
+		session_send(session, packet, packet_size);
+		session_wait(session, XMODEM_RESPONSE_TIMEOUT_MS, now_ms);
+		return;
+	}
+
+	payload = &session->buf[DATA];
+	bytes_read = session->data_out((char *) payload, session->block_size, \
+		session->last_sent_size, session->chan_state);
+	if(bytes_read < 0 || (size_t) bytes_read > session->block_size)
+	{
+		session_end(session, CHANNEL_ERROR, 0);
+		return;
+	}
+
+	if(session->flags == XMODEM_1K && (size_t) bytes_read < session->block_size)
+	{
+		session->buf[START_CHAR] = SOH;
+		session->block_size = 128;
+		session->flags = XMODEM_CRC;
+	}
+
+	if((size_t) bytes_read < session->block_size)
+	{
+		session->eof = 1;
+		pad_buffer(&payload[bytes_read], session->block_size - bytes_read, CPMEOF);
+	}
+
+	put_check(&payload[session->block_size], payload, session->block_size, session->flags);
+	session->state = SESSION_TX_PACKET;
+	session_send(session, session->buf, DATA + session->block_size + \
+		((session->flags == XMODEM) ? 1 : 2));
+	session_wait(session, XMODEM_RESPONSE_TIMEOUT_MS, now_ms);
+}
+
+/* Move on from a packet which was acknowledged, or streamed. */
+static void session_next(xmodem_session_t * session, long now_ms)
+{
+	if(session->image != NULL)
+	{
+		session->packet_no++;
+	}
+	else
+	{
+		session->buf[COMP_BLOCK_NO] = ~(++session->buf[BLOCK_NO]);
+		session->last_sent_size = session->block_size;
+	}
+	if(session->eof)
+	{
+		session_eot(session, now_ms);
+	}
+	else
+	{
+		session_load(session, now_ms);
+	}
+}
+
+static void session_eot(xmodem_session_t * session, long now_ms)
+{
+	session->state = SESSION_TX_EOT;
+	session->codes[0] = EOT;
+	session_send(session, session->codes, 1);
+	session_wait(session, XMODEM_RESPONSE_TIMEOUT_MS, now_ms);
+}
+
+/* Wait for the start of a packet, counting errors the way rx_packets()
+does. */
+static void session_listen(xmodem_session_t * session, long now_ms)
+{
+	session->error_count++;
+	if(session->error_count > 11)
+	{
+		session_end(session, MODEM_TIMEOUT, 1);
+		return;
+	}
+
+	/* Stop offering streaming if the first 'G' goes unanswered. */
+	if(session->tx_code == ASCII_G && session->error_count > 0)
+	{
+		session->tx_code = ASCII_C;
+		session->offer_tries = 1;
+	}
+
+	if(session->flags == XMODEM_CRC && session->error_count > 2 + session->offer_tries)
+	{
+		session->flags = XMODEM;
+		session->tx_code = NAK;
+	}
+
+	session->state = SESSION_RX_START;
+	session_wait(session, session->start_timeout, now_ms);
+}
+
+/* Check a packet once all of it is in buf, and answer it. */
+static void session_check(xmodem_session_t * session, long now_ms)
+{
+	unsigned char * payload = &session->buf[DATA];
+	unsigned char * trailer = &payload[session->block_size];
+	crc_state_t check;
+
+	if(session->buf[COMP_BLOCK_NO] != (unsigned char) ~session->expected_block_no \
+		&& session->buf[BLOCK_NO] != session->expected_block_no)
+	{
+		session_end(session, PACKET_MISMATCH, 1);
+		return;
+	}
+
+	crc_init(&check, session->flags);
+	crc_update(&check, payload, session->block_size);
+	if(session->flags != XMODEM)
+	{
+		crc_update(&check, trailer, 2);
+	}
+
+	if(crc_final(&check) != ((session->flags == XMODEM) ? trailer[0] : 0))
+	{
+		if(session->streaming)
+		{
+			session_end(session, BAD_CRC_CHKSUM, 1);
+			return;
+		}
+		session_code(session, NAK);
+	}
+	else
+	{
+		int bytes_written = session->data_in((char *) payload, session->block_size, \
+			0, session->chan_state);
+
+		if(bytes_written < 0 || (size_t) bytes_written < session->block_size)
+		{
+			session_end(session, CHANNEL_ERROR, 1);
+			return;
+		}
+
+		session->expected_block_no++;
+		session->error_count = -1;
+		if(!session->streaming)
+		{
+			session_code(session, ACK);
+		}
+	}
+
+	session->tx_code = NAK;
+	session_listen(session, now_ms);
+}
+
+/* Replace the output with data, such as a packet in buf. */
+static void session_send(xmodem_session_t * session, const unsigned char * data, size_t size)
+{
+	session->out = data;
+	session->out_size = size;
+}
+
+/* Queue a control character after any already waiting to be sent. */
+static void session_code(xmodem_session_t * session, char code)
+{
+	size_t count;
+
+	/* Move what's left to the front, so there is always room for the
+	few characters a receiver can queue between sends. */
+	for(count = 0; count < session->out_size; count++)
+	{
+		session->codes[count] = session->out[count];
+	}
+	session->out = session->codes;
+
+	if(session->out_size < sizeof(session->codes))
+	{
+		session->codes[session->out_size++] = (unsigned char) code;
+	}
+}
+
+/* Time out wait_ms after the output has been sent, or from now if there is
+none. */
+static void session_wait(xmodem_session_t * session, long wait_ms, long now_ms)
+{
+	session->wait_ms = wait_ms;
+	session->deadline = now_ms + wait_ms;
+	session->has_deadline = (session->out_size == 0);
+}
+
+static void session_end(xmodem_session_t * session, modem_errors_t status, int cancel)
+{
+	if(cancel)
+	{
+		session_code(session, CAN);
+	}
+	session->status = status;
+	session->state = SESSION_DONE;
+}
+
+static offset_names_t get_checksum_offset(unsigned short flags)
+{
+	return (flags == XMODEM_1K) ? X1K_CRC : CHKSUM_CRC;
+}
+
+/* static int wait_for_rx_ack(serial_handle_t serial_device)
+{
+	char rx_code;
+
+
+} */
+
+static modem_errors_t serial_to_modem_error(serial_status_t status)
+{
+	modem_errors_t equiv_status;
 	switch(status)
 	{
 		case SERIAL_NO_ERRORS:
@@ -524,3 +2293,60 @@ static modem_errors_t serial_to_modem_error(serial_status_t status)
 
 	return equiv_status;
 }
+
+/* serial_to_modem_error() for a wait on the other side, which also counts a
+timeout in stats. */
+static modem_errors_t rcv_error(serial_status_t status, modem_stats_t * stats)
+{
+	if(stats != NULL && status == SERIAL_TIMEOUT)
+	{
+		stats->timeouts++;
+	}
+
+	return serial_to_modem_error(status);
+}
+
+/* Start stats of a transfer from 0. */
+static void stats_init(modem_stats_t * stats)
+{
+	if(stats != NULL)
+	{
+		pad_buffer((unsigned char *) stats, sizeof(* stats), 0);
+	}
+}
+
+/* Count a packet of packet_size bytes sent; resend if it was sent before. */
+static void stats_sent(modem_stats_t * stats, size_t packet_size, int resend)
+{
+	if(stats == NULL)
+	{
+		return;
+	}
+
+	stats->packets_sent++;
+	stats->wire_bytes += packet_size;
+	if(resend)
+	{
+		stats->retransmits++;
+	}
+}
+
+/* Count an ACK which took rtt_ms to arrive. */
+static void stats_ack(modem_stats_t * stats, long rtt_ms)
+{
+	if(stats == NULL)
+	{
+		return;
+	}
+
+	if(stats->ack_rtt_count == 0 || rtt_ms < stats->ack_rtt_min_ms)
+	{
+		stats->ack_rtt_min_ms = rtt_ms;
+	}
+	if(rtt_ms > stats->ack_rtt_max_ms)
+	{
+		stats->ack_rtt_max_ms = rtt_ms;
+	}
+	stats->ack_rtt_count++;
+	stats->ack_rtt_total_ms += rtt_ms;
+}
@@ -0,0 +1,1139 @@
+#include "serial.h"
+#include "modem.h"
+
+#include <stddef.h> /* For size_t, NULL */
+
+/* Framing characters. */
+#define ZPAD 0x2A /* '*'; starts every header. */
+#define ZDLE 0x18 /* Escape character; the same as CAN. */
+#define ZBIN 0x41 /* 'A'; binary header with 16-bit CRC. */
+#define ZHEX 0x42 /* 'B'; hex header with 16-bit CRC. */
+#define ZBIN32 0x43 /* 'C'; binary header with 32-bit CRC. */
+#define ZRUB0 0x6C /* Escaped 0x7F. */
+#define ZRUB1 0x6D /* Escaped 0xFF. */
+#define XON 0x11
+#define XOFF 0x13
+#define BS 0x08
+
+/* Data subpacket terminators, sent after a ZDLE. */
+#define ZCRCE 0x68 /* End of frame; a header follows. */
+#define ZCRCG 0x69 /* More data follows; no response. */
+#define ZCRCQ 0x6A /* More data follows; ZACK expected. */
+#define ZCRCW 0x6B /* End of frame; ZACK expected. */
+
+/* Frame types. */
+#define ZRQINIT 0
+#define ZRINIT 1
+#define ZSINIT 2
+#define ZACK 3
+#define ZFILE 4
+#define ZSKIP 5
+#define ZNAK 6
+#define ZABORT 7
+#define ZFIN 8
+#define ZRPOS 9
+#define ZDATA 10
+#define ZEOF 11
+#define ZFERR 12
+#define ZCRC 13
+#define ZCHALLENGE 14
+
+/* Header bytes. Positions are sent LSB first, in ZP0-ZP3; flags are
+numbered from the other end, so ZF0 is the last byte. */
+#define ZP0 0
+#define ZF0 3
+
+/* ZRINIT capabilities, in ZF0. */
+#define CANFDX 0x01 /* Full duplex. */
+#define CANOVIO 0x02 /* Receives while writing to the sink. */
+#define CANFC32 0x20 /* Understands 32-bit CRCs. */
+#define ESCCTL 0x40 /* Wants every control character escaped. */
+
+/* ZFILE conversion option, in ZF0. */
+#define ZCBIN 1 /* Binary transfer; no newline conversion. */
+
+/* Results of the receive helpers, alongside frame types and data bytes. */
+#define ZM_ERROR -1 /* Bad CRC, or garbage where a frame should be. */
+#define ZM_TIMEOUT -2
+#define ZM_CANCEL -3 /* Five CANs in a row. */
+#define ZM_HW_ERROR -4
+#define ZM_TOO_LONG -5 /* Data subpacket longer than ZMODEM_BLOCK_SIZE. */
+#define GOT_FRAME_END 0x100 /* ORed with ZCRCE-ZCRCW by zdle_read(). */
+
+/* Bytes skipped while hunting for a header before giving up on it. A
+receiver may see a lot of them after asking a streaming transmitter to go
+back. */
+#define MAX_GARBAGE 16384
+
+/* The first ZMODEM_BLOCK_SIZE bytes of the caller's buffer hold a payload;
+the rest holds it again once encoded. */
+#define ENCODED ZMODEM_BLOCK_SIZE
+
+/* Protocol timeouts in milliseconds, and how often to retry before giving
+up. The defaults follow lrzsz. */
+#ifndef ZMODEM_TIMEOUT_MS
+	#define ZMODEM_TIMEOUT_MS 10000L /* Waiting for a header or data. */
+#endif
+#ifndef ZMODEM_FINISH_TIMEOUT_MS
+	#define ZMODEM_FINISH_TIMEOUT_MS 1000L /* Receiver waiting for "OO". */
+#endif
+#ifndef ZMODEM_RETRIES
+	#define ZMODEM_RETRIES 10
+#endif
+
+static modem_errors_t send_file(const ymodem_file_info_t * info, output_channel_t data_out_fcn, \
+	seek_channel_t seek_fcn, unsigned char * buf, void * chan_state, \
+	serial_handle_t serial_device, int use_crc32, const unsigned char * escapes);
+static modem_errors_t send_data(output_channel_t data_out_fcn, seek_channel_t seek_fcn, \
+	unsigned char * buf, void * chan_state, serial_handle_t serial_device, int use_crc32, \
+	const unsigned char * escapes, unsigned long pos);
+static modem_errors_t recv_file(input_channel_t data_in_fcn, unsigned char * buf, \
+	void * chan_state, serial_handle_t serial_device, unsigned long pos);
+static void send_hex_header(serial_handle_t serial_device, int type, const unsigned char * hdr);
+static void send_bin_header(serial_handle_t serial_device, int type, const unsigned char * hdr, \
+	int use_crc32, const unsigned char * escapes);
+static void send_subpacket(serial_handle_t serial_device, unsigned char * out, \
+	const unsigned char * data, size_t size, unsigned char frame_end, int use_crc32, \
+	const unsigned char * escapes);
+static size_t zdle_encode(unsigned char * out, const unsigned char * in, size_t size, \
+	const unsigned char * escapes);
+static int get_header(serial_handle_t serial_device, unsigned char * hdr, int first, \
+	int * use_crc32);
+static int poll_header(serial_handle_t serial_device, unsigned char * hdr);
+static int get_subpacket(serial_handle_t serial_device, unsigned char * buf, int * size, \
+	int use_crc32);
+static int zdle_read(serial_handle_t serial_device);
+static int read_hex(serial_handle_t serial_device);
+static int read_byte(serial_handle_t serial_device, long timeout_ms);
+static void cancel(serial_handle_t serial_device);
+static void put_pos(unsigned char * hdr, unsigned long pos);
+static unsigned long get_pos(const unsigned char * hdr);
+static size_t encode_file_info(unsigned char * buf, const ymodem_file_info_t * info);
+static void decode_file_info(const unsigned char * buf, int size, ymodem_file_info_t * info);
+static size_t put_number(unsigned char * buf, unsigned long value, unsigned int base);
+static unsigned long get_number(const unsigned char * buf, int size, int * pos, \
+	unsigned int base, int * found);
+static modem_errors_t frame_to_modem_error(int frame);
+
+/* Nonzero for bytes which are always sent escaped: ZDLE itself, XON and
+XOFF (which flow control would swallow) and DLE (which some networks
+swallow), with and without the high bit set. Everything else goes through
+zdle_encode() in runs. */
+static const unsigned char escape_table[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* escape_table, plus every other control character, for a receiver which
+asks for them to be escaped with ESCCTL. */
+static const unsigned char escape_ctl_table[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+
+modem_errors_t zmodem_tx(ymodem_next_file_t next_file_fcn, output_channel_t data_out_fcn, \
+	seek_channel_t seek_fcn, unsigned char * buf, void * chan_state, \
+	serial_handle_t serial_device)
+{
+	char wakeup[3] = { 'r', 'z', '\r' };
+	unsigned char hdr[4];
+	ymodem_file_info_t info;
+	modem_errors_t modem_status;
+	const unsigned char * escapes = escape_table;
+	unsigned int tries;
+	int use_crc32 = 0;
+	int frame, more;
+
+	/* "rz\r" starts a receiver from a shell prompt. Then ask for the
+	receiver's capabilities until it answers. */
+	serial_flush(serial_device);
+	serial_snd(wakeup, sizeof(wakeup), serial_device);
+	for(tries = 0; ; tries++)
+	{
+		if(tries > ZMODEM_RETRIES)
+		{
+			cancel(serial_device);
+			return MODEM_TIMEOUT;
+		}
+
+		put_pos(hdr, 0);
+		send_hex_header(serial_device, ZRQINIT, hdr);
+		frame = get_header(serial_device, hdr, -1, NULL);
+		if(frame == ZRINIT)
+		{
+			use_crc32 = (hdr[ZF0] & CANFC32) != 0;
+			if(hdr[ZF0] & ESCCTL)
+			{
+				escapes = escape_ctl_table;
+			}
+			break;
+		}
+		else if(frame == ZCHALLENGE)
+		{
+			send_hex_header(serial_device, ZACK, hdr);
+		}
+		else if(frame == ZM_CANCEL || frame == ZM_HW_ERROR)
+		{
+			return frame_to_modem_error(frame);
+		}
+	}
+
+	do{
+		/* Clear info, so callbacks need only set what they know. */
+		for(tries = 0; tries < sizeof(info.name); tries++)
+		{
+			info.name[tries] = NUL;
+		}
+		info.size = 0;
+		info.has_size = 0;
+		info.mtime = 0;
+		if((more = next_file_fcn(&info, chan_state)) < 0)
+		{
+			cancel(serial_device);
+			return CHANNEL_ERROR;
+		}
+
+		if(more && (modem_status = send_file(&info, data_out_fcn, seek_fcn, buf, \
+			chan_state, serial_device, use_crc32, escapes)) != MODEM_NO_ERRORS)
+		{
+			return modem_status;
+		}
+	}while(more);
+
+	/* End the session, and say "over and out" once the receiver agrees. */
+	for(tries = 0; tries <= ZMODEM_RETRIES; tries++)
+	{
+		put_pos(hdr, 0);
+		send_hex_header(serial_device, ZFIN, hdr);
+		frame = get_header(serial_device, hdr, -1, NULL);
+		if(frame == ZFIN)
+		{
+			char over[2] = { 'O', 'O' };
+
+			serial_snd(over, sizeof(over), serial_device);
+			return MODEM_NO_ERRORS;
+		}
+		else if(frame == ZM_CANCEL || frame == ZM_HW_ERROR)
+		{
+			return frame_to_modem_error(frame);
+		}
+	}
+
+	return MODEM_TIMEOUT;
+}
+
+modem_errors_t zmodem_rx(zmodem_open_file_t open_file_fcn, input_channel_t data_in_fcn, \
+	unsigned char * buf, void * chan_state, serial_handle_t serial_device)
+{
+	ymodem_file_info_t info;
+	unsigned char hdr[4];
+	modem_errors_t modem_status;
+	unsigned int errors = 0;
+	int reply = ZRINIT, send_reply = 1;
+	int use_crc32, frame, size, rc;
+	unsigned long offset;
+
+	while(1)
+	{
+		if(errors > ZMODEM_RETRIES)
+		{
+			cancel(serial_device);
+			return MODEM_TIMEOUT;
+		}
+
+		/* ZRINIT asks for the next file, or ZSKIP repeats that the last one
+		was refused. A zero buffer length invites full streaming. */
+		if(send_reply)
+		{
+			put_pos(hdr, 0);
+			if(reply == ZRINIT)
+			{
+				hdr[ZF0] = CANFDX | CANOVIO | CANFC32;
+			}
+			send_hex_header(serial_device, reply, hdr);
+		}
+		send_reply = 1;
+
+		frame = get_header(serial_device, hdr, -1, &use_crc32);
+		switch(frame)
+		{
+			case ZRQINIT:
+				break;
+			case ZSINIT:
+				/* The attention string is of no use here; just accept it. */
+				send_reply = 0;
+				put_pos(hdr, 0);
+				rc = get_subpacket(serial_device, buf, &size, use_crc32);
+				send_hex_header(serial_device, (rc >= 0) ? ZACK : ZNAK, hdr);
+				break;
+			case ZFILE:
+				if((rc = get_subpacket(serial_device, buf, &size, use_crc32)) < 0)
+				{
+					if(rc == ZM_TOO_LONG)
+					{
+						cancel(serial_device);
+					}
+					if(rc == ZM_CANCEL || rc == ZM_HW_ERROR || rc == ZM_TOO_LONG)
+					{
+						return frame_to_modem_error(rc);
+					}
+					send_reply = 0;
+					put_pos(hdr, 0);
+					send_hex_header(serial_device, ZNAK, hdr);
+					errors++;
+					break;
+				}
+
+				decode_file_info(buf, size, &info);
+				offset = 0;
+				if((rc = open_file_fcn(&info, &offset, chan_state)) < 0)
+				{
+					cancel(serial_device);
+					return CHANNEL_ERROR;
+				}
+				else if(rc > 0)
+				{
+					reply = ZSKIP;
+					break;
+				}
+
+				if((modem_status = recv_file(data_in_fcn, buf, chan_state, \
+					serial_device, offset)) != MODEM_NO_ERRORS)
+				{
+					return modem_status;
+				}
+				reply = ZRINIT;
+				errors = 0;
+				break;
+			case ZFIN:
+				put_pos(hdr, 0);
+				send_hex_header(serial_device, ZFIN, hdr);
+				/* "OO" is a courtesy; don't wait long for it. */
+				(void) read_byte(serial_device, ZMODEM_FINISH_TIMEOUT_MS);
+				(void) read_byte(serial_device, ZMODEM_FINISH_TIMEOUT_MS);
+				return MODEM_NO_ERRORS;
+			case ZM_CANCEL:
+			case ZM_HW_ERROR:
+				return frame_to_modem_error(frame);
+			default:
+				errors++;
+				break;
+		}
+	}
+}
+
+
+/* Private functions begin here. */
+/* Offer one file with ZFILE, then send it from wherever the receiver asks. */
+static modem_errors_t send_file(const ymodem_file_info_t * info, output_channel_t data_out_fcn, \
+	seek_channel_t seek_fcn, unsigned char * buf, void * chan_state, \
+	serial_handle_t serial_device, int use_crc32, const unsigned char * escapes)
+{
+	unsigned char hdr[4];
+	unsigned int tries;
+	size_t info_size;
+	int frame, resend = 1;
+
+	info_size = encode_file_info(buf, info);
+	for(tries = 0; tries <= ZMODEM_RETRIES; tries++)
+	{
+		if(resend)
+		{
+			put_pos(hdr, 0);
+			hdr[ZF0] = ZCBIN;
+			send_bin_header(serial_device, ZFILE, hdr, use_crc32, escapes);
+			send_subpacket(serial_device, buf + ENCODED, buf, info_size, ZCRCW, use_crc32, \
+				escapes);
+		}
+		resend = 1;
+
+		frame = get_header(serial_device, hdr, -1, NULL);
+		switch(frame)
+		{
+			case ZRPOS:
+				return send_data(data_out_fcn, seek_fcn, buf, chan_state, serial_device, \
+					use_crc32, escapes, get_pos(hdr));
+			case ZSKIP:
+				return MODEM_NO_ERRORS;
+			case ZRINIT:
+				/* A late answer to ZRQINIT; the answer to ZFILE is still on
+				its way. */
+				resend = 0;
+				break;
+			case ZM_CANCEL:
+			case ZM_HW_ERROR:
+				return frame_to_modem_error(frame);
+			default:
+				break;
+		}
+	}
+
+	cancel(serial_device);
+	return MODEM_TIMEOUT;
+}
+
+/* Stream a file from pos in one ZDATA frame of ZCRCG subpackets, with no
+acknowledgements. The receiver interrupts with ZRPOS if anything goes wrong,
+and the frame restarts from where it asks. */
+static modem_errors_t send_data(output_channel_t data_out_fcn, seek_channel_t seek_fcn, \
+	unsigned char * buf, void * chan_state, serial_handle_t serial_device, int use_crc32, \
+	const unsigned char * escapes, unsigned long pos)
+{
+	unsigned char hdr[4];
+	unsigned int errors = 0, tries;
+	unsigned long last_rpos = pos;
+	int frame;
+
+	while(1)
+	{
+		int last_sent_size = 0, eof = 0;
+
+		if(seek_fcn(pos, chan_state) < 0)
+		{
+			cancel(serial_device);
+			return CHANNEL_ERROR;
+		}
+
+		put_pos(hdr, pos);
+		send_bin_header(serial_device, ZDATA, hdr, use_crc32, escapes);
+
+		frame = ZM_TIMEOUT;
+		while(!eof)
+		{
+			int bytes_read = data_out_fcn((char *) buf, ZMODEM_BLOCK_SIZE, \
+				last_sent_size, chan_state);
+
+			if(bytes_read < 0 || bytes_read > ZMODEM_BLOCK_SIZE)
+			{
+				cancel(serial_device);
+				return CHANNEL_ERROR;
+			}
+
+			eof = (bytes_read < ZMODEM_BLOCK_SIZE);
+			send_subpacket(serial_device, buf + ENCODED, buf, bytes_read, \
+				eof ? ZCRCE : ZCRCG, use_crc32, escapes);
+			pos += bytes_read;
+			last_sent_size = bytes_read;
+
+			/* Check whether the receiver has spoken up, without waiting.
+			Anything but a request to go elsewhere is noise. */
+			frame = eof ? ZM_TIMEOUT : poll_header(serial_device, hdr);
+			if(frame == ZRPOS || frame == ZSKIP || frame == ZM_CANCEL \
+				|| frame == ZM_HW_ERROR)
+			{
+				/* Close the frame, so the receiver isn't left expecting
+				more data. */
+				send_subpacket(serial_device, buf + ENCODED, buf, 0, ZCRCE, use_crc32, \
+					escapes);
+				break;
+			}
+		}
+
+		/* Wait for the receiver to confirm the end of the file. */
+		for(tries = 0; eof && tries <= ZMODEM_RETRIES; tries++)
+		{
+			put_pos(hdr, pos);
+			send_bin_header(serial_device, ZEOF, hdr, use_crc32, escapes);
+			if((frame = get_header(serial_device, hdr, -1, NULL)) != ZM_TIMEOUT \
+				&& frame != ZM_ERROR && frame != ZACK)
+			{
+				break;
+			}
+		}
+
+		switch(frame)
+		{
+			case ZRINIT:
+			case ZSKIP:
+				return MODEM_NO_ERRORS;
+			case ZRPOS:
+				/* Give up if the receiver keeps asking for the same data. */
+				pos = get_pos(hdr);
+				errors = (pos > last_rpos) ? 0 : errors + 1;
+				last_rpos = pos;
+				if(errors <= ZMODEM_RETRIES)
+				{
+					break;
+				}
+				cancel(serial_device);
+				return MODEM_TIMEOUT;
+			case ZM_CANCEL:
+			case ZM_HW_ERROR:
+				return frame_to_modem_error(frame);
+			default:
+				cancel(serial_device);
+				return MODEM_TIMEOUT;
+		}
+	}
+}
+
+/* Receive one file, starting at pos. Every error is answered with ZRPOS,
+which sends the transmitter back to the first byte not yet received. */
+static modem_errors_t recv_file(input_channel_t data_in_fcn, unsigned char * buf, \
+	void * chan_state, serial_handle_t serial_device, unsigned long pos)
+{
+	unsigned char hdr[4];
+	unsigned int errors = 0;
+	int frame, frame_end, use_crc32, size;
+
+	while(1)
+	{
+		if(errors > ZMODEM_RETRIES)
+		{
+			cancel(serial_device);
+			return MODEM_TIMEOUT;
+		}
+
+		put_pos(hdr, pos);
+		send_hex_header(serial_device, ZRPOS, hdr);
+
+		frame = get_header(serial_device, hdr, -1, &use_crc32);
+		while(frame == ZDATA && get_pos(hdr) == pos)
+		{
+			do{
+				if((frame_end = get_subpacket(serial_device, buf, &size, use_crc32)) < 0)
+				{
+					break;
+				}
+
+				if(data_in_fcn((const char *) buf, size, 0, chan_state) < size)
+				{
+					cancel(serial_device);
+					return CHANNEL_ERROR;
+				}
+				pos += size;
+				errors = 0;
+
+				if(frame_end == ZCRCQ || frame_end == ZCRCW)
+				{
+					put_pos(hdr, pos);
+					send_hex_header(serial_device, ZACK, hdr);
+				}
+			}while(frame_end == ZCRCG || frame_end == ZCRCQ);
+
+			/* At the end of a frame, the next header follows immediately. */
+			frame = (frame_end < 0) ? frame_end : \
+				get_header(serial_device, hdr, -1, &use_crc32);
+		}
+
+		/* A ZEOF from beyond pos may have been sent before the transmitter
+		saw the last ZRPOS; let it time out and ask again. */
+		while(frame == ZEOF && get_pos(hdr) != pos)
+		{
+			frame = get_header(serial_device, hdr, -1, &use_crc32);
+		}
+
+		if(frame == ZEOF)
+		{
+			if(data_in_fcn((const char *) buf, 0, 1, chan_state) != 0)
+			{
+				cancel(serial_device);
+				return CHANNEL_ERROR;
+			}
+			return MODEM_NO_ERRORS;
+		}
+		else if(frame == ZFILE)
+		{
+			/* The ZRPOS went astray, and the transmitter offered the file
+			again. */
+			(void) get_subpacket(serial_device, buf, &size, use_crc32);
+		}
+		else if(frame == ZM_TOO_LONG)
+		{
+			/* Asking again would only get the same subpacket. */
+			cancel(serial_device);
+			return frame_to_modem_error(frame);
+		}
+		else if(frame == ZM_CANCEL || frame == ZM_HW_ERROR)
+		{
+			return frame_to_modem_error(frame);
+		}
+
+		/* Includes ZDATA for the wrong position. */
+		errors++;
+	}
+}
+
+/* Hex headers are plain ASCII, so they survive any link; they are used for
+everything the receiver sends, and for ZRQINIT and ZFIN. */
+static void send_hex_header(serial_handle_t serial_device, int type, const unsigned char * hdr)
+{
+	unsigned char frame[7];
+	char out[4 + 2 * 7 + 3];
+	crc_state_t check;
+	unsigned short crc;
+	size_t len = 0;
+	int count;
+
+	frame[0] = (unsigned char) type;
+	for(count = 0; count < 4; count++)
+	{
+		frame[count + 1] = hdr[count];
+	}
+	crc_init(&check, XMODEM_CRC);
+	crc_update(&check, frame, 5);
+	crc = crc_final(&check);
+	frame[5] = (unsigned char) (crc >> 8);
+	frame[6] = (unsigned char) crc;
+
+	out[len++] = ZPAD;
+	out[len++] = ZPAD;
+	out[len++] = ZDLE;
+	out[len++] = ZHEX;
+	for(count = 0; count < 7; count++)
+	{
+		out[len++] = hex_digits[frame[count] >> 4];
+		out[len++] = hex_digits[frame[count] & 0x0F];
+	}
+	out[len++] = '\r';
+	out[len++] = (char) ('\n' | 0x80);
+	/* Undo a stray XOFF, except at the end of the session, when the other
+	side may already be back at a prompt. */
+	if(type != ZACK && type != ZFIN)
+	{
+		out[len++] = XON;
+	}
+
+	serial_snd(out, len, serial_device);
+}
+
+static void send_bin_header(serial_handle_t serial_device, int type, const unsigned char * hdr, \
+	int use_crc32, const unsigned char * escapes)
+{
+	unsigned char frame[9];
+	unsigned char out[3 + 2 * 9];
+	size_t len;
+	int count;
+
+	frame[0] = (unsigned char) type;
+	for(count = 0; count < 4; count++)
+	{
+		frame[count + 1] = hdr[count];
+	}
+
+	if(use_crc32)
+	{
+		unsigned long crc = generate_crc32(0, frame, 5);
+
+		/* Sent LSB first, unlike the 16-bit CRC. */
+		for(count = 0; count < 4; count++)
+		{
+			frame[count + 5] = (unsigned char) (crc >> (8 * count));
+		}
+		len = 9;
+	}
+	else
+	{
+		crc_state_t check;
+
+		crc_init(&check, XMODEM_CRC);
+		crc_update(&check, frame, 5);
+		frame[5] = (unsigned char) (crc_final(&check) >> 8);
+		frame[6] = (unsigned char) crc_final(&check);
+		len = 7;
+	}
+
+	out[0] = ZPAD;
+	out[1] = ZDLE;
+	out[2] = use_crc32 ? ZBIN32 : ZBIN;
+	len = 3 + zdle_encode(&out[3], frame, len, escapes);
+	serial_snd((char *) out, len, serial_device);
+}
+
+/* Encode a subpacket into out (2 * size + 10 bytes) and send it with one
+write. The CRC covers the data and the terminator. */
+static void send_subpacket(serial_handle_t serial_device, unsigned char * out, \
+	const unsigned char * data, size_t size, unsigned char frame_end, int use_crc32, \
+	const unsigned char * escapes)
+{
+	unsigned char trailer[4];
+	size_t len;
+
+	len = zdle_encode(out, data, size, escapes);
+	out[len++] = ZDLE;
+	out[len++] = frame_end;
+
+	if(use_crc32)
+	{
+		unsigned long crc = generate_crc32(generate_crc32(0, data, size), &frame_end, 1);
+
+		trailer[0] = (unsigned char) crc;
+		trailer[1] = (unsigned char) (crc >> 8);
+		trailer[2] = (unsigned char) (crc >> 16);
+		trailer[3] = (unsigned char) (crc >> 24);
+		len += zdle_encode(&out[len], trailer, 4, escapes);
+	}
+	else
+	{
+		crc_state_t check;
+
+		crc_init(&check, XMODEM_CRC);
+		crc_update(&check, data, size);
+		crc_update(&check, &frame_end, 1);
+		trailer[0] = (unsigned char) (crc_final(&check) >> 8);
+		trailer[1] = (unsigned char) crc_final(&check);
+		len += zdle_encode(&out[len], trailer, 2, escapes);
+	}
+
+	serial_snd((char *) out, len, serial_device);
+}
+
+/* Escape the bytes marked in escapes, which is escape_table or
+escape_ctl_table. Returns the encoded size, at most 2 * size. */
+static size_t zdle_encode(unsigned char * out, const unsigned char * in, size_t size, \
+	const unsigned char * escapes)
+{
+	unsigned char * start = out;
+	const unsigned char * end = in + size;
+
+	while(in < end)
+	{
+		/* Almost every byte goes through as-is; copy runs of them without
+		checking for anything else. */
+		while(in < end && !escapes[*in])
+		{
+			*out++ = *in++;
+		}
+
+		if(in < end)
+		{
+			*out++ = ZDLE;
+			*out++ = *in++ ^ 0x40;
+		}
+	}
+
+	return out - start;
+}
+
+/* Wait for a header, skipping anything before it. first is a byte already
+read which may start the header, or -1. Returns the frame type with the four
+header bytes in hdr, or a ZM_* code. use_crc32, if non-NULL, is set if the
+header (and so the data that follows it) uses 32-bit CRCs. */
+static int get_header(serial_handle_t serial_device, unsigned char * hdr, int first, \
+	int * use_crc32)
+{
+	unsigned char frame[9];
+	unsigned long garbage = 0;
+	unsigned int cans = 0;
+	int pad_seen = 0, format = 0, size, count, c;
+
+	c = (first >= 0) ? first : read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+	while(1)
+	{
+		if(c < 0)
+		{
+			return c;
+		}
+
+		cans = (c == CAN) ? cans + 1 : 0;
+		if(cans >= 5)
+		{
+			return ZM_CANCEL;
+		}
+
+		if(c == ZDLE && pad_seen)
+		{
+			format = c = read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+			if(format == ZBIN || format == ZHEX || format == ZBIN32)
+			{
+				break;
+			}
+			/* Look at this byte again; it may be a CAN. */
+			pad_seen = 0;
+			continue;
+		}
+
+		pad_seen = (c == ZPAD);
+		if(++garbage > MAX_GARBAGE)
+		{
+			return ZM_ERROR;
+		}
+		c = read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+	}
+
+	size = (format == ZBIN32) ? 9 : 7;
+	for(count = 0; count < size; count++)
+	{
+		c = (format == ZHEX) ? read_hex(serial_device) : zdle_read(serial_device);
+		if(c < 0 || c >= GOT_FRAME_END)
+		{
+			return (c < 0) ? c : ZM_ERROR;
+		}
+		frame[count] = (unsigned char) c;
+	}
+
+	if(format == ZBIN32)
+	{
+		unsigned long crc = generate_crc32(0, frame, 5);
+
+		for(count = 0; count < 4; count++)
+		{
+			if(frame[count + 5] != (unsigned char) (crc >> (8 * count)))
+			{
+				return ZM_ERROR;
+			}
+		}
+	}
+	else
+	{
+		crc_state_t check;
+
+		/* The CRC includes itself, leaving 0 for a good header. */
+		crc_init(&check, XMODEM_CRC);
+		crc_update(&check, frame, 7);
+		if(crc_final(&check) != 0)
+		{
+			return ZM_ERROR;
+		}
+	}
+
+	/* Hex headers end with CR LF (either may have the high bit set). A
+	trailing XON is left to be skipped as garbage. */
+	if(format == ZHEX && ((c = read_byte(serial_device, ZMODEM_TIMEOUT_MS)) & 0x7F) == '\r')
+	{
+		(void) read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+	}
+
+	for(count = 0; count < 4; count++)
+	{
+		hdr[count] = frame[count + 1];
+	}
+	if(use_crc32 != NULL)
+	{
+		(* use_crc32) = (format == ZBIN32);
+	}
+	return frame[0];
+}
+
+/* Return a header if the start of one has already arrived, without waiting
+for one otherwise (ZM_TIMEOUT). */
+static int poll_header(serial_handle_t serial_device, unsigned char * hdr)
+{
+	char c;
+
+	while(serial_rcv_ms(&c, 1, 0, NULL, serial_device) == SERIAL_NO_ERRORS)
+	{
+		if(c == ZPAD || c == CAN)
+		{
+			return get_header(serial_device, hdr, (unsigned char) c, NULL);
+		}
+	}
+
+	return ZM_TIMEOUT;
+}
+
+/* Receive a data subpacket of up to ZMODEM_BLOCK_SIZE bytes into buf.
+Returns its terminator (ZCRCE-ZCRCW), or a ZM_* code; ZM_TOO_LONG if the
+subpacket doesn't fit. */
+static int get_subpacket(serial_handle_t serial_device, unsigned char * buf, int * size, \
+	int use_crc32)
+{
+	unsigned char trailer[5];
+	int count = 0, trailer_size, c;
+
+	while((c = zdle_read(serial_device)) >= 0 && c < GOT_FRAME_END)
+	{
+		if(count == ZMODEM_BLOCK_SIZE)
+		{
+			return ZM_TOO_LONG;
+		}
+		buf[count++] = (unsigned char) c;
+	}
+	if(c < 0)
+	{
+		return c;
+	}
+
+	trailer[0] = (unsigned char) c;
+	trailer_size = use_crc32 ? 5 : 3;
+	for(c = 1; c < trailer_size; c++)
+	{
+		int t = zdle_read(serial_device);
+
+		if(t < 0 || t >= GOT_FRAME_END)
+		{
+			return (t < 0) ? t : ZM_ERROR;
+		}
+		trailer[c] = (unsigned char) t;
+	}
+
+	if(use_crc32)
+	{
+		unsigned long crc = generate_crc32(generate_crc32(0, buf, count), trailer, 1);
+
+		if(trailer[1] != (unsigned char) crc || trailer[2] != (unsigned char) (crc >> 8) \
+			|| trailer[3] != (unsigned char) (crc >> 16) \
+			|| trailer[4] != (unsigned char) (crc >> 24))
+		{
+			return ZM_ERROR;
+		}
+	}
+	else
+	{
+		crc_state_t check;
+
+		crc_init(&check, XMODEM_CRC);
+		crc_update(&check, buf, count);
+		crc_update(&check, trailer, 3);
+		if(crc_final(&check) != 0)
+		{
+			return ZM_ERROR;
+		}
+	}
+
+	(* size) = count;
+	return trailer[0];
+}
+
+/* Read one byte of binary data, undoing ZDLE escapes. A subpacket
+terminator is returned as GOT_FRAME_END | ZCRCx. */
+static int zdle_read(serial_handle_t serial_device)
+{
+	unsigned int cans;
+	int c;
+
+	/* Flow control characters are always escaped, so bare ones are noise
+	from the link. */
+	do{
+		c = read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+	}while(c == XON || c == XOFF || c == (XON | 0x80) || c == (XOFF | 0x80));
+
+	if(c != ZDLE)
+	{
+		return c;
+	}
+
+	/* ZDLE is CAN; four more of them cancel. */
+	cans = 1;
+	do{
+		c = read_byte(serial_device, ZMODEM_TIMEOUT_MS);
+		if(c == CAN && ++cans >= 5)
+		{
+			return ZM_CANCEL;
+		}
+	}while(c == CAN || c == XON || c == XOFF);
+
+	switch(c)
+	{
+		case ZCRCE:
+		case ZCRCG:
+		case ZCRCQ:
+		case ZCRCW:
+			return GOT_FRAME_END | c;
+		case ZRUB0:
+			return 0x7F;
+		case ZRUB1:
+			return 0xFF;
+		default:
+			if(c < 0)
+			{
+				return c;
+			}
+			return ((c & 0x60) == 0x40) ? (c ^ 0x40) : ZM_ERROR;
+	}
+}
+
+/* Two lowercase hex digits. */
+static int read_hex(serial_handle_t serial_device)
+{
+	int value = 0, count, c;
+
+	for(count = 0; count < 2; count++)
+	{
+		if((c = read_byte(serial_device, ZMODEM_TIMEOUT_MS)) < 0)
+		{
+			return c;
+		}
+
+		c &= 0x7F;
+		if(c >= '0' && c <= '9')
+		{
+			value = (value << 4) | (c - '0');
+		}
+		else if(c >= 'a' && c <= 'f')
+		{
+			value = (value << 4) | (c - 'a' + 10);
+		}
+		else
+		{
+			return ZM_ERROR;
+		}
+	}
+
+	return value;
+}
+
+static int read_byte(serial_handle_t serial_device, long timeout_ms)
+{
+	serial_status_t ser_status;
+	char c;
+
+	ser_status = serial_rcv_ms(&c, 1, timeout_ms, NULL, serial_device);
+	if(ser_status == SERIAL_TIMEOUT)
+	{
+		return ZM_TIMEOUT;
+	}
+	else if(ser_status != SERIAL_NO_ERRORS)
+	{
+		return ZM_HW_ERROR;
+	}
+
+	return (unsigned char) c;
+}
+
+/* Eight CANs, then backspaces to erase them in case the other side is a
+terminal. */
+static void cancel(serial_handle_t serial_device)
+{
+	char abort_seq[16] = { CAN, CAN, CAN, CAN, CAN, CAN, CAN, CAN, \
+		BS, BS, BS, BS, BS, BS, BS, BS };
+
+	serial_snd(abort_seq, sizeof(abort_seq), serial_device);
+}
+
+static void put_pos(unsigned char * hdr, unsigned long pos)
+{
+	hdr[ZP0] = (unsigned char) pos;
+	hdr[ZP0 + 1] = (unsigned char) (pos >> 8);
+	hdr[ZP0 + 2] = (unsigned char) (pos >> 16);
+	hdr[ZP0 + 3] = (unsigned char) (pos >> 24);
+}
+
+static unsigned long get_pos(const unsigned char * hdr)
+{
+	return (unsigned long) hdr[ZP0] | ((unsigned long) hdr[ZP0 + 1] << 8) \
+		| ((unsigned long) hdr[ZP0 + 2] << 16) | ((unsigned long) hdr[ZP0 + 3] << 24);
+}
+
+/* The ZFILE subpacket: the name, a NUL, then the decimal size and octal
+modification time separated by a space, and another NUL. */
+static size_t encode_file_info(unsigned char * buf, const ymodem_file_info_t * info)
+{
+	size_t len = 0;
+
+	while(len < YMODEM_MAX_NAME && info->name[len] != NUL)
+	{
+		buf[len] = (unsigned char) info->name[len];
+		len++;
+	}
+	buf[len++] = NUL;
+
+	/* The modification time can't be sent without the size before it. */
+	if(info->has_size)
+	{
+		len += put_number(&buf[len], info->size, 10);
+		buf[len++] = ' ';
+		len += put_number(&buf[len], info->mtime, 8);
+	}
+	buf[len++] = NUL;
+
+	return len;
+}
+
+static void decode_file_info(const unsigned char * buf, int size, ymodem_file_info_t * info)
+{
+	int pos = 0, len = 0, found;
+
+	while(pos < size && buf[pos] != NUL)
+	{
+		if(len < YMODEM_MAX_NAME)
+		{
+			info->name[len++] = (char) buf[pos];
+		}
+		pos++;
+	}
+	info->name[len] = NUL;
+	pos++;
+
+	info->size = get_number(buf, size, &pos, 10, &info->has_size);
+	info->mtime = get_number(buf, size, &pos, 8, &found);
+}
+
+static size_t put_number(unsigned char * buf, unsigned long value, unsigned int base)
+{
+	unsigned char digits[12];
+	size_t len = 0, count = 0;
+
+	do{
+		digits[count++] = (unsigned char) ('0' + value % base);
+		value /= base;
+	}while(value > 0);
+
+	while(count > 0)
+	{
+		buf[len++] = digits[--count];
+	}
+
+	return len;
+}
+
+/* Parse a number at buf[*pos], skipping leading spaces. found is set if
+there were any digits. */
+static unsigned long get_number(const unsigned char * buf, int size, int * pos, \
+	unsigned int base, int * found)
+{
+	unsigned long value = 0;
+
+	(* found) = 0;
+	while((* pos) < size && buf[* pos] == ' ')
+	{
+		(* pos)++;
+	}
+
+	while((* pos) < size && buf[* pos] >= '0' && buf[* pos] < '0' + base)
+	{
+		value = value * base + (buf[* pos] - '0');
+		(* found) = 1;
+		(* pos)++;
+	}
+
+	return value;
+}
+
+static modem_errors_t frame_to_modem_error(int frame)
+{
+	switch(frame)
+	{
+		case ZM_CANCEL:
+			return SENT_CAN;
+		case ZM_HW_ERROR:
+			return MODEM_HW_ERROR;
+		case ZM_TIMEOUT:
+			return MODEM_TIMEOUT;
+		case ZM_TOO_LONG:
+			return NOT_IMPLEMENTED;
+		default:
+			return UNDEFINED_ERROR;
+	}
+}
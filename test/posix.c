@@ -0,0 +1,1678 @@
+/* End-to-end tests of the posix platform over pseudo-terminals. Unlike
+unittest.c, these run the real serprim.c; no hardware is required. */
+
+/* openpty() is not in POSIX. */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "minunit.h"
+
+#include "serial.h"
+#include "modem.h"
+#include "posix/serposix.h"
+#include "posix/filechan.h"
+#include "posix/runner.h"
+#ifdef __linux__
+#include "posix/engine.h"
+#endif
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stddef.h>
+
+#if defined(__APPLE__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <util.h>
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+#include <libutil.h>
+#else
+#include <pty.h>
+#endif
+
+#define XFER_SIZE (100 * 1024 + 77)
+#define TX_WINDOW 8
+
+/* Variants of run_xfer(), which may be combined. */
+#define XFER_PLAIN 0
+#define XFER_ZERO_COPY 1 /* xmodem_tx_borrow() and xmodem_rx_window(). */
+#define XFER_TX_WINDOW 2 /* xmodem_tx_windowed(). */
+#define XFER_RX_WINDOW 4 /* xmodem_rx_windowed(). */
+#define XFER_YMODEM 8 /* ymodem_tx() and ymodem_rx(), sending a batch. */
+#define XFER_TX_1K 16 /* Transmitter uses XMODEM_1K, whatever the mode. */
+#define XFER_RX_1K 32 /* Receiver uses XMODEM_1K, whatever the mode. */
+#define XFER_ZMODEM 64 /* zmodem_tx() and zmodem_rx(), sending the batch. */
+#define XFER_TX_PREFETCH 128 /* xmodem_tx_prefetch(). */
+
+/* Pty pairs run at once by the transfer engine. */
+#define ENGINE_PAIRS 200
+/* Ports sent the same image at once, and its size. */
+#define ENGINE_FANOUT 48
+#define ENGINE_IMAGE_SIZE (20 * 1024 + 300)
+/* Pty pairs run at once by the thread pool runner, and its threads. Slaves
+are opened through serial_init() from this port number on. */
+#define RUNNER_PAIRS 32
+#define RUNNER_WORKERS 16
+#define RUNNER_PORT_BASE 100
+
+/* ZMODEM frame types and framing, for playing one side by hand. */
+#define ZM_ZRINIT 1
+#define ZM_ZFILE 4
+#define ZM_ZFIN 8
+#define ZM_ZRPOS 9
+#define ZM_ZDATA 10
+#define ZM_ZDLE 0x18
+#define ZM_ZCRCE 0x68
+#define ZM_ZCRCW 0x6B
+#define ZM_ESCCTL 0x40 /* In ZF0, the last header byte, of ZRINIT. */
+
+/* Exit status which tells meson a test was skipped. */
+#define EXIT_SKIPPED 77
+
+typedef struct mem_chan
+{
+	unsigned char * buf;
+	size_t buflen;
+	size_t bufpos;
+}mem_chan_t;
+
+typedef struct rx_job
+{
+	serial_handle_t port;
+	xmodem_xfer_mode_t mode;
+	mem_chan_t chan;
+	int variant;
+	file_sink_t * sink; /* If non-NULL, receive into this instead of chan. */
+	modem_errors_t status;
+}rx_job_t;
+
+typedef struct pipe_job
+{
+	int fd;
+	size_t size;
+}pipe_job_t;
+
+serial_handle_t master_port, slave_port;
+char slave_name[64];
+unsigned char tx_data[XFER_SIZE];
+unsigned char rx_data[XFER_SIZE + 1024];
+unsigned char tx_packet[X1K_END + 1];
+unsigned char rx_packet[X1K_END + 1];
+unsigned char tx_window_buf[TX_WINDOW * X1K_END];
+/* YMODEM batch of two files: all of tx_data, then its first 1000 bytes. */
+size_t batch_sizes[2];
+int batch_sent, batch_opened;
+/* ZMODEM resumes the first file of the batch from here. */
+unsigned long zmodem_resume_at;
+unsigned char tx_zbuf[ZMODEM_BUF_SIZE];
+unsigned char rx_zbuf[ZMODEM_BUF_SIZE];
+/* SFL loads are placed in rx_data relative to this address. */
+#define SFL_BASE 0x40000000UL
+unsigned long sfl_entry;
+unsigned int sfl_loads, sfl_regions_sent;
+unsigned char sfl_tx_buf[SFL_TX_BUF_SIZE];
+unsigned char source_buf[FILECHAN_MIN_BUF];
+unsigned char sink_buf[2 * FILECHAN_MIN_BUF];
+/* Transfers the engine has reported finished. */
+unsigned int engine_finished;
+
+static int mem_out(char * buf, const int request_size, const int last_sent_size, void * const chan_state);
+static int mem_borrow(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state);
+static int mem_in(const char * buf, const int buf_size, const int eof, void * const chan_state);
+static char * mem_window(const int request_size, const int last_recv_size, const int eof, void * const chan_state);
+static int batch_next(ymodem_file_info_t * info, void * const chan_state);
+static int batch_open(const ymodem_file_info_t * info, void * const chan_state);
+static int zmodem_open(const ymodem_file_info_t * info, unsigned long * offset, void * const chan_state);
+static int mem_seek(unsigned long offset, void * const chan_state);
+static int lrzsz_next(ymodem_file_info_t * info, void * const chan_state);
+static int lrzsz_open(const ymodem_file_info_t * info, unsigned long * offset, void * const chan_state);
+static int sfl_store(unsigned long address, const char * buf, const int buf_size, const int eof, void * const chan_state);
+static int sfl_boot(unsigned long address, void * const chan_state);
+static void * sfl_thread(void * arg);
+static int sfl_regions(unsigned long * address, const unsigned char ** data, size_t * size, void * const chan_state);
+static size_t sfl_frame(unsigned char * frame, unsigned char cmd, unsigned long address, \
+	const unsigned char * data, size_t len);
+static void * ztx_thread(void * arg);
+static size_t zm_hex_header(char * out, int type, const unsigned char * hdr);
+static size_t zm_subpacket(unsigned char * out, const unsigned char * data, size_t size, \
+	unsigned char frame_end);
+static int find_program(const char * name, const char * alt_name, char * path, size_t size);
+static pid_t spawn_on_slave(const char * path, char * const argv[], const char * dir);
+#ifdef __linux__
+static void engine_done(engine_port_t * port, modem_errors_t status, void * const chan_state);
+#endif
+static void * rx_thread(void * arg);
+static void * pipe_thread(void * arg);
+static void fill_random(size_t size);
+static int temp_fd(void);
+static double now_sec(void);
+static void run_xfer(xmodem_xfer_mode_t mode, size_t size, int variant);
+static void run_file_xfer(xmodem_xfer_mode_t mode, size_t size, int from_pipe);
+
+
+void pty_setup()
+{
+	int master_fd, slave_fd;
+
+	master_port = slave_port = NULL;
+	if(openpty(&master_fd, &slave_fd, slave_name, NULL, NULL))
+	{
+		return;
+	}
+
+	master_port = posix_open_fd(master_fd, 115200);
+	slave_port = posix_open_fd(slave_fd, 115200);
+}
+
+void pty_teardown()
+{
+	if(master_port != NULL)
+	{
+		serial_close(&master_port);
+	}
+	if(slave_port != NULL)
+	{
+		serial_close(&slave_port);
+	}
+}
+
+
+MU_TEST(test_posix_open_fd)
+{
+	int pipe_fds[2];
+
+	mu_check(master_port != NULL);
+	mu_check(slave_port != NULL);
+	mu_check(posix_get_fd(master_port) >= 0);
+	mu_check(posix_open_fd(-1, 115200) == NULL);
+
+	/* A pipe is never a tty; don't use stdin, which may be the user's. */
+	mu_check(pipe(pipe_fds) == 0);
+	mu_check(posix_open_fd(pipe_fds[0], 115200) == NULL);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+MU_TEST(test_posix_roundtrip)
+{
+	char out[] = "\x00\x11\x13\x0D\x0A\x1A\x7F\xFFraw";
+	char in[sizeof(out)];
+
+	/* Control characters must pass through untouched in raw mode. */
+	mu_check(serial_snd(out, sizeof(out), master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(in, sizeof(out), 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_check(memcmp(in, out, sizeof(out)) == 0);
+
+	mu_check(serial_snd(in, sizeof(in), slave_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(out, sizeof(in), 1, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_check(memcmp(in, out, sizeof(out)) == 0);
+}
+
+MU_TEST(test_posix_sndv)
+{
+	serial_iovec_t spans[40];
+	char out[40 * 3];
+	char in[sizeof(out)];
+	unsigned int i, total = 0;
+
+	/* More spans than fit in one writev() batch, some of them empty. */
+	for(i = 0; i < sizeof(out); i++)
+	{
+		out[i] = (char) (i * 7);
+	}
+	for(i = 0; i < 40; i++)
+	{
+		spans[i].data = out + total;
+		spans[i].num_bytes = i % 4;
+		total += spans[i].num_bytes;
+	}
+
+	mu_check(serial_sndv(spans, 40, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(in, total, 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_check(memcmp(in, out, total) == 0);
+	mu_check(serial_rcv(in, 1, 0, NULL, slave_port) == SERIAL_TIMEOUT);
+}
+
+MU_TEST(test_posix_timeout_whole_request)
+{
+	char buf[4];
+	double start, wall;
+	clock_t cpu;
+
+	/* Only half of the request arrives, so the read must time out after
+	the full timeout without spinning on the CPU. */
+	mu_check(serial_snd("ab", 2, master_port) == SERIAL_NO_ERRORS);
+	start = now_sec();
+	cpu = clock();
+	mu_check(serial_rcv(buf, 4, 1, NULL, slave_port) == SERIAL_TIMEOUT);
+	wall = now_sec() - start;
+	mu_check(wall > 0.9 && wall < 1.5);
+	mu_check((double) (clock() - cpu) / CLOCKS_PER_SEC < 0.1);
+}
+
+MU_TEST(test_posix_timeout_ms)
+{
+	char buf[2];
+	long spent = -1;
+	double start, wall;
+
+	/* Sub-second timeouts must neither round down to 0 nor up to 1 s. */
+	start = now_sec();
+	mu_check(serial_rcv_ms(buf, 1, 150, NULL, slave_port) == SERIAL_TIMEOUT);
+	wall = now_sec() - start;
+	mu_check(wall > 0.14 && wall < 0.5);
+
+	mu_check(serial_snd("hi", 2, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(buf, 2, 150, &spent, slave_port) == SERIAL_NO_ERRORS);
+	mu_check(spent >= 0 && spent < 100);
+}
+
+MU_TEST(test_posix_rcv_some)
+{
+	char out[300];
+	char in[sizeof(out)];
+	unsigned int i, got, total = 0;
+	char c = NUL;
+
+	for(i = 0; i < sizeof(out); i++)
+	{
+		out[i] = (char) (i * 13 + 1);
+	}
+
+	/* Peeking leaves the first byte to be received again; partial reads
+	then return whatever has arrived. */
+	mu_check(serial_snd(out, sizeof(out), master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_peek(&c, 1000, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq(out[0], c);
+	while(total < sizeof(out))
+	{
+		mu_check(serial_rcv_some(in + total, sizeof(in) - total, 1000, &got, slave_port) \
+			== SERIAL_NO_ERRORS);
+		mu_check(got > 0 && got <= sizeof(in) - total);
+		total += got;
+	}
+	mu_check(memcmp(in, out, sizeof(out)) == 0);
+	mu_check(serial_rcv_some(in, sizeof(in), 50, &got, slave_port) == SERIAL_TIMEOUT);
+	mu_assert_int_eq(0, got);
+	mu_check(serial_peek(&c, 50, slave_port) == SERIAL_TIMEOUT);
+
+	/* Bytes already taken from the tty into the handle's receive buffer
+	are discarded by a flush too. */
+	mu_check(serial_snd("ab", 2, master_port) == SERIAL_NO_ERRORS);
+	usleep(10000);
+	mu_check(serial_rcv(&c, 1, 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('a', c);
+	mu_check(serial_flush(slave_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_snd("c", 1, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(&c, 1, 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('c', c);
+}
+
+MU_TEST(test_posix_drain)
+{
+	char c = 'x';
+	double start, wall;
+
+	/* At 115200 baud the idle gap is the 20 ms floor, not the 1 s the
+	caller allows. */
+	mu_check(serial_snd("stale", 5, master_port) == SERIAL_NO_ERRORS);
+	start = now_sec();
+	mu_check(serial_drain(slave_port, 1000) == SERIAL_NO_ERRORS);
+	wall = now_sec() - start;
+	mu_check(wall > 0.015 && wall < 0.5);
+	mu_check(serial_snd("!", 1, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(&c, 1, 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('!', c);
+
+	/* A shorter gap from the caller is honoured. */
+	start = now_sec();
+	mu_check(serial_drain(slave_port, 5) == SERIAL_NO_ERRORS);
+	mu_check(now_sec() - start < 0.015);
+	mu_check(serial_drain(NULL, 5) == SERIAL_HW_ERROR);
+}
+
+MU_TEST(test_posix_flush)
+{
+	char c = 'x';
+
+	mu_check(serial_snd("stale", 5, master_port) == SERIAL_NO_ERRORS);
+	usleep(10000);
+	mu_check(serial_flush(slave_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_snd("!", 1, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(&c, 1, 1, NULL, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('!', c);
+}
+
+MU_TEST(test_posix_port_path)
+{
+	serial_handle_t by_number;
+	char c = NUL;
+
+	mu_check(posix_set_port_path(POSIX_MAX_PORTS, slave_name) == -1);
+	mu_check(posix_set_port_path(7, slave_name) == 0);
+	mu_check(serial_init(7, 230400, &by_number) == SERIAL_NO_ERRORS);
+	mu_check(serial_snd("q", 1, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(&c, 1, 1, NULL, by_number) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('q', c);
+	mu_check(serial_close(&by_number) == SERIAL_NO_ERRORS);
+	mu_check(posix_set_port_path(7, NULL) == 0);
+}
+
+MU_TEST(test_posix_xmodem_1k)
+{
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_PLAIN);
+}
+
+MU_TEST(test_posix_xmodem_1k_zero_copy)
+{
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_ZERO_COPY);
+}
+
+MU_TEST(test_posix_xmodem_crc)
+{
+	run_xfer(XMODEM_CRC, 5000, XFER_PLAIN);
+}
+
+MU_TEST(test_posix_xmodem_chksum)
+{
+	run_xfer(XMODEM, 1000, XFER_PLAIN);
+}
+
+MU_TEST(test_posix_xmodem_prefetch)
+{
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_TX_PREFETCH);
+	run_xfer(XMODEM, 1000, XFER_TX_PREFETCH);
+}
+
+MU_TEST(test_posix_xmodem_windowed)
+{
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_TX_WINDOW | XFER_RX_WINDOW);
+	run_xfer(XMODEM_CRC, 5000, XFER_TX_WINDOW | XFER_RX_WINDOW);
+}
+
+MU_TEST(test_posix_xmodem_windowed_fallback)
+{
+	/* Each side against a classic peer. A windowed receiver waits out one
+	handshake timeout before giving up on the window. */
+	run_xfer(XMODEM_1K, 5000, XFER_TX_WINDOW);
+	run_xfer(XMODEM_1K, 5000, XFER_RX_WINDOW);
+	/* XMODEM has no CRC, so a window is never negotiated. */
+	run_xfer(XMODEM, 1000, XFER_TX_WINDOW | XFER_RX_WINDOW);
+}
+
+MU_TEST(test_posix_ymodem_batch)
+{
+	batch_sizes[0] = XFER_SIZE;
+	batch_sizes[1] = 1000;
+	batch_sent = batch_opened = 0;
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_YMODEM);
+	mu_assert_int_eq(2, batch_opened);
+}
+
+MU_TEST(test_posix_xmodem_streaming)
+{
+	run_xfer(XMODEM_G, XFER_SIZE, XFER_PLAIN);
+	run_xfer(XMODEM_G, XFER_SIZE, XFER_ZERO_COPY);
+}
+
+MU_TEST(test_posix_xmodem_streaming_fallback)
+{
+	/* Against a classic peer, both sides settle on XMODEM_1K. A streaming
+	receiver waits out one handshake timeout before giving up on 'G'. */
+	run_xfer(XMODEM_G, 5000, XFER_RX_1K);
+	run_xfer(XMODEM_G, 5000, XFER_TX_1K);
+}
+
+MU_TEST(test_posix_ymodem_g)
+{
+	batch_sizes[0] = XFER_SIZE;
+	batch_sizes[1] = 1000;
+	batch_sent = batch_opened = 0;
+	run_xfer(XMODEM_G, XFER_SIZE, XFER_YMODEM);
+	mu_assert_int_eq(2, batch_opened);
+}
+
+MU_TEST(test_posix_zmodem_batch)
+{
+	batch_sizes[0] = XFER_SIZE;
+	batch_sizes[1] = 1000;
+	batch_sent = batch_opened = 0;
+	zmodem_resume_at = 0;
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_ZMODEM);
+	mu_assert_int_eq(2, batch_opened);
+}
+
+MU_TEST(test_posix_zmodem_resume)
+{
+	/* The receiver already holds part of the first file, and asks for the
+	rest with ZRPOS. */
+	batch_sizes[0] = XFER_SIZE;
+	batch_sizes[1] = 1000;
+	batch_sent = batch_opened = 0;
+	zmodem_resume_at = 40000;
+	run_xfer(XMODEM_1K, XFER_SIZE, XFER_ZMODEM);
+	mu_assert_int_eq(2, batch_opened);
+	zmodem_resume_at = 0;
+}
+
+/* Play a receiver which asks for control characters to be escaped, and
+check that none reach the line bare. */
+MU_TEST(test_posix_zmodem_escctl)
+{
+	unsigned char hdr[4] = { 0, 0, 0, 0x01 | 0x02 | ZM_ESCCTL };
+	char out[32];
+	pthread_t tx;
+	rx_job_t job;
+	size_t len, got = 0, i;
+	unsigned int num_read;
+
+	fill_random(4096);
+	job.port = slave_port;
+	job.chan.buf = tx_data;
+	job.chan.buflen = 4096;
+	job.chan.bufpos = 0;
+	job.status = UNDEFINED_ERROR;
+	batch_sent = 0;
+	mu_check(pthread_create(&tx, NULL, ztx_thread, &job) == 0);
+
+	/* Answer "rz\r" and ZRQINIT, and send the whole file from the start. */
+	mu_check(serial_rcv_some((char *) rx_data, 1, 2000, &num_read, master_port) == SERIAL_NO_ERRORS);
+	serial_drain(master_port, 100);
+	len = zm_hex_header(out, ZM_ZRINIT, hdr);
+	hdr[3] = 0;
+	len += zm_hex_header(out + len, ZM_ZRPOS, hdr);
+	mu_check(serial_snd(out, len, master_port) == SERIAL_NO_ERRORS);
+
+	/* Take everything up to ZEOF, which waits for an answer. */
+	while(serial_rcv_some((char *) rx_data + got, sizeof(rx_data) - got, 1000, &num_read, \
+		master_port) == SERIAL_NO_ERRORS)
+	{
+		got += num_read;
+	}
+
+	len = zm_hex_header(out, ZM_ZRINIT, hdr);
+	len += zm_hex_header(out + len, ZM_ZFIN, hdr);
+	mu_check(serial_snd(out, len, master_port) == SERIAL_NO_ERRORS);
+	pthread_join(tx, NULL);
+	mu_check(job.status == MODEM_NO_ERRORS);
+
+	/* Only ZDLE, and the CR, LF and XON ending hex headers, are left. */
+	mu_check(got > 4096);
+	for(i = 0; i < got; i++)
+	{
+		if((rx_data[i] & 0x60) == 0 && rx_data[i] != ZM_ZDLE && rx_data[i] != '\r' \
+			&& rx_data[i] != ('\n' | 0x80) && rx_data[i] != 0x11)
+		{
+			break;
+		}
+	}
+	mu_assert_int_eq((int) got, (int) i);
+}
+
+/* A subpacket longer than zmodem_rx() can hold, as from sz -8, ends the
+transfer instead of being asked for again and again. */
+MU_TEST(test_posix_zmodem_too_long)
+{
+	unsigned char hdr[4] = { 0, 0, 0, 0 };
+	const unsigned char info[] = "0\0" "2000 13132027400";
+	unsigned char frames[2 * 2000 + 64];
+	char reply[64];
+	pthread_t rx;
+	rx_job_t job;
+	size_t len;
+	unsigned int num_read;
+
+	fill_random(2000);
+	batch_sizes[0] = 2000;
+	batch_sent = batch_opened = 0;
+	zmodem_resume_at = 0;
+	job.port = slave_port;
+	job.variant = XFER_ZMODEM;
+	job.sink = NULL;
+	job.chan.buf = rx_data;
+	job.chan.buflen = sizeof(rx_data);
+	job.chan.bufpos = 0;
+	job.status = UNDEFINED_ERROR;
+	mu_check(pthread_create(&rx, NULL, rx_thread, &job) == 0);
+
+	/* ZRINIT, then ZRPOS once the file is offered. */
+	mu_check(serial_rcv_some(reply, 1, 2000, &num_read, master_port) == SERIAL_NO_ERRORS);
+	serial_drain(master_port, 100);
+	len = zm_hex_header((char *) frames, ZM_ZFILE, hdr);
+	len += zm_subpacket(frames + len, info, sizeof(info), ZM_ZCRCW);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_some(reply, 1, 2000, &num_read, master_port) == SERIAL_NO_ERRORS);
+	serial_drain(master_port, 100);
+
+	len = zm_hex_header((char *) frames, ZM_ZDATA, hdr);
+	len += zm_subpacket(frames + len, tx_data, 2000, ZM_ZCRCE);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	pthread_join(rx, NULL);
+
+	mu_check(job.status == NOT_IMPLEMENTED);
+	mu_assert_int_eq(1, batch_opened);
+	mu_assert_int_eq(0, (int) job.chan.bufpos);
+	serial_drain(master_port, 100);
+}
+
+/* Interoperability with lrzsz, in both directions. Run on its own, as
+`posix lrzsz`, which reports a skip unless sz and rz (or lsz and lrz) are
+installed. */
+MU_TEST(test_posix_zmodem_lrzsz)
+{
+	char sz_path[256], rz_path[256], dir[] = "/tmp/libmodem-XXXXXX", file[64];
+	char * sz_argv[] = { "sz", "-q", "lrzsz.bin", NULL };
+	char * rz_argv[] = { "rz", "-q", NULL };
+	mem_chan_t chan;
+	modem_errors_t status;
+	pid_t pid;
+	int fd, wstatus;
+
+	mu_check(find_program("sz", "lsz", sz_path, sizeof(sz_path)));
+	mu_check(find_program("rz", "lrz", rz_path, sizeof(rz_path)));
+
+	mu_check(mkdtemp(dir) != NULL);
+	fill_random(XFER_SIZE);
+
+	/* sz to zmodem_rx(). */
+	snprintf(file, sizeof(file), "%s/lrzsz.bin", dir);
+	mu_check((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0);
+	mu_check(write(fd, tx_data, XFER_SIZE) == XFER_SIZE);
+	close(fd);
+
+	chan.buf = rx_data;
+	chan.buflen = sizeof(rx_data);
+	chan.bufpos = 0;
+	mu_check((pid = spawn_on_slave(sz_path, sz_argv, dir)) > 0);
+	status = zmodem_rx(lrzsz_open, mem_in, rx_zbuf, &chan, master_port);
+	if(status != MODEM_NO_ERRORS)
+	{
+		kill(pid, SIGKILL);
+	}
+	mu_check(waitpid(pid, &wstatus, 0) == pid);
+	mu_check(status == MODEM_NO_ERRORS);
+	mu_check(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0);
+	mu_assert_int_eq(XFER_SIZE, (int) chan.bufpos);
+	mu_check(memcmp(tx_data, rx_data, XFER_SIZE) == 0);
+	unlink(file);
+
+	/* zmodem_tx() to rz. */
+	chan.buf = tx_data;
+	chan.buflen = XFER_SIZE;
+	chan.bufpos = 0;
+	batch_sent = 0;
+	mu_check((pid = spawn_on_slave(rz_path, rz_argv, dir)) > 0);
+	status = zmodem_tx(lrzsz_next, mem_out, mem_seek, tx_zbuf, &chan, master_port);
+	if(status != MODEM_NO_ERRORS)
+	{
+		kill(pid, SIGKILL);
+	}
+	mu_check(waitpid(pid, &wstatus, 0) == pid);
+	mu_check(status == MODEM_NO_ERRORS);
+	mu_check(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0);
+	mu_check((fd = open(file, O_RDONLY)) >= 0);
+	mu_check(read(fd, rx_data, sizeof(rx_data)) == XFER_SIZE);
+	mu_check(memcmp(tx_data, rx_data, XFER_SIZE) == 0);
+	close(fd);
+	unlink(file);
+	rmdir(dir);
+}
+
+/* Play the host side of SFL by hand, with the kinds of damage a real line
+causes. */
+MU_TEST(test_posix_sfl_rx)
+{
+	unsigned char frames[2 * SFL_FRAME_SIZE];
+	char reply[SFL_FRAME_SIZE];
+	pthread_t rx;
+	rx_job_t job;
+	size_t len;
+
+	fill_random(4 * 251);
+	job.port = slave_port;
+	job.chan.buf = rx_data;
+	job.chan.buflen = sizeof(rx_data);
+	job.chan.bufpos = 0;
+	job.status = UNDEFINED_ERROR;
+	sfl_entry = 0;
+	mu_check(pthread_create(&rx, NULL, sfl_thread, &job) == 0);
+
+	mu_check(serial_rcv_ms(reply, 14, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_check(memcmp(reply, "sL5DdSMmkekro\n", 14) == 0);
+	mu_check(serial_snd("z6IHG7cYDID6o\n", 14, master_port) == SERIAL_NO_ERRORS);
+
+	len = sfl_frame(frames, 0x01, SFL_BASE, tx_data, 251);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 1, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('K', reply[0]);
+
+	/* A damaged frame, and one cut short, are both asked for again. */
+	len = sfl_frame(frames, 0x01, SFL_BASE + 251, tx_data + 251, 251);
+	frames[100] ^= 0x04;
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 1, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('C', reply[0]);
+	frames[100] ^= 0x04;
+	mu_check(serial_snd((char *) frames, 50, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 1, 3000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('C', reply[0]);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 1, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('K', reply[0]);
+
+	/* Frames sent without waiting are acknowledged in order. */
+	len = sfl_frame(frames, 0x01, SFL_BASE + 502, tx_data + 502, 251);
+	len += sfl_frame(frames + len, 0x01, SFL_BASE + 753, tx_data + 753, 251);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 2, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_check(memcmp(reply, "KK", 2) == 0);
+
+	len = sfl_frame(frames, 0x02, SFL_BASE, NULL, 0);
+	mu_check(serial_snd((char *) frames, len, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(reply, 1, 2000, NULL, master_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq('K', reply[0]);
+	pthread_join(rx, NULL);
+
+	mu_check(job.status == MODEM_NO_ERRORS);
+	mu_check(sfl_entry == SFL_BASE);
+	mu_assert_int_eq(4 * 251, (int) job.chan.bufpos);
+	mu_check(memcmp(tx_data, rx_data, 4 * 251) == 0);
+}
+
+/* Upload an image with an erased gap to sfl_rx(). */
+MU_TEST(test_posix_sfl_tx)
+{
+	pthread_t rx;
+	rx_job_t job;
+
+	fill_random(XFER_SIZE);
+	memset(tx_data + 10000, 0xFF, 10000);
+	memset(rx_data, 0xFF, sizeof(rx_data));
+	job.port = slave_port;
+	job.chan.buf = rx_data;
+	job.chan.buflen = sizeof(rx_data);
+	job.chan.bufpos = 0;
+	job.status = UNDEFINED_ERROR;
+	sfl_entry = 0;
+	sfl_loads = sfl_regions_sent = 0;
+	mu_check(pthread_create(&rx, NULL, sfl_thread, &job) == 0);
+
+	mu_check(sfl_tx(sfl_regions, SFL_BASE + 0x100, 0xFF, sfl_tx_buf, NULL, master_port) == MODEM_NO_ERRORS);
+	pthread_join(rx, NULL);
+
+	mu_check(job.status == MODEM_NO_ERRORS);
+	mu_check(sfl_entry == SFL_BASE + 0x100);
+	mu_assert_int_eq(XFER_SIZE, (int) job.chan.bufpos);
+	mu_check(memcmp(tx_data, rx_data, XFER_SIZE) == 0);
+	/* Full frames, except where the regions and the gap end. */
+	mu_check(sfl_loads <= (XFER_SIZE - 10000) / 251 + 3);
+}
+
+MU_TEST(test_posix_filechan_mmap)
+{
+	fill_random(XFER_SIZE);
+	run_file_xfer(XMODEM_1K, XFER_SIZE, 0);
+}
+
+MU_TEST(test_posix_filechan_pipe)
+{
+	fill_random(XFER_SIZE);
+	run_file_xfer(XMODEM_1K, XFER_SIZE, 1);
+}
+
+MU_TEST(test_posix_filechan_boundary)
+{
+	/* A whole block of padding follows the data, and an empty file is
+	nothing but padding. */
+	fill_random(4096);
+	tx_data[4095] = 'x';
+	run_file_xfer(XMODEM_CRC, 4096, 0);
+	run_file_xfer(XMODEM_CRC, 0, 0);
+}
+
+MU_TEST(test_posix_filechan_cpmeof_runs)
+{
+	/* Runs of CPMEOF longer than the sink's buffer, but not at the end of
+	the file, are data. */
+	fill_random(3000);
+	memset(tx_data + 3000, CPMEOF, 3 * sizeof(sink_buf));
+	tx_data[3000 + 3 * sizeof(sink_buf)] = 'x';
+	run_file_xfer(XMODEM_1K, 3001 + 3 * sizeof(sink_buf), 0);
+}
+
+
+#ifdef __linux__
+MU_TEST(test_posix_engine)
+{
+	static unsigned char sinks[ENGINE_PAIRS][4096];
+	static unsigned char bufs[2 * ENGINE_PAIRS + 1][X1K_END + 1];
+	static mem_chan_t chans[2 * ENGINE_PAIRS + 1];
+	static engine_port_t ports[2 * ENGINE_PAIRS + 1];
+	static serial_handle_t handles[2 * ENGINE_PAIRS + 2];
+	const xmodem_xfer_mode_t modes[] = { XMODEM_1K, XMODEM_CRC, XMODEM_G, XMODEM };
+	modem_engine_t engine;
+	unsigned int pair, opened;
+	int master_fd, slave_fd;
+
+	/* Each pty pair runs its own transfer, with the transmitter on the
+	master and the receiver on the slave, all from one thread. */
+	fill_random(ENGINE_PAIRS + 4000);
+	mu_check(engine_init(&engine, engine_done) == 0);
+	engine_finished = 0;
+	for(opened = 0; opened < ENGINE_PAIRS; opened++)
+	{
+		if(openpty(&master_fd, &slave_fd, NULL, NULL, NULL))
+		{
+			break;
+		}
+		handles[2 * opened] = posix_open_fd(master_fd, 115200);
+		handles[2 * opened + 1] = posix_open_fd(slave_fd, 115200);
+
+		chans[2 * opened].buf = tx_data + opened;
+		chans[2 * opened].buflen = 3000 + opened;
+		chans[2 * opened].bufpos = 0;
+		chans[2 * opened + 1].buf = sinks[opened];
+		chans[2 * opened + 1].buflen = sizeof(sinks[opened]);
+		chans[2 * opened + 1].bufpos = 0;
+		mu_check(engine_add_tx(&engine, &ports[2 * opened], handles[2 * opened], mem_out, \
+			bufs[2 * opened], &chans[2 * opened], modes[opened % 4]) == 0);
+		mu_check(engine_add_rx(&engine, &ports[2 * opened + 1], handles[2 * opened + 1], mem_in, \
+			bufs[2 * opened + 1], &chans[2 * opened + 1], modes[opened % 4]) == 0);
+	}
+	mu_check(opened == ENGINE_PAIRS);
+
+	/* A port whose other end has gone fails on its own. */
+	mu_check(openpty(&master_fd, &slave_fd, NULL, NULL, NULL) == 0);
+	handles[2 * opened] = posix_open_fd(master_fd, 115200);
+	close(slave_fd);
+	chans[2 * opened] = chans[0];
+	mu_check(engine_add_tx(&engine, &ports[2 * opened], handles[2 * opened], mem_out, \
+		bufs[2 * opened], &chans[2 * opened], XMODEM_1K) == 0);
+
+	mu_check(engine_run(&engine, 30000) == 0);
+	mu_assert_int_eq(2 * opened + 1, engine_finished);
+	mu_check(engine_port_status(&ports[2 * opened]) == MODEM_HW_ERROR);
+	for(pair = 0; pair < opened; pair++)
+	{
+		mu_check(engine_port_status(&ports[2 * pair]) == MODEM_NO_ERRORS);
+		mu_check(engine_port_status(&ports[2 * pair + 1]) == MODEM_NO_ERRORS);
+		mu_check(memcmp(tx_data + pair, sinks[pair], 3000 + pair) == 0);
+	}
+
+	engine_close(&engine);
+	for(pair = 0; pair < 2 * opened + 1; pair++)
+	{
+		serial_close(&handles[pair]);
+	}
+}
+
+MU_TEST(test_posix_engine_buffered)
+{
+	static unsigned char buf[X1K_END + 1];
+	engine_port_t port;
+	modem_engine_t engine;
+	mem_chan_t chan;
+	char rx_code = EOT;
+
+	/* An EOT the receiver's handle took in before the engine saw it must
+	still end the transfer. */
+	mu_check(serial_snd(&rx_code, 1, master_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_peek(&rx_code, 1000, slave_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq(EOT, rx_code);
+
+	chan.buf = rx_data;
+	chan.buflen = sizeof(rx_data);
+	chan.bufpos = 0;
+	mu_check(engine_init(&engine, NULL) == 0);
+	mu_check(engine_add_rx(&engine, &port, slave_port, mem_in, buf, &chan, XMODEM_CRC) == 0);
+	mu_check(engine_run(&engine, 5000) == 0);
+	mu_check(engine_port_status(&port) == MODEM_NO_ERRORS);
+	mu_assert_int_eq(0, (int) chan.bufpos);
+	engine_close(&engine);
+}
+
+MU_TEST(test_posix_engine_image)
+{
+	static unsigned char image_buf[ENGINE_IMAGE_SIZE + ENGINE_IMAGE_SIZE / 8];
+	static unsigned char sinks[ENGINE_FANOUT][ENGINE_IMAGE_SIZE + 1024];
+	static unsigned char bufs[ENGINE_FANOUT][X1K_END + 1];
+	static mem_chan_t chans[ENGINE_FANOUT];
+	static engine_port_t ports[2 * ENGINE_FANOUT];
+	static serial_handle_t handles[2 * ENGINE_FANOUT];
+	xmodem_image_t image;
+	modem_engine_t engine;
+	unsigned int port;
+	int master_fd, slave_fd;
+
+	/* One image, framed once, goes out to every port. */
+	fill_random(ENGINE_IMAGE_SIZE);
+	mu_check(xmodem_image_size(ENGINE_IMAGE_SIZE, XMODEM_1K) <= sizeof(image_buf));
+	mu_check(xmodem_image_init(&image, image_buf, sizeof(image_buf), tx_data, \
+		ENGINE_IMAGE_SIZE, XMODEM_1K) == 0);
+	mu_check(engine_init(&engine, engine_done) == 0);
+	engine_finished = 0;
+	for(port = 0; port < ENGINE_FANOUT; port++)
+	{
+		mu_check(openpty(&master_fd, &slave_fd, NULL, NULL, NULL) == 0);
+		handles[2 * port] = posix_open_fd(master_fd, 115200);
+		handles[2 * port + 1] = posix_open_fd(slave_fd, 115200);
+
+		chans[port].buf = sinks[port];
+		chans[port].buflen = sizeof(sinks[port]);
+		chans[port].bufpos = 0;
+		mu_check(engine_add_tx_image(&engine, &ports[2 * port], handles[2 * port], \
+			&image, NULL) == 0);
+		mu_check(engine_add_rx(&engine, &ports[2 * port + 1], handles[2 * port + 1], mem_in, \
+			bufs[port], &chans[port], XMODEM_1K) == 0);
+	}
+
+	mu_check(engine_run(&engine, 30000) == 0);
+	mu_assert_int_eq(2 * ENGINE_FANOUT, engine_finished);
+	for(port = 0; port < ENGINE_FANOUT; port++)
+	{
+		mu_check(engine_port_status(&ports[2 * port]) == MODEM_NO_ERRORS);
+		mu_check(engine_port_status(&ports[2 * port + 1]) == MODEM_NO_ERRORS);
+		mu_check(memcmp(tx_data, sinks[port], ENGINE_IMAGE_SIZE) == 0);
+	}
+
+	engine_close(&engine);
+	for(port = 0; port < 2 * ENGINE_FANOUT; port++)
+	{
+		serial_close(&handles[port]);
+	}
+}
+#endif
+
+MU_TEST(test_posix_runner)
+{
+	static unsigned char sinks[RUNNER_PAIRS][4096];
+	static unsigned char bufs[2 * RUNNER_PAIRS + 1][X1K_END + 1];
+	static mem_chan_t chans[2 * RUNNER_PAIRS];
+	static runner_job_t jobs[2 * RUNNER_PAIRS + 1];
+	static serial_handle_t masters[RUNNER_PAIRS];
+	static int slave_fds[RUNNER_PAIRS];
+	static char names[RUNNER_PAIRS][64];
+	const xmodem_xfer_mode_t modes[] = { XMODEM_1K, XMODEM_CRC, XMODEM_G, XMODEM };
+	runner_stats_t stats;
+	unsigned long total = 0;
+	unsigned int pair;
+	int master_fd;
+
+	/* Each transmitter directly precedes its receiver, so the pool can
+	run both ends of every link with fewer threads than jobs. Transmitters
+	use open masters; receivers open their slave by port number. */
+	fill_random(RUNNER_PAIRS + 4000);
+	for(pair = 0; pair < RUNNER_PAIRS; pair++)
+	{
+		runner_job_t * tx = &jobs[2 * pair];
+		runner_job_t * rx = &jobs[2 * pair + 1];
+
+		mu_check(openpty(&master_fd, &slave_fds[pair], names[pair], NULL, NULL) == 0);
+		masters[pair] = posix_open_fd(master_fd, 115200);
+		mu_check(posix_set_port_path(RUNNER_PORT_BASE + pair, names[pair]) == 0);
+
+		chans[2 * pair].buf = tx_data + pair;
+		chans[2 * pair].buflen = 3000 + pair;
+		chans[2 * pair].bufpos = 0;
+		chans[2 * pair + 1].buf = sinks[pair];
+		chans[2 * pair + 1].buflen = sizeof(sinks[pair]);
+		chans[2 * pair + 1].bufpos = 0;
+
+		memset(tx, 0, sizeof(runner_job_t));
+		tx->device = masters[pair];
+		tx->direction = RUNNER_TX;
+		tx->mode = modes[pair % 4];
+		tx->data_out = mem_out;
+		tx->chan_state = &chans[2 * pair];
+		tx->buf = bufs[2 * pair];
+
+		memset(rx, 0, sizeof(runner_job_t));
+		rx->port_no = RUNNER_PORT_BASE + pair;
+		rx->baud_rate = 115200;
+		rx->direction = RUNNER_RX;
+		rx->mode = modes[pair % 4];
+		rx->data_in = mem_in;
+		rx->chan_state = &chans[2 * pair + 1];
+		rx->buf = bufs[2 * pair + 1];
+	}
+
+	/* A port which can't be opened fails on its own. */
+	memset(&jobs[2 * RUNNER_PAIRS], 0, sizeof(runner_job_t));
+	mu_check(posix_set_port_path(RUNNER_PORT_BASE + RUNNER_PAIRS, "/nonexistent/tty") == 0);
+	jobs[2 * RUNNER_PAIRS].port_no = RUNNER_PORT_BASE + RUNNER_PAIRS;
+	jobs[2 * RUNNER_PAIRS].baud_rate = 115200;
+	jobs[2 * RUNNER_PAIRS].direction = RUNNER_RX;
+	jobs[2 * RUNNER_PAIRS].data_in = mem_in;
+	jobs[2 * RUNNER_PAIRS].buf = bufs[2 * RUNNER_PAIRS];
+
+	mu_check(runner_run(jobs, 2 * RUNNER_PAIRS + 1, 0, NULL) == -1);
+	mu_assert_int_eq(1, runner_run(jobs, 2 * RUNNER_PAIRS + 1, RUNNER_WORKERS, &stats));
+	mu_assert_int_eq(1, stats.failed);
+	mu_check(jobs[2 * RUNNER_PAIRS].status == MODEM_HW_ERROR);
+	mu_check(jobs[2 * RUNNER_PAIRS].bytes == 0);
+	for(pair = 0; pair < RUNNER_PAIRS; pair++)
+	{
+		mu_check(jobs[2 * pair].status == MODEM_NO_ERRORS);
+		mu_check(jobs[2 * pair + 1].status == MODEM_NO_ERRORS);
+		mu_check(memcmp(tx_data + pair, sinks[pair], 3000 + pair) == 0);
+
+		/* The receiver also counts the padding of the last block. */
+		mu_check(jobs[2 * pair].bytes == 3000 + pair);
+		mu_check(jobs[2 * pair + 1].bytes == (3000 + pair + 127) / 128 * 128);
+		mu_check(jobs[2 * pair].duration_ms >= 0);
+		total += jobs[2 * pair].bytes + jobs[2 * pair + 1].bytes;
+	}
+
+	mu_check(stats.bytes == total);
+	mu_check(stats.elapsed_ms >= 0);
+	mu_check(stats.elapsed_ms == 0 || stats.bytes_per_sec > 0);
+
+	for(pair = 0; pair <= RUNNER_PAIRS; pair++)
+	{
+		posix_set_port_path(RUNNER_PORT_BASE + pair, NULL);
+	}
+
+	for(pair = 0; pair < RUNNER_PAIRS; pair++)
+	{
+		serial_close(&masters[pair]);
+		close(slave_fds[pair]);
+	}
+}
+
+
+MU_TEST_SUITE(posix_test_suite)
+{
+	MU_SUITE_CONFIGURE(&pty_setup, &pty_teardown);
+	MU_RUN_TEST(test_posix_open_fd);
+	MU_RUN_TEST(test_posix_roundtrip);
+	MU_RUN_TEST(test_posix_sndv);
+	MU_RUN_TEST(test_posix_timeout_whole_request);
+	MU_RUN_TEST(test_posix_timeout_ms);
+	MU_RUN_TEST(test_posix_rcv_some);
+	MU_RUN_TEST(test_posix_drain);
+	MU_RUN_TEST(test_posix_flush);
+	MU_RUN_TEST(test_posix_port_path);
+	MU_RUN_TEST(test_posix_xmodem_1k);
+	MU_RUN_TEST(test_posix_xmodem_1k_zero_copy);
+	MU_RUN_TEST(test_posix_xmodem_crc);
+	MU_RUN_TEST(test_posix_xmodem_chksum);
+	MU_RUN_TEST(test_posix_xmodem_prefetch);
+	MU_RUN_TEST(test_posix_xmodem_windowed);
+	MU_RUN_TEST(test_posix_xmodem_windowed_fallback);
+	MU_RUN_TEST(test_posix_ymodem_batch);
+	MU_RUN_TEST(test_posix_xmodem_streaming);
+	MU_RUN_TEST(test_posix_xmodem_streaming_fallback);
+	MU_RUN_TEST(test_posix_ymodem_g);
+	MU_RUN_TEST(test_posix_zmodem_batch);
+	MU_RUN_TEST(test_posix_zmodem_resume);
+	MU_RUN_TEST(test_posix_zmodem_escctl);
+	MU_RUN_TEST(test_posix_zmodem_too_long);
+	MU_RUN_TEST(test_posix_sfl_rx);
+	MU_RUN_TEST(test_posix_sfl_tx);
+	MU_RUN_TEST(test_posix_filechan_mmap);
+	MU_RUN_TEST(test_posix_filechan_pipe);
+	MU_RUN_TEST(test_posix_filechan_boundary);
+	MU_RUN_TEST(test_posix_filechan_cpmeof_runs);
+#ifdef __linux__
+	MU_RUN_TEST(test_posix_engine);
+	MU_RUN_TEST(test_posix_engine_buffered);
+	MU_RUN_TEST(test_posix_engine_image);
+#endif
+	MU_RUN_TEST(test_posix_runner);
+}
+
+MU_TEST_SUITE(lrzsz_test_suite)
+{
+	MU_SUITE_CONFIGURE(&pty_setup, &pty_teardown);
+	MU_RUN_TEST(test_posix_zmodem_lrzsz);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char path[256];
+
+	if(argc > 1 && strcmp(argv[1], "lrzsz") == 0)
+	{
+		if(!find_program("sz", "lsz", path, sizeof(path)) \
+			|| !find_program("rz", "lrz", path, sizeof(path)))
+		{
+			printf("lrzsz not found; skipping interoperability test\n");
+			return EXIT_SKIPPED;
+		}
+
+		MU_RUN_SUITE(lrzsz_test_suite);
+	}
+	else
+	{
+		MU_RUN_SUITE(posix_test_suite);
+	}
+	MU_REPORT();
+	return minunit_fail != 0;
+}
+
+
+/* Send size bytes of random data from the master to the slave side, with the
+receiver running in its own thread. variant selects which transmitter and
+receiver are used. */
+static void run_xfer(xmodem_xfer_mode_t mode, size_t size, int variant)
+{
+	pthread_t rx;
+	rx_job_t job;
+	mem_chan_t tx_chan;
+	modem_stats_t stats;
+	size_t i;
+
+	fill_random(size);
+
+	job.port = slave_port;
+	job.mode = (variant & XFER_RX_1K) ? XMODEM_1K : mode;
+	job.variant = variant;
+	job.sink = NULL;
+	job.chan.buf = rx_data;
+	job.chan.buflen = sizeof(rx_data);
+	job.chan.bufpos = 0;
+	job.status = UNDEFINED_ERROR;
+	tx_chan.buf = tx_data;
+	tx_chan.buflen = size;
+	tx_chan.bufpos = 0;
+	if(variant & XFER_TX_1K)
+	{
+		mode = XMODEM_1K;
+	}
+	if(variant & XFER_ZMODEM)
+	{
+		/* What the receiver already has of a resumed file. */
+		memcpy(rx_data, tx_data, zmodem_resume_at);
+	}
+
+	mu_check(pthread_create(&rx, NULL, rx_thread, &job) == 0);
+	if(variant & XFER_ZERO_COPY)
+	{
+		mu_check(xmodem_tx_borrow(mem_borrow, tx_packet, &tx_chan, master_port, mode, NULL) == MODEM_NO_ERRORS);
+	}
+	else if(variant & XFER_YMODEM)
+	{
+		mu_check(ymodem_tx(batch_next, mem_out, tx_packet, &tx_chan, master_port, mode, NULL) == MODEM_NO_ERRORS);
+	}
+	else if(variant & XFER_ZMODEM)
+	{
+		mu_check(zmodem_tx(batch_next, mem_out, mem_seek, tx_zbuf, &tx_chan, master_port) == MODEM_NO_ERRORS);
+	}
+	else if(variant & XFER_TX_WINDOW)
+	{
+		mu_check(xmodem_tx_windowed(mem_out, tx_window_buf, TX_WINDOW, &tx_chan, master_port, mode, NULL) == MODEM_NO_ERRORS);
+	}
+	else if(variant & XFER_TX_PREFETCH)
+	{
+		mu_check(xmodem_tx_prefetch(mem_out, tx_window_buf, &tx_chan, master_port, mode, NULL) == MODEM_NO_ERRORS);
+	}
+	else
+	{
+		mu_check(xmodem_tx(mem_out, tx_packet, &tx_chan, master_port, mode, &stats) == MODEM_NO_ERRORS);
+
+		/* Nothing is lost on a pseudo-terminal, so every packet was
+		acknowledged the first time, unless it was streamed. */
+		mu_assert_int_eq((int) size, (int) stats.payload_bytes);
+		mu_assert_int_eq(0, (int) stats.retransmits);
+		mu_check(stats.ack_rtt_count == stats.packets_sent \
+			|| (mode == XMODEM_G && stats.ack_rtt_count == 0));
+		mu_check(stats.wire_bytes > size + stats.padding_bytes);
+		mu_check(stats.ack_rtt_min_ms <= stats.ack_rtt_max_ms);
+	}
+	pthread_join(rx, NULL);
+
+	mu_check(job.status == MODEM_NO_ERRORS);
+	mu_check(job.chan.bufpos >= size);
+	mu_check(memcmp(tx_data, rx_data, size) == 0);
+	if(variant & (XFER_YMODEM | XFER_ZMODEM))
+	{
+		/* The padding was trimmed, and the second file follows the first. */
+		mu_assert_int_eq((int) (size + batch_sizes[1]), (int) job.chan.bufpos);
+		mu_check(memcmp(tx_data, rx_data + size, batch_sizes[1]) == 0);
+		return;
+	}
+
+	for(i = size; i < job.chan.bufpos; i++)
+	{
+		mu_assert_int_eq(CPMEOF, rx_data[i]);
+	}
+}
+
+static void * rx_thread(void * arg)
+{
+	rx_job_t * job = arg;
+
+	/* xmodem_tx() flushes its receive buffer before waiting for the start
+	character; don't send it before then. */
+	usleep(50000);
+	if(job->sink != NULL)
+	{
+		unsigned char header[DATA + 2];
+
+		job->status = xmodem_rx_window(file_sink_window, header, job->sink, job->port, job->mode, NULL);
+	}
+	else if(job->variant & XFER_ZERO_COPY)
+	{
+		unsigned char header[DATA + 2];
+
+		job->status = xmodem_rx_window(mem_window, header, &job->chan, job->port, job->mode, NULL);
+	}
+	else if(job->variant & XFER_YMODEM)
+	{
+		job->status = ymodem_rx(batch_open, mem_in, rx_packet, &job->chan, job->port, job->mode, NULL);
+	}
+	else if(job->variant & XFER_ZMODEM)
+	{
+		job->status = zmodem_rx(zmodem_open, mem_in, rx_zbuf, &job->chan, job->port);
+	}
+	else if(job->variant & XFER_RX_WINDOW)
+	{
+		job->status = xmodem_rx_windowed(mem_in, rx_packet, &job->chan, job->port, job->mode, NULL);
+	}
+	else
+	{
+		job->status = xmodem_rx(mem_in, rx_packet, &job->chan, job->port, job->mode, NULL);
+	}
+	return NULL;
+}
+
+/* Send tx_data from a file (or pipe) on the master side to a file on the
+slave side, using the file channels. */
+static void run_file_xfer(xmodem_xfer_mode_t mode, size_t size, int from_pipe)
+{
+	pthread_t rx, writer;
+	rx_job_t job;
+	pipe_job_t pjob;
+	file_source_t src;
+	file_sink_t sink;
+	int src_fd, dst_fd, fds[2];
+	struct stat st;
+
+	dst_fd = temp_fd();
+	mu_check(dst_fd >= 0);
+	if(from_pipe)
+	{
+		mu_check(pipe(fds) == 0);
+		src_fd = fds[0];
+		pjob.fd = fds[1];
+		pjob.size = size;
+		mu_check(pthread_create(&writer, NULL, pipe_thread, &pjob) == 0);
+	}
+	else
+	{
+		src_fd = temp_fd();
+		mu_check(src_fd >= 0);
+		mu_check(write(src_fd, tx_data, size) == (ssize_t) size);
+		mu_check(lseek(src_fd, 0, SEEK_SET) == 0);
+	}
+
+	mu_check(file_source_init(&src, src_fd, source_buf, sizeof(source_buf)) == 0);
+	mu_check(file_sink_init(&sink, dst_fd, sink_buf, sizeof(sink_buf), from_pipe ? 0 : size) == 0);
+
+	job.port = slave_port;
+	job.mode = mode;
+	job.variant = XFER_PLAIN;
+	job.sink = &sink;
+	job.status = UNDEFINED_ERROR;
+	mu_check(pthread_create(&rx, NULL, rx_thread, &job) == 0);
+	/* Streaming sources can be borrowed from too, but exercise the copying
+	channel as well. */
+	if(from_pipe)
+	{
+		mu_check(xmodem_tx(file_source_read, tx_packet, &src, master_port, mode, NULL) == MODEM_NO_ERRORS);
+		pthread_join(writer, NULL);
+	}
+	else
+	{
+		mu_check(xmodem_tx_borrow(file_source_borrow, tx_packet, &src, master_port, mode, NULL) == MODEM_NO_ERRORS);
+	}
+	pthread_join(rx, NULL);
+	file_source_close(&src);
+
+	mu_check(job.status == MODEM_NO_ERRORS);
+	mu_check(file_sink_close(&sink) == 0);
+	mu_check(fstat(dst_fd, &st) == 0);
+	mu_assert_int_eq((int) size, (int) st.st_size);
+	mu_check(pread(dst_fd, rx_data, size, 0) == (ssize_t) size);
+	mu_check(memcmp(tx_data, rx_data, size) == 0);
+
+	close(src_fd);
+	close(dst_fd);
+}
+
+static int batch_next(ymodem_file_info_t * info, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	if(batch_sent == 2)
+	{
+		return 0;
+	}
+
+	chan->bufpos = 0;
+	chan->buflen = batch_sizes[batch_sent];
+	info->name[0] = (char) ('0' + batch_sent);
+	info->size = batch_sizes[batch_sent];
+	info->has_size = 1;
+	info->mtime = 1500000000UL + batch_sent++;
+	return 1;
+}
+
+static int batch_open(const ymodem_file_info_t * info, void * const chan_state)
+{
+	(void) chan_state;
+
+	if(batch_opened == 2 || info->name[0] != '0' + batch_opened || info->name[1] != NUL \
+		|| info->size != batch_sizes[batch_opened] \
+		|| info->mtime != 1500000000UL + batch_opened)
+	{
+		return -1;
+	}
+
+	batch_opened++;
+	return 0;
+}
+
+static int zmodem_open(const ymodem_file_info_t * info, unsigned long * offset, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	if(batch_open(info, chan_state))
+	{
+		return -1;
+	}
+
+	if(batch_opened == 1)
+	{
+		(* offset) = zmodem_resume_at;
+		chan->bufpos += zmodem_resume_at;
+	}
+	return 0;
+}
+
+static int lrzsz_next(ymodem_file_info_t * info, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	if(batch_sent++)
+	{
+		return 0;
+	}
+
+	chan->bufpos = 0;
+	memcpy(info->name, "lrzsz.bin", 10);
+	info->size = chan->buflen;
+	info->has_size = 1;
+	info->mtime = 1500000000UL;
+	return 1;
+}
+
+static int lrzsz_open(const ymodem_file_info_t * info, unsigned long * offset, void * const chan_state)
+{
+	(void) offset;
+	(void) chan_state;
+
+	return (strcmp(info->name, "lrzsz.bin") == 0 && info->has_size \
+		&& info->size == XFER_SIZE) ? 0 : -1;
+}
+
+/* Loads land at their offset from SFL_BASE; bufpos tracks the end of the
+furthest one. */
+static int sfl_store(unsigned long address, const char * buf, const int buf_size, const int eof, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+	size_t offset = address - SFL_BASE;
+
+	if(eof)
+	{
+		return 0;
+	}
+
+	if(address < SFL_BASE || offset + buf_size > chan->buflen)
+	{
+		return -1;
+	}
+
+	memcpy(chan->buf + offset, buf, buf_size);
+	sfl_loads++;
+	if(offset + buf_size > chan->bufpos)
+	{
+		chan->bufpos = offset + buf_size;
+	}
+	return buf_size;
+}
+
+static int sfl_boot(unsigned long address, void * const chan_state)
+{
+	(void) chan_state;
+
+	sfl_entry = address;
+	return 0;
+}
+
+static void * sfl_thread(void * arg)
+{
+	rx_job_t * job = arg;
+
+	job->status = sfl_rx(sfl_store, sfl_boot, rx_packet, &job->chan, job->port);
+	return NULL;
+}
+
+/* tx_data as two adjoining regions. */
+static int sfl_regions(unsigned long * address, const unsigned char ** data, size_t * size, void * const chan_state)
+{
+	(void) chan_state;
+
+	if(sfl_regions_sent == 2)
+	{
+		return 0;
+	}
+
+	(* address) = SFL_BASE + sfl_regions_sent * 50000UL;
+	(* data) = tx_data + sfl_regions_sent * 50000UL;
+	(* size) = sfl_regions_sent++ ? XFER_SIZE - 50000 : 50000;
+	return 1;
+}
+
+/* Build an SFL frame as the host would. A nonzero address goes before the
+data, as LOAD and JUMP expect. */
+static size_t sfl_frame(unsigned char * frame, unsigned char cmd, unsigned long address, \
+	const unsigned char * data, size_t len)
+{
+	unsigned short crc;
+	size_t pos = 4;
+
+	if(address != 0)
+	{
+		frame[pos++] = (unsigned char) (address >> 24);
+		frame[pos++] = (unsigned char) (address >> 16);
+		frame[pos++] = (unsigned char) (address >> 8);
+		frame[pos++] = (unsigned char) address;
+	}
+	if(len > 0)
+	{
+		memcpy(frame + pos, data, len);
+		pos += len;
+	}
+
+	frame[0] = (unsigned char) (pos - 4);
+	frame[3] = cmd;
+	crc = generate_crc(frame + 3, pos - 3);
+	frame[1] = (unsigned char) (crc >> 8);
+	frame[2] = (unsigned char) crc;
+	return pos;
+}
+
+static void * ztx_thread(void * arg)
+{
+	rx_job_t * job = arg;
+
+	job->status = zmodem_tx(lrzsz_next, mem_out, mem_seek, tx_zbuf, &job->chan, job->port);
+	return NULL;
+}
+
+/* A ZMODEM hex header, as both sides may send. */
+static size_t zm_hex_header(char * out, int type, const unsigned char * hdr)
+{
+	unsigned char frame[7];
+	unsigned short crc;
+	size_t len = 4;
+	int i;
+
+	frame[0] = (unsigned char) type;
+	memcpy(frame + 1, hdr, 4);
+	crc = generate_crc(frame, 5);
+	frame[5] = (unsigned char) (crc >> 8);
+	frame[6] = (unsigned char) crc;
+
+	memcpy(out, "**\x18" "B", 4);
+	for(i = 0; i < 7; i++)
+	{
+		len += sprintf(out + len, "%02x", frame[i]);
+	}
+	out[len++] = '\r';
+	out[len++] = (char) ('\n' | 0x80);
+	return len;
+}
+
+/* A data subpacket with a 16-bit CRC, as follows a hex header. Every control
+character is escaped, which the receiver must accept. */
+static size_t zm_subpacket(unsigned char * out, const unsigned char * data, size_t size, \
+	unsigned char frame_end)
+{
+	unsigned char trailer[2];
+	crc_state_t check;
+	size_t len = 0, i;
+
+	/* The CRC covers the data and the terminator. */
+	crc_init(&check, XMODEM_CRC);
+	crc_update(&check, data, size);
+	crc_update(&check, &frame_end, 1);
+	trailer[0] = (unsigned char) (crc_final(&check) >> 8);
+	trailer[1] = (unsigned char) crc_final(&check);
+
+	for(i = 0; i < size + 2; i++)
+	{
+		unsigned char c = (i < size) ? data[i] : trailer[i - size];
+
+		if(i == size)
+		{
+			out[len++] = ZM_ZDLE;
+			out[len++] = frame_end;
+		}
+		if((c & 0x60) == 0)
+		{
+			out[len++] = ZM_ZDLE;
+			c ^= 0x40;
+		}
+		out[len++] = c;
+	}
+
+	return len;
+}
+
+/* Search PATH for either name. */
+static int find_program(const char * name, const char * alt_name, char * path, size_t size)
+{
+	const char * names[2];
+	const char * dirs = getenv("PATH");
+	int i;
+
+	names[0] = name;
+	names[1] = alt_name;
+	while(dirs != NULL && *dirs != NUL)
+	{
+		const char * end = strchr(dirs, ':');
+		int len = (end != NULL) ? (int) (end - dirs) : (int) strlen(dirs);
+
+		for(i = 0; i < 2; i++)
+		{
+			snprintf(path, size, "%.*s/%s", len, dirs, names[i]);
+			if(access(path, X_OK) == 0)
+			{
+				return 1;
+			}
+		}
+		dirs = (end != NULL) ? end + 1 : NULL;
+	}
+
+	return 0;
+}
+
+/* Run a program in dir with the slave side as its terminal. */
+static pid_t spawn_on_slave(const char * path, char * const argv[], const char * dir)
+{
+	pid_t pid = fork();
+
+	if(pid == 0)
+	{
+		int fd = posix_get_fd(slave_port);
+		int null_fd = open("/dev/null", O_WRONLY);
+		int flags = fcntl(fd, F_GETFL);
+
+		/* lrzsz expects blocking I/O on its terminal. */
+		if(chdir(dir) || flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) \
+			|| dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(null_fd, 2) < 0)
+		{
+			_exit(127);
+		}
+		execv(path, argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static void * pipe_thread(void * arg)
+{
+	pipe_job_t * job = arg;
+	size_t done = 0;
+
+	/* Dribble the data in, so the reader sees short reads. */
+	while(done < job->size)
+	{
+		size_t chunk = (job->size - done < 3000) ? job->size - done : 3000;
+		ssize_t written = write(job->fd, tx_data + done, chunk);
+
+		if(written <= 0)
+		{
+			break;
+		}
+		done += (size_t) written;
+	}
+
+	close(job->fd);
+	return NULL;
+}
+
+static void fill_random(size_t size)
+{
+	size_t i;
+
+	srand((unsigned int) size);
+	for(i = 0; i < size; i++)
+	{
+		tx_data[i] = (unsigned char) rand();
+	}
+
+	/* Trailing CPMEOF is indistinguishable from padding. */
+	if(size > 0 && tx_data[size - 1] == CPMEOF)
+	{
+		tx_data[size - 1] = 0;
+	}
+}
+
+/* An anonymous temporary file. */
+static int temp_fd(void)
+{
+	char path[] = "/tmp/libmodem-XXXXXX";
+	int fd = mkstemp(path);
+
+	if(fd >= 0)
+	{
+		unlink(path);
+	}
+
+	return fd;
+}
+
+#ifdef __linux__
+static void engine_done(engine_port_t * port, modem_errors_t status, void * const chan_state)
+{
+	(void) port;
+	(void) status;
+	(void) chan_state;
+	engine_finished++;
+}
+#endif
+
+static int mem_out(char * buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+	size_t left;
+	int size;
+
+	chan->bufpos += last_sent_size;
+	left = chan->buflen - chan->bufpos;
+	size = ((size_t) request_size < left) ? request_size : (int) left;
+	memcpy(buf, chan->buf + chan->bufpos, size);
+
+	return size;
+}
+
+static int mem_seek(unsigned long offset, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	if(offset > chan->buflen)
+	{
+		return -1;
+	}
+
+	chan->bufpos = offset;
+	return 0;
+}
+
+static int mem_borrow(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+	size_t left;
+
+	chan->bufpos += last_sent_size;
+	left = chan->buflen - chan->bufpos;
+	*buf = (const char *) chan->buf + chan->bufpos;
+
+	return ((size_t) request_size < left) ? request_size : (int) left;
+}
+
+static int mem_in(const char * buf, const int buf_size, const int eof, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	if(eof)
+	{
+		return buf_size;
+	}
+
+	if(chan->bufpos + buf_size > chan->buflen)
+	{
+		return -1;
+	}
+
+	memcpy(chan->buf + chan->bufpos, buf, buf_size);
+	chan->bufpos += buf_size;
+	return buf_size;
+}
+
+static char * mem_window(const int request_size, const int last_recv_size, const int eof, void * const chan_state)
+{
+	mem_chan_t * chan = chan_state;
+
+	chan->bufpos += last_recv_size;
+	if(eof)
+	{
+		return (char *) chan->buf;
+	}
+
+	if(chan->bufpos + request_size > chan->buflen)
+	{
+		return NULL;
+	}
+
+	return (char *) chan->buf + chan->bufpos;
+}
+
+static double now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -90,9 +90,9 @@ int write_data(serial_handle_t port, char * data, unsigned int num_bytes)
 	}
 }
 
-int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int timeout)
+int read_data(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms)
 {
-	(void) timeout;
+	(void) timeout_ms;
 
 	if(VOID_TO_PORT(port, bad_read))
 	{
@@ -116,16 +116,16 @@ int read_data(serial_handle_t port, char * data, unsigned int num_bytes, int tim
 	}
 }
 
-int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, int timeout, int * elapsed)
+int read_data_get_elapsed_time(serial_handle_t port, char * data, unsigned int num_bytes, long timeout_ms, long * elapsed_ms)
 {
 	int rc;
 	time_t start, end;
 
 	time(&start);
-	rc = read_data(port, data, num_bytes, timeout);
+	rc = read_data(port, data, num_bytes, timeout_ms);
 	time(&end);
 
-	*elapsed = (int) difftime(end, start);
+	*elapsed_ms = (long) (difftime(end, start) * 1000);
 	return rc;
 }
 
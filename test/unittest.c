@@ -5,6 +5,7 @@
 #include "modem.h"
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <limits.h>
 
 typedef struct tx_params
@@ -32,16 +33,54 @@ char local_sink[STATIC_BUFSIZ] = {'\0'};
 char remote_source[STATIC_BUFSIZ] = {'\0'};
 char remote_sink[STATIC_BUFSIZ] = {'\0'};
 char cpmeof_buf[1024] = {CPMEOF};
+unsigned char crc_buf[8192 + 16];
 
 unsigned char temp_buf[X1K_END + 1]; /* A dummy buffer to make the xmodem routines happy. */
+unsigned char session_buf[X1K_END + 1]; /* Receiver's buffer, for sessions. */
+unsigned char image_buf[4096];
+unsigned char prefetch_buf[2 * X1K_END]; /* Two packets, for xmodem_tx_prefetch(). */
 
 serial_handle_t local_port, remote_port;
 TX_PARAMS tx_opts = {local_source, local_sink, 0, 0, 0};
 RX_PARAMS rx_opts = {remote_source, remote_sink, 0, 0};
 
+/* YMODEM batch: files still to send, and what the receiver was told. */
+int ymodem_files_left;
+int ymodem_files_opened;
+ymodem_file_info_t ymodem_last_info;
+
+/* SFL loads are placed in the sink relative to this address. */
+#define SFL_TEST_BASE 0x40000000UL
+unsigned long sfl_eof_addr, sfl_boot_addr;
+/* Regions of tx_opts.data_source uploaded by sfl_tx(): the first two
+adjoin, and the third is elsewhere. */
+const struct { unsigned long addr; size_t offset, size; } sfl_regions[3] = {
+	{ SFL_TEST_BASE, 0, 200 },
+	{ SFL_TEST_BASE + 200, 200, 100 },
+	{ SFL_TEST_BASE + 0x400, 300, 100 }
+};
+unsigned int sfl_regions_sent;
+/* LOAD frames sfl_tx() makes of them, with the third region's data from
+320 to 379 erased: adjoining regions packed into a full frame, and the
+third region split around the erased run. */
+const struct { unsigned long addr; size_t offset, size; } sfl_frames[4] = {
+	{ SFL_TEST_BASE, 0, 251 },
+	{ SFL_TEST_BASE + 251, 251, 49 },
+	{ SFL_TEST_BASE + 0x400, 300, 20 },
+	{ SFL_TEST_BASE + 0x400 + 80, 380, 20 }
+};
+
 /* Data xfer fcns used as XMODEM callbacks. */
 static int data_out_fcn(char * buf, const int request_size, const int last_sent_size, void * const chan_state);
 static int data_in_fcn(const char * buf, const int request_size, const int eot, void * const chan_state);
+static int data_borrow_fcn(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state);
+static int data_checked_fcn(char * buf, const int request_size, const int last_sent_size, crc_state_t * check, void * const chan_state);
+static char * data_window_fcn(const int request_size, const int last_recv_size, const int eot, void * const chan_state);
+static int next_file_fcn(ymodem_file_info_t * info, void * const chan_state);
+static int open_file_fcn(const ymodem_file_info_t * info, void * const chan_state);
+static int sfl_load_fcn(unsigned long address, const char * buf, const int buf_size, const int eof, void * const chan_state);
+static int sfl_boot_fcn(unsigned long address, void * const chan_state);
+static int sfl_region_fcn(unsigned long * address, const unsigned char ** data, size_t * size, void * const chan_state);
 /* Helper functions. */
 static void fill_buf(char * buf, unsigned int num_chars);
 static int buf_cmp(char * buf1, char * buf2, int len);
@@ -50,6 +89,10 @@ static void buf_clr(char * buf, unsigned int num_chars);
 
 static void verify_packet(char * packet, unsigned char packet_no, char * payload, \
 	unsigned int payload_len, int using_chksum, int using_1k);
+static unsigned short reference_crc(unsigned char * data, size_t size);
+static size_t session_relay(xmodem_session_t * from, xmodem_session_t * to, long now_ms);
+static unsigned int make_sfl_frame(char * frame, unsigned char cmd, unsigned long address, \
+	char * data, unsigned int len);
 
 /* Setup/teardown functions for each test. */
 /* Test setup clears all buffers and assumes a working serial port. */
@@ -131,6 +174,27 @@ MU_TEST(test_ser_tx)
 	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 128) == 1);
 }
 
+MU_TEST(test_ser_sndv)
+{
+	serial_iovec_t spans[4];
+
+	fill_buf(tx_opts.data_source, 128);
+	spans[0].data = tx_opts.data_source;
+	spans[0].num_bytes = 3;
+	spans[1].data = tx_opts.data_source + 3;
+	spans[1].num_bytes = 0;
+	spans[2].data = tx_opts.data_source + 3;
+	spans[2].num_bytes = 124;
+	spans[3].data = tx_opts.data_source + 127;
+	spans[3].num_bytes = 1;
+	mu_check(serial_sndv(spans, 4, local_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(rx_opts.data_sink, 128, 1, NULL, remote_port) == SERIAL_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 128) == 1);
+
+	VOID_TO_PORT(local_port, bad_write) = 1;
+	mu_check(serial_sndv(spans, 4, local_port) == SERIAL_HW_ERROR);
+}
+
 MU_TEST(test_ser_rx_hw_error_bad_read)
 {
 	VOID_TO_PORT(remote_port, bad_read) = 1;
@@ -162,6 +226,46 @@ MU_TEST(test_ser_rx_timeout)
 	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 128) == 0);
 }
 
+MU_TEST(test_ser_rx_ms)
+{
+	long spent_ms = -1;
+	int spent = -1;
+
+	fill_buf(tx_opts.data_source, 128);
+	mu_check(serial_snd(tx_opts.data_source, 128, local_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_ms(rx_opts.data_sink, 64, 250, &spent_ms, remote_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv(rx_opts.data_sink + 64, 64, 1, &spent, remote_port) == SERIAL_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 128) == 1);
+	mu_check(spent_ms >= 0 && spent_ms < 1000);
+	mu_check(spent == 0);
+
+	VOID_TO_PORT(remote_port, force_rx_timeout) = 1;
+	mu_check(serial_rcv_ms(rx_opts.data_sink, 1, 0, NULL, remote_port) == SERIAL_TIMEOUT);
+}
+
+MU_TEST(test_ser_rx_some)
+{
+	unsigned int got = 0;
+	char c = NUL;
+
+	/* Without read_data_some(), one byte arrives per call, and peeking is
+	not supported. */
+	fill_buf(tx_opts.data_source, 4);
+	mu_check(serial_snd(tx_opts.data_source, 4, local_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_rcv_some(rx_opts.data_sink, 4, 100, &got, remote_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq(1, got);
+	mu_check(serial_rcv_some(rx_opts.data_sink + 1, 3, 100, &got, remote_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq(1, got);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 2) == 1);
+	mu_check(serial_rcv_some(rx_opts.data_sink, 0, 100, &got, remote_port) == SERIAL_NO_ERRORS);
+	mu_assert_int_eq(0, got);
+	mu_check(serial_peek(&c, 100, remote_port) == SERIAL_HW_ERROR);
+
+	VOID_TO_PORT(remote_port, force_rx_timeout) = 1;
+	mu_check(serial_rcv_some(rx_opts.data_sink, 4, 0, &got, remote_port) == SERIAL_TIMEOUT);
+	mu_check(serial_rcv_some(rx_opts.data_sink, 4, 0, &got, NULL) == SERIAL_HW_ERROR);
+}
+
 MU_TEST(test_ser_rx_flush_close)
 {
 	fill_buf(tx_opts.data_source, 128);
@@ -242,7 +346,7 @@ MU_TEST(test_xmodem_packet)
 	/* Fill the local source data buffer and make sure it's size is correctly
 	set for input into the xmodem_tx fcn. */
 	fill_buf(tx_opts.data_source, tx_opts.source_size = 127);
-	xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM);
+	xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM, NULL);
 
 	/* Instead of testing xmodem_rx, intercept the packet directly and test the
 	transmit routine. */
@@ -263,7 +367,7 @@ MU_TEST(test_xmodem_packet_boundary)
 	mu_check(serial_snd(rx_opts.data_source, 4, remote_port) == SERIAL_NO_ERRORS);
 	mu_assert_int_eq(NAK, VOID_TO_PORT(local_port, rx_line)[0]);
 	fill_buf(tx_opts.data_source, tx_opts.source_size = 128);
-	xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM);
+	xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM, NULL);
 
 	serial_rcv(rx_opts.data_sink, 2*CHKSUM_END, 1, NULL, remote_port);
 	verify_packet(&rx_opts.data_sink[0], 1, tx_opts.data_source, 128, 1, 0);
@@ -282,8 +386,8 @@ MU_TEST(test_xmodem_xfer_chksum)
 	mu_assert_int_eq(NAK, VOID_TO_PORT(local_port, rx_line)[0]);
 
 	fill_buf(tx_opts.data_source, tx_opts.source_size = 255);
-	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM) == MODEM_NO_ERRORS);
-	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM) == MODEM_NO_ERRORS);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM, NULL) == MODEM_NO_ERRORS);
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM, NULL) == MODEM_NO_ERRORS);
 
 	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 255) == 1);
 	mu_assert_int_eq(rx_opts.data_sink[255], CPMEOF);
@@ -306,8 +410,8 @@ MU_TEST(test_xmodem_xfer_crc)
 	mu_assert_int_eq(ASCII_C, VOID_TO_PORT(local_port, rx_line)[0]);
 
 	fill_buf(tx_opts.data_source, tx_opts.source_size = 255);
-	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC) == MODEM_NO_ERRORS);
-	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_CRC) == MODEM_NO_ERRORS);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
 
 	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 255) == 1);
 	mu_assert_int_eq(rx_opts.data_sink[255], CPMEOF);
@@ -332,14 +436,842 @@ MU_TEST(test_xmodem_xfer_1k)
 	mu_assert_int_eq(ASCII_C, VOID_TO_PORT(local_port, rx_line)[0]);
 
 	fill_buf(tx_opts.data_source, tx_opts.source_size = 2048 - 128);
-	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_1K) == MODEM_NO_ERRORS);
-	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_1K) == MODEM_NO_ERRORS);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
 
 	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 2048 - 128) == 1);
 	mu_assert_int_eq(rx_opts.data_sink[2047], CPMEOF); /* Ensure last 128 is EOF */
 }
 
 
+MU_TEST(test_xmodem_xfer_borrow)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+
+	rx_opts.data_source[0] = ASCII_C;
+	rx_opts.data_source[1] = NAK; /* First block is sent twice. */
+	rx_opts.data_source[2] = ACK;
+	rx_opts.data_source[3] = ACK; /* Short block. */
+	rx_opts.data_source[4] = ACK; /* EOT */
+	mu_check(serial_snd(rx_opts.data_source, 5, remote_port) == SERIAL_NO_ERRORS);
+
+	/* The byte after the data must not be overwritten by padding. */
+	fill_buf(tx_opts.data_source, 201);
+	tx_opts.source_size = 200;
+	mu_check(xmodem_tx_borrow(data_borrow_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+
+	verify_packet(&sent[0], 1, tx_opts.data_source, 128, 1, 0);
+	verify_packet(&sent[CRC_END], 1, tx_opts.data_source, 128, 1, 0);
+	verify_packet(&sent[2 * CRC_END], 2, tx_opts.data_source + 128, 72, 1, 0);
+	mu_assert_int_eq(reference_crc((unsigned char *) &sent[2 * CRC_END + DATA], 128), \
+		((unsigned char) sent[3 * CRC_END - 2] << 8) | (unsigned char) sent[3 * CRC_END - 1]);
+	mu_assert_int_eq(EOT, sent[3 * CRC_END]);
+	mu_assert_int_eq(200, (unsigned char) tx_opts.data_source[200]);
+}
+
+
+MU_TEST(test_xmodem_xfer_checked)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	unsigned int offset;
+
+	rx_opts.data_source[0] = ASCII_C;
+	rx_opts.data_source[1] = ACK; /* 1024 */
+	rx_opts.data_source[2] = ACK; /* 128, from a 300 byte read. */
+	rx_opts.data_source[3] = ACK; /* 128 */
+	rx_opts.data_source[4] = ACK; /* Short block. */
+	rx_opts.data_source[5] = ACK; /* EOT */
+	mu_check(serial_snd(rx_opts.data_source, 6, remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 1024 + 300);
+	mu_check(xmodem_tx_checked(data_checked_fcn, temp_buf, &tx_opts, local_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+
+	verify_packet(&sent[0], 1, tx_opts.data_source, 1024, 0, 1);
+	mu_assert_int_eq(reference_crc((unsigned char *) &sent[DATA], 1024), \
+		((unsigned char) sent[X1K_END - 2] << 8) | (unsigned char) sent[X1K_END - 1]);
+	for(offset = 0; offset < 3; offset++)
+	{
+		char * packet = &sent[X1K_END + offset * CRC_END];
+
+		verify_packet(packet, offset + 2, tx_opts.data_source + 1024 + offset * 128, \
+			(offset < 2) ? 128 : 44, 1, 0);
+		mu_assert_int_eq(reference_crc((unsigned char *) &packet[DATA], 128), \
+			((unsigned char) packet[CRC_END - 2] << 8) | (unsigned char) packet[CRC_END - 1]);
+	}
+	mu_assert_int_eq(EOT, sent[X1K_END + 3 * CRC_END]);
+}
+
+MU_TEST(test_xmodem_xfer_checked_trusted)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+
+	rx_opts.data_source[0] = ASCII_C;
+	rx_opts.data_source[1] = ACK;
+	rx_opts.data_source[2] = ACK; /* EOT */
+	mu_check(serial_snd(rx_opts.data_source, 3, remote_port) == SERIAL_NO_ERRORS);
+
+	/* The trailer is the channel's CRC; the payload isn't read again. */
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 128);
+	tx_opts.force_bad_checksum = 1;
+	mu_check(xmodem_tx_checked(data_checked_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+
+	verify_packet(&sent[0], 1, tx_opts.data_source, 128, 1, 0);
+	mu_check(reference_crc((unsigned char *) &sent[DATA], 128) != \
+		(((unsigned char) sent[CRC_END - 2] << 8) | (unsigned char) sent[CRC_END - 1]));
+}
+
+
+MU_TEST(test_xmodem_rx_window)
+{
+	unsigned char header[DATA + 2];
+	char * rx_responses = VOID_TO_PORT(local_port, rx_line);
+
+	rx_opts.data_source[0] = ASCII_C;
+	rx_opts.data_source[1] = NAK; /* Corrupt 1024 block below. */
+	rx_opts.data_source[2] = ACK;
+	rx_opts.data_source[3] = ACK; /* 128 */
+	rx_opts.data_source[4] = ACK; /* EOT */
+	mu_check(serial_snd(rx_opts.data_source, 5, remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 1024 + 100);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+
+	/* Flip a payload bit of the first copy of block 1, so it is received
+	into the window, rejected and then overwritten by the resend. */
+	VOID_TO_PORT(local_port, tx_line)[DATA + 500] ^= 0x10;
+
+	rx_opts.sink_size = 1024 + 128;
+	mu_check(xmodem_rx_window(data_window_fcn, header, &rx_opts, remote_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 1024 + 100) == 1);
+	mu_assert_int_eq(CPMEOF, rx_opts.data_sink[1024 + 127]);
+	mu_check(rx_opts.sink_pos == 1024 + 128);
+	mu_assert_int_eq(ASCII_C, rx_responses[5]);
+	mu_assert_int_eq(NAK, rx_responses[6]);
+	mu_assert_int_eq(ACK, rx_responses[7]);
+
+	/* A sink without room aborts the transfer. */
+	rx_opts.sink_pos = 0;
+	rx_opts.sink_size = 100;
+	VOID_TO_PORT(remote_port, buf_pos_rx) = 0;
+	mu_check(xmodem_rx_window(data_window_fcn, header, &rx_opts, remote_port, XMODEM_1K, NULL) == CHANNEL_ERROR);
+}
+
+
+MU_TEST(test_xmodem_windowed)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	char * rx_responses = VOID_TO_PORT(local_port, rx_line);
+	const char responses[] = { ASCII_W, ACK, 1, ACK, 2, NAK, 3, ACK, 3, \
+		ACK, 4, ACK };
+	const char rx_expected[] = { ASCII_W, ACK, 1, ACK, 2, ACK, 3, ACK, 4, ACK };
+	unsigned int i;
+
+	/* All four blocks fit in the window, so they go out before any response
+	is read. The NAK for block 3 acknowledges blocks 1 and 2 (already done
+	here) and sends the transmitter back to block 3. */
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 3 * 128 + 50);
+	mu_check(xmodem_tx_windowed(data_out_fcn, temp_buf, 4, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+
+	verify_packet(&sent[0], 1, tx_opts.data_source, 128, 1, 0);
+	verify_packet(&sent[CRC_END], 2, tx_opts.data_source + 128, 128, 1, 0);
+	verify_packet(&sent[2 * CRC_END], 3, tx_opts.data_source + 256, 128, 1, 0);
+	verify_packet(&sent[3 * CRC_END], 4, tx_opts.data_source + 384, 50, 1, 0);
+	verify_packet(&sent[4 * CRC_END], 3, tx_opts.data_source + 256, 128, 1, 0);
+	verify_packet(&sent[5 * CRC_END], 4, tx_opts.data_source + 384, 50, 1, 0);
+	mu_assert_int_eq(EOT, sent[6 * CRC_END]);
+
+	/* Replayed to a windowed receiver, the resent blocks 3 and 4 arrive out
+	of sequence and are dropped. The rest are acknowledged by number. */
+	mu_check(xmodem_rx_windowed(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 3 * 128 + 50) == 1);
+	mu_assert_int_eq(4 * 128, rx_opts.sink_pos);
+	for(i = 0; i < sizeof(rx_expected); i++)
+	{
+		mu_assert_int_eq(rx_expected[i], rx_responses[sizeof(responses) + i]);
+	}
+}
+
+
+MU_TEST(test_xmodem_prefetch)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	const char responses[] = { ASCII_C, NAK, ACK, ACK, ACK, ACK };
+
+	/* Block 2 is read while block 1 is on the wire, and block 1 is resent
+	from its own slot, so the source only ever moves forward. */
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 2 * 1024 + 100);
+	mu_check(xmodem_tx_prefetch(data_out_fcn, prefetch_buf, &tx_opts, local_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+
+	verify_packet(&sent[0], 1, tx_opts.data_source, 1024, 0, 1);
+	verify_packet(&sent[X1K_END], 1, tx_opts.data_source, 1024, 0, 1);
+	verify_packet(&sent[2 * X1K_END], 2, tx_opts.data_source + 1024, 1024, 0, 1);
+	verify_packet(&sent[3 * X1K_END], 3, tx_opts.data_source + 2048, 100, 1, 0);
+	mu_assert_int_eq(reference_crc((unsigned char *) &sent[3 * X1K_END + DATA], 128), \
+		((unsigned char) sent[3 * X1K_END + CRC_END - 2] << 8) | \
+		(unsigned char) sent[3 * X1K_END + CRC_END - 1]);
+	mu_assert_int_eq(EOT, sent[3 * X1K_END + CRC_END]);
+	mu_assert_int_eq(2048, tx_opts.source_pos);
+
+	/* The receiver sees an ordinary transfer, once the first copy of block
+	1 is damaged to match the NAK. */
+	sent[DATA + 10] ^= 0x01;
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_1K, NULL) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 2 * 1024 + 100) == 1);
+	mu_assert_int_eq(2048 + 128, rx_opts.sink_pos);
+}
+
+
+MU_TEST(test_xmodem_stats)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	const char responses[] = { ASCII_C, NAK, ACK, ACK, ACK };
+	modem_stats_t stats;
+
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	/* One 1024 byte block, sent twice, then 100 bytes in a 128 byte block. */
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 1024 + 100);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_1K, &stats) == MODEM_NO_ERRORS);
+	mu_assert_int_eq(3, stats.packets_sent);
+	mu_assert_int_eq(0, stats.packets_received);
+	mu_assert_int_eq(1, stats.retransmits);
+	mu_assert_int_eq(1, stats.naks_received);
+	mu_assert_int_eq(0, stats.timeouts);
+	mu_assert_int_eq(1, stats.tail_switches);
+	mu_assert_int_eq(0, stats.downgrades_crc);
+	mu_assert_int_eq(1024 + 100, stats.payload_bytes);
+	mu_assert_int_eq(28, stats.padding_bytes);
+	mu_assert_int_eq(2 * X1K_END + CRC_END, stats.wire_bytes);
+	mu_assert_int_eq(2, stats.ack_rtt_count);
+	mu_check(stats.ack_rtt_min_ms <= stats.ack_rtt_max_ms);
+
+	/* Replayed with the first copy damaged, the receiver rejects it. */
+	sent[DATA + 10] ^= 0x01;
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_1K, &stats) == MODEM_NO_ERRORS);
+	mu_assert_int_eq(0, stats.packets_sent);
+	mu_assert_int_eq(3, stats.packets_received);
+	mu_assert_int_eq(1, stats.naks_bad_check);
+	mu_assert_int_eq(0, stats.naks_timeout);
+	mu_assert_int_eq(1, stats.tail_switches);
+	mu_assert_int_eq(1024 + 128, stats.payload_bytes);
+	mu_assert_int_eq(2 * X1K_END + CRC_END, stats.wire_bytes);
+	mu_assert_int_eq(0, stats.ack_rtt_count);
+}
+
+
+MU_TEST(test_xmodem_prefetch_stats)
+{
+	const char responses[] = { ASCII_C, ACK, ACK, ACK, ACK, ACK, ACK };
+	modem_stats_t stats;
+
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	/* The second read returns 500 bytes, more than the 128 byte blocks
+	which finish the transfer hold; only the last of those is padded. */
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 1024 + 500);
+	mu_check(xmodem_tx_prefetch(data_out_fcn, prefetch_buf, &tx_opts, local_port, XMODEM_1K, &stats) == MODEM_NO_ERRORS);
+	mu_assert_int_eq(5, stats.packets_sent);
+	mu_assert_int_eq(0, stats.retransmits);
+	mu_assert_int_eq(1, stats.tail_switches);
+	mu_assert_int_eq(1024 + 500, stats.payload_bytes);
+	mu_assert_int_eq(12, stats.padding_bytes);
+	mu_assert_int_eq(X1K_END + 4 * CRC_END, stats.wire_bytes);
+	mu_assert_int_eq(5, stats.ack_rtt_count);
+}
+
+
+MU_TEST(test_xmodem_streaming)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	char * rx_responses = VOID_TO_PORT(local_port, rx_line);
+	const char cancel[] = { ASCII_G, CAN };
+	/* The simulated line never times out, so each poll for a cancel while
+	streaming consumes a character; NUL stands for an idle line. */
+	const char responses[] = { ASCII_G, NUL, NUL, ACK };
+
+	/* A cancel is noticed as soon as the packet in flight has gone. */
+	buf_cpy(rx_opts.data_source, (char *) cancel, sizeof(cancel));
+	buf_cpy(rx_opts.data_source + sizeof(cancel), (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(cancel) + sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 1024 + 50);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_G, NULL) == SENT_CAN);
+	mu_assert_int_eq(X1K_END, VOID_TO_PORT(local_port, buf_pos_tx));
+
+	/* Otherwise, packets go out without waiting, and only EOT is
+	acknowledged. */
+	VOID_TO_PORT(local_port, buf_pos_tx) = 0;
+	tx_opts.source_pos = 0;
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_G, NULL) == MODEM_NO_ERRORS);
+	verify_packet(&sent[0], 1, tx_opts.data_source, 1024, 0, 1);
+	verify_packet(&sent[X1K_END], 2, tx_opts.data_source + 1024, 50, 1, 0);
+	mu_assert_int_eq(EOT, sent[X1K_END + CRC_END]);
+
+	/* Replayed to the receiver, nothing but the EOT is acknowledged. */
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_G, NULL) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 1024 + 50) == 1);
+	mu_assert_int_eq(1024 + 128, rx_opts.sink_pos);
+	mu_assert_int_eq(ASCII_G, rx_responses[6]);
+	mu_assert_int_eq(ACK, rx_responses[7]);
+
+	/* A bad packet can't be resent, so it cancels the transfer. */
+	sent[DATA + 100] ^= 0x04;
+	VOID_TO_PORT(remote_port, buf_pos_rx) = 0;
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_G, NULL) == BAD_CRC_CHKSUM);
+	mu_assert_int_eq(ASCII_G, rx_responses[8]);
+	mu_assert_int_eq(CAN, rx_responses[9]);
+}
+
+
+MU_TEST(test_ymodem_batch)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	char * rx_responses = VOID_TO_PORT(local_port, rx_line);
+	const char responses[] = { ASCII_C, ACK, ASCII_C, ACK, ACK, ACK, \
+		ASCII_C, ACK, ASCII_C, ACK, ACK, ACK, ASCII_C, ACK };
+	char header[128] = "a.bin\0" "200 12345";
+	modem_stats_t stats;
+	unsigned int i;
+
+	/* Two files: "a.bin" of 200 bytes, and "b" of 128 bytes, which is
+	followed by a block of nothing but padding. */
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses));
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses), remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, 200);
+	ymodem_files_left = 2;
+	mu_check(ymodem_tx(next_file_fcn, data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+
+	/* Headers are padded with NUL. */
+	verify_packet(&sent[0], 0, header, 128, 1, 0);
+	verify_packet(&sent[CRC_END], 1, tx_opts.data_source, 128, 1, 0);
+	verify_packet(&sent[2 * CRC_END], 2, tx_opts.data_source + 128, 72, 1, 0);
+	mu_assert_int_eq(EOT, sent[3 * CRC_END]);
+	buf_clr(header, 128);
+	buf_cpy(header, "b\0" "128", 6);
+	verify_packet(&sent[3 * CRC_END + 1], 0, header, 128, 1, 0);
+	verify_packet(&sent[4 * CRC_END + 1], 1, tx_opts.data_source, 128, 1, 0);
+	verify_packet(&sent[5 * CRC_END + 1], 2, cpmeof_buf, 0, 1, 0);
+	mu_assert_int_eq(EOT, sent[6 * CRC_END + 1]);
+	buf_clr(header, 128);
+	verify_packet(&sent[6 * CRC_END + 2], 0, header, 128, 1, 0);
+
+	/* Replayed to the receiver, each file arrives trimmed to its size. */
+	mu_check(ymodem_rx(open_file_fcn, data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_CRC, &stats) == MODEM_NO_ERRORS);
+	mu_assert_int_eq(2, ymodem_files_opened);
+	mu_check(buf_cmp(ymodem_last_info.name, "b", 2) == 1);
+	mu_assert_int_eq(128, ymodem_last_info.size);
+	mu_assert_int_eq(0, ymodem_last_info.mtime);
+	mu_assert_int_eq(200 + 128, rx_opts.sink_pos);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 200) == 1);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink + 200, 128) == 1);
+	/* Headers aren't file data, and the padding is known from the sizes. */
+	mu_assert_int_eq(7, stats.packets_received);
+	mu_assert_int_eq(200 + 128, stats.payload_bytes);
+	mu_assert_int_eq(56 + 128, stats.padding_bytes);
+	for(i = 0; i < sizeof(responses); i++)
+	{
+		mu_assert_int_eq(responses[i], rx_responses[sizeof(responses) + i]);
+	}
+}
+
+
+MU_TEST(test_xmodem_rx_bad_crc)
+{
+	char packet[CRC_END];
+	char eot = EOT;
+	char * rx_responses = VOID_TO_PORT(local_port, rx_line);
+
+	rx_opts.data_source[0] = ASCII_C;
+	rx_opts.data_source[1] = ACK;
+	rx_opts.data_source[2] = ACK;
+	mu_check(serial_snd(rx_opts.data_source, 3, remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, tx_opts.source_size = 127);
+	mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+
+	/* Replace what the transmitter sent with: the packet with one payload
+	bit flipped, the good packet, and EOT. */
+	buf_cpy(packet, VOID_TO_PORT(local_port, tx_line), CRC_END);
+	VOID_TO_PORT(local_port, buf_pos_tx) = 0;
+	packet[DATA + 100] ^= 0x04;
+	mu_check(serial_snd(packet, CRC_END, local_port) == SERIAL_NO_ERRORS);
+	packet[DATA + 100] ^= 0x04;
+	mu_check(serial_snd(packet, CRC_END, local_port) == SERIAL_NO_ERRORS);
+	mu_check(serial_snd(&eot, 1, local_port) == SERIAL_NO_ERRORS);
+
+	mu_check(xmodem_rx(data_in_fcn, temp_buf, &rx_opts, remote_port, XMODEM_CRC, NULL) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 127) == 1);
+	mu_assert_int_eq(rx_opts.sink_pos, 128);
+
+	/* Responses start after the 3 control codes queued above. */
+	mu_assert_int_eq(ASCII_C, rx_responses[3]);
+	mu_assert_int_eq(NAK, rx_responses[4]);
+	mu_assert_int_eq(ACK, rx_responses[5]);
+	mu_assert_int_eq(ACK, rx_responses[6]);
+}
+
+
+MU_TEST(test_xmodem_session)
+{
+	xmodem_session_t tx, rx;
+	const xmodem_xfer_mode_t modes[] = { XMODEM, XMODEM_1K, XMODEM_G };
+	const char * out;
+	unsigned int mode, rounds;
+	size_t rx_sent;
+	int corrupted;
+
+	/* Sessions talk to each other directly; no serial port is involved. */
+	fill_buf(tx_opts.data_source, 3000);
+	for(mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++)
+	{
+		tx_opts.source_size = 3000;
+		tx_opts.source_pos = 0;
+		rx_opts.sink_pos = 0;
+		buf_clr(rx_opts.data_sink, 3100);
+		rx_sent = 0;
+		corrupted = 0;
+
+		xmodem_session_tx(&tx, data_out_fcn, temp_buf, &tx_opts, modes[mode], 0);
+		xmodem_session_rx(&rx, data_in_fcn, session_buf, &rx_opts, modes[mode], 0);
+		for(rounds = 0; rounds < 100 && (xmodem_session_status(&tx) == MODEM_IN_PROGRESS \
+			|| xmodem_session_output(&rx, &out) > 0); rounds++)
+		{
+			/* Damage the first packet once; unless streaming, it is sent
+			again after a NAK. */
+			if(!corrupted && modes[mode] != XMODEM_G && xmodem_session_output(&tx, &out) > DATA)
+			{
+				temp_buf[DATA + 5] ^= 0x10;
+				corrupted = 1;
+			}
+			session_relay(&tx, &rx, 0);
+			rx_sent += session_relay(&rx, &tx, 0);
+		}
+
+		mu_assert_int_eq(MODEM_NO_ERRORS, xmodem_session_status(&tx));
+		mu_assert_int_eq(MODEM_NO_ERRORS, xmodem_session_status(&rx));
+		mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 3000) == 1);
+		mu_assert_int_eq((modes[mode] == XMODEM) ? 24 * 128 : 2 * 1024 + 8 * 128, rx_opts.sink_pos);
+	}
+
+	/* Streaming, the receiver only sends 'G' and the final ACK. */
+	mu_assert_int_eq(2, rx_sent);
+}
+
+MU_TEST(test_xmodem_session_timeouts)
+{
+	xmodem_session_t session;
+	const char * out;
+	char responses[16];
+	unsigned int count;
+	long now, deadline;
+
+	/* The receiver asks for CRCs four times, then falls back to checksums,
+	and cancels after 12 timeouts in all. */
+	xmodem_session_rx(&session, data_in_fcn, session_buf, &rx_opts, XMODEM_CRC, 0);
+	mu_check(!xmodem_session_deadline(&session, &deadline));
+	for(count = 0, now = 0; count < sizeof(responses) && xmodem_session_output(&session, &out) > 0; count++)
+	{
+		responses[count] = out[0];
+		xmodem_session_sent(&session, 1, now);
+		if(xmodem_session_deadline(&session, &deadline))
+		{
+			mu_assert_int_eq(now + 3000, deadline);
+			xmodem_session_tick(&session, deadline - 1);
+			mu_assert_int_eq(0, xmodem_session_output(&session, &out));
+			xmodem_session_tick(&session, now = deadline);
+		}
+	}
+	mu_assert_int_eq(14, count);
+	mu_check(buf_cmp(responses, "CCCC", 4) == 1);
+	mu_assert_int_eq(NAK, responses[12]);
+	mu_assert_int_eq(CAN, responses[13]);
+	mu_assert_int_eq(MODEM_TIMEOUT, xmodem_session_status(&session));
+
+	/* A packet cut short is answered with a NAK once the line has been idle
+	for a while. */
+	xmodem_session_rx(&session, data_in_fcn, session_buf, &rx_opts, XMODEM_CRC, 0);
+	xmodem_session_sent(&session, 1, 0);
+	responses[0] = SOH;
+	mu_assert_int_eq(1, xmodem_session_feed(&session, responses, 1, 10));
+	mu_assert_int_eq(50, xmodem_session_feed(&session, cpmeof_buf, 50, 20));
+	mu_check(xmodem_session_deadline(&session, &deadline) && deadline == 1020);
+	xmodem_session_tick(&session, 1020);
+	mu_check(xmodem_session_deadline(&session, &deadline) && deadline == 1270);
+	mu_assert_int_eq(1, xmodem_session_feed(&session, cpmeof_buf, 1, 1100));
+	xmodem_session_tick(&session, 1270);
+	mu_assert_int_eq(0, xmodem_session_output(&session, &out));
+	xmodem_session_tick(&session, 1350);
+	mu_assert_int_eq(1, xmodem_session_output(&session, &out));
+	mu_assert_int_eq(NAK, out[0]);
+
+	/* EOT ends the transfer, leaving the ACK to be sent and anything after
+	it unread. */
+	responses[0] = EOT;
+	responses[1] = 'x';
+	mu_assert_int_eq(1, xmodem_session_feed(&session, responses, 2, 1400));
+	mu_assert_int_eq(MODEM_NO_ERRORS, xmodem_session_status(&session));
+	mu_assert_int_eq(2, xmodem_session_output(&session, &out));
+	mu_assert_int_eq(ACK, out[1]);
+
+	/* Garbage doesn't hold off the transmitter's start timeout. */
+	xmodem_session_tx(&session, data_out_fcn, temp_buf, &tx_opts, XMODEM_CRC, 100);
+	mu_assert_int_eq(3, xmodem_session_feed(&session, "xyz", 3, 30000));
+	xmodem_session_tick(&session, 60099);
+	mu_assert_int_eq(MODEM_IN_PROGRESS, xmodem_session_status(&session));
+	xmodem_session_tick(&session, 60100);
+	mu_assert_int_eq(MODEM_TIMEOUT, xmodem_session_status(&session));
+}
+
+
+MU_TEST(test_xmodem_image)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	const xmodem_xfer_mode_t modes[] = { XMODEM, XMODEM_CRC, XMODEM_1K };
+	xmodem_image_t image;
+	xmodem_session_t tx, rx;
+	const char * out;
+	const char nak = NAK;
+	unsigned int mode, count;
+	size_t size;
+
+	fill_buf(tx_opts.data_source, 3007);
+	for(mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++)
+	{
+		VOID_TO_PORT(local_port, buf_pos_tx) = 0;
+		VOID_TO_PORT(local_port, buf_pos_rx) = 0;
+		VOID_TO_PORT(remote_port, buf_pos_tx) = 0;
+		rx_opts.data_source[0] = (modes[mode] == XMODEM) ? NAK : ASCII_C;
+		for(count = 1; count < 32; count++)
+		{
+			rx_opts.data_source[count] = ACK;
+		}
+		mu_check(serial_snd(rx_opts.data_source, 32, remote_port) == SERIAL_NO_ERRORS);
+
+		/* An image holds exactly what xmodem_tx() sends, up to EOT. */
+		tx_opts.source_size = 3007;
+		tx_opts.source_pos = 0;
+		mu_check(xmodem_tx(data_out_fcn, temp_buf, &tx_opts, local_port, modes[mode], NULL) == MODEM_NO_ERRORS);
+		size = xmodem_image_size(3007, modes[mode]);
+		mu_assert_int_eq((modes[mode] == XMODEM_1K) ? 2 * X1K_END + 8 * CRC_END : \
+			24 * ((modes[mode] == XMODEM) ? CHKSUM_END : CRC_END), size);
+		mu_check(xmodem_image_init(&image, image_buf, size - 1, (unsigned char *) tx_opts.data_source, \
+			3007, modes[mode]) == -1);
+		mu_check(xmodem_image_init(&image, image_buf, size, (unsigned char *) tx_opts.data_source, \
+			3007, modes[mode]) == 0);
+		mu_check(buf_cmp(sent, (char *) image_buf, size) == 1);
+		mu_assert_int_eq(EOT, sent[size]);
+
+		/* Sending the image gives the same again. */
+		buf_clr(sent, size + 1);
+		VOID_TO_PORT(local_port, buf_pos_tx) = 0;
+		VOID_TO_PORT(local_port, buf_pos_rx) = 0;
+		mu_check(xmodem_tx_image(&image, local_port, NULL) == MODEM_NO_ERRORS);
+		mu_check(buf_cmp(sent, (char *) image_buf, size) == 1);
+		mu_assert_int_eq(EOT, sent[size]);
+	}
+
+	/* Sessions send from the image too. */
+	rx_opts.sink_pos = 0;
+	xmodem_session_tx_image(&tx, &image, 0);
+	xmodem_session_rx(&rx, data_in_fcn, session_buf, &rx_opts, XMODEM_1K, 0);
+	for(count = 0; count < 100 && xmodem_session_status(&tx) == MODEM_IN_PROGRESS; count++)
+	{
+		if(count == 4)
+		{
+			/* A packet lost on the way is sent again after a NAK. */
+			xmodem_session_sent(&tx, xmodem_session_output(&tx, &out), 0);
+			xmodem_session_feed(&tx, &nak, 1, 0);
+		}
+		session_relay(&tx, &rx, 0);
+		session_relay(&rx, &tx, 0);
+	}
+	mu_assert_int_eq(MODEM_NO_ERRORS, xmodem_session_status(&tx));
+	mu_assert_int_eq(MODEM_NO_ERRORS, xmodem_session_status(&rx));
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 3007) == 1);
+	mu_assert_int_eq(2 * 1024 + 8 * 128, rx_opts.sink_pos);
+}
+
+
+MU_TEST(test_sfl_rx)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	char * host = rx_opts.data_source;
+	const char noise[] = "BIOS> serialboot\n";
+	const char expected[] = "sL5DdSMmkekro\n" "KKUEK";
+	unsigned int len = 0;
+
+	/* Console output, the handshake, two loads out of address order, an
+	unknown command, a load without an address, and the jump. */
+	fill_buf(tx_opts.data_source, 500);
+	buf_cpy(host, (char *) noise, sizeof(noise) - 1);
+	len += sizeof(noise) - 1;
+	buf_cpy(host + len, "z6IHG7cYDID6o\n", 14);
+	len += 14;
+	len += make_sfl_frame(host + len, 0x01, SFL_TEST_BASE + 251, tx_opts.data_source + 251, 249);
+	len += make_sfl_frame(host + len, 0x01, SFL_TEST_BASE, tx_opts.data_source, 251);
+	len += make_sfl_frame(host + len, 0x07, 0, NULL, 0);
+	len += make_sfl_frame(host + len, 0x01, 0, NULL, 0);
+	len += make_sfl_frame(host + len, 0x02, SFL_TEST_BASE + 0x10, NULL, 0);
+	mu_check(serial_snd(host, len, remote_port) == SERIAL_NO_ERRORS);
+
+	sfl_eof_addr = sfl_boot_addr = 0;
+	mu_check(sfl_rx(sfl_load_fcn, sfl_boot_fcn, temp_buf, &rx_opts, local_port) == MODEM_NO_ERRORS);
+	mu_check(buf_cmp(tx_opts.data_source, rx_opts.data_sink, 500) == 1);
+	mu_check(sfl_eof_addr == SFL_TEST_BASE + 0x10);
+	mu_check(sfl_boot_addr == SFL_TEST_BASE + 0x10);
+	mu_assert_int_eq(sizeof(expected) - 1, VOID_TO_PORT(local_port, buf_pos_tx));
+	mu_check(buf_cmp(sent, (char *) expected, sizeof(expected) - 1) == 1);
+
+	/* An abort is acknowledged, and nothing is started. */
+	VOID_TO_PORT(local_port, buf_pos_tx) = 0;
+	len = 0;
+	buf_cpy(host, "z6IHG7cYDID6o\n", 14);
+	len += 14;
+	len += make_sfl_frame(host + len, 0x00, 0, NULL, 0);
+	mu_check(serial_snd(host, len, remote_port) == SERIAL_NO_ERRORS);
+
+	sfl_boot_addr = 0;
+	mu_check(sfl_rx(sfl_load_fcn, sfl_boot_fcn, temp_buf, &rx_opts, local_port) == SENT_CAN);
+	mu_assert_int_eq(0, sfl_boot_addr);
+	mu_assert_int_eq('K', sent[14]);
+}
+
+MU_TEST(test_sfl_tx)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	const char responses[] = "sL5DdSMmkekro\n" "KKKKK";
+	char untouched[60] = { 0 };
+	unsigned char * frame;
+	unsigned int i, pos = 14;
+
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses) - 1);
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses) - 1, remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, 400);
+	for(i = 320; i < 380; i++)
+	{
+		tx_opts.data_source[i] = (char) 0xFF;
+	}
+	sfl_regions_sent = 0;
+	mu_check(sfl_tx(sfl_region_fcn, SFL_TEST_BASE, 0xFF, temp_buf, &tx_opts, local_port) == MODEM_NO_ERRORS);
+
+	mu_check(buf_cmp(sent, "z6IHG7cYDID6o\n", 14) == 1);
+	for(i = 0; i < 4; i++)
+	{
+		frame = (unsigned char *) sent + pos;
+		mu_assert_int_eq(sfl_frames[i].size + 4, frame[0]);
+		mu_assert_int_eq(0x01, frame[3]);
+		mu_check(((unsigned long) frame[4] << 24 | (unsigned long) frame[5] << 16 \
+			| (unsigned long) frame[6] << 8 | frame[7]) == sfl_frames[i].addr);
+		mu_check(buf_cmp((char *) frame + 8, tx_opts.data_source + sfl_frames[i].offset, sfl_frames[i].size) == 1);
+		mu_assert_int_eq(generate_crc(frame + 3, frame[0] + 1), (frame[1] << 8) | frame[2]);
+		pos += 4 + frame[0];
+	}
+	mu_assert_int_eq(4, sent[pos]);
+	mu_assert_int_eq(0x02, sent[pos + 3]);
+	mu_assert_int_eq(pos + 8, VOID_TO_PORT(local_port, buf_pos_tx));
+
+	/* Replayed to the receiver, the run is left as it was. */
+	mu_check(sfl_rx(sfl_load_fcn, sfl_boot_fcn, temp_buf, &rx_opts, remote_port) == MODEM_NO_ERRORS);
+	mu_check(sfl_boot_addr == SFL_TEST_BASE);
+	mu_check(buf_cmp(rx_opts.data_sink, tx_opts.data_source, 300) == 1);
+	mu_check(buf_cmp(rx_opts.data_sink + 0x400, tx_opts.data_source + 300, 20) == 1);
+	mu_check(buf_cmp(rx_opts.data_sink + 0x400 + 20, untouched, 60) == 1);
+	mu_check(buf_cmp(rx_opts.data_sink + 0x400 + 80, tx_opts.data_source + 380, 20) == 1);
+}
+
+MU_TEST(test_sfl_tx_bios)
+{
+	char * sent = VOID_TO_PORT(local_port, tx_line);
+	/* The LiteX BIOS answers every frame in turn, without discarding the
+	frame pipelined behind a damaged one. */
+	const char responses[] = "sL5DdSMmkekro\n" "CKKCKKK";
+	/* So only the damaged frames are sent again, each behind the frame that
+	was in flight with it. */
+	const unsigned int order[7] = { 0, 1, 0, 2, 3, 2, 4 };
+	unsigned char * frame;
+	unsigned int i, pos = 14;
+
+	buf_cpy(rx_opts.data_source, (char *) responses, sizeof(responses) - 1);
+	mu_check(serial_snd(rx_opts.data_source, sizeof(responses) - 1, remote_port) == SERIAL_NO_ERRORS);
+
+	fill_buf(tx_opts.data_source, 400);
+	for(i = 320; i < 380; i++)
+	{
+		tx_opts.data_source[i] = (char) 0xFF;
+	}
+	sfl_regions_sent = 0;
+	mu_check(sfl_tx(sfl_region_fcn, SFL_TEST_BASE, 0xFF, temp_buf, &tx_opts, local_port) == MODEM_NO_ERRORS);
+
+	mu_check(buf_cmp(sent, "z6IHG7cYDID6o\n", 14) == 1);
+	for(i = 0; i < 7; i++)
+	{
+		frame = (unsigned char *) sent + pos;
+		if(order[i] == 4)
+		{
+			/* The JUMP, only once every LOAD is acknowledged. */
+			mu_assert_int_eq(4, frame[0]);
+			mu_assert_int_eq(0x02, frame[3]);
+		}
+		else
+		{
+			mu_assert_int_eq(sfl_frames[order[i]].size + 4, frame[0]);
+			mu_assert_int_eq(0x01, frame[3]);
+			mu_check(((unsigned long) frame[4] << 24 | (unsigned long) frame[5] << 16 \
+				| (unsigned long) frame[6] << 8 | frame[7]) == sfl_frames[order[i]].addr);
+		}
+		pos += 4 + frame[0];
+	}
+	mu_assert_int_eq(pos, VOID_TO_PORT(local_port, buf_pos_tx));
+
+	/* Replayed to the receiver, frames loaded twice do no harm. */
+	mu_check(sfl_rx(sfl_load_fcn, sfl_boot_fcn, temp_buf, &rx_opts, remote_port) == MODEM_NO_ERRORS);
+	mu_check(sfl_boot_addr == SFL_TEST_BASE);
+	mu_check(buf_cmp(rx_opts.data_sink, tx_opts.data_source, 300) == 1);
+	mu_check(buf_cmp(rx_opts.data_sink + 0x400, tx_opts.data_source + 300, 20) == 1);
+	mu_check(buf_cmp(rx_opts.data_sink + 0x400 + 80, tx_opts.data_source + 380, 20) == 1);
+}
+
+
+MU_TEST(test_crc_known_values)
+{
+	unsigned char check_str[11] = "123456789";
+
+	/* Standard check value for CRC-16/XMODEM. */
+	mu_assert_int_eq(0x31C3, generate_crc(check_str, 9));
+	mu_assert_int_eq(0xDD, generate_chksum(check_str, 9));
+	mu_assert_int_eq(0x0000, generate_crc(check_str, 0));
+
+	/* A buffer followed by its own CRC (MSB first) always checks to 0. This
+	is what xmodem_rx() relies on. */
+	check_str[9] = 0x31;
+	check_str[10] = 0xC3;
+	mu_assert_int_eq(0x0000, generate_crc(check_str, 11));
+}
+
+MU_TEST(test_crc32_known_values)
+{
+	unsigned char check_str[10] = "123456789";
+
+	/* Standard check value for CRC-32, as used by ZMODEM. */
+	mu_check(generate_crc32(0, check_str, 9) == 0xCBF43926UL);
+	mu_check(generate_crc32(0, check_str, 0) == 0);
+
+	/* Results chain, so data can be checked as it arrives. */
+	mu_check(generate_crc32(generate_crc32(0, check_str, 4), check_str + 4, 5) == 0xCBF43926UL);
+}
+
+MU_TEST(test_crc_engine_matches_reference)
+{
+	unsigned int len, offset;
+
+	/* Cover every tail length of every slice width, starting at each
+	possible misalignment. */
+	fill_buf(local_source, STATIC_BUFSIZ);
+	for(offset = 0; offset < 8; offset++)
+	{
+		for(len = 0; len <= 300; len++)
+		{
+			unsigned char * start = (unsigned char *) local_source + offset;
+			mu_assert_int_eq(reference_crc(start, len), generate_crc(start, len));
+		}
+	}
+}
+
+MU_TEST(test_crc_random_lengths)
+{
+	unsigned int len;
+
+	/* Exercises whichever kernel generate_crc() dispatches to on this CPU,
+	including every remainder after the 64 and 16-byte folding loops. The
+	start offset varies so unaligned loads are covered too. */
+	srand(0x1021);
+	for(len = 0; len < sizeof(crc_buf); len++)
+	{
+		crc_buf[len] = (unsigned char) rand();
+	}
+
+	for(len = 0; len <= 8192; len++)
+	{
+		unsigned char * start = crc_buf + (len % 16);
+		if(reference_crc(start, len) != generate_crc(start, len))
+		{
+			mu_assert_int_eq(reference_crc(start, len), generate_crc(start, len));
+		}
+	}
+	mu_check(len == 8193);
+}
+
+MU_TEST(test_chksum_random_lengths)
+{
+	unsigned int len;
+
+	srand(0x1021);
+	for(len = 0; len < sizeof(crc_buf); len++)
+	{
+		crc_buf[len] = (unsigned char) rand();
+	}
+
+	for(len = 0; len <= 8192; len++)
+	{
+		unsigned char * start = crc_buf + (len % 16);
+		unsigned char expected = 0;
+		unsigned int count;
+
+		for(count = 0; count < len; count++)
+		{
+			expected += start[count];
+		}
+
+		if(expected != generate_chksum(start, len))
+		{
+			mu_assert_int_eq(expected, generate_chksum(start, len));
+		}
+	}
+	mu_check(len == 8193);
+}
+
+MU_TEST(test_crc_incremental)
+{
+	crc_state_t crc, chksum;
+	unsigned char copy_dest[1100];
+	unsigned int pos, chunk;
+
+	srand(0x1021);
+	for(pos = 0; pos < sizeof(crc_buf); pos++)
+	{
+		crc_buf[pos] = (unsigned char) rand();
+	}
+
+	/* Odd chunk sizes make sure the running value is carried correctly into
+	every engine and kernel, not just started from 0. */
+	crc_init(&crc, XMODEM_1K);
+	crc_init(&chksum, XMODEM);
+	for(pos = 0, chunk = 1; pos + chunk <= 8192; pos += chunk, chunk = (chunk * 7 + 3) % 200)
+	{
+		crc_update(&crc, crc_buf + pos, chunk);
+		crc_update(&chksum, crc_buf + pos, chunk);
+		mu_assert_int_eq(generate_crc(crc_buf, pos + chunk), crc_final(&crc));
+		mu_assert_int_eq(generate_chksum(crc_buf, pos + chunk), crc_final(&chksum));
+	}
+
+	crc_init(&crc, XMODEM_CRC);
+	crc_copy(&crc, copy_dest, crc_buf + 3, 1024);
+	crc_copy(&crc, copy_dest + 1024, crc_buf + 3 + 1024, 76);
+	mu_check(buf_cmp((char *) copy_dest, (char *) crc_buf + 3, 1100) == 1);
+	mu_assert_int_eq(generate_crc(crc_buf + 3, 1100), crc_final(&crc));
+}
+
+
 static void verify_packet(char * packet, unsigned char packet_no, char * payload,
 	unsigned int payload_len, int using_chksum, int using_1k)
 {
@@ -371,10 +1303,13 @@ MU_TEST_SUITE(ser_test_suite)
 {
 	MU_SUITE_CONFIGURE(&ser_test_setup, &ser_test_teardown);
 	MU_RUN_TEST(test_ser_tx);
+	MU_RUN_TEST(test_ser_sndv);
 	MU_RUN_TEST(test_ser_tx_hw_error_bad_write);
 
 	MU_RUN_TEST(test_ser_rx_hw_error_bad_read);
 	MU_RUN_TEST(test_ser_rx_timeout);
+	MU_RUN_TEST(test_ser_rx_ms);
+	MU_RUN_TEST(test_ser_rx_some);
 	MU_RUN_TEST(test_ser_rx_flush_close);
 
 	MU_RUN_TEST(test_ser_bad_handle);
@@ -387,6 +1322,30 @@ MU_TEST_SUITE(ser_test_suite)
 	MU_RUN_TEST(test_xmodem_xfer_chksum);
 	MU_RUN_TEST(test_xmodem_xfer_crc);
 	MU_RUN_TEST(test_xmodem_xfer_1k);
+	MU_RUN_TEST(test_xmodem_xfer_borrow);
+	MU_RUN_TEST(test_xmodem_xfer_checked);
+	MU_RUN_TEST(test_xmodem_xfer_checked_trusted);
+	MU_RUN_TEST(test_xmodem_rx_bad_crc);
+	MU_RUN_TEST(test_xmodem_rx_window);
+	MU_RUN_TEST(test_xmodem_windowed);
+	MU_RUN_TEST(test_xmodem_prefetch);
+	MU_RUN_TEST(test_xmodem_stats);
+	MU_RUN_TEST(test_xmodem_prefetch_stats);
+	MU_RUN_TEST(test_xmodem_streaming);
+	MU_RUN_TEST(test_ymodem_batch);
+	MU_RUN_TEST(test_xmodem_session);
+	MU_RUN_TEST(test_xmodem_session_timeouts);
+	MU_RUN_TEST(test_xmodem_image);
+	MU_RUN_TEST(test_sfl_rx);
+	MU_RUN_TEST(test_sfl_tx);
+	MU_RUN_TEST(test_sfl_tx_bios);
+
+	MU_RUN_TEST(test_crc_known_values);
+	MU_RUN_TEST(test_crc32_known_values);
+	MU_RUN_TEST(test_crc_engine_matches_reference);
+	MU_RUN_TEST(test_crc_random_lengths);
+	MU_RUN_TEST(test_chksum_random_lengths);
+	MU_RUN_TEST(test_crc_incremental);
 }
 
 
@@ -441,6 +1400,142 @@ static int data_out_fcn(char * buf, const int request_size, const int last_sent_
 }
 
 
+static int data_borrow_fcn(const char ** buf, const int request_size, const int last_sent_size, void * const chan_state)
+{
+	TX_PARAMS * const tx_parms = (TX_PARAMS * const) chan_state;
+	int size_left;
+
+	tx_parms->source_pos += last_sent_size;
+
+	size_left = tx_parms->source_size - tx_parms->source_pos;
+	(* buf) = tx_parms->data_source + tx_parms->source_pos;
+
+	return (request_size < size_left) ? request_size : size_left;
+}
+
+
+/* As data_out_fcn(), folding the data into the checksum/CRC as it is copied.
+force_bad_checksum folds in one byte too many. */
+static int data_checked_fcn(char * buf, const int request_size, const int last_sent_size, crc_state_t * check, void * const chan_state)
+{
+	TX_PARAMS * const tx_parms = (TX_PARAMS * const) chan_state;
+	int size_left;
+	int actual_size_sent;
+
+	tx_parms->source_pos += last_sent_size;
+
+	size_left = tx_parms->source_size - tx_parms->source_pos;
+	actual_size_sent = (request_size < size_left) ? request_size : size_left;
+
+	crc_copy(check, (unsigned char *) buf, \
+		(const unsigned char *) tx_parms->data_source + tx_parms->source_pos, actual_size_sent);
+	if(tx_parms->force_bad_checksum)
+	{
+		crc_update(check, (const unsigned char *) "", 1);
+	}
+
+	return actual_size_sent;
+}
+
+
+static char * data_window_fcn(const int request_size, const int last_recv_size, const int eot, void * const chan_state)
+{
+	RX_PARAMS * const rx_params = (RX_PARAMS * const) chan_state;
+
+	rx_params->sink_pos += last_recv_size;
+	if(eot)
+	{
+		return rx_params->data_sink;
+	}
+
+	if(rx_params->sink_pos + request_size > rx_params->sink_size)
+	{
+		return NULL;
+	}
+
+	return rx_params->data_sink + rx_params->sink_pos;
+}
+
+
+static int next_file_fcn(ymodem_file_info_t * info, void * const chan_state)
+{
+	TX_PARAMS * const tx_parms = (TX_PARAMS * const) chan_state;
+
+	tx_parms->source_pos = 0;
+	if(ymodem_files_left == 2)
+	{
+		buf_cpy(info->name, "a.bin", 6);
+		info->size = tx_parms->source_size = 200;
+		info->mtime = 012345;
+	}
+	else if(ymodem_files_left == 1)
+	{
+		buf_cpy(info->name, "b", 2);
+		info->size = tx_parms->source_size = 128;
+	}
+	info->has_size = 1;
+
+	return (ymodem_files_left-- > 0);
+}
+
+static int open_file_fcn(const ymodem_file_info_t * info, void * const chan_state)
+{
+	(void) chan_state;
+
+	/* The first file's header is checked here, as it is overwritten. */
+	if(ymodem_files_opened++ == 0 && !(buf_cmp((char *) info->name, "a.bin", 6) == 1 \
+		&& info->has_size && info->size == 200 && info->mtime == 012345))
+	{
+		return -1;
+	}
+
+	ymodem_last_info = (* info);
+	return 0;
+}
+
+static int sfl_load_fcn(unsigned long address, const char * buf, const int buf_size, const int eof, void * const chan_state)
+{
+	RX_PARAMS * const rx_params = (RX_PARAMS * const) chan_state;
+
+	if(eof)
+	{
+		sfl_eof_addr = address;
+		return buf_size;
+	}
+
+	if(address < SFL_TEST_BASE || address - SFL_TEST_BASE + buf_size > rx_params->sink_size)
+	{
+		return -1;
+	}
+
+	buf_cpy(rx_params->data_sink + (address - SFL_TEST_BASE), (char *) buf, buf_size);
+	return buf_size;
+}
+
+static int sfl_boot_fcn(unsigned long address, void * const chan_state)
+{
+	(void) chan_state;
+
+	sfl_boot_addr = address;
+	return 0;
+}
+
+static int sfl_region_fcn(unsigned long * address, const unsigned char ** data, size_t * size, void * const chan_state)
+{
+	TX_PARAMS * const tx_parms = (TX_PARAMS * const) chan_state;
+
+	if(sfl_regions_sent == 3)
+	{
+		return 0;
+	}
+
+	(* address) = sfl_regions[sfl_regions_sent].addr;
+	(* data) = (const unsigned char *) tx_parms->data_source + sfl_regions[sfl_regions_sent].offset;
+	(* size) = sfl_regions[sfl_regions_sent++].size;
+	return 1;
+}
+
+
 static void fill_buf(char * buf, unsigned int num_chars)
 {
 	unsigned int cur;
@@ -486,3 +1581,63 @@ static void buf_clr(char * buf, unsigned int num_chars)
 		buf[cur] = '\0';
 	}
 }
+
+/* The original bit-serial CRC loop, kept here as the reference every
+crc_engine is checked against. */
+/* Pass everything one session has to send to the other. */
+static size_t session_relay(xmodem_session_t * from, xmodem_session_t * to, long now_ms)
+{
+	const char * data;
+	size_t size = xmodem_session_output(from, &data);
+
+	if(size > 0)
+	{
+		xmodem_session_feed(to, data, size, now_ms);
+		xmodem_session_sent(from, size, now_ms);
+	}
+
+	return size;
+}
+
+static unsigned short reference_crc(unsigned char * data, size_t size)
+{
+	unsigned int crc = 0x0000;
+	size_t octet_count;
+	unsigned char bit_count;
+
+	for(octet_count = 0; octet_count < size; octet_count++)
+	{
+		crc = (crc ^ (unsigned int) data[octet_count] << 8);
+		for(bit_count = 1; bit_count <= 8; bit_count++)
+		{
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+	return crc & 0xFFFF;
+}
+
+/* Build an SFL frame. A nonzero address goes before the data, as LOAD and
+JUMP expect. */
+static unsigned int make_sfl_frame(char * frame, unsigned char cmd, unsigned long address, \
+	char * data, unsigned int len)
+{
+	unsigned short crc;
+	unsigned int pos = 4;
+
+	if(address != 0)
+	{
+		frame[pos++] = (char) (address >> 24);
+		frame[pos++] = (char) (address >> 16);
+		frame[pos++] = (char) (address >> 8);
+		frame[pos++] = (char) address;
+	}
+	buf_cpy(frame + pos, data, len);
+	pos += len;
+
+	frame[0] = (char) (pos - 4);
+	frame[3] = (char) cmd;
+	crc = generate_crc((unsigned char *) frame + 3, pos - 3);
+	frame[1] = (char) (crc >> 8);
+	frame[2] = (char) crc;
+	return pos;
+}